@@ -0,0 +1,173 @@
+// AdaptiveSampling.h
+// Decides how many image pairs to take at each exposure time.
+// Every pair gives one estimate of the mean and of the temporal variance. The estimates are accumulated as they arrive,
+// and the point is done once the confidence intervals of both are narrow enough (relative to their values).
+// Bright points converge quickly, dark points (where the variance is small and noisy) get more pairs.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef ADAPTIVESAMPLING_H
+#define ADAPTIVESAMPLING_H
+
+#include <cmath>
+#include <stdint.h>
+
+namespace AdaptiveSampling
+{
+	struct Settings
+	{
+		double relativeTolerance = 0.02; // stop when the confidence interval half-width is below this fraction of the estimate
+		double z = 1.96; // width of the confidence interval in standard errors (1.96 = 95%)
+		uint32_t minPairs = 2; // at least 2, otherwise there is no interval to check
+		uint32_t maxPairs = 16; // stop here even if the tolerance was not reached. minPairs = maxPairs gives a fixed count.
+	};
+
+	// Running mean and variance of a series of values (Welford's method, one value at a time, nothing stored).
+	class RunningStats
+	{
+	private:
+		uint64_t m_count = 0;
+		double m_mean = 0;
+		double m_m2 = 0;
+
+	public:
+		void Add(double value);
+		void Reset();
+		uint64_t GetCount();
+		double GetMean();
+		double GetVariance();
+
+		// z * standard error of the mean
+		double GetHalfWidth(double z);
+	};
+
+	class PointEstimator
+	{
+	private:
+		RunningStats m_mean;
+		RunningStats m_temporalVariance;
+
+	public:
+		// Add the estimates of one pair.
+		void AddPair(double mean, double temporalVariance);
+
+		// Start over (new exposure time, or the settings changed).
+		void Reset();
+
+		// true if enough pairs were taken.
+		bool IsDone(const Settings& settings);
+
+		uint32_t GetNumPairs();
+		double GetMean();
+		double GetMeanHalfWidth(const Settings& settings);
+		double GetTemporalVariance();
+		double GetTemporalVarianceHalfWidth(const Settings& settings);
+	};
+}
+
+// *********************************************************************************************************
+inline void AdaptiveSampling::RunningStats::Add(double value)
+{
+	m_count++;
+	double delta = value - m_mean;
+	m_mean += delta / m_count;
+	m_m2 += delta * (value - m_mean);
+}
+
+inline void AdaptiveSampling::RunningStats::Reset()
+{
+	m_count = 0;
+	m_mean = 0;
+	m_m2 = 0;
+}
+
+inline uint64_t AdaptiveSampling::RunningStats::GetCount()
+{
+	return m_count;
+}
+
+inline double AdaptiveSampling::RunningStats::GetMean()
+{
+	return m_mean;
+}
+
+inline double AdaptiveSampling::RunningStats::GetVariance()
+{
+	return (m_count > 1) ? m_m2 / (m_count - 1) : 0;
+}
+
+inline double AdaptiveSampling::RunningStats::GetHalfWidth(double z)
+{
+	if (m_count < 2)
+		return 0;
+
+	return z * std::sqrt(GetVariance() / m_count);
+}
+
+inline void AdaptiveSampling::PointEstimator::AddPair(double mean, double temporalVariance)
+{
+	m_mean.Add(mean);
+	m_temporalVariance.Add(temporalVariance);
+}
+
+inline void AdaptiveSampling::PointEstimator::Reset()
+{
+	m_mean.Reset();
+	m_temporalVariance.Reset();
+}
+
+inline bool AdaptiveSampling::PointEstimator::IsDone(const Settings& settings)
+{
+	uint64_t pairs = m_mean.GetCount();
+	if (pairs >= settings.maxPairs)
+		return true;
+	if (pairs < settings.minPairs || pairs < 2)
+		return false;
+
+	// (values near zero are compared against a small floor, so a black or noise-free image can still finish)
+	double mean = std::fabs(m_mean.GetMean());
+	double variance = std::fabs(m_temporalVariance.GetMean());
+	bool meanDone = m_mean.GetHalfWidth(settings.z) <= settings.relativeTolerance * ((mean > 1) ? mean : 1);
+	bool varianceDone = m_temporalVariance.GetHalfWidth(settings.z) <= settings.relativeTolerance * ((variance > 0.01) ? variance : 0.01);
+	return meanDone && varianceDone;
+}
+
+inline uint32_t AdaptiveSampling::PointEstimator::GetNumPairs()
+{
+	return (uint32_t)m_mean.GetCount();
+}
+
+inline double AdaptiveSampling::PointEstimator::GetMean()
+{
+	return m_mean.GetMean();
+}
+
+inline double AdaptiveSampling::PointEstimator::GetMeanHalfWidth(const Settings& settings)
+{
+	return m_mean.GetHalfWidth(settings.z);
+}
+
+inline double AdaptiveSampling::PointEstimator::GetTemporalVariance()
+{
+	return m_temporalVariance.GetMean();
+}
+
+inline double AdaptiveSampling::PointEstimator::GetTemporalVarianceHalfWidth(const Settings& settings)
+{
+	return m_temporalVariance.GetHalfWidth(settings.z);
+}
+// *********************************************************************************************************
+#endif
@@ -32,10 +32,48 @@
 
 #include <cstdio>
 #include <string>
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <algorithm>
 #include <stdint.h>
 
+#include "ThreadPool.h"
+
 namespace AnalysisTools
 {
+	// Images are reduced in chunks of this many bytes (about half of a typical L2 cache).
+	// The chunks are spread over the thread pool and their results are merged in chunk order,
+	// so the results are identical no matter how many threads are used.
+	const size_t c_reductionChunkSize = 256 * 1024;
+
+	// The basic statistics of an image, gathered in one pass. 64 bit accumulators so 100MP+ images can't overflow.
+	struct Stats
+	{
+		uint64_t count = 0;
+		uint64_t sum = 0;
+		uint64_t sumOfSquares = 0;
+		uint32_t min = UINT32_MAX;
+		uint32_t max = 0;
+
+		void Merge(const Stats& other);
+	};
+
+	// Find the count, sum, sum of squares, min and max of all pixels (8bit and unpacked 16bit formats).
+	Stats FindStats(Pylon::CPylonImage& image);
+
+	// Single threaded kernel for one chunk of pixels.
+	template <typename T>
+	void FindStatsT(const T* pImage, size_t numPixels, Stats& stats);
+
+	// Chunked, multi-threaded reduction of a whole buffer.
+	template <typename T>
+	Stats FindStatsParallel(const T* pImage, size_t numPixels);
+
+	// FindStats() compiled for one pixel format (see PixelFormatTraits.h and FormatDispatch.h).
+	template <typename Traits>
+	Stats FindStatsForFormat(Pylon::CPylonImage& image);
+
 	uint32_t FindAvg(Pylon::CPylonImage& image);
 
 	uint32_t FindMin(Pylon::CPylonImage& image);
@@ -43,67 +81,525 @@ namespace AnalysisTools
 	uint32_t FindMax(Pylon::CPylonImage& image);
 
 	double FindSNR(Pylon::CPylonImage& image);
+
+	// Same as above, from statistics that were already gathered.
+	double FindSNR(const Stats& stats);
+
+	// Statistics of the difference of two images of the same scene (a - b). Only the temporal noise is left in the difference.
+	struct DiffStats
+	{
+		uint64_t count = 0;
+		int64_t sum = 0;
+		uint64_t sumOfSquares = 0;
+
+		void Merge(const DiffStats& other);
+	};
+
+	// Single threaded kernel for one chunk of pixels.
+	template <typename T>
+	void FindDiffStatsT(const T* pImageA, const T* pImageB, size_t numPixels, DiffStats& stats);
+
+	// Chunked, multi-threaded reduction of two whole buffers.
+	template <typename T>
+	DiffStats FindDiffStatsParallel(const T* pImageA, const T* pImageB, size_t numPixels);
+
+	// FindDiffStats compiled for one pixel format (see PixelFormatTraits.h and FormatDispatch.h). Both images must have the same format and size.
+	template <typename Traits>
+	DiffStats FindDiffStatsForFormat(Pylon::CPylonImage& imageA, Pylon::CPylonImage& imageB);
+
+	// EMVA1288 temporal variance of one image: var(a - b) / 2.
+	double FindTemporalVariance(const DiffStats& stats);
+
+	// The four color planes of a Bayer mosaic. (Where each one sits in the 2x2 cell depends on the format, see PixelFormatTraits::CfaLayout.)
+	enum ECfaPlane
+	{
+		Plane_Red = 0,
+		Plane_GreenRed = 1, // Gr, the green pixels on the red rows
+		Plane_GreenBlue = 2, // Gb, the green pixels on the blue rows
+		Plane_Blue = 3
+	};
+	const uint32_t c_numCfaPlanes = 4;
+
+	// Statistics of each plane of a pair of Bayer images, gathered in a single pass over both mosaics.
+	// Gr and Gb are kept apart, so an imbalance between them shows up instead of being averaged away.
+	struct CfaPairStats
+	{
+		Stats image1[4];
+		Stats image2[4];
+		DiffStats diff[4]; // image1 - image2, for the temporal noise
+		uint64_t saturated[4] = { 0, 0, 0, 0 }; // pixels at the saturation value, in either image
+
+		void Merge(const CfaPairStats& other);
+	};
+
+	// Single threaded kernel for a band of cell rows (one cell row = two image rows).
+	template <typename Traits>
+	void FindCfaPairStatsT(const typename Traits::value_type* pImage1, const typename Traits::value_type* pImage2, uint32_t width, uint32_t firstCellRow, uint32_t numCellRows, CfaPairStats& stats);
+
+	// Chunked, multi-threaded reduction of two whole Bayer images of the same format and size.
+	template <typename Traits>
+	CfaPairStats FindCfaPairStatsForFormat(Pylon::CPylonImage& image1, Pylon::CPylonImage& image2);
+
+	// The results of one plane (or of several planes together).
+	struct PlaneSummary
+	{
+		double mean = 0; // of both images
+		double temporalNoise = 0; // sqrt of the temporal variance
+		double snr = 0; // mean / temporal noise
+		double saturation = 0; // fraction of saturated pixels
+	};
+
+	PlaneSummary SummarizePlane(const CfaPairStats& stats, uint32_t plane);
+
+	// Gr and Gb pooled into one green plane (in floating point). Only for when a single green value is wanted.
+	PlaneSummary SummarizeGreen(const CfaPairStats& stats);
+
+	// helper
+	PlaneSummary SummarizeStats(const Stats& image1, const Stats& image2, const DiffStats& diff, uint64_t saturated);
+
+	// Row and column mean profiles of an image, one set per CFA channel.
+	// Mono images have 1 channel. Bayer images have 4 channels, indexed by position in the 2x2 cell: 0=(0,0), 1=(0,1), 2=(1,0), 3=(1,1).
+	// (eg: for BayerRG, 0=R, 1=Gr, 2=Gb, 3=B)
+	struct Profiles
+	{
+		uint32_t numChannels = 0;
+		std::vector<double> rowMean[4]; // one entry per row of the channel's sub-image
+		std::vector<double> colMean[4]; // one entry per column of the channel's sub-image
+	};
+
+	// Compute the row and column profiles of all channels in a single pass over the image.
+	bool FindProfiles(Pylon::CPylonImage& image, Profiles& profiles, std::string& errorMessage);
+
+	// Standard deviation of a profile (eg: the row or column fixed pattern noise).
+	double FindProfileStdDev(const std::vector<double>& profile);
+
+	// EMVA1288-style spectrogram of a profile: sqrt(|DFT|^2 / N) with the mean removed, in DN. N is the length of the profile.
+	// The profile is zero-padded to the next power of two n, so the output has n/2+1 bins, bin k at k/n cycles/pixel.
+	// The scaling uses N on purpose: white noise of standard deviation s shows as a level of s with or without the padding.
+	void FindSpectrogram(const std::vector<double>& profile, std::vector<double>& spectrogram);
+
+	template <typename T>
+	void FindProfilesT(const T* pImage, uint32_t width, uint32_t height, Profiles& profiles);
+
+	// Same as above, with the rows coming from getRow(y) (a const T* for row y, read in order), eg: rows unpacked one at a time.
+	template <typename T, typename GetRow>
+	void FindProfilesRowsT(GetRow getRow, uint32_t width, uint32_t height, Profiles& profiles);
+
+	// FindProfiles() compiled for one pixel format (see PixelFormatTraits.h and FormatDispatch.h).
+	template <typename Traits>
+	bool FindProfilesForFormat(Pylon::CPylonImage& image, Profiles& profiles, std::string& errorMessage);
+
+	// Counting histograms of the pixel values of each channel, for order statistics (percentiles, median, trimmed mean) in O(n),
+	// without sorting or copying the pixels. Unlike the min and max, these can't be decided by a few defective pixels.
+	// Mono images have 1 channel, Bayer images 4, in ECfaPlane order (R, Gr, Gb, B).
+	struct Histograms
+	{
+		uint32_t numChannels = 0;
+		std::vector<uint64_t> counts[c_numCfaPlanes]; // one bin per value, 2^bitDepth bins
+	};
+
+	// Single threaded kernel for a band of rows. pCounts has numChannels * 2^bitDepth bins (they are added to).
+	template <typename Traits>
+	void FindHistogramsT(const typename Traits::value_type* pImage, uint32_t width, uint32_t firstRow, uint32_t numRows, uint32_t* pCounts);
+
+	// Chunked, multi-threaded histograms of a whole image, compiled for one pixel format.
+	template <typename Traits>
+	void FindHistogramsForFormat(Pylon::CPylonImage& image, Histograms& histograms);
+
+	// Adds the bins of numChunks chunks (numChannels * 2^bitDepth each, back to back) into histograms, whose counts must be sized and zeroed.
+	// (split across the pool by bin ranges, so it doesn't grow with the image size)
+	void MergeHistogramChunks(const uint32_t* pChunkCounts, size_t numChunks, Histograms& histograms);
+
+	// The smallest value which at least percent % of the pixels are at or below (0 = the min, 100 = the max).
+	uint32_t FindPercentile(const std::vector<uint64_t>& counts, double percent);
+
+	uint32_t FindMedian(const std::vector<uint64_t>& counts);
+
+	// The mean without the trimPercent % lowest and trimPercent % highest pixels.
+	double FindTrimmedMean(const std::vector<uint64_t>& counts, double trimPercent);
+
+	// The lowest percentile of all channels (eg: for "is every channel saturated?" or "is every channel above the black level?").
+	uint32_t FindLowestPercentile(const Histograms& histograms, double percent);
 }
 
 // *********************************************************************************************************
-inline uint32_t AnalysisTools::FindAvg(Pylon::CPylonImage& image)
+inline void AnalysisTools::Stats::Merge(const Stats& other)
+{
+	count += other.count;
+	sum += other.sum;
+	sumOfSquares += other.sumOfSquares;
+	if (other.min < min)
+		min = other.min;
+	if (other.max > max)
+		max = other.max;
+}
+
+template <typename T>
+inline void AnalysisTools::FindStatsT(const T* pImage, size_t numPixels, Stats& stats)
 {
-	uint32_t sum = 0;
-	uint32_t avg = 0;
-	uint8_t* pImage = (uint8_t*)image.GetBuffer();
+	// Four independent lanes break the dependency chains, so the compiler can keep several adds in flight (or vectorize).
+	uint64_t sum[4] = { 0, 0, 0, 0 };
+	uint64_t sumOfSquares[4] = { 0, 0, 0, 0 };
+	uint32_t min[4] = { UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX };
+	uint32_t max[4] = { 0, 0, 0, 0 };
+	size_t i = 0;
 
-	for (uint32_t i = 0; i < image.GetImageSize(); i++)
+	for (; i + 4 <= numPixels; i += 4)
+	{
+		for (int lane = 0; lane < 4; lane++)
+		{
+			uint32_t value = pImage[i + lane];
+			sum[lane] += value;
+			sumOfSquares[lane] += (uint64_t)value * value;
+			min[lane] = (value < min[lane]) ? value : min[lane];
+			max[lane] = (value > max[lane]) ? value : max[lane];
+		}
+	}
+	for (; i < numPixels; i++)
 	{
-		sum = sum + (uint32_t)pImage[i];
+		uint32_t value = pImage[i];
+		sum[0] += value;
+		sumOfSquares[0] += (uint64_t)value * value;
+		min[0] = (value < min[0]) ? value : min[0];
+		max[0] = (value > max[0]) ? value : max[0];
 	}
-	avg = sum / image.GetImageSize();
 
-	return avg;
+	stats.count = numPixels;
+	stats.sum = sum[0] + sum[1] + sum[2] + sum[3];
+	stats.sumOfSquares = sumOfSquares[0] + sumOfSquares[1] + sumOfSquares[2] + sumOfSquares[3];
+	stats.min = UINT32_MAX;
+	stats.max = 0;
+	for (int lane = 0; lane < 4; lane++)
+	{
+		if (min[lane] < stats.min)
+			stats.min = min[lane];
+		if (max[lane] > stats.max)
+			stats.max = max[lane];
+	}
 }
 
-inline uint32_t AnalysisTools::FindMin(Pylon::CPylonImage& image)
+template <typename T>
+inline AnalysisTools::Stats AnalysisTools::FindStatsParallel(const T* pImage, size_t numPixels)
 {
-	uint32_t min = UINT32_MAX;
-	uint8_t* pImage = (uint8_t*)image.GetBuffer();
+	Stats stats;
+	size_t pixelsPerChunk = c_reductionChunkSize / sizeof(T);
+	size_t numChunks = (numPixels + pixelsPerChunk - 1) / pixelsPerChunk;
+
+	if (numPixels == 0)
+		return stats;
 
-	for (uint32_t i = 0; i < image.GetImageSize(); i++)
+	// Each chunk writes its own result, so no locking is needed.
+	// The results array is kept per thread and only grows, so steady-state calls don't allocate.
+	// (the tasks run on the pool threads, so they must use this thread's array through a reference, not the thread_local name)
+	static thread_local std::vector<Stats> chunkStats;
+	if (chunkStats.size() < numChunks)
+		chunkStats.resize(numChunks);
+	std::vector<Stats>& results = chunkStats;
+
+	auto task = [&](size_t chunk)
 	{
-		if ((uint32_t)pImage[i] < min)
-			min = pImage[i];
+		size_t first = chunk * pixelsPerChunk;
+		size_t count = (first + pixelsPerChunk < numPixels) ? pixelsPerChunk : numPixels - first;
+		FindStatsT<T>(pImage + first, count, results[chunk]);
+	};
+	// (passed by reference, so the std::function wrapper doesn't need to allocate a copy of the lambda)
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	// merge in chunk order
+	for (size_t chunk = 0; chunk < numChunks; chunk++)
+		stats.Merge(chunkStats[chunk]);
+
+	return stats;
+}
+
+inline AnalysisTools::Stats AnalysisTools::FindStats(Pylon::CPylonImage& image)
+{
+	if (Pylon::BitPerPixel(image.GetPixelType()) > 8)
+		return FindStatsParallel<uint16_t>((const uint16_t*)image.GetBuffer(), image.GetImageSize() / 2);
+	else
+		return FindStatsParallel<uint8_t>((const uint8_t*)image.GetBuffer(), image.GetImageSize());
+}
+
+template <typename Traits>
+inline AnalysisTools::Stats AnalysisTools::FindStatsForFormat(Pylon::CPylonImage& image)
+{
+	typedef typename Traits::value_type T;
+	return FindStatsParallel<T>((const T*)image.GetBuffer(), image.GetImageSize() / sizeof(T));
+}
+
+inline void AnalysisTools::DiffStats::Merge(const DiffStats& other)
+{
+	count += other.count;
+	sum += other.sum;
+	sumOfSquares += other.sumOfSquares;
+}
+
+template <typename T>
+inline void AnalysisTools::FindDiffStatsT(const T* pImageA, const T* pImageB, size_t numPixels, DiffStats& stats)
+{
+	// Four independent lanes, like FindStatsT().
+	int64_t sum[4] = { 0, 0, 0, 0 };
+	uint64_t sumOfSquares[4] = { 0, 0, 0, 0 };
+
+	size_t i = 0;
+	for (; i + 4 <= numPixels; i += 4)
+	{
+		for (int lane = 0; lane < 4; lane++)
+		{
+			int64_t diff = (int64_t)pImageA[i + lane] - (int64_t)pImageB[i + lane];
+			sum[lane] += diff;
+			sumOfSquares[lane] += (uint64_t)(diff * diff);
+		}
+	}
+	for (; i < numPixels; i++)
+	{
+		int64_t diff = (int64_t)pImageA[i] - (int64_t)pImageB[i];
+		sum[0] += diff;
+		sumOfSquares[0] += (uint64_t)(diff * diff);
 	}
 
-	return min;
+	stats.count = numPixels;
+	stats.sum = sum[0] + sum[1] + sum[2] + sum[3];
+	stats.sumOfSquares = sumOfSquares[0] + sumOfSquares[1] + sumOfSquares[2] + sumOfSquares[3];
 }
 
-inline uint32_t AnalysisTools::FindMax(Pylon::CPylonImage& image)
+template <typename T>
+inline AnalysisTools::DiffStats AnalysisTools::FindDiffStatsParallel(const T* pImageA, const T* pImageB, size_t numPixels)
+{
+	DiffStats stats;
+	size_t pixelsPerChunk = c_reductionChunkSize / sizeof(T);
+	size_t numChunks = (numPixels + pixelsPerChunk - 1) / pixelsPerChunk;
+
+	if (numPixels == 0)
+		return stats;
+
+	static thread_local std::vector<DiffStats> chunkStats;
+	if (chunkStats.size() < numChunks)
+		chunkStats.resize(numChunks);
+	std::vector<DiffStats>& results = chunkStats;
+
+	auto task = [&](size_t chunk)
+	{
+		size_t first = chunk * pixelsPerChunk;
+		size_t count = (first + pixelsPerChunk < numPixels) ? pixelsPerChunk : numPixels - first;
+		FindDiffStatsT<T>(pImageA + first, pImageB + first, count, results[chunk]);
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	for (size_t chunk = 0; chunk < numChunks; chunk++)
+		stats.Merge(chunkStats[chunk]);
+
+	return stats;
+}
+
+template <typename Traits>
+inline AnalysisTools::DiffStats AnalysisTools::FindDiffStatsForFormat(Pylon::CPylonImage& imageA, Pylon::CPylonImage& imageB)
+{
+	typedef typename Traits::value_type T;
+	size_t size = (imageA.GetImageSize() < imageB.GetImageSize()) ? imageA.GetImageSize() : imageB.GetImageSize();
+	return FindDiffStatsParallel<T>((const T*)imageA.GetBuffer(), (const T*)imageB.GetBuffer(), size / sizeof(T));
+}
+
+inline double AnalysisTools::FindTemporalVariance(const DiffStats& stats)
+{
+	if (stats.count < 2)
+		return 0;
+
+	double mean = (double)stats.sum / stats.count;
+	double variance = ((double)stats.sumOfSquares - mean * (double)stats.sum) / (stats.count - 1);
+	return (variance > 0) ? variance / 2 : 0;
+}
+
+inline void AnalysisTools::CfaPairStats::Merge(const CfaPairStats& other)
 {
-	uint32_t max = 0;
-	uint8_t* pImage = (uint8_t*)image.GetBuffer();
-	for (uint32_t i = 0; i < image.GetImageSize(); i++)
+	for (uint32_t plane = 0; plane < c_numCfaPlanes; plane++)
 	{
-		if ((uint32_t)pImage[i] > max)
-			max = pImage[i];
+		image1[plane].Merge(other.image1[plane]);
+		image2[plane].Merge(other.image2[plane]);
+		diff[plane].Merge(other.diff[plane]);
+		saturated[plane] += other.saturated[plane];
 	}
+}
+
+template <typename Traits>
+inline void AnalysisTools::FindCfaPairStatsT(const typename Traits::value_type* pImage1, const typename Traits::value_type* pImage2, uint32_t width, uint32_t firstCellRow, uint32_t numCellRows, CfaPairStats& stats)
+{
+	typedef typename Traits::value_type T;
 
-	return max;
+	// where each plane sits in the cell (known at compile time, so the inner loop has no lookups)
+	const uint32_t position[4] = { Traits::red, Traits::green1, Traits::green2, Traits::blue };
+	const uint32_t saturationValue = (1u << Traits::bitDepth) - 1;
+	uint32_t cellsPerRow = width / 2;
+
+	uint64_t sum1[4] = { 0, 0, 0, 0 };
+	uint64_t sumOfSquares1[4] = { 0, 0, 0, 0 };
+	uint32_t min1[4] = { UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX };
+	uint32_t max1[4] = { 0, 0, 0, 0 };
+	uint64_t sum2[4] = { 0, 0, 0, 0 };
+	uint64_t sumOfSquares2[4] = { 0, 0, 0, 0 };
+	uint32_t min2[4] = { UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX };
+	uint32_t max2[4] = { 0, 0, 0, 0 };
+	int64_t diffSum[4] = { 0, 0, 0, 0 };
+	uint64_t diffSumOfSquares[4] = { 0, 0, 0, 0 };
+	uint64_t saturated[4] = { 0, 0, 0, 0 };
+
+	for (uint32_t cellRow = firstCellRow; cellRow < firstCellRow + numCellRows; cellRow++)
+	{
+		const T* pRows1[2] = { pImage1 + (size_t)(2 * cellRow) * width, pImage1 + (size_t)(2 * cellRow + 1) * width };
+		const T* pRows2[2] = { pImage2 + (size_t)(2 * cellRow) * width, pImage2 + (size_t)(2 * cellRow + 1) * width };
+
+		for (uint32_t x = 0; x < cellsPerRow; x++)
+		{
+			for (uint32_t plane = 0; plane < 4; plane++)
+			{
+				size_t offset = 2 * (size_t)x + (position[plane] & 1);
+				uint32_t value1 = pRows1[position[plane] >> 1][offset];
+				uint32_t value2 = pRows2[position[plane] >> 1][offset];
+				int64_t diff = (int64_t)value1 - (int64_t)value2;
+
+				sum1[plane] += value1;
+				sumOfSquares1[plane] += (uint64_t)value1 * value1;
+				min1[plane] = (value1 < min1[plane]) ? value1 : min1[plane];
+				max1[plane] = (value1 > max1[plane]) ? value1 : max1[plane];
+				sum2[plane] += value2;
+				sumOfSquares2[plane] += (uint64_t)value2 * value2;
+				min2[plane] = (value2 < min2[plane]) ? value2 : min2[plane];
+				max2[plane] = (value2 > max2[plane]) ? value2 : max2[plane];
+				diffSum[plane] += diff;
+				diffSumOfSquares[plane] += (uint64_t)(diff * diff);
+				saturated[plane] += (value1 >= saturationValue) + (value2 >= saturationValue);
+			}
+		}
+	}
+
+	uint64_t count = (uint64_t)cellsPerRow * numCellRows;
+	for (uint32_t plane = 0; plane < 4; plane++)
+	{
+		stats.image1[plane].count = count;
+		stats.image1[plane].sum = sum1[plane];
+		stats.image1[plane].sumOfSquares = sumOfSquares1[plane];
+		stats.image1[plane].min = min1[plane];
+		stats.image1[plane].max = max1[plane];
+		stats.image2[plane].count = count;
+		stats.image2[plane].sum = sum2[plane];
+		stats.image2[plane].sumOfSquares = sumOfSquares2[plane];
+		stats.image2[plane].min = min2[plane];
+		stats.image2[plane].max = max2[plane];
+		stats.diff[plane].count = count;
+		stats.diff[plane].sum = diffSum[plane];
+		stats.diff[plane].sumOfSquares = diffSumOfSquares[plane];
+		stats.saturated[plane] = saturated[plane];
+	}
+}
+
+template <typename Traits>
+inline AnalysisTools::CfaPairStats AnalysisTools::FindCfaPairStatsForFormat(Pylon::CPylonImage& image1, Pylon::CPylonImage& image2)
+{
+	typedef typename Traits::value_type T;
+
+	CfaPairStats stats;
+	uint32_t width = image1.GetWidth();
+	uint32_t numCellRows = image1.GetHeight() / 2;
+	if (width < 2 || numCellRows == 0 || image2.GetWidth() != width || image2.GetHeight() != image1.GetHeight())
+		return stats;
+
+	// chunks of whole cell rows, about c_reductionChunkSize of each image
+	size_t bytesPerCellRow = 2 * (size_t)width * sizeof(T);
+	uint32_t cellRowsPerChunk = (uint32_t)((c_reductionChunkSize + bytesPerCellRow - 1) / bytesPerCellRow);
+	size_t numChunks = (numCellRows + cellRowsPerChunk - 1) / cellRowsPerChunk;
+
+	// (the tasks run on the pool threads, so they must use this thread's array through a reference, not the thread_local name)
+	static thread_local std::vector<CfaPairStats> chunkStats;
+	if (chunkStats.size() < numChunks)
+		chunkStats.resize(numChunks);
+	std::vector<CfaPairStats>& results = chunkStats;
+
+	const T* pImage1 = (const T*)image1.GetBuffer();
+	const T* pImage2 = (const T*)image2.GetBuffer();
+	auto task = [&](size_t chunk)
+	{
+		uint32_t first = (uint32_t)chunk * cellRowsPerChunk;
+		uint32_t count = (first + cellRowsPerChunk < numCellRows) ? cellRowsPerChunk : numCellRows - first;
+		FindCfaPairStatsT<Traits>(pImage1, pImage2, width, first, count, results[chunk]);
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	// merge in chunk order
+	for (size_t chunk = 0; chunk < numChunks; chunk++)
+		stats.Merge(chunkStats[chunk]);
+
+	return stats;
+}
+
+inline AnalysisTools::PlaneSummary AnalysisTools::SummarizeStats(const Stats& image1, const Stats& image2, const DiffStats& diff, uint64_t saturated)
+{
+	PlaneSummary summary;
+	if (image1.count == 0 || image2.count == 0)
+		return summary;
+
+	summary.mean = ((double)image1.sum / image1.count + (double)image2.sum / image2.count) / 2;
+	summary.temporalNoise = std::sqrt(FindTemporalVariance(diff));
+	summary.snr = (summary.temporalNoise > 0) ? summary.mean / summary.temporalNoise : 0;
+	summary.saturation = (double)saturated / (image1.count + image2.count);
+	return summary;
+}
+
+inline AnalysisTools::PlaneSummary AnalysisTools::SummarizePlane(const CfaPairStats& stats, uint32_t plane)
+{
+	return SummarizeStats(stats.image1[plane], stats.image2[plane], stats.diff[plane], stats.saturated[plane]);
+}
+
+inline AnalysisTools::PlaneSummary AnalysisTools::SummarizeGreen(const CfaPairStats& stats)
+{
+	Stats image1 = stats.image1[Plane_GreenRed];
+	Stats image2 = stats.image2[Plane_GreenRed];
+	DiffStats diff = stats.diff[Plane_GreenRed];
+	image1.Merge(stats.image1[Plane_GreenBlue]);
+	image2.Merge(stats.image2[Plane_GreenBlue]);
+	diff.Merge(stats.diff[Plane_GreenBlue]);
+	return SummarizeStats(image1, image2, diff, stats.saturated[Plane_GreenRed] + stats.saturated[Plane_GreenBlue]);
+}
+
+inline uint32_t AnalysisTools::FindAvg(Pylon::CPylonImage& image)
+{
+	Stats stats = FindStats(image);
+
+	if (stats.count == 0)
+		return 0;
+
+	return (uint32_t)(stats.sum / stats.count);
+}
+
+inline uint32_t AnalysisTools::FindMin(Pylon::CPylonImage& image)
+{
+	return FindStats(image).min;
+}
+
+inline uint32_t AnalysisTools::FindMax(Pylon::CPylonImage& image)
+{
+	return FindStats(image).max;
 }
 
 inline double AnalysisTools::FindSNR(Pylon::CPylonImage& image)
+{
+	return FindSNR(FindStats(image));
+}
+
+inline double AnalysisTools::FindSNR(const Stats& stats)
 {
 	double var = 0;
 	double stddev = 0;
 	double snr = 0;
-	uint32_t mean = 0;
-	uint8_t* pImage = (uint8_t*)image.GetBuffer();
 
-	mean = AnalysisTools::FindAvg(image);
+	if (stats.count == 0)
+		return 0;
 
-	for (uint32_t i = 0; i < image.GetImageSize(); i++)
-	{
-		var = var + (((uint32_t)pImage[i] - mean) * ((uint32_t)pImage[i] - mean));
-	}
+	// The variance is taken around the (integer) average pixel value, as it always has been.
+	// sum((x - mean)^2) = sumOfSquares - 2 * mean * sum + count * mean^2, which is exact in 64 bit integers.
+	uint64_t mean = stats.sum / stats.count;
+	uint64_t squaredDeviations = (stats.sumOfSquares + stats.count * mean * mean) - 2 * mean * stats.sum;
 
-	var = var / image.GetImageSize();
+	var = (double)squaredDeviations / stats.count;
 	stddev = sqrt(var);
 
 	if (stddev == 0)
@@ -116,5 +612,381 @@ inline double AnalysisTools::FindSNR(Pylon::CPylonImage& image)
 
 	return snr;
 }
+
+inline bool AnalysisTools::FindProfiles(Pylon::CPylonImage& image, Profiles& profiles, std::string& errorMessage)
+{
+	try
+	{
+		Pylon::EPixelType pixelType = image.GetPixelType();
+
+		if (Pylon::IsPacked(pixelType) || Pylon::SamplesPerPixel(pixelType) != 1)
+		{
+			errorMessage = "ERROR: Only unpacked mono and Bayer formats are supported.";
+			return false;
+		}
+
+		profiles.numChannels = Pylon::IsBayer(pixelType) ? 4 : 1;
+
+		if (Pylon::BitPerPixel(pixelType) == 8)
+			FindProfilesT<uint8_t>((const uint8_t*)image.GetBuffer(), image.GetWidth(), image.GetHeight(), profiles);
+		else
+			FindProfilesT<uint16_t>((const uint16_t*)image.GetBuffer(), image.GetWidth(), image.GetHeight(), profiles);
+
+		return true;
+	}
+	catch (std::exception& e)
+	{
+		errorMessage = "An exception occured in FindProfiles(): ";
+		errorMessage.append(e.what());
+		return false;
+	}
+}
+
+template <typename Traits>
+inline bool AnalysisTools::FindProfilesForFormat(Pylon::CPylonImage& image, Profiles& profiles, std::string& errorMessage)
+{
+	typedef typename Traits::value_type T;
+
+	if (image.GetPixelType() != Traits::pixelType)
+	{
+		errorMessage = "ERROR: Image does not have the pixel type this function was compiled for.";
+		return false;
+	}
+
+	profiles.numChannels = Traits::isBayer ? 4 : 1;
+	FindProfilesT<T>((const T*)image.GetBuffer(), image.GetWidth(), image.GetHeight(), profiles);
+	return true;
+}
+
+template <typename T>
+inline void AnalysisTools::FindProfilesT(const T* pImage, uint32_t width, uint32_t height, Profiles& profiles)
+{
+	FindProfilesRowsT<T>([pImage, width](uint32_t y) { return pImage + (size_t)y * width; }, width, height, profiles);
+}
+
+template <typename T, typename GetRow>
+inline void AnalysisTools::FindProfilesRowsT(GetRow getRow, uint32_t width, uint32_t height, Profiles& profiles)
+{
+	// For Bayer images, we only use complete 2x2 cells.
+	bool isBayer = (profiles.numChannels == 4);
+	uint32_t usedWidth = isBayer ? (width & ~1u) : width;
+	uint32_t usedHeight = isBayer ? (height & ~1u) : height;
+	uint32_t subWidth = isBayer ? usedWidth / 2 : usedWidth;
+	uint32_t subHeight = isBayer ? usedHeight / 2 : usedHeight;
+
+	for (uint32_t c = 0; c < profiles.numChannels; c++)
+	{
+		profiles.rowMean[c].assign(subHeight, 0.0);
+		profiles.colMean[c].assign(subWidth, 0.0);
+	}
+
+	if (subWidth == 0 || subHeight == 0)
+		return;
+
+	// The column sums are accumulated while the rows stream by, so the image is read only once.
+	// Bayer images keep a separate set of column sums for even and odd rows (this stays small enough to live in cache).
+	// (kept per thread and only grows, so steady-state calls don't allocate)
+	static thread_local std::vector<uint64_t> colSums;
+	colSums.assign(isBayer ? 2 * (size_t)width : (size_t)width, 0);
+
+	for (uint32_t y = 0; y < usedHeight; y++)
+	{
+		const T* pRow = getRow(y);
+		uint64_t* pColSums = &colSums[isBayer ? (size_t)(y & 1) * width : 0];
+		uint64_t rowSumEven = 0;
+		uint64_t rowSumOdd = 0;
+		uint32_t x = 0;
+
+		for (; x + 1 < usedWidth; x += 2)
+		{
+			uint32_t even = pRow[x];
+			uint32_t odd = pRow[x + 1];
+			rowSumEven += even;
+			rowSumOdd += odd;
+			pColSums[x] += even;
+			pColSums[x + 1] += odd;
+		}
+		for (; x < usedWidth; x++)
+		{
+			rowSumEven += pRow[x];
+			pColSums[x] += pRow[x];
+		}
+
+		if (isBayer)
+		{
+			uint32_t channel = (y & 1) * 2;
+			profiles.rowMean[channel][y / 2] = (double)rowSumEven / subWidth;
+			profiles.rowMean[channel + 1][y / 2] = (double)rowSumOdd / subWidth;
+		}
+		else
+		{
+			profiles.rowMean[0][y] = (double)(rowSumEven + rowSumOdd) / subWidth;
+		}
+	}
+
+	if (isBayer)
+	{
+		for (uint32_t c = 0; c < 4; c++)
+		{
+			const uint64_t* pColSums = &colSums[(size_t)(c / 2) * width + (c % 2)];
+			for (uint32_t i = 0; i < subWidth; i++)
+				profiles.colMean[c][i] = (double)pColSums[2 * i] / subHeight;
+		}
+	}
+	else
+	{
+		for (uint32_t i = 0; i < subWidth; i++)
+			profiles.colMean[0][i] = (double)colSums[i] / subHeight;
+	}
+}
+
+inline double AnalysisTools::FindProfileStdDev(const std::vector<double>& profile)
+{
+	if (profile.size() == 0)
+		return 0;
+
+	double mean = 0;
+	double var = 0;
+
+	for (size_t i = 0; i < profile.size(); i++)
+		mean = mean + profile[i];
+	mean = mean / profile.size();
+
+	for (size_t i = 0; i < profile.size(); i++)
+		var = var + ((profile[i] - mean) * (profile[i] - mean));
+	var = var / profile.size();
+
+	return sqrt(var);
+}
+
+inline void AnalysisTools::FindSpectrogram(const std::vector<double>& profile, std::vector<double>& spectrogram)
+{
+	size_t length = profile.size();
+	spectrogram.clear();
+	if (length == 0)
+		return;
+
+	// zero-pad to the next power of two so we can use a radix-2 FFT
+	size_t n = 1;
+	uint32_t log2n = 0;
+	while (n < length)
+	{
+		n <<= 1;
+		log2n++;
+	}
+
+	double mean = 0;
+	for (size_t i = 0; i < length; i++)
+		mean = mean + profile[i];
+	mean = mean / length;
+
+	// load the input in bit-reversed order
+	std::vector<std::complex<double>> data(n, std::complex<double>(0, 0));
+	for (size_t i = 0; i < length; i++)
+	{
+		size_t reversed = 0;
+		for (uint32_t b = 0; b < log2n; b++)
+			reversed |= ((i >> b) & 1) << (log2n - 1 - b);
+		data[reversed] = std::complex<double>(profile[i] - mean, 0);
+	}
+
+	// iterative Cooley-Tukey butterflies
+	const double pi = 3.14159265358979323846;
+	for (size_t span = 2; span <= n; span <<= 1)
+	{
+		std::complex<double> step = std::polar(1.0, -2.0 * pi / span);
+		for (size_t start = 0; start < n; start += span)
+		{
+			std::complex<double> twiddle(1, 0);
+			for (size_t k = 0; k < span / 2; k++)
+			{
+				std::complex<double> even = data[start + k];
+				std::complex<double> odd = data[start + k + span / 2] * twiddle;
+				data[start + k] = even + odd;
+				data[start + k + span / 2] = even - odd;
+				twiddle *= step;
+			}
+		}
+	}
+
+	spectrogram.resize(n / 2 + 1);
+	for (size_t k = 0; k < spectrogram.size(); k++)
+		spectrogram[k] = sqrt(std::norm(data[k]) / length);
+}
+
+template <typename Traits>
+inline void AnalysisTools::FindHistogramsT(const typename Traits::value_type* pImage, uint32_t width, uint32_t firstRow, uint32_t numRows, uint32_t* pCounts)
+{
+	typedef typename Traits::value_type T;
+	const uint32_t numBins = 1u << Traits::bitDepth;
+
+	// the plane of each position in the 2x2 cell (all 0 for mono)
+	uint32_t planeOf[4] = { 0, 0, 0, 0 };
+	if (Traits::isBayer)
+	{
+		planeOf[Traits::red] = Plane_Red;
+		planeOf[Traits::green1] = Plane_GreenRed;
+		planeOf[Traits::green2] = Plane_GreenBlue;
+		planeOf[Traits::blue] = Plane_Blue;
+	}
+
+	for (uint32_t row = firstRow; row < firstRow + numRows; row++)
+	{
+		const T* pRow = pImage + (size_t)row * width;
+		uint32_t* pEven = pCounts + (size_t)planeOf[(row & 1) * 2] * numBins;
+		uint32_t* pOdd = pCounts + (size_t)planeOf[(row & 1) * 2 + 1] * numBins;
+
+		// (values above the bit depth only come from a broken buffer, but must not write outside the histogram)
+		uint32_t x = 0;
+		for (; x + 2 <= width; x += 2)
+		{
+			uint32_t even = pRow[x];
+			uint32_t odd = pRow[x + 1];
+			pEven[(even < numBins) ? even : numBins - 1]++;
+			pOdd[(odd < numBins) ? odd : numBins - 1]++;
+		}
+		if (x < width)
+		{
+			uint32_t even = pRow[x];
+			pEven[(even < numBins) ? even : numBins - 1]++;
+		}
+	}
+}
+
+template <typename Traits>
+inline void AnalysisTools::FindHistogramsForFormat(Pylon::CPylonImage& image, Histograms& histograms)
+{
+	typedef typename Traits::value_type T;
+	const uint32_t numBins = 1u << Traits::bitDepth;
+	const uint32_t numChannels = Traits::isBayer ? c_numCfaPlanes : 1;
+	uint32_t width = image.GetWidth();
+	uint32_t height = image.GetHeight();
+
+	histograms.numChannels = numChannels;
+	for (uint32_t channel = 0; channel < c_numCfaPlanes; channel++)
+		histograms.counts[channel].assign((channel < numChannels) ? numBins : 0, 0);
+	if (width == 0 || height == 0)
+		return;
+
+	// Every chunk needs its own (32 bit) bins, so the chunks are a few per thread rather than c_reductionChunkSize each.
+	// (the counts are integers, so the result doesn't depend on how the rows are split)
+	size_t numChunks = ThreadPool::GetDefaultPool().GetNumThreads() * 2;
+	uint32_t rowsPerChunk = (uint32_t)((height + numChunks - 1) / numChunks);
+	uint32_t minRowsPerChunk = (uint32_t)((c_reductionChunkSize + width * sizeof(T) - 1) / (width * sizeof(T)));
+	rowsPerChunk = (rowsPerChunk < minRowsPerChunk) ? minRowsPerChunk : rowsPerChunk;
+	numChunks = (height + rowsPerChunk - 1) / rowsPerChunk;
+	size_t binsPerChunk = (size_t)numChannels * numBins;
+
+	// The scratch bins only ever grow, and each task clears just its own chunk's bins (on its own thread, instead of all of them here).
+	// (the tasks run on the pool threads, so they must use this thread's array through a reference, not the thread_local name)
+	static thread_local std::vector<uint32_t> chunkCounts;
+	if (chunkCounts.size() < numChunks * binsPerChunk)
+		chunkCounts.resize(numChunks * binsPerChunk);
+	std::vector<uint32_t>& results = chunkCounts;
+
+	const T* pImage = (const T*)image.GetBuffer();
+	auto task = [&](size_t chunk)
+	{
+		uint32_t* pCounts = &results[chunk * binsPerChunk];
+		std::fill(pCounts, pCounts + binsPerChunk, 0);
+
+		uint32_t first = (uint32_t)chunk * rowsPerChunk;
+		uint32_t count = (first + rowsPerChunk < height) ? rowsPerChunk : height - first;
+		FindHistogramsT<Traits>(pImage, width, first, count, pCounts);
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	MergeHistogramChunks(&chunkCounts[0], numChunks, histograms);
+}
+
+inline void AnalysisTools::MergeHistogramChunks(const uint32_t* pChunkCounts, size_t numChunks, Histograms& histograms)
+{
+	const size_t numBins = histograms.counts[0].size();
+	const size_t binsPerChunk = (size_t)histograms.numChannels * numBins;
+	const size_t binsPerTask = (numBins < 4096) ? numBins : 4096;
+	const size_t tasksPerChannel = (numBins + binsPerTask - 1) / binsPerTask;
+
+	auto task = [&](size_t taskIndex)
+	{
+		size_t channel = taskIndex / tasksPerChannel;
+		size_t first = (taskIndex % tasksPerChannel) * binsPerTask;
+		size_t last = (first + binsPerTask < numBins) ? first + binsPerTask : numBins;
+		uint64_t* pCounts = &histograms.counts[channel][0];
+		for (size_t chunk = 0; chunk < numChunks; chunk++)
+		{
+			const uint32_t* pChunk = pChunkCounts + chunk * binsPerChunk + channel * numBins;
+			for (size_t bin = first; bin < last; bin++)
+				pCounts[bin] += pChunk[bin];
+		}
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(histograms.numChannels * tasksPerChannel, std::cref(task));
+}
+
+inline uint32_t AnalysisTools::FindPercentile(const std::vector<uint64_t>& counts, double percent)
+{
+	uint64_t total = 0;
+	for (size_t bin = 0; bin < counts.size(); bin++)
+		total += counts[bin];
+	if (total == 0)
+		return 0;
+
+	// the rank of the pixel we want, counting from 1
+	double rank = std::ceil(percent / 100.0 * total);
+	uint64_t target = (rank < 1) ? 1 : ((rank > total) ? total : (uint64_t)rank);
+
+	uint64_t cumulative = 0;
+	for (size_t bin = 0; bin < counts.size(); bin++)
+	{
+		cumulative += counts[bin];
+		if (cumulative >= target)
+			return (uint32_t)bin;
+	}
+	return (uint32_t)(counts.size() - 1);
+}
+
+inline uint32_t AnalysisTools::FindMedian(const std::vector<uint64_t>& counts)
+{
+	return FindPercentile(counts, 50);
+}
+
+inline double AnalysisTools::FindTrimmedMean(const std::vector<uint64_t>& counts, double trimPercent)
+{
+	uint64_t total = 0;
+	for (size_t bin = 0; bin < counts.size(); bin++)
+		total += counts[bin];
+
+	// the same number of pixels is dropped from both ends
+	uint64_t trimmed = (uint64_t)(trimPercent / 100.0 * total);
+	if (total == 0 || 2 * trimmed >= total)
+		return (total > 0) ? (double)FindMedian(counts) : 0;
+
+	// keep the pixels with ranks [trimmed, total - trimmed), counting from 0
+	uint64_t first = trimmed;
+	uint64_t last = total - trimmed;
+	uint64_t cumulative = 0;
+	double sum = 0;
+	for (size_t bin = 0; bin < counts.size() && cumulative < last; bin++)
+	{
+		uint64_t begin = cumulative;
+		uint64_t end = cumulative + counts[bin];
+		cumulative = end;
+		begin = (begin > first) ? begin : first;
+		end = (end < last) ? end : last;
+		if (end > begin)
+			sum += (double)bin * (end - begin);
+	}
+	return sum / (last - first);
+}
+
+inline uint32_t AnalysisTools::FindLowestPercentile(const Histograms& histograms, double percent)
+{
+	uint32_t lowest = UINT32_MAX;
+	for (uint32_t channel = 0; channel < histograms.numChannels; channel++)
+	{
+		uint32_t value = FindPercentile(histograms.counts[channel], percent);
+		lowest = (value < lowest) ? value : lowest;
+	}
+	return (histograms.numChannels > 0) ? lowest : 0;
+}
 // *********************************************************************************************************
 #endif
\ No newline at end of file
@@ -0,0 +1,604 @@
+// BatchAnalyzer.h
+// Analyzes frames which were saved to disk, with the same statistics as the live test, and produces the same result rows.
+// Frames are taken in name order from each directory, and every two consecutive frames are one measurement pair (like the emulator plays them back).
+// - Image files (.png, .tif/.tiff, .bmp) are loaded by pylon.
+// - Raw dumps (.raw) are memory-mapped and analyzed in place. A raw file holds one or more frames of the same format back to back
+//   (eg: a recording of a whole sweep), so the width, height and pixel format must be given.
+// If a frame file name contains "_exp<microseconds>" (eg: frame_exp1250_0.png), consecutive pairs with the same exposure time are
+// combined into one row, like the live test does when it takes several pairs per exposure time.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef BATCHANALYZER_H
+#define BATCHANALYZER_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience (if this header included first)
+#endif
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+
+#include "AnalysisTools.h"
+#include "FormatDispatch.h"
+#include "ThreadPool.h"
+#include "DarkBright.h"
+#include "AdaptiveSampling.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#ifdef WIN_BUILD
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace BatchAnalyzer
+{
+	// The layout of the frames in raw dumps. Image files carry their own size, but Bayer frames saved as image files
+	// are loaded as mono, so a pixelType given here is also applied to them (if the bits per pixel match).
+	struct RawFormat
+	{
+		Pylon::EPixelType pixelType = Pylon::PixelType_Undefined;
+		uint32_t width = 0;
+		uint32_t height = 0;
+	};
+
+	// A file mapped read-only into memory. The pages are read by the OS as they are touched, so nothing is copied.
+	class MappedFile
+	{
+	private:
+		const uint8_t* m_pData = nullptr;
+		size_t m_size = 0;
+#ifdef WIN_BUILD
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = NULL;
+#else
+		int m_file = -1;
+#endif
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+	public:
+		MappedFile();
+		~MappedFile();
+
+		bool Open(const std::string& fileName, std::string& errorMessage);
+		void Close();
+		const uint8_t* GetData();
+		size_t GetSize();
+	};
+
+	// How long the analysis took and how much was read.
+	struct Summary
+	{
+		uint64_t numFiles = 0;
+		uint64_t numFrames = 0;
+		uint64_t numPairs = 0;
+		uint64_t bytesAnalyzed = 0;
+		double seconds = 0;
+	};
+
+	// Analyze all frames in the directories (in order) and return one row per exposure time.
+	// Pairs are spread over the thread pool. If there are fewer pairs than threads, the pairs are analyzed one after the other
+	// and the pool works on the tiles of each image instead.
+	bool Run(const std::vector<std::string>& directories, const RawFormat& rawFormat, const AdaptiveSampling::Settings& samplingSettings, std::vector<DarkBright::Measurement>& rows, Summary& summary, std::string& errorMessage);
+
+	// The intermediate profiles of one pair.
+	struct Scratch
+	{
+		AnalysisTools::Profiles profiles1;
+		AnalysisTools::Profiles profiles2;
+		AnalysisTools::Profiles profilesAvg;
+	};
+
+	// The same measurements the live test makes of a pair. Fields the files don't have (gain, black level, offsets) stay zero.
+	bool AnalyzePair(const FormatDispatch::Kernels& kernels, Pylon::CPylonImage& image1, Pylon::CPylonImage& image2, Scratch& scratch, DarkBright::Measurement& measurement, std::string& errorMessage);
+
+	// helpers
+	// List the frame files (.raw, .png, .tif, .tiff, .bmp) of a directory, sorted by name.
+	bool ListFrameFiles(const std::string& directory, std::vector<std::string>& fileNames, std::string& errorMessage);
+	bool IsRawFile(const std::string& fileName);
+	// The "_exp<microseconds>" part of a file name, or 0 if there is none.
+	double ParseExposureTime(const std::string& fileName);
+}
+
+// *********************************************************************************************************
+inline BatchAnalyzer::MappedFile::MappedFile()
+{
+	// nothing
+}
+
+inline BatchAnalyzer::MappedFile::~MappedFile()
+{
+	Close();
+}
+
+inline bool BatchAnalyzer::MappedFile::Open(const std::string& fileName, std::string& errorMessage)
+{
+	Close();
+
+#ifdef WIN_BUILD
+	m_file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+	{
+		errorMessage = "ERROR: Could not open " + fileName;
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(m_file, &size) == FALSE)
+	{
+		errorMessage = "ERROR: Could not get the size of " + fileName;
+		Close();
+		return false;
+	}
+	m_size = (size_t)size.QuadPart;
+	if (m_size == 0)
+		return true;
+
+	m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping != NULL)
+		m_pData = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	m_file = open(fileName.c_str(), O_RDONLY);
+	if (m_file < 0)
+	{
+		errorMessage = "ERROR: Could not open " + fileName;
+		return false;
+	}
+
+	struct stat status;
+	if (fstat(m_file, &status) != 0)
+	{
+		errorMessage = "ERROR: Could not get the size of " + fileName;
+		Close();
+		return false;
+	}
+	m_size = (size_t)status.st_size;
+	if (m_size == 0)
+		return true;
+
+	void* pData = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_file, 0);
+	if (pData != MAP_FAILED)
+	{
+		m_pData = (const uint8_t*)pData;
+		// the frames are mostly read front to back, so let the OS read ahead
+		madvise(pData, m_size, MADV_SEQUENTIAL);
+	}
+#endif
+
+	if (m_pData == nullptr)
+	{
+		errorMessage = "ERROR: Could not map " + fileName + " into memory.";
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+inline void BatchAnalyzer::MappedFile::Close()
+{
+#ifdef WIN_BUILD
+	if (m_pData != nullptr)
+		UnmapViewOfFile(m_pData);
+	if (m_mapping != NULL)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+	m_mapping = NULL;
+	m_file = INVALID_HANDLE_VALUE;
+#else
+	if (m_pData != nullptr)
+		munmap((void*)m_pData, m_size);
+	if (m_file >= 0)
+		close(m_file);
+	m_file = -1;
+#endif
+	m_pData = nullptr;
+	m_size = 0;
+}
+
+inline const uint8_t* BatchAnalyzer::MappedFile::GetData()
+{
+	return m_pData;
+}
+
+inline size_t BatchAnalyzer::MappedFile::GetSize()
+{
+	return m_size;
+}
+
+inline bool BatchAnalyzer::IsRawFile(const std::string& fileName)
+{
+	return fileName.size() > 4 && fileName.compare(fileName.size() - 4, 4, ".raw") == 0;
+}
+
+inline bool BatchAnalyzer::ListFrameFiles(const std::string& directory, std::vector<std::string>& fileNames, std::string& errorMessage)
+{
+	const char* extensions[] = { ".raw", ".png", ".tif", ".tiff", ".bmp" };
+	std::vector<std::string> names;
+
+#ifdef WIN_BUILD
+	WIN32_FIND_DATAA findData;
+	HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &findData);
+	if (find == INVALID_HANDLE_VALUE)
+	{
+		errorMessage = "ERROR: Could not read the directory " + directory;
+		return false;
+	}
+	do
+	{
+		if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+			names.push_back(findData.cFileName);
+	} while (FindNextFileA(find, &findData) != FALSE);
+	FindClose(find);
+#else
+	DIR* pDirectory = opendir(directory.c_str());
+	if (pDirectory == NULL)
+	{
+		errorMessage = "ERROR: Could not read the directory " + directory;
+		return false;
+	}
+	for (struct dirent* pEntry = readdir(pDirectory); pEntry != NULL; pEntry = readdir(pDirectory))
+	{
+		if (pEntry->d_name[0] != '.')
+			names.push_back(pEntry->d_name);
+	}
+	closedir(pDirectory);
+#endif
+
+	std::sort(names.begin(), names.end());
+
+	fileNames.clear();
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		std::string lowerCase = names[i];
+		for (size_t c = 0; c < lowerCase.size(); c++)
+			lowerCase[c] = (char)tolower((unsigned char)lowerCase[c]);
+
+		for (size_t e = 0; e < sizeof(extensions) / sizeof(extensions[0]); e++)
+		{
+			size_t length = std::strlen(extensions[e]);
+			if (lowerCase.size() > length && lowerCase.compare(lowerCase.size() - length, length, extensions[e]) == 0)
+			{
+				fileNames.push_back(directory + "/" + names[i]);
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+inline double BatchAnalyzer::ParseExposureTime(const std::string& fileName)
+{
+	size_t slash = fileName.find_last_of("/\\");
+	size_t position = fileName.find("_exp", (slash == std::string::npos) ? 0 : slash);
+	if (position == std::string::npos)
+		return 0;
+
+	return std::atof(fileName.c_str() + position + 4);
+}
+
+inline bool BatchAnalyzer::AnalyzePair(const FormatDispatch::Kernels& kernels, Pylon::CPylonImage& image1, Pylon::CPylonImage& image2, Scratch& scratch, DarkBright::Measurement& m, std::string& errorMessage)
+{
+	try
+	{
+		if (image1.GetPixelType() != image2.GetPixelType() || image1.GetWidth() != image2.GetWidth() || image1.GetHeight() != image2.GetHeight()
+			|| image1.GetWidth() == 0 || image1.GetHeight() == 0)
+		{
+			errorMessage = "ERROR: The two frames of a pair must have the same format and size.";
+			return false;
+		}
+
+		m = DarkBright::Measurement();
+		m.width = image1.GetWidth();
+		m.height = image1.GetHeight();
+
+		AnalysisTools::Stats stats1 = kernels.findStats(image1);
+		AnalysisTools::Stats stats2 = kernels.findStats(image2);
+		m.minAll = (stats1.min + stats2.min) / 2;
+		m.maxAll = (stats1.max + stats2.max) / 2;
+		m.avgAll = (uint32_t)((stats1.sum / stats1.count + stats2.sum / stats2.count) / 2);
+		m.snrAll = (AnalysisTools::FindSNR(stats1) + AnalysisTools::FindSNR(stats2)) / 2;
+
+		if (kernels.isBayer)
+		{
+			// all four planes of both images in one pass, like the live test
+			AnalysisTools::CfaPairStats cfaStats = kernels.findCfaPairStats(image1, image2);
+			AnalysisTools::Stats green1 = cfaStats.image1[AnalysisTools::Plane_GreenRed];
+			AnalysisTools::Stats green2 = cfaStats.image2[AnalysisTools::Plane_GreenRed];
+			green1.Merge(cfaStats.image1[AnalysisTools::Plane_GreenBlue]);
+			green2.Merge(cfaStats.image2[AnalysisTools::Plane_GreenBlue]);
+
+			m.avgRed = (uint32_t)AnalysisTools::SummarizePlane(cfaStats, AnalysisTools::Plane_Red).mean;
+			m.avgGreen = (uint32_t)AnalysisTools::SummarizeGreen(cfaStats).mean;
+			m.avgBlue = (uint32_t)AnalysisTools::SummarizePlane(cfaStats, AnalysisTools::Plane_Blue).mean;
+			m.snrRed = (AnalysisTools::FindSNR(cfaStats.image1[AnalysisTools::Plane_Red]) + AnalysisTools::FindSNR(cfaStats.image2[AnalysisTools::Plane_Red])) / 2;
+			m.snrGreen = (AnalysisTools::FindSNR(green1) + AnalysisTools::FindSNR(green2)) / 2;
+			m.snrBlue = (AnalysisTools::FindSNR(cfaStats.image1[AnalysisTools::Plane_Blue]) + AnalysisTools::FindSNR(cfaStats.image2[AnalysisTools::Plane_Blue])) / 2;
+
+			m.hasPlanes = true;
+			for (uint32_t plane = 0; plane < AnalysisTools::c_numCfaPlanes; plane++)
+				m.planes[plane] = AnalysisTools::SummarizePlane(cfaStats, plane);
+		}
+
+		// row and column FPN from the averaged profiles of the two images
+		if (kernels.findProfiles(image1, scratch.profiles1, errorMessage) == false || kernels.findProfiles(image2, scratch.profiles2, errorMessage) == false)
+			return false;
+
+		AnalysisTools::Profiles& profiles1 = scratch.profiles1;
+		AnalysisTools::Profiles& profiles2 = scratch.profiles2;
+		AnalysisTools::Profiles& profilesAvg = scratch.profilesAvg;
+		profilesAvg.numChannels = profiles1.numChannels;
+		for (uint32_t c = 0; c < profiles1.numChannels; c++)
+		{
+			profilesAvg.rowMean[c].resize(profiles1.rowMean[c].size());
+			profilesAvg.colMean[c].resize(profiles1.colMean[c].size());
+			for (size_t n = 0; n < profiles1.rowMean[c].size(); n++)
+				profilesAvg.rowMean[c][n] = (profiles1.rowMean[c][n] + profiles2.rowMean[c][n]) / 2;
+			for (size_t n = 0; n < profiles1.colMean[c].size(); n++)
+				profilesAvg.colMean[c][n] = (profiles1.colMean[c][n] + profiles2.colMean[c][n]) / 2;
+
+			m.rowFpn = m.rowFpn + AnalysisTools::FindProfileStdDev(profilesAvg.rowMean[c]);
+			m.colFpn = m.colFpn + AnalysisTools::FindProfileStdDev(profilesAvg.colMean[c]);
+		}
+		if (profilesAvg.numChannels > 0)
+		{
+			m.rowFpn = m.rowFpn / profilesAvg.numChannels;
+			m.colFpn = m.colFpn / profilesAvg.numChannels;
+		}
+
+		// the estimates of this one pair (Run() combines the pairs of an exposure time)
+		m.numPairs = 1;
+		m.mean = ((double)stats1.sum / stats1.count + (double)stats2.sum / stats2.count) / 2;
+		m.temporalVariance = AnalysisTools::FindTemporalVariance(kernels.findDiffStats(image1, image2));
+
+		return true;
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in AnalyzePair(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+	catch (std::exception& e)
+	{
+		errorMessage = "An exception occured in AnalyzePair(): ";
+		errorMessage.append(e.what());
+		return false;
+	}
+}
+
+inline bool BatchAnalyzer::Run(const std::vector<std::string>& directories, const RawFormat& rawFormat, const AdaptiveSampling::Settings& samplingSettings, std::vector<DarkBright::Measurement>& rows, Summary& summary, std::string& errorMessage)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	summary = Summary();
+	rows.clear();
+
+	// A frame is a file, or one frame inside a raw file.
+	struct Frame
+	{
+		size_t file = 0;
+		size_t offset = 0; // raw files only
+	};
+
+	std::vector<std::string> fileNames;
+	std::vector<std::unique_ptr<MappedFile>> mappedFiles; // (nullptr for image files)
+	std::vector<Frame> frames;
+	std::vector<size_t> pairStarts; // index of the first frame of each pair
+	std::vector<size_t> pairDirectories;
+	size_t unpairedFrames = 0;
+
+	size_t rawFrameSize = 0;
+	if (rawFormat.pixelType != Pylon::PixelType_Undefined)
+		rawFrameSize = ((size_t)rawFormat.width * Pylon::BitPerPixel(rawFormat.pixelType) + 7) / 8 * rawFormat.height;
+
+	for (size_t d = 0; d < directories.size(); d++)
+	{
+		std::vector<std::string> directoryFiles;
+		if (ListFrameFiles(directories[d], directoryFiles, errorMessage) == false)
+			return false;
+
+		size_t firstFrame = frames.size();
+		for (size_t f = 0; f < directoryFiles.size(); f++)
+		{
+			Frame frame;
+			frame.file = fileNames.size();
+			fileNames.push_back(directoryFiles[f]);
+
+			if (IsRawFile(directoryFiles[f]))
+			{
+				if (rawFrameSize == 0)
+				{
+					errorMessage = "ERROR: Raw files need the pixel format and size of the frames.";
+					return false;
+				}
+
+				// All raw files are mapped up front. This only reserves address space, the pages are read when a pair needs them.
+				std::unique_ptr<MappedFile> pMappedFile(new MappedFile());
+				if (pMappedFile->Open(directoryFiles[f], errorMessage) == false)
+					return false;
+				if (pMappedFile->GetSize() % rawFrameSize != 0)
+				{
+					errorMessage = "ERROR: The size of " + directoryFiles[f] + " is not a multiple of the frame size.";
+					return false;
+				}
+				for (frame.offset = 0; frame.offset < pMappedFile->GetSize(); frame.offset += rawFrameSize)
+					frames.push_back(frame);
+				mappedFiles.push_back(std::move(pMappedFile));
+			}
+			else
+			{
+				frames.push_back(frame);
+				mappedFiles.push_back(std::unique_ptr<MappedFile>());
+			}
+		}
+
+		// pairs don't span directories (a directory is one recording)
+		for (size_t first = firstFrame; first + 1 < frames.size(); first += 2)
+		{
+			pairStarts.push_back(first);
+			pairDirectories.push_back(d);
+		}
+		// (the last frame of an odd count has no partner and is not analyzed)
+		unpairedFrames += (frames.size() - firstFrame) % 2;
+	}
+
+	summary.numFiles = fileNames.size();
+	summary.numFrames = frames.size() - unpairedFrames;
+	summary.numPairs = pairStarts.size();
+	if (pairStarts.empty())
+	{
+		errorMessage = "ERROR: No frame pairs found.";
+		return false;
+	}
+
+	std::vector<DarkBright::Measurement> pairResults(pairStarts.size());
+	std::vector<double> pairExposureTimes(pairStarts.size());
+	std::vector<std::string> pairErrors(pairStarts.size());
+	std::vector<uint64_t> pairBytes(pairStarts.size());
+
+	auto analyzeFrame = [&](const Frame& frame, Pylon::CPylonImage& image, std::string& error) -> bool
+	{
+		try
+		{
+			MappedFile* pMappedFile = mappedFiles[frame.file].get();
+			if (pMappedFile != nullptr)
+			{
+				// (the analysis only reads the image, so the read-only mapping can be attached directly)
+				image.AttachUserBuffer((void*)(pMappedFile->GetData() + frame.offset), rawFrameSize, rawFormat.pixelType, rawFormat.width, rawFormat.height, 0);
+				return true;
+			}
+
+			Pylon::CImagePersistence::Load(fileNames[frame.file].c_str(), image);
+			if (rawFormat.pixelType != Pylon::PixelType_Undefined && image.GetPixelType() != rawFormat.pixelType)
+			{
+				if (Pylon::BitPerPixel(image.GetPixelType()) != Pylon::BitPerPixel(rawFormat.pixelType))
+				{
+					error = "ERROR: " + fileNames[frame.file] + " does not have the bits per pixel of the given pixel format.";
+					return false;
+				}
+				image.ChangePixelType(rawFormat.pixelType);
+			}
+			return true;
+		}
+		catch (GenICam::GenericException& e)
+		{
+			error = "ERROR: Could not load " + fileNames[frame.file] + ": ";
+			error.append(e.GetDescription());
+			return false;
+		}
+		catch (std::exception& e)
+		{
+			// (eg: out of memory, or a read error of a mapped file)
+			error = "ERROR: Could not load " + fileNames[frame.file] + ": ";
+			error.append(e.what());
+			return false;
+		}
+	};
+
+	auto analyzePair = [&](size_t pair)
+	{
+		Pylon::CPylonImage image1;
+		Pylon::CPylonImage image2;
+		Scratch scratch;
+		const Frame& frame1 = frames[pairStarts[pair]];
+		const Frame& frame2 = frames[pairStarts[pair] + 1];
+
+		if (analyzeFrame(frame1, image1, pairErrors[pair]) == false || analyzeFrame(frame2, image2, pairErrors[pair]) == false)
+			return;
+
+		const FormatDispatch::Kernels* pKernels = FormatDispatch::GetKernels(image1.GetPixelType());
+		if (pKernels == nullptr)
+		{
+			pairErrors[pair] = "ERROR: The pixel format of " + fileNames[frame1.file] + " is not supported.";
+			return;
+		}
+
+		if (AnalyzePair(*pKernels, image1, image2, scratch, pairResults[pair], pairErrors[pair]) == false)
+			return;
+
+		pairExposureTimes[pair] = ParseExposureTime(fileNames[frame1.file]);
+		pairBytes[pair] = image1.GetImageSize() + image2.GetImageSize();
+	};
+
+	// With enough pairs, each thread takes whole pairs (the kernels then run on that thread alone, see ThreadPool::Pool::ParallelFor()).
+	// Otherwise the pairs go one at a time, and the kernels split each image into tiles across the pool.
+	ThreadPool::Pool& pool = ThreadPool::GetDefaultPool();
+	if (pairStarts.size() >= pool.GetNumThreads())
+		pool.ParallelFor(pairStarts.size(), std::cref(analyzePair));
+	else
+	{
+		for (size_t pair = 0; pair < pairStarts.size(); pair++)
+			analyzePair(pair);
+	}
+
+	// Merge in pair order, so the rows come out like the live test logs them.
+	AdaptiveSampling::PointEstimator pointEstimator;
+	for (size_t pair = 0; pair < pairStarts.size(); pair++)
+	{
+		if (pairErrors[pair].empty() == false)
+		{
+			errorMessage = pairErrors[pair];
+			return false;
+		}
+		summary.bytesAnalyzed += pairBytes[pair];
+
+		DarkBright::Measurement& m = pairResults[pair];
+		m.exposureTime = pairExposureTimes[pair];
+		pointEstimator.AddPair(m.mean, m.temporalVariance);
+
+		// The row of an exposure time is logged after its last pair, with the estimates over all of its pairs.
+		bool lastOfPoint = (pair + 1 == pairStarts.size()) || m.exposureTime == 0 || pairExposureTimes[pair + 1] != m.exposureTime
+			|| pairDirectories[pair + 1] != pairDirectories[pair];
+		if (lastOfPoint)
+		{
+			m.numPairs = pointEstimator.GetNumPairs();
+			m.mean = pointEstimator.GetMean();
+			m.meanHalfWidth = pointEstimator.GetMeanHalfWidth(samplingSettings);
+			m.temporalVariance = pointEstimator.GetTemporalVariance();
+			m.temporalVarianceHalfWidth = pointEstimator.GetTemporalVarianceHalfWidth(samplingSettings);
+			rows.push_back(m);
+			pointEstimator.Reset();
+		}
+	}
+
+	std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+	summary.seconds = seconds.count();
+	return true;
+}
+// *********************************************************************************************************
+#endif
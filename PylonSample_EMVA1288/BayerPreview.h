@@ -0,0 +1,301 @@
+// BayerPreview.h
+// A color preview of raw Bayer images: one RGB8 pixel per 2x2 cell (half resolution, greens averaged), no interpolation.
+// Saturated cells can be painted in a false color, to see at a glance where the sensor clips.
+// Cheap enough for every frame of a multi-megapixel stream: one pass, 16 cells per step, split across the thread pool.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef BAYERPREVIEW_H
+#define BAYERPREVIEW_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "PixelFormatTraits.h"
+#include "AnalysisTools.h"
+#include "PackedPixels.h"
+#include "ThreadPool.h"
+
+// pshufb splits the cells into colors and interleaves the RGB output
+// (compiled like the unpacking in PackedPixels.h: on every x86/x64 build, and only called if the CPU has SSSE3)
+#if defined PACKEDPIXELS_SSSE3
+#define BAYERPREVIEW_SSSE3
+#endif
+
+namespace BayerPreview
+{
+	// Saturated cells are painted magenta, which a neutral scene doesn't produce.
+	const uint8_t c_overlayRed = 255;
+	const uint8_t c_overlayGreen = 0;
+	const uint8_t c_overlayBlue = 255;
+
+	// Make the preview of a Bayer image (RGB8packed, width/2 x height/2). Pixels are scaled to 8 bits by dropping the low bits.
+	// saturationLevel > 0: cells with any pixel at or above it are painted in the overlay color. 0: no overlay.
+	// The preview is reused if it already has the right format and size (eg: checked out of an ImagePool).
+	template <typename Traits>
+	bool MakePreviewT(Pylon::CPylonImage& image, uint32_t saturationLevel, Pylon::CPylonImage& preview, std::string& errorMessage);
+
+	// One row of cells: pRow0 and pRow1 are the two rows of the mosaic, pRgb gets subWidth RGB pixels.
+	template <typename Traits, typename T>
+	void MakePreviewRowT(const T* pRow0, const T* pRow1, uint32_t subWidth, uint32_t saturationLevel, uint8_t* pRgb);
+}
+
+// *********************************************************************************************************
+namespace BayerPreview
+{
+#if defined BAYERPREVIEW_SSSE3
+	// helpers for MakePreviewRowT(): split 16 cells into the four pixels of each cell (p[0] = top left ... p[3] = bottom right),
+	// already reduced to 8 bits, and flag the cells with any pixel at or above the saturation level.
+	PACKEDPIXELS_TARGET_SSSE3 inline void LoadCells(const uint8_t* pRow0, const uint8_t* pRow1, uint32_t saturationLevel, __m128i p[4], __m128i& green, __m128i& saturated, const uint32_t green1, const uint32_t green2)
+	{
+		const __m128i low = _mm_set1_epi16(0x00ff);
+		const uint8_t* pRows[2] = { pRow0, pRow1 };
+		for (int r = 0; r < 2; r++)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)pRows[r]);
+			__m128i b = _mm_loadu_si128((const __m128i*)(pRows[r] + 16));
+			p[2 * r] = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+			p[2 * r + 1] = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+		}
+
+		green = _mm_avg_epu8(p[green1], p[green2]);
+
+		saturated = _mm_setzero_si128();
+		if (saturationLevel > 0 && saturationLevel <= 0xff)
+		{
+			// x >= level exactly when max(x, level) == x
+			const __m128i level = _mm_set1_epi8((char)saturationLevel);
+			for (int i = 0; i < 4; i++)
+				saturated = _mm_or_si128(saturated, _mm_cmpeq_epi8(_mm_max_epu8(p[i], level), p[i]));
+		}
+	}
+
+	PACKEDPIXELS_TARGET_SSSE3 inline void LoadCells(const uint16_t* pRow0, const uint16_t* pRow1, uint32_t saturationLevel, __m128i p[4], __m128i& green, __m128i& saturated, const uint32_t green1, const uint32_t green2, const __m128i& shift)
+	{
+		// gathers the even pixels of 8 into the low half, the odd ones into the high half
+		const __m128i split = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+		const __m128i level = _mm_set1_epi16((short)(uint16_t)saturationLevel);
+		const bool checkSaturation = (saturationLevel > 0 && saturationLevel <= 0xffff);
+		const uint16_t* pRows[2] = { pRow0, pRow1 };
+
+		// two halves of 8 cells, each kept at 16 bits until the very end
+		__m128i half[2][4];
+		__m128i halfGreen[2];
+		__m128i halfSaturated[2];
+		for (int h = 0; h < 2; h++)
+		{
+			for (int r = 0; r < 2; r++)
+			{
+				__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pRows[r] + 16 * h)), split);
+				__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pRows[r] + 16 * h + 8)), split);
+				half[h][2 * r] = _mm_unpacklo_epi64(a, b);
+				half[h][2 * r + 1] = _mm_unpackhi_epi64(a, b);
+			}
+
+			halfGreen[h] = _mm_srl_epi16(_mm_avg_epu16(half[h][green1], half[h][green2]), shift);
+
+			// x >= level exactly when the saturated difference level - x is 0
+			halfSaturated[h] = _mm_setzero_si128();
+			if (checkSaturation)
+			{
+				for (int i = 0; i < 4; i++)
+					halfSaturated[h] = _mm_or_si128(halfSaturated[h], _mm_cmpeq_epi16(_mm_subs_epu16(level, half[h][i]), _mm_setzero_si128()));
+			}
+
+			for (int i = 0; i < 4; i++)
+				half[h][i] = _mm_srl_epi16(half[h][i], shift);
+		}
+
+		// (values above the bit depth saturate at 255, like the scalar loop)
+		for (int i = 0; i < 4; i++)
+			p[i] = _mm_packus_epi16(half[0][i], half[1][i]);
+		green = _mm_packus_epi16(halfGreen[0], halfGreen[1]);
+		saturated = _mm_packs_epi16(halfSaturated[0], halfSaturated[1]);
+	}
+
+	// Paint the saturated cells, and store 16 RGB pixels.
+	PACKEDPIXELS_TARGET_SSSE3 inline void StoreCells(__m128i red, __m128i green, __m128i blue, __m128i saturated, uint8_t* pRgb)
+	{
+		red = _mm_or_si128(_mm_andnot_si128(saturated, red), _mm_and_si128(saturated, _mm_set1_epi8((char)c_overlayRed)));
+		green = _mm_or_si128(_mm_andnot_si128(saturated, green), _mm_and_si128(saturated, _mm_set1_epi8((char)c_overlayGreen)));
+		blue = _mm_or_si128(_mm_andnot_si128(saturated, blue), _mm_and_si128(saturated, _mm_set1_epi8((char)c_overlayBlue)));
+
+		// each output register takes its bytes from all three colors (-1 leaves a byte for another color)
+		__m128i out0 = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(red, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+			_mm_shuffle_epi8(green, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+			_mm_shuffle_epi8(blue, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+		__m128i out1 = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(red, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+			_mm_shuffle_epi8(green, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+			_mm_shuffle_epi8(blue, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+		__m128i out2 = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(red, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+			_mm_shuffle_epi8(green, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+			_mm_shuffle_epi8(blue, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+
+		_mm_storeu_si128((__m128i*)pRgb, out0);
+		_mm_storeu_si128((__m128i*)(pRgb + 16), out1);
+		_mm_storeu_si128((__m128i*)(pRgb + 32), out2);
+	}
+
+	// The 16 cell step for each pixel size (returns the number of cells done).
+	template <typename Traits>
+	PACKEDPIXELS_TARGET_SSSE3 inline uint32_t MakePreviewCells(const uint8_t* pRow0, const uint8_t* pRow1, uint32_t subWidth, uint32_t saturationLevel, uint8_t* pRgb)
+	{
+		uint32_t x = 0;
+		for (; x + 16 <= subWidth; x += 16)
+		{
+			__m128i p[4], green, saturated;
+			LoadCells(pRow0 + 2 * x, pRow1 + 2 * x, saturationLevel, p, green, saturated, Traits::green1, Traits::green2);
+			StoreCells(p[Traits::red], green, p[Traits::blue], saturated, pRgb + 3 * (size_t)x);
+		}
+		return x;
+	}
+
+	template <typename Traits>
+	PACKEDPIXELS_TARGET_SSSE3 inline uint32_t MakePreviewCells(const uint16_t* pRow0, const uint16_t* pRow1, uint32_t subWidth, uint32_t saturationLevel, uint8_t* pRgb)
+	{
+		uint32_t x = 0;
+		const __m128i shift = _mm_cvtsi32_si128((int)(Traits::bitDepth - 8));
+		for (; x + 16 <= subWidth; x += 16)
+		{
+			__m128i p[4], green, saturated;
+			LoadCells(pRow0 + 2 * x, pRow1 + 2 * x, saturationLevel, p, green, saturated, Traits::green1, Traits::green2, shift);
+			StoreCells(p[Traits::red], green, p[Traits::blue], saturated, pRgb + 3 * (size_t)x);
+		}
+		return x;
+	}
+#endif
+
+	// The two rows of a cell row: straight from the buffer, or unpacked into pCellRow (2 * width pixels).
+	template <typename Traits, bool isPacked>
+	struct CellRows
+	{
+		static void Get(const uint8_t* pImage, size_t stride, uint32_t width, uint32_t y, uint16_t* pCellRow, const typename Traits::value_type* pRows[2])
+		{
+			(void)width; (void)pCellRow;
+			pRows[0] = (const typename Traits::value_type*)(pImage + 2 * (size_t)y * stride);
+			pRows[1] = (const typename Traits::value_type*)(pImage + (2 * (size_t)y + 1) * stride);
+		}
+	};
+
+	template <typename Traits>
+	struct CellRows<Traits, true>
+	{
+		static void Get(const uint8_t* pImage, size_t stride, uint32_t width, uint32_t y, uint16_t* pCellRow, const uint16_t* pRows[2])
+		{
+			PackedPixels::UnpackRowsT<Traits::bitDepth>(pImage, stride, width, 2 * y, 2, pCellRow);
+			pRows[0] = pCellRow;
+			pRows[1] = pCellRow + width;
+		}
+	};
+}
+
+template <typename Traits, typename T>
+inline void BayerPreview::MakePreviewRowT(const T* pRow0, const T* pRow1, uint32_t subWidth, uint32_t saturationLevel, uint8_t* pRgb)
+{
+	const uint32_t shift = Traits::bitDepth - 8;
+	uint32_t x = 0;
+#if defined BAYERPREVIEW_SSSE3
+	if (PackedPixels::HasSsse3())
+		x = MakePreviewCells<Traits>(pRow0, pRow1, subWidth, saturationLevel, pRgb);
+#endif
+
+	// the rest of the row (and everything, without SSSE3), rounded the same way as the vector loop
+	for (; x < subWidth; x++)
+	{
+		const uint32_t cell[4] = { pRow0[2 * x], pRow0[2 * x + 1], pRow1[2 * x], pRow1[2 * x + 1] };
+		uint8_t* pPixel = pRgb + 3 * (size_t)x;
+		if (saturationLevel > 0 && (cell[0] >= saturationLevel || cell[1] >= saturationLevel || cell[2] >= saturationLevel || cell[3] >= saturationLevel))
+		{
+			pPixel[0] = c_overlayRed;
+			pPixel[1] = c_overlayGreen;
+			pPixel[2] = c_overlayBlue;
+			continue;
+		}
+		uint32_t red = cell[Traits::red] >> shift;
+		uint32_t green = ((cell[Traits::green1] + cell[Traits::green2] + 1) >> 1) >> shift;
+		uint32_t blue = cell[Traits::blue] >> shift;
+		pPixel[0] = (uint8_t)((red > 0xff) ? 0xff : red);
+		pPixel[1] = (uint8_t)((green > 0xff) ? 0xff : green);
+		pPixel[2] = (uint8_t)((blue > 0xff) ? 0xff : blue);
+	}
+}
+
+template <typename Traits>
+inline bool BayerPreview::MakePreviewT(Pylon::CPylonImage& image, uint32_t saturationLevel, Pylon::CPylonImage& preview, std::string& errorMessage)
+{
+	typedef typename Traits::value_type T;
+	static_assert(Traits::isBayer, "The preview needs a Bayer format");
+
+	try
+	{
+		if (image.GetPixelType() != Traits::pixelType)
+		{
+			errorMessage = "ERROR: Image does not have the pixel type this function was compiled for.";
+			return false;
+		}
+
+		uint32_t width = image.GetWidth();
+		uint32_t subWidth = width / 2;
+		uint32_t subHeight = image.GetHeight() / 2;
+		if (preview.GetPixelType() != Pylon::PixelType_RGB8packed || preview.GetWidth() != subWidth || preview.GetHeight() != subHeight)
+			preview.Reset(Pylon::PixelType_RGB8packed, subWidth, subHeight);
+		if (subWidth == 0 || subHeight == 0)
+			return true;
+
+		// chunks of whole cell rows, about c_reductionChunkSize of the image each
+		size_t stride = Traits::isPacked ? PackedPixels::GetStride(image, Traits::bitDepth) : (size_t)width * sizeof(T);
+		size_t bytesPerCellRow = 2 * stride;
+		uint32_t cellRowsPerChunk = (uint32_t)((AnalysisTools::c_reductionChunkSize + bytesPerCellRow - 1) / bytesPerCellRow);
+		size_t numChunks = (subHeight + cellRowsPerChunk - 1) / cellRowsPerChunk;
+
+		const uint8_t* pImage = (const uint8_t*)image.GetBuffer();
+		uint8_t* pPreview = (uint8_t*)preview.GetBuffer();
+		auto task = [&](size_t chunk)
+		{
+			// (packed formats: each pool thread unpacks one cell row at a time into its own buffer)
+			static thread_local std::vector<uint16_t> cellRow;
+			if (Traits::isPacked)
+				cellRow.resize(2 * (size_t)width);
+
+			uint32_t first = (uint32_t)chunk * cellRowsPerChunk;
+			uint32_t last = (first + cellRowsPerChunk < subHeight) ? first + cellRowsPerChunk : subHeight;
+			for (uint32_t y = first; y < last; y++)
+			{
+				const T* pRows[2];
+				CellRows<Traits, Traits::isPacked>::Get(pImage, stride, width, y, Traits::isPacked ? &cellRow[0] : nullptr, pRows);
+				MakePreviewRowT<Traits, T>(pRows[0], pRows[1], subWidth, saturationLevel, pPreview + (size_t)y * subWidth * 3);
+			}
+		};
+		ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+		return true;
+	}
+	catch (std::exception& e)
+	{
+		errorMessage = "An exception occured in MakePreview(): ";
+		errorMessage.append(e.what());
+		return false;
+	}
+}
+// *********************************************************************************************************
+#endif
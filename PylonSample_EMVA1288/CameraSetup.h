@@ -0,0 +1,331 @@
+// CameraSetup.h
+// Fast camera setup from cached feature persistence (.pfs) snapshots.
+// The first run on a camera model and firmware sets the camera up feature by feature (every write a round trip to the device),
+// and saves two snapshots: the camera right after loading the default user set, and the finished test configuration.
+// Later runs load the default user set, and write only the features in which the two snapshots differ, in one batch.
+// Comparing the snapshots on the host replaces reading the features back from the camera, as the camera is known to be at its defaults.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef CAMERASETUP_H
+#define CAMERASETUP_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience
+#endif
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace CameraSetup
+{
+	// One line of a snapshot: "name<tab>value". Comment lines (the header) have an empty name and are kept whole in value.
+	struct Entry
+	{
+		std::string name = "";
+		std::string value = "";
+	};
+
+	// The lines of a snapshot, in order (selectors come before the features they select).
+	typedef std::vector<Entry> Snapshot;
+
+	// What Apply() did.
+	struct Report
+	{
+		size_t numFeatures = 0; // in the configuration snapshot
+		size_t numWritten = 0; // differed from the defaults (with the selectors they need)
+		double milliseconds = 0;
+	};
+
+	// The snapshots are named <directory><model>_<firmware>_<width>x<height>_v<version>.pfs and ..._Defaults.pfs.
+	// width and height are the AOI the setup writes, so a different AOI gets its own snapshots.
+	// Raise version when the setup code changes, so the snapshots are taken again.
+	std::string MakeFileBase(Pylon::CBaslerUniversalInstantCamera& camera, const std::string& directory, int64_t width, int64_t height, uint32_t version);
+
+	bool HasSnapshots(const std::string& fileBase);
+
+	// The camera's persistent features, as .pfs text.
+	bool TakeSnapshot(Pylon::CBaslerUniversalInstantCamera& camera, std::string& text, std::string& errorMessage);
+
+	// Save the snapshot of the defaults (taken right after loading the default user set) and of the finished configuration.
+	bool Store(const std::string& fileBase, const std::string& defaults, const std::string& configuration, std::string& errorMessage);
+
+	// Load the default user set, then write what the configuration changes, in one batch.
+	// If this fails, the camera is in an unknown state: set it up feature by feature (and store new snapshots).
+	bool Apply(Pylon::CBaslerUniversalInstantCamera& camera, const std::string& fileBase, Report& report, std::string& errorMessage);
+
+	// helpers
+	void Parse(const std::string& text, Snapshot& snapshot);
+	std::string Format(const Snapshot& snapshot);
+
+	// The lines of configuration which differ from defaults (the n-th line of a feature is compared with the n-th line of the same feature),
+	// each after the selectors in front of it in configuration. The header is kept, the pylon loader checks it.
+	void Diff(const Snapshot& defaults, const Snapshot& configuration, Snapshot& diff, size_t& numFeatures);
+
+	bool IsSelector(const std::string& name);
+	bool ReadFile(const std::string& fileName, std::string& text, std::string& errorMessage);
+	bool WriteFile(const std::string& fileName, const std::string& text, std::string& errorMessage);
+}
+
+// *********************************************************************************************************
+inline std::string CameraSetup::MakeFileBase(Pylon::CBaslerUniversalInstantCamera& camera, const std::string& directory, int64_t width, int64_t height, uint32_t version)
+{
+	std::string firmware = camera.DeviceFirmwareVersion.IsReadable() ? camera.DeviceFirmwareVersion.GetValue().c_str() : camera.GetDeviceInfo().GetDeviceVersion().c_str();
+	std::string name = std::string(camera.GetDeviceInfo().GetModelName().c_str()) + "_" + firmware;
+
+	// (model names have spaces, firmware versions dots and slashes)
+	for (size_t i = 0; i < name.size(); i++)
+	{
+		char c = name[i];
+		bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+		name[i] = keep ? c : '_';
+	}
+	return directory + name + "_" + std::to_string(width) + "x" + std::to_string(height) + "_v" + std::to_string(version);
+}
+
+inline bool CameraSetup::HasSnapshots(const std::string& fileBase)
+{
+	const std::string fileNames[2] = { fileBase + ".pfs", fileBase + "_Defaults.pfs" };
+	for (int f = 0; f < 2; f++)
+	{
+		std::FILE* const file = std::fopen(fileNames[f].c_str(), "rb");
+		if (file == NULL)
+			return false;
+		std::fclose(file);
+	}
+	return true;
+}
+
+inline bool CameraSetup::TakeSnapshot(Pylon::CBaslerUniversalInstantCamera& camera, std::string& text, std::string& errorMessage)
+{
+	try
+	{
+		Pylon::String_t snapshot;
+		Pylon::CFeaturePersistence::SaveToString(snapshot, &camera.GetNodeMap());
+		text = snapshot.c_str();
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in TakeSnapshot(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+	return true;
+}
+
+inline bool CameraSetup::Store(const std::string& fileBase, const std::string& defaults, const std::string& configuration, std::string& errorMessage)
+{
+	return WriteFile(fileBase + "_Defaults.pfs", defaults, errorMessage) && WriteFile(fileBase + ".pfs", configuration, errorMessage);
+}
+
+inline bool CameraSetup::Apply(Pylon::CBaslerUniversalInstantCamera& camera, const std::string& fileBase, Report& report, std::string& errorMessage)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	report = Report();
+
+	std::string defaultsText = "";
+	std::string configurationText = "";
+	if (ReadFile(fileBase + "_Defaults.pfs", defaultsText, errorMessage) == false || ReadFile(fileBase + ".pfs", configurationText, errorMessage) == false)
+		return false;
+
+	Snapshot defaults;
+	Snapshot configuration;
+	Snapshot diff;
+	Parse(defaultsText, defaults);
+	Parse(configurationText, configuration);
+	Diff(defaults, configuration, diff, report.numFeatures);
+	if (report.numFeatures == 0)
+	{
+		errorMessage = "ERROR: The camera setup snapshot " + fileBase + ".pfs is empty.";
+		return false;
+	}
+
+	try
+	{
+		// the diff is against the defaults, so the camera must be at its defaults
+		camera.UserSetSelector.TrySetValue(Basler_UniversalCameraParams::UserSetSelectorEnums::UserSetSelector_Default);
+		camera.UserSetLoad.Execute();
+
+		// (the values were accepted by the camera when the snapshot was taken, so they are not read back)
+		for (size_t i = 0; i < diff.size(); i++)
+			report.numWritten += diff[i].name.empty() ? 0 : 1;
+		if (report.numWritten > 0)
+			Pylon::CFeaturePersistence::LoadFromString(Format(diff).c_str(), &camera.GetNodeMap(), false);
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in Apply(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+
+	report.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return true;
+}
+
+inline void CameraSetup::Parse(const std::string& text, Snapshot& snapshot)
+{
+	snapshot.clear();
+	size_t position = 0;
+	while (position < text.size())
+	{
+		size_t end = text.find('\n', position);
+		end = (end == std::string::npos) ? text.size() : end;
+		std::string line = text.substr(position, end - position);
+		position = end + 1;
+		if (line.empty() == false && line.back() == '\r')
+			line.pop_back();
+		if (line.empty())
+			continue;
+
+		Entry entry;
+		size_t tab = line.find('\t');
+		if (line[0] == '#' || tab == std::string::npos)
+		{
+			entry.value = line;
+		}
+		else
+		{
+			entry.name = line.substr(0, tab);
+			entry.value = line.substr(tab + 1);
+		}
+		snapshot.push_back(entry);
+	}
+}
+
+inline std::string CameraSetup::Format(const Snapshot& snapshot)
+{
+	std::string text = "";
+	for (size_t i = 0; i < snapshot.size(); i++)
+	{
+		if (snapshot[i].name.empty() == false)
+		{
+			text.append(snapshot[i].name);
+			text.append("\t");
+		}
+		text.append(snapshot[i].value);
+		text.append("\n");
+	}
+	return text;
+}
+
+inline void CameraSetup::Diff(const Snapshot& defaults, const Snapshot& configuration, Snapshot& diff, size_t& numFeatures)
+{
+	diff.clear();
+	numFeatures = 0;
+
+	// the values of each feature in the defaults, in order
+	std::map<std::string, std::vector<std::string>> defaultValues;
+	for (size_t i = 0; i < defaults.size(); i++)
+	{
+		if (defaults[i].name.empty() == false)
+			defaultValues[defaults[i].name].push_back(defaults[i].value);
+	}
+
+	std::map<std::string, size_t> occurrences; // how many lines of each feature have been seen
+	std::map<std::string, std::string> selected; // the value of each selector, as the configuration sets it up to here
+	std::map<std::string, std::string> written; // the value of each selector in the diff so far
+	for (size_t i = 0; i < configuration.size(); i++)
+	{
+		const Entry& entry = configuration[i];
+		if (entry.name.empty())
+		{
+			diff.push_back(entry);
+			continue;
+		}
+
+		size_t occurrence = occurrences[entry.name]++;
+		if (IsSelector(entry.name))
+		{
+			selected[entry.name] = entry.value;
+			continue;
+		}
+
+		numFeatures++;
+		std::map<std::string, std::vector<std::string>>::const_iterator found = defaultValues.find(entry.name);
+		if (found != defaultValues.end() && occurrence < found->second.size() && found->second[occurrence] == entry.value)
+			continue;
+
+		// write the selectors first, where the diff doesn't have them at this value yet
+		for (std::map<std::string, std::string>::const_iterator s = selected.begin(); s != selected.end(); ++s)
+		{
+			std::map<std::string, std::string>::iterator last = written.find(s->first);
+			if (last == written.end() || last->second != s->second)
+			{
+				Entry selector;
+				selector.name = s->first;
+				selector.value = s->second;
+				diff.push_back(selector);
+				written[s->first] = s->second;
+			}
+		}
+		diff.push_back(entry);
+	}
+}
+
+inline bool CameraSetup::IsSelector(const std::string& name)
+{
+	const std::string suffix = "Selector";
+	return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+inline bool CameraSetup::ReadFile(const std::string& fileName, std::string& text, std::string& errorMessage)
+{
+	std::FILE* const file = std::fopen(fileName.c_str(), "rb");
+	if (file == NULL)
+	{
+		errorMessage = "ERROR: Could not open " + fileName;
+		return false;
+	}
+
+	text.clear();
+	char buffer[4096];
+	size_t numRead = 0;
+	while ((numRead = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+		text.append(buffer, numRead);
+	std::fclose(file);
+	return true;
+}
+
+inline bool CameraSetup::WriteFile(const std::string& fileName, const std::string& text, std::string& errorMessage)
+{
+	std::FILE* const file = std::fopen(fileName.c_str(), "wb");
+	if (file == NULL)
+	{
+		errorMessage = "ERROR: Could not create " + fileName;
+		return false;
+	}
+
+	bool written = (std::fwrite(text.data(), 1, text.size(), file) == text.size());
+	written = (std::fclose(file) == 0) && written;
+	if (written == false)
+		errorMessage = "ERROR: Could not write " + fileName;
+	return written;
+}
+// *********************************************************************************************************
+#endif
@@ -0,0 +1,420 @@
+// Checkpoint.h
+// Saves the state of a running sweep, so a sweep interrupted by an exception (eg: a cable pull) can be resumed
+// from the last checkpoint instead of being started over. See --resume.
+// The checkpoints are written on their own thread, to a temporary file which then replaces the previous checkpoint,
+// so there is always one complete checkpoint on the disk. A checkpoint is only written once the result rows it
+// counts are in the results file, so the two always match.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience (if this header included first)
+#endif
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#ifdef WIN_BUILD
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "DarkBright.h"
+#include "ResultWriter.h"
+#include "SweepScheduler.h"
+
+namespace Checkpoint
+{
+	// How long a checkpoint waits for the results file to catch up before it is skipped.
+	const uint32_t c_resultsTimeoutMs = 10000;
+
+	// Where the sweep was, and what it had done so far. The sweep continues at pointIndex.
+	struct State
+	{
+		uint64_t scheduleHash = 0; // the sweep this checkpoint belongs to (see HashSchedule())
+		uint32_t numPoints = 0;
+		uint32_t pointIndex = 0; // the point to continue with
+		bool pointStarted = false; // false: start the point from the beginning
+		uint32_t imagesGrabbed = 0; // measurement loops of this point so far (they count towards maxImagesToGrab)
+		double nextExposureTime = 0; // of the next measurement of this point
+		double blackLevel = 0; // of this point, after any black level calibration
+		uint64_t rowsLogged = 0; // rows in the results file
+		bool spectrogramSaved = false;
+		bool flatFieldTried = false;
+		bool flatFieldSaved = false; // the flat-field correction is in its file
+		std::vector<DarkBright::Measurement> pendingMeasurements; // bright measurements still waiting for their dark partners
+	};
+
+	// A fingerprint of the sweep settings. A checkpoint can only be resumed by the same sweep.
+	uint64_t HashSchedule(const std::vector<SweepScheduler::SweepPoint>& schedule);
+
+	// Write the state to a temporary file, then replace fileName with it.
+	bool Save(const std::string& fileName, const State& state, std::string& errorMessage);
+
+	bool Load(const std::string& fileName, State& state, std::string& errorMessage);
+
+	// Remove the checkpoint (eg: once the sweep is complete, so it can't be resumed by mistake).
+	void Remove(const std::string& fileName);
+
+	// Saves the states posted to it on its own thread. Only the newest state is kept, so posting never waits for the disk.
+	class Writer
+	{
+	private:
+		std::string m_fileName = "";
+		ResultWriter::Writer* m_pResults = nullptr;
+		std::mutex m_mutex;
+		std::condition_variable m_wakeCondition;
+		State m_pending;
+		bool m_hasPending = false;
+		bool m_stop = false;
+		std::thread m_thread;
+		// written by the writer thread, read under the mutex
+		uint64_t m_numSaved = 0;
+		std::string m_lastError = "";
+
+		void Run();
+
+	public:
+		Writer();
+		~Writer();
+
+		// pResults: the rows counted by the states are in this writer's file before a state is saved (can be nullptr).
+		bool Start(const std::string& fileName, ResultWriter::Writer* pResults, std::string& errorMessage);
+
+		// Save this state soon (replaces any state not saved yet).
+		void Post(const State& state);
+
+		// Save the last posted state and stop. Returns false if any checkpoint failed (errorMessage has the last error).
+		bool Stop(std::string& errorMessage);
+
+		bool IsRunning();
+		uint64_t GetNumSaved();
+	};
+
+	// helpers
+	template <typename T> void Append(std::string& out, T value);
+	template <typename T> bool Read(const std::string& in, size_t& position, T& value);
+}
+
+// *********************************************************************************************************
+template <typename T>
+inline void Checkpoint::Append(std::string& out, T value)
+{
+	out.append((const char*)&value, sizeof(T));
+}
+
+template <typename T>
+inline bool Checkpoint::Read(const std::string& in, size_t& position, T& value)
+{
+	if (position + sizeof(T) > in.size())
+		return false;
+	std::memcpy(&value, in.data() + position, sizeof(T));
+	position += sizeof(T);
+	return true;
+}
+
+inline uint64_t Checkpoint::HashSchedule(const std::vector<SweepScheduler::SweepPoint>& schedule)
+{
+	// FNV-1a over the settings of every point
+	std::string bytes = "";
+	for (size_t p = 0; p < schedule.size(); p++)
+	{
+		const SweepScheduler::SweepPoint& point = schedule[p];
+		bytes.append(point.stream.pixelFormat);
+		bytes.push_back('\0');
+		Append<int64_t>(bytes, point.stream.width);
+		Append<int64_t>(bytes, point.stream.height);
+		Append<int64_t>(bytes, point.stream.offsetX);
+		Append<int64_t>(bytes, point.stream.offsetY);
+		Append<double>(bytes, point.gain);
+		Append<double>(bytes, point.blackLevel);
+		Append<double>(bytes, point.exposureTime);
+	}
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < bytes.size(); i++)
+	{
+		hash ^= (uint8_t)bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// File: "EMVACKPT" (8 bytes), uint32 version, uint32 size of a Measurement, then the State fields in declaration order
+// (bools as uint32), the number of pending measurements (uint32) and the pending measurements as they are in memory.
+// (the Measurements are only readable by the same build, which is all a resume needs)
+inline bool Checkpoint::Save(const std::string& fileName, const State& state, std::string& errorMessage)
+{
+	const uint32_t version = 1;
+	std::string out = "";
+	out.append("EMVACKPT", 8);
+	Append<uint32_t>(out, version);
+	Append<uint32_t>(out, (uint32_t)sizeof(DarkBright::Measurement));
+	Append<uint64_t>(out, state.scheduleHash);
+	Append<uint32_t>(out, state.numPoints);
+	Append<uint32_t>(out, state.pointIndex);
+	Append<uint32_t>(out, state.pointStarted ? 1 : 0);
+	Append<uint32_t>(out, state.imagesGrabbed);
+	Append<double>(out, state.nextExposureTime);
+	Append<double>(out, state.blackLevel);
+	Append<uint64_t>(out, state.rowsLogged);
+	Append<uint32_t>(out, state.spectrogramSaved ? 1 : 0);
+	Append<uint32_t>(out, state.flatFieldTried ? 1 : 0);
+	Append<uint32_t>(out, state.flatFieldSaved ? 1 : 0);
+	Append<uint32_t>(out, (uint32_t)state.pendingMeasurements.size());
+	if (state.pendingMeasurements.empty() == false)
+		out.append((const char*)&state.pendingMeasurements[0], state.pendingMeasurements.size() * sizeof(DarkBright::Measurement));
+
+	// write (and sync) the temporary file completely before it replaces the last checkpoint
+	std::string tempFileName = fileName + ".tmp";
+	std::FILE* file = std::fopen(tempFileName.c_str(), "wb");
+	if (file == NULL)
+	{
+		errorMessage = "ERROR: Could not create " + tempFileName;
+		return false;
+	}
+	bool written = (std::fwrite(out.data(), 1, out.size(), file) == out.size()) && (std::fflush(file) == 0);
+#ifdef WIN_BUILD
+	written = written && (_commit(_fileno(file)) == 0);
+#else
+	written = written && (fsync(fileno(file)) == 0);
+#endif
+	written = (std::fclose(file) == 0) && written;
+	if (written == false)
+	{
+		errorMessage = "ERROR: Could not write " + tempFileName;
+		std::remove(tempFileName.c_str());
+		return false;
+	}
+
+#ifdef WIN_BUILD
+	bool replaced = (MoveFileExA(tempFileName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE);
+#else
+	bool replaced = (std::rename(tempFileName.c_str(), fileName.c_str()) == 0);
+#endif
+	if (replaced == false)
+	{
+		errorMessage = "ERROR: Could not replace " + fileName;
+		return false;
+	}
+	return true;
+}
+
+inline bool Checkpoint::Load(const std::string& fileName, State& state, std::string& errorMessage)
+{
+	std::FILE* file = std::fopen(fileName.c_str(), "rb");
+	if (file == NULL)
+	{
+		errorMessage = "ERROR: Could not open " + fileName + " (no checkpoint to resume from?)";
+		return false;
+	}
+	std::string in = "";
+	char buffer[65536];
+	size_t numRead = 0;
+	while ((numRead = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+		in.append(buffer, numRead);
+	std::fclose(file);
+
+	size_t position = 8;
+	uint32_t version = 0;
+	uint32_t measurementSize = 0;
+	uint32_t pointStarted = 0;
+	uint32_t spectrogramSaved = 0;
+	uint32_t flatFieldTried = 0;
+	uint32_t flatFieldSaved = 0;
+	uint32_t numPending = 0;
+	bool valid = (in.compare(0, 8, "EMVACKPT", 8) == 0)
+		&& Read(in, position, version) && version == 1
+		&& Read(in, position, measurementSize) && measurementSize == sizeof(DarkBright::Measurement)
+		&& Read(in, position, state.scheduleHash)
+		&& Read(in, position, state.numPoints)
+		&& Read(in, position, state.pointIndex)
+		&& Read(in, position, pointStarted)
+		&& Read(in, position, state.imagesGrabbed)
+		&& Read(in, position, state.nextExposureTime)
+		&& Read(in, position, state.blackLevel)
+		&& Read(in, position, state.rowsLogged)
+		&& Read(in, position, spectrogramSaved)
+		&& Read(in, position, flatFieldTried)
+		&& Read(in, position, flatFieldSaved)
+		&& Read(in, position, numPending)
+		&& (in.size() - position) == (size_t)numPending * sizeof(DarkBright::Measurement);
+	if (valid == false)
+	{
+		errorMessage = "ERROR: " + fileName + " is not a checkpoint of this version of the test.";
+		return false;
+	}
+
+	state.pointStarted = (pointStarted != 0);
+	state.spectrogramSaved = (spectrogramSaved != 0);
+	state.flatFieldTried = (flatFieldTried != 0);
+	state.flatFieldSaved = (flatFieldSaved != 0);
+	state.pendingMeasurements.resize(numPending);
+	if (numPending > 0)
+		std::memcpy((void*)&state.pendingMeasurements[0], in.data() + position, (size_t)numPending * sizeof(DarkBright::Measurement));
+	return true;
+}
+
+inline void Checkpoint::Remove(const std::string& fileName)
+{
+	std::remove(fileName.c_str());
+	std::remove((fileName + ".tmp").c_str());
+}
+
+inline Checkpoint::Writer::Writer()
+{
+	// nothing
+}
+
+inline Checkpoint::Writer::~Writer()
+{
+	// (an exception ended the sweep: the last state is still saved, so the sweep can be resumed)
+	std::string errorMessage = "";
+	Stop(errorMessage);
+}
+
+inline bool Checkpoint::Writer::Start(const std::string& fileName, ResultWriter::Writer* pResults, std::string& errorMessage)
+{
+	if (m_thread.joinable())
+	{
+		errorMessage = "ERROR: The checkpoint writer is already running.";
+		return false;
+	}
+
+	m_fileName = fileName;
+	m_pResults = pResults;
+	m_hasPending = false;
+	m_stop = false;
+	m_numSaved = 0;
+	m_lastError = "";
+	m_thread = std::thread(&Writer::Run, this);
+	return true;
+}
+
+inline void Checkpoint::Writer::Post(const State& state)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pending = state;
+		m_hasPending = true;
+	}
+	m_wakeCondition.notify_one();
+}
+
+inline void Checkpoint::Writer::Run()
+{
+	State state;
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (true)
+	{
+		m_wakeCondition.wait(lock, [this]() { return m_hasPending || m_stop; });
+		if (m_hasPending == false)
+			break; // stopping, and everything is saved
+
+		state = m_pending;
+		m_hasPending = false;
+		lock.unlock();
+
+		// The results file must have the rows this state counts, or a resume would lose them.
+		// (once a write failed, it never will)
+		bool rowsFlushed = true;
+		bool writeFailed = (m_pResults != nullptr && m_pResults->HasWriteFailed());
+		if (m_pResults != nullptr && writeFailed == false)
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			while (m_pResults->GetRowsFlushed() < state.rowsLogged)
+			{
+				if (m_pResults->HasWriteFailed())
+				{
+					writeFailed = true;
+					break;
+				}
+				std::chrono::duration<double, std::milli> waited = std::chrono::steady_clock::now() - start;
+				if (waited.count() > c_resultsTimeoutMs)
+				{
+					rowsFlushed = false;
+					break;
+				}
+				// (asked again every time, in case the writer thread was between batches)
+				m_pResults->RequestFlush();
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			}
+		}
+
+		std::string errorMessage = "";
+		bool saved = rowsFlushed && writeFailed == false && Save(m_fileName, state, errorMessage);
+		if (writeFailed)
+			errorMessage = "ERROR: The results file is missing rows (a write failed), no more checkpoints are saved.";
+		else if (rowsFlushed == false)
+			errorMessage = "ERROR: The results file didn't catch up, a checkpoint was skipped.";
+
+		lock.lock();
+		if (saved)
+			m_numSaved++;
+		else
+			m_lastError = errorMessage;
+	}
+}
+
+inline bool Checkpoint::Writer::Stop(std::string& errorMessage)
+{
+	if (m_thread.joinable() == false)
+		return true;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeCondition.notify_one();
+	m_thread.join();
+
+	if (m_lastError.empty() == false)
+	{
+		errorMessage = m_lastError;
+		return false;
+	}
+	return true;
+}
+
+inline bool Checkpoint::Writer::IsRunning()
+{
+	return m_thread.joinable();
+}
+
+inline uint64_t Checkpoint::Writer::GetNumSaved()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_numSaved;
+}
+// *********************************************************************************************************
+#endif
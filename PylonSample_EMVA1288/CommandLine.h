@@ -0,0 +1,170 @@
+// CommandLine.h
+// Command line options of the sample. Without any options, it runs the test interactively on the first camera found.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef COMMANDLINE_H
+#define COMMANDLINE_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace CommandLine
+{
+	struct Options
+	{
+		bool waitOnExit = true; // "Press enter to exit." (turn off for scripts and CI)
+		bool useEmulator = false; // use the pylon camera emulator instead of a real camera
+		std::string imageDirectory = ""; // emulator only: feed the emulator with the images in this directory
+		std::string syntheticDirectory = ""; // emulator only: generate synthetic photon transfer frames into this directory and feed them
+		std::string referenceCsv = ""; // compare the results against this csv file and fail if they differ
+		double tolerance = 0.01; // relative tolerance for the comparison
+		std::vector<std::string> analyzeDirectories; // analyze the frames saved in these directories instead of using a camera
+		std::string rawPixelFormat = ""; // pixel format of the frames in raw files (eg: "BayerRG8")
+		uint32_t rawWidth = 0; // size of the frames in raw files
+		uint32_t rawHeight = 0;
+		bool singleShot = false; // screening: estimate the photon transfer curve from a few pairs of a graded scene instead of sweeping
+		bool resume = false; // continue an interrupted sweep from its checkpoint (see Checkpoint.h)
+		uint32_t numThreads = 0; // analysis threads including the main thread (0: one per hardware core)
+		std::string mainCores = ""; // pin the main (grab) thread to these cores, eg: "2" or "2-3" (see ThreadTuning.h)
+		std::string workerCores = ""; // pin the analysis workers to these cores, one each, round robin
+		int numaNode = -1; // run the threads, and allocate the frame buffers, on this NUMA node
+		bool realtimeGrab = false; // realtime priority for the main thread and pylon's grab threads
+		bool freshSetup = false; // set the camera up feature by feature and take the setup snapshot again (see CameraSetup.h)
+		bool adaptiveSampling = false; // take pairs at each exposure time until the estimates converge (see AdaptiveSampling.h)
+	};
+
+	// Returns false (with a message) if the options are not valid.
+	bool Parse(int argc, char* argv[], Options& options, std::string& errorMessage);
+
+	void PrintUsage(const char* programName);
+}
+
+// *********************************************************************************************************
+inline bool CommandLine::Parse(int argc, char* argv[], Options& options, std::string& errorMessage)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = (i + 1 < argc);
+
+		if (arg == "--no-wait")
+			options.waitOnExit = false;
+		else if (arg == "--emulator")
+			options.useEmulator = true;
+		else if (arg == "--images" && hasValue)
+			options.imageDirectory = argv[++i];
+		else if (arg == "--synthetic" && hasValue)
+			options.syntheticDirectory = argv[++i];
+		else if (arg == "--reference" && hasValue)
+			options.referenceCsv = argv[++i];
+		else if (arg == "--tolerance" && hasValue)
+			options.tolerance = atof(argv[++i]);
+		else if (arg == "--analyze" && hasValue)
+			options.analyzeDirectories.push_back(argv[++i]);
+		else if (arg == "--single-shot")
+			options.singleShot = true;
+		else if (arg == "--resume")
+			options.resume = true;
+		else if (arg == "--threads" && hasValue)
+			options.numThreads = (uint32_t)atoi(argv[++i]);
+		else if (arg == "--main-cores" && hasValue)
+			options.mainCores = argv[++i];
+		else if (arg == "--worker-cores" && hasValue)
+			options.workerCores = argv[++i];
+		else if (arg == "--numa-node" && hasValue)
+			options.numaNode = atoi(argv[++i]);
+		else if (arg == "--realtime")
+			options.realtimeGrab = true;
+		else if (arg == "--fresh-setup")
+			options.freshSetup = true;
+		else if (arg == "--adaptive")
+			options.adaptiveSampling = true;
+		else if (arg == "--raw-format" && hasValue)
+			options.rawPixelFormat = argv[++i];
+		else if (arg == "--raw-size" && hasValue)
+		{
+			unsigned int rawWidth = 0;
+			unsigned int rawHeight = 0;
+			if (std::sscanf(argv[++i], "%ux%u", &rawWidth, &rawHeight) != 2 || rawWidth == 0 || rawHeight == 0)
+			{
+				errorMessage = "ERROR: --raw-size needs <width>x<height>, eg: 128x128";
+				return false;
+			}
+			options.rawWidth = rawWidth;
+			options.rawHeight = rawHeight;
+		}
+		else
+		{
+			errorMessage = "ERROR: Unknown option or missing value: " + arg;
+			return false;
+		}
+	}
+
+	if ((options.imageDirectory.empty() == false || options.syntheticDirectory.empty() == false) && options.useEmulator == false)
+	{
+		errorMessage = "ERROR: --images and --synthetic need --emulator.";
+		return false;
+	}
+
+	if (options.analyzeDirectories.empty() == false && options.useEmulator)
+	{
+		errorMessage = "ERROR: --analyze works on saved frames and can't be used with --emulator.";
+		return false;
+	}
+
+	if (options.analyzeDirectories.empty() == false && options.singleShot)
+	{
+		errorMessage = "ERROR: --single-shot needs a camera and can't be used with --analyze.";
+		return false;
+	}
+
+	if (options.resume && (options.singleShot || options.analyzeDirectories.empty() == false))
+	{
+		errorMessage = "ERROR: --resume continues a sweep and can't be used with --single-shot or --analyze.";
+		return false;
+	}
+
+	return true;
+}
+
+inline void CommandLine::PrintUsage(const char* programName)
+{
+	std::printf("Usage: %s [options]\n", programName);
+	std::printf("  --no-wait              don't wait for enter before exiting\n");
+	std::printf("  --emulator             use the pylon camera emulator instead of a real camera\n");
+	std::printf("  --images <dir>         feed the emulator with the images in <dir>\n");
+	std::printf("  --synthetic <dir>      generate synthetic photon transfer frames into <dir> and feed them to the emulator\n");
+	std::printf("  --reference <csv>      compare the results with <csv>, exit code 2 if they differ\n");
+	std::printf("  --tolerance <x>        relative tolerance of the comparison (default 0.01)\n");
+	std::printf("  --analyze <dir>        analyze the frames saved in <dir> instead of using a camera (can be repeated)\n");
+	std::printf("  --single-shot          screening: photon transfer curve and gain K from a few pairs of a graded scene, no sweep\n");
+	std::printf("  --resume               continue an interrupted sweep from its last checkpoint (same settings and camera)\n");
+	std::printf("  --threads <n>          analysis threads, including the main thread (default: one per core)\n");
+	std::printf("  --main-cores <list>    pin the main (grab) thread to these cores (eg: 2 or 2-3)\n");
+	std::printf("  --worker-cores <list>  pin the analysis workers to these cores, one each (eg: 4-7,12)\n");
+	std::printf("  --numa-node <n>        run the threads and allocate the frame buffers on NUMA node <n>\n");
+	std::printf("  --realtime             realtime priority for the grab threads (Linux: SCHED_FIFO, needs CAP_SYS_NICE)\n");
+	std::printf("  --fresh-setup          set the camera up feature by feature, and cache the setup again\n");
+	std::printf("  --adaptive             take pairs at each exposure time until the estimates converge (no exposure sequencer)\n");
+	std::printf("  --raw-format <format>  pixel format of the frames in .raw files, or of Bayer frames saved as images (eg: BayerRG8)\n");
+	std::printf("  --raw-size <w>x<h>     size of the frames in .raw files\n");
+}
+// *********************************************************************************************************
+#endif
@@ -0,0 +1,300 @@
+// DarkBright.h
+// Measuring dark and bright images in the same session, by switching a Basler light off and on.
+// EMVA1288 needs the dark signal at every exposure time of the bright sweep, so the bright means can be dark-corrected.
+// The bright measurements are held back until their dark partners are taken, then logged together as one row.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef DARKBRIGHT_H
+#define DARKBRIGHT_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+#include "FrameTiming.h"
+#include "AnalysisTools.h"
+#include "RoiStats.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+namespace DarkBright
+{
+	// One row of the results.
+	struct Measurement
+	{
+		double exposureTime = 0;
+		uint32_t minAll = 0;
+		uint32_t maxAll = 0;
+		uint32_t avgAll = 0;
+		uint32_t avgRed = 0;
+		uint32_t avgGreen = 0;
+		uint32_t avgBlue = 0;
+		double snrAll = 0;
+		double snrRed = 0;
+		double snrGreen = 0;
+		double snrBlue = 0;
+		double rowFpn = 0;
+		double colFpn = 0;
+		double gain = 0;
+		double blackLevel = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		int offsetX = 0;
+		int offsetY = 0;
+		// the estimates over all pairs taken at this exposure time (see AdaptiveSampling.h)
+		uint32_t numPairs = 0;
+		double mean = 0;
+		double meanHalfWidth = 0; // confidence interval
+		double temporalVariance = 0;
+		double temporalVarianceHalfWidth = 0;
+		// the four planes of a Bayer sensor (R, Gr, Gb, B, see AnalysisTools::ECfaPlane). Empty for mono sensors.
+		bool hasPlanes = false;
+		AnalysisTools::PlaneSummary planes[4];
+		// filled in by the dark measurement at the same exposure time (if any)
+		bool hasDark = false;
+		double darkAvgAll = 0;
+		double darkAvgRed = 0;
+		double darkAvgGreen = 0;
+		double darkAvgBlue = 0;
+		// statistics of each ROI (see RoiStats.h), in the order of the ROI list
+		uint32_t numRois = 0;
+		RoiStats::RoiSummary rois[RoiStats::c_maxRois];
+	};
+
+	// Append the csv header/row (with line end) to out.
+	// The ROI columns come last, one set per name in roiNames (the rows must have the same ROIs).
+	void FormatCsvHeader(std::string& out, const std::vector<std::string>& roiNames = std::vector<std::string>());
+
+	// Plane columns stay empty for mono sensors, dark and dark-corrected columns if the measurement has no dark partner
+	// (the corrected red, green and blue also for mono sensors), ROI columns if the ROI was not inside the frame.
+	// The corrected means are mean and the plane means minus the dark, not the avg columns, which are truncated to whole DN.
+	void FormatCsvRow(const Measurement& measurement, std::string& out);
+
+	// printf-style append to out. Long output is not truncated, an encoding error appends nothing.
+	void AppendFormat(std::string& out, const char* format, ...);
+
+	// Switch the light (Device1) on or off and give it time to settle. Does nothing if the camera has no light control.
+	bool SetLight(Pylon::CBaslerUniversalInstantCamera& camera, bool on, uint32_t settleTimeMs, std::string& errorMessage);
+
+	bool HasLight(Pylon::CBaslerUniversalInstantCamera& camera);
+
+	// Trigger the camera and retrieve a pair of images.
+	// triggersPerPair is 1 if the camera takes both with one FrameBurstStart trigger, 2 if each needs a FrameStart trigger.
+	// If given, pFrameTiming records the trigger and arrival of each frame.
+	void GrabPair(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult1, Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult2, FrameTiming::Analyzer* pFrameTiming = nullptr);
+}
+
+// *********************************************************************************************************
+inline void DarkBright::FormatCsvHeader(std::string& out, const std::vector<std::string>& roiNames)
+{
+	AppendFormat(out, "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s",
+		"Exposure Time",
+		"Min Pixel Value",
+		"Max Pixel Value",
+		"Average All Pixels",
+		"Avg Red Pixels",
+		"Avg Green Pixels",
+		"Avg Blue Pixels",
+		"SNR All Pixels",
+		"SNR Red",
+		"SNR Green",
+		"SNR Blue",
+		"Row FPN",
+		"Column FPN",
+		"Gain",
+		"Black Level",
+		"Width",
+		"Height",
+		"Offset X",
+		"Offset Y",
+		"Pairs",
+		"Mean",
+		"Mean CI",
+		"Temporal Variance",
+		"Temporal Variance CI");
+
+	const char* planeNames[4] = { "Red", "Gr", "Gb", "Blue" };
+	for (int plane = 0; plane < 4; plane++)
+	{
+		AppendFormat(out, ",%s Mean,%s Temporal Noise,%s SNR,%s Saturation", planeNames[plane], planeNames[plane], planeNames[plane], planeNames[plane]);
+	}
+
+	out.append(",Dark Avg All Pixels,Dark Avg Red,Dark Avg Green,Dark Avg Blue,Corrected Avg All Pixels,Corrected Avg Red,Corrected Avg Green,Corrected Avg Blue");
+
+	for (size_t roi = 0; roi < roiNames.size(); roi++)
+		out.append("," + roiNames[roi] + " Mean," + roiNames[roi] + " Std Dev," + roiNames[roi] + " Temporal Noise");
+	out.append("\n");
+}
+
+inline void DarkBright::FormatCsvRow(const Measurement& m, std::string& out)
+{
+	AppendFormat(out, "%f,%u,%u,%u,%u,%u,%u,%f,%f,%f,%f,%f,%f,%f,%f,%u,%u,%d,%d,%u,%f,%f,%f,%f",
+		(double)m.exposureTime,
+		(uint32_t)m.minAll,
+		(uint32_t)m.maxAll,
+		(uint32_t)m.avgAll,
+		(uint32_t)m.avgRed,
+		(uint32_t)m.avgGreen,
+		(uint32_t)m.avgBlue,
+		(double)m.snrAll,
+		(double)m.snrRed,
+		(double)m.snrGreen,
+		(double)m.snrBlue,
+		(double)m.rowFpn,
+		(double)m.colFpn,
+		(double)m.gain,
+		(double)m.blackLevel,
+		(uint32_t)m.width,
+		(uint32_t)m.height,
+		(int)m.offsetX,
+		(int)m.offsetY,
+		(uint32_t)m.numPairs,
+		(double)m.mean,
+		(double)m.meanHalfWidth,
+		(double)m.temporalVariance,
+		(double)m.temporalVarianceHalfWidth);
+
+	for (int plane = 0; plane < 4; plane++)
+	{
+		if (m.hasPlanes)
+		{
+			AppendFormat(out, ",%f,%f,%f,%f", m.planes[plane].mean, m.planes[plane].temporalNoise, m.planes[plane].snr, m.planes[plane].saturation);
+		}
+		else
+			out.append(",,,,");
+	}
+
+	if (m.hasDark)
+	{
+		AppendFormat(out, ",%f,%f,%f,%f,%f",
+			m.darkAvgAll,
+			m.darkAvgRed,
+			m.darkAvgGreen,
+			m.darkAvgBlue,
+			m.mean - m.darkAvgAll);
+		if (m.hasPlanes)
+		{
+			double green = (m.planes[AnalysisTools::Plane_GreenRed].mean + m.planes[AnalysisTools::Plane_GreenBlue].mean) / 2;
+			AppendFormat(out, ",%f,%f,%f",
+				m.planes[AnalysisTools::Plane_Red].mean - m.darkAvgRed,
+				green - m.darkAvgGreen,
+				m.planes[AnalysisTools::Plane_Blue].mean - m.darkAvgBlue);
+		}
+		else
+			out.append(",,,");
+	}
+	else
+	{
+		out.append(",,,,,,,,");
+	}
+
+	for (uint32_t roi = 0; roi < m.numRois; roi++)
+	{
+		if (m.rois[roi].valid)
+		{
+			AppendFormat(out, ",%f,%f,%f", m.rois[roi].mean, m.rois[roi].stdDev, m.rois[roi].temporalNoise);
+		}
+		else
+			out.append(",,,");
+	}
+	out.append("\n");
+}
+
+inline void DarkBright::AppendFormat(std::string& out, const char* format, ...)
+{
+	// most lines fit into the buffer
+	char line[1024];
+	va_list args;
+	va_start(args, format);
+	int length = std::vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length < 0)
+		return;
+	if ((size_t)length < sizeof(line))
+	{
+		out.append(line, (size_t)length);
+		return;
+	}
+
+	// too long: format again, straight into out (vsnprintf needs room for the terminating zero)
+	size_t start = out.size();
+	out.resize(start + (size_t)length + 1);
+	va_start(args, format);
+	std::vsnprintf(&out[start], (size_t)length + 1, format, args);
+	va_end(args);
+	out.resize(start + (size_t)length);
+}
+
+inline bool DarkBright::HasLight(Pylon::CBaslerUniversalInstantCamera& camera)
+{
+	return camera.BslLightControlMode.IsWritable() && camera.BslLightDeviceSelector.IsReadable();
+}
+
+inline bool DarkBright::SetLight(Pylon::CBaslerUniversalInstantCamera& camera, bool on, uint32_t settleTimeMs, std::string& errorMessage)
+{
+	try
+	{
+		if (HasLight(camera) == false)
+			return true;
+
+		camera.BslLightDeviceSelector.SetValue(Basler_UniversalCameraParams::BslLightDeviceSelector_Device1);
+		camera.BslLightDeviceOperationMode.SetValue(on ? Basler_UniversalCameraParams::BslLightDeviceOperationMode_On : Basler_UniversalCameraParams::BslLightDeviceOperationMode_Off);
+
+		// the light needs a moment to reach a stable brightness (or to go completely dark)
+		if (settleTimeMs > 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(settleTimeMs));
+
+		return true;
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in SetLight(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+}
+
+inline void DarkBright::GrabPair(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult1, Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult2, FrameTiming::Analyzer* pFrameTiming)
+{
+	if (pFrameTiming != nullptr)
+		pFrameTiming->OnTrigger();
+	camera.TriggerSoftware.Execute();
+
+	// Wait for images to arrive and then retrieve them into the smartpointers
+	camera.RetrieveResult(5000, ptrGrabResult1, Pylon::TimeoutHandling_ThrowException);
+	if (pFrameTiming != nullptr)
+		pFrameTiming->OnFrame(ptrGrabResult1);
+
+	if (triggersPerPair == 2)
+	{
+		camera.WaitForFrameTriggerReady(5000, Pylon::TimeoutHandling_ThrowException);
+		if (pFrameTiming != nullptr)
+			pFrameTiming->OnTrigger();
+		camera.TriggerSoftware.Execute();
+	}
+	camera.RetrieveResult(5000, ptrGrabResult2, Pylon::TimeoutHandling_ThrowException);
+	if (pFrameTiming != nullptr)
+		pFrameTiming->OnFrame(ptrGrabResult2);
+}
+// *********************************************************************************************************
+#endif
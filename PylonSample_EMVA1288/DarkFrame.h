@@ -0,0 +1,592 @@
+// DarkFrame.h
+// Master dark frames for dark subtraction during the sweep.
+// Dark frames (light off) are summed as they arrive, into one master per exposure time. The masters are kept in a cache of bounded size,
+// and the dark frame for an exposure time between two masters is interpolated per pixel (the dark signal grows linearly with the exposure time).
+// Each bright frame has its dark frame subtracted in place (saturating integer math, SSE2 where available) before it is measured.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef DARKFRAME_H
+#define DARKFRAME_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+#include "AnalysisTools.h"
+#include "DarkBright.h"
+#include "ExposureSequencer.h"
+#include "FlatField.h"
+#include "FormatDispatch.h"
+#include "FrameTiming.h"
+#include "SweepScheduler.h"
+#include "ThreadPool.h"
+
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DARKFRAME_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace DarkFrame
+{
+	// Exposure times closer than this (us) share a master.
+	const double c_exposureTolerance = 0.5;
+
+	// The settings a master belongs to, besides the exposure time.
+	struct Key
+	{
+		SweepScheduler::StreamConfig stream;
+		double gain = 0;
+		double blackLevel = 0;
+	};
+
+	bool IsSameKey(const Key& a, const Key& b);
+
+	// The key of a sweep point (at the black level the camera is at now, the calibration may have raised it).
+	Key MakeKey(const SweepScheduler::SweepPoint& point, double blackLevel);
+
+	// A master dark frame, as 16 bit values. The means of the four positions in the 2x2 Bayer cell (all the same for mono)
+	// are kept apart: each position's pixels are stored shifted by less than 1 DN, so their mean is its (whole) pedestal.
+	// Subtracting a master and adding back the pedestals removes the dark pattern, but keeps the mean of each plane,
+	// so the noise of dark pixels isn't clipped at zero and the black level and saturation decisions see the same levels.
+	struct Master
+	{
+		Key key;
+		double exposureTime = 0;
+		Pylon::EPixelType pixelType = Pylon::PixelType_Undefined;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t numFrames = 0;
+		std::vector<uint16_t> pixels;
+		uint16_t pedestals[4] = { 0, 0, 0, 0 };
+		double positionMeans[4] = { 0, 0, 0, 0 }; // the dark level of each position, DN
+		double mean = 0;
+
+		size_t GetBytes() const;
+	};
+
+	// Make a master from the per-pixel sums of the dark frames.
+	bool MakeMaster(const FlatField::Accumulator& accumulator, const Key& key, double exposureTime, Master& master, std::string& errorMessage);
+
+	// Subtract a master from a frame in place (multi-threaded): corrected = raw - master + pedestal, clamped to the range of the format.
+	// Saturated pixels stay saturated.
+	bool Subtract(const Master& master, Pylon::CPylonImage& image, std::string& errorMessage);
+
+	// Single threaded kernel: one row. pedestalEven/Odd are the pedestals of the even and odd columns of the row.
+	template <typename T>
+	void SubtractRowT(T* pRow, const uint16_t* pMaster, uint32_t width, uint16_t pedestalEven, uint16_t pedestalOdd, uint16_t maxValue);
+
+	// The dark levels of a master as the dark columns of a measurement (the planes are found with the kernels of the frame format).
+	void FillMeasurement(const Master& master, const FormatDispatch::Kernels& kernels, DarkBright::Measurement& measurement);
+
+	// The masters of a sweep. When a new master doesn't fit into maxBytes, masters of other settings are evicted first,
+	// then those with the exposure time farthest from the new one (a ramp doesn't come back to them).
+	// Besides the masters, the cache keeps one interpolated frame.
+	class Cache
+	{
+	private:
+		std::vector<Master> m_masters;
+		size_t m_maxBytes = 256 << 20;
+		size_t m_bytes = 0;
+		uint64_t m_numEvicted = 0;
+		Master m_interpolated;
+		bool m_hasInterpolated = false;
+
+		// index of the master for this exposure time, or -1
+		int FindExact(const Key& key, double exposureTime) const;
+		// the nearest masters below and above, or -1
+		void FindNeighbors(const Key& key, double exposureTime, int& below, int& above) const;
+
+	public:
+		Cache();
+		~Cache();
+
+		void SetMaxBytes(size_t maxBytes);
+
+		// Keep a master (its pixels are moved into the cache). Replaces a master of the same settings and exposure time.
+		bool Add(Master& master, std::string& errorMessage);
+
+		// There is a master for this exposure time.
+		bool Has(const Key& key, double exposureTime) const;
+
+		// Find() can give a dark frame for this exposure time (a master, or masters below and above it).
+		bool Covers(const Key& key, double exposureTime) const;
+
+		// The dark frame for this exposure time, or nullptr. Valid until the next call to Find(), Add() or Clear().
+		const Master* Find(const Key& key, double exposureTime);
+
+		void Clear();
+
+		size_t GetBytes() const;
+		size_t GetNumMasters() const;
+		uint64_t GetNumEvicted() const;
+	};
+
+	// With the light off, grab numFrames frames at each of the exposure times the cache doesn't have yet, and add them to the cache as masters.
+	// The camera must be grabbing, without the sequencer (the exposure times are set directly). The light is on again when this returns.
+	bool Capture(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, ExposureSequencer::Sequencer& sequencer, const std::vector<double>& exposureTimes,
+		uint32_t numFrames, uint32_t lightSettleTimeMs, const Key& key, FrameTiming::Analyzer* pFrameTiming, Cache& cache, std::string& errorMessage);
+}
+
+// *********************************************************************************************************
+inline bool DarkFrame::IsSameKey(const Key& a, const Key& b)
+{
+	return SweepScheduler::IsSameStream(a.stream, b.stream) && a.gain == b.gain && a.blackLevel == b.blackLevel;
+}
+
+inline DarkFrame::Key DarkFrame::MakeKey(const SweepScheduler::SweepPoint& point, double blackLevel)
+{
+	Key key;
+	key.stream = point.stream;
+	key.gain = point.gain;
+	key.blackLevel = blackLevel;
+	return key;
+}
+
+inline size_t DarkFrame::Master::GetBytes() const
+{
+	return pixels.size() * sizeof(uint16_t);
+}
+
+inline bool DarkFrame::MakeMaster(const FlatField::Accumulator& accumulator, const Key& key, double exposureTime, Master& master, std::string& errorMessage)
+{
+	if (accumulator.GetNumFrames() == 0)
+	{
+		errorMessage = "ERROR: A master dark frame needs at least one frame.";
+		return false;
+	}
+
+	master.key = key;
+	master.exposureTime = exposureTime;
+	master.pixelType = accumulator.GetPixelType();
+	master.width = accumulator.GetWidth();
+	master.height = accumulator.GetHeight();
+	master.numFrames = accumulator.GetNumFrames();
+
+	const uint32_t width = master.width;
+	const uint32_t height = master.height;
+	const uint32_t maxValue = (1u << Pylon::BitDepth(master.pixelType)) - 1;
+	const bool isBayer = Pylon::IsBayer(master.pixelType);
+	const std::vector<uint32_t>& sums = accumulator.GetSums();
+	const double scale = 1.0 / master.numFrames;
+
+	// the mean of each position first, then the pixels shifted so each position's mean is a whole number
+	double positionSums[4] = { 0, 0, 0, 0 };
+	uint64_t positionCounts[4] = { 0, 0, 0, 0 };
+	double total = 0;
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			uint32_t position = isBayer ? ((y & 1) * 2 + (x & 1)) : 0;
+			positionSums[position] += sums[(size_t)y * width + x];
+			positionCounts[position]++;
+		}
+	}
+
+	double shifts[4] = { 0, 0, 0, 0 };
+	for (uint32_t position = 0; position < 4; position++)
+	{
+		uint32_t from = isBayer ? position : 0;
+		double mean = (positionCounts[from] > 0) ? positionSums[from] * scale / positionCounts[from] : 0;
+		uint32_t pedestal = (uint32_t)(mean + 0.5);
+		master.positionMeans[position] = mean;
+		master.pedestals[position] = (uint16_t)((pedestal < maxValue) ? pedestal : maxValue);
+		shifts[position] = master.pedestals[position] - mean;
+		total += positionSums[position];
+	}
+	master.mean = total * scale / ((double)width * height);
+
+	master.pixels.resize((size_t)width * height);
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			size_t i = (size_t)y * width + x;
+			// (ties to even: with an even number of frames, half values are common, and always rounding them up would raise the level)
+			double value = std::nearbyint(sums[i] * scale + shifts[isBayer ? ((y & 1) * 2 + (x & 1)) : 0]);
+			value = (value > 0) ? value : 0;
+			master.pixels[i] = (uint16_t)((value < maxValue) ? value : maxValue);
+		}
+	}
+	return true;
+}
+
+inline bool DarkFrame::Subtract(const Master& master, Pylon::CPylonImage& image, std::string& errorMessage)
+{
+	if (master.pixels.empty() || image.GetPixelType() != master.pixelType || image.GetWidth() != master.width || image.GetHeight() != master.height)
+	{
+		errorMessage = "ERROR: The frame doesn't match the master dark frame.";
+		return false;
+	}
+
+	const uint32_t width = master.width;
+	const uint32_t height = master.height;
+	const uint16_t maxValue = (uint16_t)((1u << Pylon::BitDepth(master.pixelType)) - 1);
+	const bool is16Bit = (Pylon::BitPerPixel(master.pixelType) > 8);
+	size_t rowsPerChunk = AnalysisTools::c_reductionChunkSize / ((size_t)width * (is16Bit ? sizeof(uint16_t) : sizeof(uint8_t)));
+	rowsPerChunk = (rowsPerChunk > 0) ? rowsPerChunk : 1;
+	const size_t numChunks = (height + rowsPerChunk - 1) / rowsPerChunk;
+	void* pBuffer = image.GetBuffer();
+
+	auto task = [&](size_t chunk)
+	{
+		size_t firstRow = chunk * rowsPerChunk;
+		size_t lastRow = (firstRow + rowsPerChunk < height) ? firstRow + rowsPerChunk : height;
+		for (size_t y = firstRow; y < lastRow; y++)
+		{
+			// (the pedestals of mono frames are all the same)
+			uint16_t pedestalEven = master.pedestals[(y & 1) * 2];
+			uint16_t pedestalOdd = master.pedestals[(y & 1) * 2 + 1];
+			const uint16_t* pMaster = &master.pixels[y * width];
+			if (is16Bit)
+				SubtractRowT<uint16_t>((uint16_t*)pBuffer + y * width, pMaster, width, pedestalEven, pedestalOdd, maxValue);
+			else
+				SubtractRowT<uint8_t>((uint8_t*)pBuffer + y * width, pMaster, width, pedestalEven, pedestalOdd, maxValue);
+		}
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+	return true;
+}
+
+template <typename T>
+inline void DarkFrame::SubtractRowT(T* pRow, const uint16_t* pMaster, uint32_t width, uint16_t pedestalEven, uint16_t pedestalOdd, uint16_t maxValue)
+{
+	uint32_t x = 0;
+
+#ifdef DARKFRAME_SSE2
+	// raw - master + pedestal without leaving the unsigned range: (raw - master) and (master - raw) saturate at zero, so one of them is 0,
+	// and ((raw - master) + pedestal) - (master - raw) is the result, clamped at 0 and at the top of the lane.
+	// Both steps are 16 (or 8) columns wide, an even number, so the pedestals of the even and odd columns keep their lanes.
+	if (sizeof(T) == 1)
+	{
+		const __m128i pedestals = _mm_set1_epi16((int16_t)(pedestalEven | (pedestalOdd << 8)));
+		const __m128i maxValues = _mm_set1_epi8((char)maxValue);
+		for (; x + 16 <= width; x += 16)
+		{
+			__m128i raw = _mm_loadu_si128((const __m128i*)(pRow + x));
+			__m128i dark = _mm_packus_epi16(_mm_loadu_si128((const __m128i*)(pMaster + x)), _mm_loadu_si128((const __m128i*)(pMaster + x + 8)));
+			__m128i result = _mm_subs_epu8(_mm_adds_epu8(_mm_subs_epu8(raw, dark), pedestals), _mm_subs_epu8(dark, raw));
+			result = _mm_min_epu8(result, maxValues);
+			__m128i saturated = _mm_cmpeq_epi8(raw, maxValues);
+			result = _mm_or_si128(_mm_and_si128(saturated, raw), _mm_andnot_si128(saturated, result));
+			_mm_storeu_si128((__m128i*)(pRow + x), result);
+		}
+	}
+	else
+	{
+		const __m128i pedestals = _mm_set1_epi32((int32_t)(pedestalEven | ((uint32_t)pedestalOdd << 16)));
+		const __m128i maxValues = _mm_set1_epi16((int16_t)maxValue);
+		for (; x + 8 <= width; x += 8)
+		{
+			__m128i raw = _mm_loadu_si128((const __m128i*)(pRow + x));
+			__m128i dark = _mm_loadu_si128((const __m128i*)(pMaster + x));
+			__m128i result = _mm_subs_epu16(_mm_adds_epu16(_mm_subs_epu16(raw, dark), pedestals), _mm_subs_epu16(dark, raw));
+			// (SSE2 has no unsigned 16 bit min: min(a, b) = a - (a - b, saturated at zero))
+			result = _mm_sub_epi16(result, _mm_subs_epu16(result, maxValues));
+			__m128i saturated = _mm_cmpeq_epi16(raw, maxValues);
+			result = _mm_or_si128(_mm_and_si128(saturated, raw), _mm_andnot_si128(saturated, result));
+			_mm_storeu_si128((__m128i*)(pRow + x), result);
+		}
+	}
+#endif
+
+	for (; x < width; x++)
+	{
+		if (pRow[x] >= maxValue)
+		{
+			pRow[x] = (T)maxValue;
+			continue;
+		}
+		int32_t value = (int32_t)pRow[x] - pMaster[x] + ((x & 1) ? pedestalOdd : pedestalEven);
+		value = (value > 0) ? value : 0;
+		pRow[x] = (T)((value < maxValue) ? value : maxValue);
+	}
+}
+
+inline void DarkFrame::FillMeasurement(const Master& master, const FormatDispatch::Kernels& kernels, DarkBright::Measurement& measurement)
+{
+	const uint32_t* positions = kernels.planePositions;
+	measurement.hasDark = true;
+	measurement.darkAvgAll = master.mean;
+	measurement.darkAvgRed = master.positionMeans[positions[AnalysisTools::Plane_Red]];
+	measurement.darkAvgGreen = (master.positionMeans[positions[AnalysisTools::Plane_GreenRed]] + master.positionMeans[positions[AnalysisTools::Plane_GreenBlue]]) / 2;
+	measurement.darkAvgBlue = master.positionMeans[positions[AnalysisTools::Plane_Blue]];
+}
+
+inline DarkFrame::Cache::Cache()
+{
+	// nothing
+}
+
+inline DarkFrame::Cache::~Cache()
+{
+	// nothing
+}
+
+inline void DarkFrame::Cache::SetMaxBytes(size_t maxBytes)
+{
+	m_maxBytes = maxBytes;
+}
+
+inline int DarkFrame::Cache::FindExact(const Key& key, double exposureTime) const
+{
+	for (size_t i = 0; i < m_masters.size(); i++)
+	{
+		if (std::fabs(m_masters[i].exposureTime - exposureTime) <= c_exposureTolerance && IsSameKey(m_masters[i].key, key))
+			return (int)i;
+	}
+	return -1;
+}
+
+inline void DarkFrame::Cache::FindNeighbors(const Key& key, double exposureTime, int& below, int& above) const
+{
+	below = -1;
+	above = -1;
+	for (size_t i = 0; i < m_masters.size(); i++)
+	{
+		const Master& master = m_masters[i];
+		if (IsSameKey(master.key, key) == false)
+			continue;
+		if (master.exposureTime < exposureTime && (below < 0 || master.exposureTime > m_masters[below].exposureTime))
+			below = (int)i;
+		if (master.exposureTime > exposureTime && (above < 0 || master.exposureTime < m_masters[above].exposureTime))
+			above = (int)i;
+	}
+}
+
+inline bool DarkFrame::Cache::Add(Master& master, std::string& errorMessage)
+{
+	if (master.GetBytes() > m_maxBytes)
+	{
+		errorMessage = "ERROR: A master dark frame is larger than the dark frame cache.";
+		return false;
+	}
+
+	m_hasInterpolated = false;
+	int existing = FindExact(master.key, master.exposureTime);
+	if (existing >= 0)
+	{
+		m_bytes -= m_masters[existing].GetBytes();
+		m_masters.erase(m_masters.begin() + existing);
+	}
+
+	while (m_bytes + master.GetBytes() > m_maxBytes && m_masters.empty() == false)
+	{
+		size_t victim = 0;
+		double victimDistance = -1;
+		for (size_t i = 0; i < m_masters.size(); i++)
+		{
+			// (masters of other settings count as infinitely far away)
+			double distance = IsSameKey(m_masters[i].key, master.key) ? std::fabs(m_masters[i].exposureTime - master.exposureTime) : HUGE_VAL;
+			if (distance > victimDistance)
+			{
+				victim = i;
+				victimDistance = distance;
+			}
+		}
+		m_bytes -= m_masters[victim].GetBytes();
+		m_masters.erase(m_masters.begin() + victim);
+		m_numEvicted++;
+	}
+
+	m_bytes += master.GetBytes();
+	m_masters.push_back(Master());
+	std::swap(m_masters.back(), master);
+	return true;
+}
+
+inline bool DarkFrame::Cache::Has(const Key& key, double exposureTime) const
+{
+	return FindExact(key, exposureTime) >= 0;
+}
+
+inline bool DarkFrame::Cache::Covers(const Key& key, double exposureTime) const
+{
+	if (Has(key, exposureTime))
+		return true;
+	int below = -1;
+	int above = -1;
+	FindNeighbors(key, exposureTime, below, above);
+	return below >= 0 && above >= 0;
+}
+
+inline const DarkFrame::Master* DarkFrame::Cache::Find(const Key& key, double exposureTime)
+{
+	int exact = FindExact(key, exposureTime);
+	if (exact >= 0)
+		return &m_masters[exact];
+
+	// the last interpolated frame is reused while the exposure time stays (eg: for all pairs of one measurement)
+	if (m_hasInterpolated && m_interpolated.exposureTime == exposureTime && IsSameKey(m_interpolated.key, key))
+		return &m_interpolated;
+
+	int below = -1;
+	int above = -1;
+	FindNeighbors(key, exposureTime, below, above);
+	if (below < 0 || above < 0)
+		return nullptr;
+
+	const Master& low = m_masters[below];
+	const Master& high = m_masters[above];
+	if (low.pixelType != high.pixelType || low.width != high.width || low.height != high.height)
+		return nullptr;
+
+	// the dark level of each pixel (relative to its position's pedestal) and of each position, at the weight of the exposure time
+	const double weight = (exposureTime - low.exposureTime) / (high.exposureTime - low.exposureTime);
+	const uint32_t width = low.width;
+	const uint32_t height = low.height;
+	const uint32_t maxValue = (1u << Pylon::BitDepth(low.pixelType)) - 1;
+	m_interpolated.key = key;
+	m_interpolated.exposureTime = exposureTime;
+	m_interpolated.pixelType = low.pixelType;
+	m_interpolated.width = width;
+	m_interpolated.height = height;
+	m_interpolated.numFrames = (low.numFrames < high.numFrames) ? low.numFrames : high.numFrames;
+	m_interpolated.mean = low.mean + weight * (high.mean - low.mean);
+	double lowShifts[4];
+	double highShifts[4];
+	for (uint32_t position = 0; position < 4; position++)
+	{
+		double mean = low.positionMeans[position] + weight * (high.positionMeans[position] - low.positionMeans[position]);
+		uint32_t pedestal = (uint32_t)(mean + 0.5);
+		m_interpolated.positionMeans[position] = mean;
+		m_interpolated.pedestals[position] = (uint16_t)((pedestal < maxValue) ? pedestal : maxValue);
+		lowShifts[position] = (double)m_interpolated.pedestals[position] - low.pedestals[position];
+		highShifts[position] = (double)m_interpolated.pedestals[position] - high.pedestals[position];
+	}
+	m_interpolated.pixels.resize((size_t)width * height);
+
+	size_t rowsPerChunk = AnalysisTools::c_reductionChunkSize / ((size_t)width * sizeof(uint16_t));
+	rowsPerChunk = (rowsPerChunk > 0) ? rowsPerChunk : 1;
+	const size_t numChunks = (height + rowsPerChunk - 1) / rowsPerChunk;
+	const bool isBayer = Pylon::IsBayer(low.pixelType);
+	uint16_t* pOut = m_interpolated.pixels.data();
+
+	auto task = [&](size_t chunk)
+	{
+		size_t firstRow = chunk * rowsPerChunk;
+		size_t lastRow = (firstRow + rowsPerChunk < height) ? firstRow + rowsPerChunk : height;
+		for (size_t y = firstRow; y < lastRow; y++)
+		{
+			for (uint32_t x = 0; x < width; x++)
+			{
+				size_t i = y * width + x;
+				uint32_t position = isBayer ? (uint32_t)((y & 1) * 2 + (x & 1)) : 0;
+				double value = std::nearbyint((1 - weight) * (low.pixels[i] + lowShifts[position]) + weight * (high.pixels[i] + highShifts[position]));
+				value = (value > 0) ? value : 0;
+				pOut[i] = (uint16_t)((value < maxValue) ? value : maxValue);
+			}
+		}
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	m_hasInterpolated = true;
+	return &m_interpolated;
+}
+
+inline void DarkFrame::Cache::Clear()
+{
+	m_masters.clear();
+	m_bytes = 0;
+	m_hasInterpolated = false;
+}
+
+inline size_t DarkFrame::Cache::GetBytes() const
+{
+	return m_bytes;
+}
+
+inline size_t DarkFrame::Cache::GetNumMasters() const
+{
+	return m_masters.size();
+}
+
+inline uint64_t DarkFrame::Cache::GetNumEvicted() const
+{
+	return m_numEvicted;
+}
+
+inline bool DarkFrame::Capture(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, ExposureSequencer::Sequencer& sequencer, const std::vector<double>& exposureTimes,
+	uint32_t numFrames, uint32_t lightSettleTimeMs, const Key& key, FrameTiming::Analyzer* pFrameTiming, Cache& cache, std::string& errorMessage)
+{
+	if (DarkBright::HasLight(camera) == false)
+	{
+		errorMessage = "ERROR: Dark subtraction needs a Basler Camera Light for the dark frames.";
+		return false;
+	}
+
+	uint32_t numPairs = (numFrames > 2) ? (numFrames + 1) / 2 : 1;
+	FlatField::Accumulator accumulator;
+	bool succeeded = true;
+	bool lightOff = false;
+	try
+	{
+		for (size_t e = 0; e < exposureTimes.size() && succeeded; e++)
+		{
+			if (cache.Has(key, exposureTimes[e]))
+				continue;
+
+			// (the light only goes off if a master is missing)
+			if (lightOff == false)
+			{
+				lightOff = DarkBright::SetLight(camera, false, lightSettleTimeMs, errorMessage);
+				succeeded = lightOff;
+			}
+
+			Master master;
+			sequencer.SetExposureTime(camera, exposureTimes[e]);
+			succeeded = succeeded
+				&& FlatField::GrabInto(camera, triggersPerPair, numPairs, pFrameTiming, accumulator, errorMessage)
+				&& MakeMaster(accumulator, key, exposureTimes[e], master, errorMessage)
+				&& cache.Add(master, errorMessage);
+		}
+
+		if (lightOff)
+		{
+			std::string lightError = "";
+			lightOff = (DarkBright::SetLight(camera, true, lightSettleTimeMs, lightError) == false);
+			if (lightOff && succeeded)
+			{
+				errorMessage = lightError;
+				succeeded = false;
+			}
+		}
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in Capture(): ";
+		errorMessage.append(e.GetDescription());
+		succeeded = false;
+	}
+
+	// don't leave the light off for the rest of the sweep
+	if (lightOff)
+	{
+		std::string lightError = "";
+		DarkBright::SetLight(camera, true, lightSettleTimeMs, lightError);
+	}
+
+	return succeeded;
+}
+// *********************************************************************************************************
+#endif
@@ -0,0 +1,313 @@
+// ExposureSequencer.h
+// Pre-programs blocks of upcoming exposure times into the camera's sequencer sets, so the camera can step through
+// the sweep without the host setting (and reading back) the exposure time for every point.
+// Each grab result is matched to its exposure time using chunk data.
+// Cameras without a sequencer (eg: the pylon camera emulator) fall back to a host-side cache of the exposure time,
+// which at least saves the read-back of the value for every point.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef EXPOSURESEQUENCER_H
+#define EXPOSURESEQUENCER_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+#include <exception>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace ExposureSequencer
+{
+	class Sequencer
+	{
+	private:
+		bool m_sequencerAvailable = false;
+		bool m_chunksAvailable = false;
+		bool m_sequencerActive = false;
+		uint32_t m_framesPerStep = 1;
+		size_t m_maxBlockSize = 0;
+		std::vector<double> m_block; // the exposure times currently programmed, one per step
+		size_t m_nextStep = 0; // the step the camera will run with the next trigger
+		double m_cachedExposureTime = -1; // host-side copy of the camera's ExposureTime (-1 = unknown)
+
+		// Switch the sequencer on or off. Frames are triggered one by one, so none are in flight between steps and this is done while grabbing.
+		// Only if the camera doesn't allow that, grabbing is stopped (stoppedGrabbing = true) and left to the caller to start again.
+		void SetMode(Pylon::CBaslerUniversalInstantCamera& camera, bool on, bool& stoppedGrabbing);
+
+	public:
+		Sequencer();
+		~Sequencer();
+
+		// Find out what the camera supports and turn on the exposure time chunk. The camera must not be grabbing.
+		// useSequencer = false forces the host-side cache, even if the camera has a sequencer.
+		bool Setup(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t framesPerStep, bool useSequencer, std::string& errorMessage);
+
+		// How many steps fit into the sequencer at once (each step uses framesPerStep sets). 0 if there is no sequencer.
+		size_t GetMaxBlockSize();
+
+		// Program a block of exposure times into the sequencer sets, starting with the first one.
+		// All other settings (gain, black level, ...) are saved into the sets as they are now.
+		// The sets are programmed while grabbing. Only cameras which can't switch the sequencer off and on while grabbing are stopped for it,
+		// restartedGrabbing tells if that happened (the frame sequence starts over).
+		bool LoadBlock(Pylon::CBaslerUniversalInstantCamera& camera, const std::vector<double>& exposureTimes, bool& restartedGrabbing, std::string& errorMessage);
+
+		// Turn the sequencer off again, like LoadBlock() only stopping grabbing if the camera needs it.
+		void Disable(Pylon::CBaslerUniversalInstantCamera& camera, bool& restartedGrabbing);
+
+		// Call after every triggered step. Returns false when the programmed block is used up and the next one must be loaded.
+		bool AdvanceStep();
+
+		// Forget the programmed block (eg: when a setting stored in the sets changed). The next step needs a new block.
+		void InvalidateBlock();
+
+		// Set the exposure time for the next step without the sequencer. Only writes to the camera if the value changed.
+		void SetExposureTime(Pylon::CBaslerUniversalInstantCamera& camera, double exposureTime);
+
+		// The exposure time the next step will run with, without asking the camera.
+		double GetExposureTime(Pylon::CBaslerUniversalInstantCamera& camera);
+
+		// The exposure time a frame was actually taken with: from chunk data if available, otherwise what was programmed.
+		double GetFrameExposureTime(Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult, double expectedExposureTime);
+
+		bool IsSequencerActive();
+		bool HasChunks();
+	};
+}
+
+// *********************************************************************************************************
+inline ExposureSequencer::Sequencer::Sequencer()
+{
+	// nothing
+}
+
+inline ExposureSequencer::Sequencer::~Sequencer()
+{
+	// nothing
+}
+
+inline bool ExposureSequencer::Sequencer::Setup(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t framesPerStep, bool useSequencer, std::string& errorMessage)
+{
+	try
+	{
+		if (camera.IsGrabbing())
+		{
+			errorMessage = "ERROR: Stop grabbing before setting up the sequencer.";
+			return false;
+		}
+
+		m_framesPerStep = (framesPerStep == 0) ? 1 : framesPerStep;
+		m_sequencerActive = false;
+		m_block.clear();
+		m_nextStep = 0;
+		m_cachedExposureTime = -1;
+
+		// Tag every frame with the exposure time it was taken with.
+		m_chunksAvailable = false;
+		if (camera.ChunkModeActive.TrySetValue(true) && camera.ChunkSelector.TrySetValue(Basler_UniversalCameraParams::ChunkSelector_ExposureTime))
+			m_chunksAvailable = camera.ChunkEnable.TrySetValue(true);
+
+		m_sequencerAvailable = useSequencer && camera.SequencerMode.IsWritable() && camera.SequencerConfigurationMode.IsWritable();
+		m_maxBlockSize = 0;
+		if (m_sequencerAvailable)
+		{
+			// the set selector can only be read in configuration mode
+			camera.SequencerMode.TrySetValue(Basler_UniversalCameraParams::SequencerMode_Off);
+			camera.SequencerConfigurationMode.TrySetValue(Basler_UniversalCameraParams::SequencerConfigurationMode_On);
+			m_maxBlockSize = (size_t)(camera.SequencerSetSelector.GetMax() + 1) / m_framesPerStep;
+			camera.SequencerConfigurationMode.TrySetValue(Basler_UniversalCameraParams::SequencerConfigurationMode_Off);
+			m_sequencerAvailable = (m_maxBlockSize > 0);
+		}
+
+		return true;
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in Setup(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+	catch (std::exception& e)
+	{
+		errorMessage = "An exception occured in Setup(): ";
+		errorMessage.append(e.what());
+		return false;
+	}
+}
+
+inline size_t ExposureSequencer::Sequencer::GetMaxBlockSize()
+{
+	return m_maxBlockSize;
+}
+
+inline void ExposureSequencer::Sequencer::SetMode(Pylon::CBaslerUniversalInstantCamera& camera, bool on, bool& stoppedGrabbing)
+{
+	const Basler_UniversalCameraParams::SequencerModeEnums mode = on ? Basler_UniversalCameraParams::SequencerMode_On : Basler_UniversalCameraParams::SequencerMode_Off;
+	if (camera.SequencerMode.IsReadable() && camera.SequencerMode.GetValue() == mode)
+		return;
+
+	if (camera.SequencerMode.TrySetValue(mode) == false)
+	{
+		if (camera.IsGrabbing())
+		{
+			camera.StopGrabbing();
+			stoppedGrabbing = true;
+		}
+		camera.SequencerMode.SetValue(mode);
+	}
+}
+
+inline bool ExposureSequencer::Sequencer::LoadBlock(Pylon::CBaslerUniversalInstantCamera& camera, const std::vector<double>& exposureTimes, bool& restartedGrabbing, std::string& errorMessage)
+{
+	restartedGrabbing = false;
+	try
+	{
+		if (m_sequencerAvailable == false)
+		{
+			errorMessage = "ERROR: Camera has no sequencer.";
+			return false;
+		}
+
+		if (exposureTimes.size() == 0 || exposureTimes.size() > m_maxBlockSize)
+		{
+			errorMessage = "ERROR: Block does not fit into the sequencer.";
+			return false;
+		}
+
+		size_t numSets = exposureTimes.size() * m_framesPerStep;
+
+		// the sets can only be configured while the sequencer is off
+		SetMode(camera, false, restartedGrabbing);
+		if (camera.SequencerConfigurationMode.IsWritable() == false && camera.IsGrabbing())
+		{
+			camera.StopGrabbing();
+			restartedGrabbing = true;
+		}
+		camera.SequencerConfigurationMode.SetValue(Basler_UniversalCameraParams::SequencerConfigurationMode_On);
+
+		// Every step is stored framesPerStep times, so all frames of a burst use the same exposure time.
+		// The sets advance with every frame and wrap around at the end of the block.
+		for (size_t set = 0; set < numSets; set++)
+		{
+			camera.SequencerSetSelector.SetValue((int64_t)set);
+			camera.ExposureTime.SetValue(exposureTimes[set / m_framesPerStep]);
+			camera.SequencerPathSelector.SetValue(0);
+			camera.SequencerSetNext.SetValue((int64_t)((set + 1) % numSets));
+			camera.SequencerTriggerSource.SetValue(Basler_UniversalCameraParams::SequencerTriggerSource_FrameStart);
+			camera.SequencerSetSave.Execute();
+		}
+
+		camera.SequencerSetStart.SetValue(0);
+		camera.SequencerConfigurationMode.SetValue(Basler_UniversalCameraParams::SequencerConfigurationMode_Off);
+		SetMode(camera, true, restartedGrabbing);
+		if (restartedGrabbing)
+			camera.StartGrabbing();
+
+		m_block = exposureTimes;
+		m_nextStep = 0;
+		m_sequencerActive = true;
+		// the sequencer owns the exposure time now
+		m_cachedExposureTime = -1;
+
+		return true;
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in LoadBlock(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+	catch (std::exception& e)
+	{
+		errorMessage = "An exception occured in LoadBlock(): ";
+		errorMessage.append(e.what());
+		return false;
+	}
+}
+
+inline void ExposureSequencer::Sequencer::Disable(Pylon::CBaslerUniversalInstantCamera& camera, bool& restartedGrabbing)
+{
+	restartedGrabbing = false;
+	if (m_sequencerAvailable)
+	{
+		SetMode(camera, false, restartedGrabbing);
+		if (restartedGrabbing)
+			camera.StartGrabbing();
+	}
+
+	InvalidateBlock();
+}
+
+inline bool ExposureSequencer::Sequencer::AdvanceStep()
+{
+	if (m_sequencerActive == false)
+		return true;
+
+	m_nextStep++;
+	return m_nextStep < m_block.size();
+}
+
+inline void ExposureSequencer::Sequencer::InvalidateBlock()
+{
+	m_sequencerActive = false;
+	m_block.clear();
+	m_nextStep = 0;
+	m_cachedExposureTime = -1;
+}
+
+inline void ExposureSequencer::Sequencer::SetExposureTime(Pylon::CBaslerUniversalInstantCamera& camera, double exposureTime)
+{
+	if (exposureTime != m_cachedExposureTime)
+	{
+		camera.ExposureTime.SetValue(exposureTime);
+		m_cachedExposureTime = exposureTime;
+	}
+}
+
+inline double ExposureSequencer::Sequencer::GetExposureTime(Pylon::CBaslerUniversalInstantCamera& camera)
+{
+	if (m_sequencerActive && m_nextStep < m_block.size())
+		return m_block[m_nextStep];
+
+	// only ask the camera if we don't know
+	if (m_cachedExposureTime < 0)
+		m_cachedExposureTime = camera.ExposureTime.GetValue();
+
+	return m_cachedExposureTime;
+}
+
+inline double ExposureSequencer::Sequencer::GetFrameExposureTime(Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult, double expectedExposureTime)
+{
+	// (chunk data is parsed on the host, this doesn't talk to the camera)
+	if (m_chunksAvailable && ptrGrabResult->ChunkExposureTime.IsReadable())
+		return ptrGrabResult->ChunkExposureTime.GetValue();
+
+	return expectedExposureTime;
+}
+
+inline bool ExposureSequencer::Sequencer::IsSequencerActive()
+{
+	return m_sequencerActive;
+}
+
+inline bool ExposureSequencer::Sequencer::HasChunks()
+{
+	return m_chunksAvailable;
+}
+// *********************************************************************************************************
+#endif
@@ -0,0 +1,776 @@
+// FlatField.h
+// Flat-field and dark-frame correction, built from the camera in the same session as the measurements.
+// A master dark and a master flat frame are averaged from many frames at one exposure time (light off / light on).
+// From them every pixel gets an offset (its dark level) and a gain (which brings its response to the mean of its color plane).
+// The coefficients are stored in fixed point, so frames are corrected with 16 bit integer math (SSE2 where available) at full frame rate.
+// They can be saved for use in production, and the DSNU and PRNU left after the correction are checked right away on fresh frames.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef FLATFIELD_H
+#define FLATFIELD_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience
+#endif
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+#include "AnalysisTools.h"
+#include "DarkBright.h"
+#include "FormatDispatch.h"
+#include "FrameTiming.h"
+#include "HighPass.h"
+#include "ThreadPool.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLATFIELD_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace FlatField
+{
+	// The gains are unsigned 2.14 fixed point numbers (16384 = 1.0).
+	const uint32_t c_gainFractionBits = 14;
+	const uint16_t c_unityGain = 1 << c_gainFractionBits;
+	// The correction multiplies signed 16 bit values, so a gain must stay below 2.0.
+	// Pixels which would need more (or which don't respond to light at all) are counted as defects.
+	const uint16_t c_maxGain = 32767;
+	// The per-pixel sums are 32 bit, which holds this many frames of 16 bit pixels.
+	const uint32_t c_maxFrames = 65536;
+
+	// Per-pixel sums of many frames of the same size and format (a master dark or master flat frame in the making).
+	class Accumulator
+	{
+	private:
+		std::vector<uint32_t> m_sums;
+		Pylon::EPixelType m_pixelType = Pylon::PixelType_Undefined;
+		uint32_t m_width = 0;
+		uint32_t m_height = 0;
+		uint32_t m_numFrames = 0;
+
+	public:
+		// Start over. The first frame added sets the size and format.
+		void Reset();
+
+		// Add an (unpacked) frame.
+		bool Add(Pylon::CPylonImage& image, std::string& errorMessage);
+
+		uint32_t GetNumFrames() const;
+		uint32_t GetWidth() const;
+		uint32_t GetHeight() const;
+		Pylon::EPixelType GetPixelType() const;
+		const std::vector<uint32_t>& GetSums() const;
+	};
+
+	// Add numPixels pixels of a frame to the sums (multi-threaded).
+	template <typename T>
+	void AccumulateT(const T* pImage, uint32_t* pSums, size_t numPixels);
+
+	// The per-pixel offset and gain coefficients of one frame geometry and format.
+	// corrected = (((raw - offset) * gain) >> c_gainFractionBits) + pedestal, clamped to the range of the format.
+	class Correction
+	{
+	private:
+		std::vector<uint16_t> m_offsets; // the dark level of each pixel
+		std::vector<uint16_t> m_gains; // 2.14 fixed point
+		Pylon::EPixelType m_pixelType = Pylon::PixelType_Undefined;
+		uint32_t m_width = 0;
+		uint32_t m_height = 0;
+		uint16_t m_pedestal = 0; // the mean dark level, added back so the noise of dark pixels isn't clipped at zero
+		uint64_t m_numDefects = 0;
+
+	public:
+		// For Bayer formats, each pixel is brought to the mean of its own color plane, so the color balance is kept.
+		bool Build(const Accumulator& dark, const Accumulator& flat, std::string& errorMessage);
+
+		bool IsValid() const;
+
+		// Correct a frame in place (multi-threaded). The frame must have the size and format the correction was built for.
+		bool Apply(Pylon::CPylonImage& image, std::string& errorMessage) const;
+
+		// Save the coefficients for use in production. Little endian binary:
+		// "FLATFLD1", uint32 width, height, pixel type, gain fraction bits, pedestal, then width*height uint16 offsets, then width*height uint16 gains.
+		bool Save(const std::string& fileName, std::string& errorMessage) const;
+		bool Load(const std::string& fileName, std::string& errorMessage);
+
+		uint32_t GetWidth() const;
+		uint32_t GetHeight() const;
+		Pylon::EPixelType GetPixelType() const;
+		uint16_t GetPedestal() const;
+		uint64_t GetNumDefects() const;
+		const std::vector<uint16_t>& GetOffsets() const;
+		const std::vector<uint16_t>& GetGains() const;
+	};
+
+	// Single threaded kernel: correct numPixels pixels. pIn and pOut may be the same.
+	template <typename T>
+	void ApplyT(const T* pIn, T* pOut, const uint16_t* pOffsets, const uint16_t* pGains, size_t numPixels, uint16_t pedestal, uint16_t maxValue);
+
+	// The spatial nonuniformity of a pair of frames, without the temporal noise (EMVA1288: variance of the mean frame - temporal variance / 2).
+	// For Bayer formats, the planes are measured separately and averaged (like the row and column FPN).
+	// highPassVariance is the same after a box-filter high-pass (without the low-frequency shading), for unpacked formats only.
+	struct Nonuniformity
+	{
+		double mean = 0;
+		double spatialVariance = 0;
+		double highPassVariance = 0;
+		bool hasHighPass = false;
+	};
+
+	Nonuniformity FindNonuniformity(const FormatDispatch::Kernels& kernels, Pylon::CPylonImage& image1, Pylon::CPylonImage& image2);
+
+	// What Calibrate() found.
+	struct Report
+	{
+		uint32_t numFrames = 0; // averaged into each master frame
+		double dsnuBefore = 0; // DN, from a fresh dark pair
+		double dsnuAfter = 0;
+		double prnuBefore = 0; // percent, from a fresh bright pair and the dark pair
+		double prnuAfter = 0;
+		// the same after a 5x5 box-filter high-pass (EMVA1288), and of the master frames themselves (0 for packed formats)
+		double dsnuHighPassBefore = 0;
+		double dsnuHighPassAfter = 0;
+		double prnuHighPassBefore = 0;
+		double prnuHighPassAfter = 0;
+		double dsnuHighPassMaster = 0;
+		double prnuHighPassMaster = 0;
+		uint64_t numDefects = 0;
+		double megabytesPerSecond = 0; // speed of Correction::Apply()
+	};
+
+	// Build the correction at the camera's current exposure time: numFrames with the light on, numFrames with the light off,
+	// then one more pair of each to check the correction. The light must be on, and is on again when this returns.
+	bool Calibrate(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, uint32_t numFrames, uint32_t lightSettleTimeMs, const FormatDispatch::Kernels& kernels,
+		FrameTiming::Analyzer* pFrameTiming, Accumulator& masterDark, Accumulator& masterFlat, Correction& correction, Report& report, std::string& errorMessage);
+
+	// Grab numPairs pairs into an accumulator.
+	bool GrabInto(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, uint32_t numPairs, FrameTiming::Analyzer* pFrameTiming, Accumulator& accumulator, std::string& errorMessage);
+}
+
+// *********************************************************************************************************
+inline void FlatField::Accumulator::Reset()
+{
+	m_sums.clear();
+	m_pixelType = Pylon::PixelType_Undefined;
+	m_width = 0;
+	m_height = 0;
+	m_numFrames = 0;
+}
+
+inline bool FlatField::Accumulator::Add(Pylon::CPylonImage& image, std::string& errorMessage)
+{
+	if (Pylon::IsPacked(image.GetPixelType()))
+	{
+		errorMessage = "ERROR: The flat-field correction doesn't support packed pixel formats.";
+		return false;
+	}
+
+	if (m_numFrames == 0)
+	{
+		m_pixelType = image.GetPixelType();
+		m_width = image.GetWidth();
+		m_height = image.GetHeight();
+		m_sums.assign((size_t)m_width * m_height, 0);
+	}
+	else if (image.GetPixelType() != m_pixelType || image.GetWidth() != m_width || image.GetHeight() != m_height)
+	{
+		errorMessage = "ERROR: All frames of a master frame must have the same size and pixel format.";
+		return false;
+	}
+
+	if (m_numFrames >= c_maxFrames)
+	{
+		errorMessage = "ERROR: Too many frames for one master frame.";
+		return false;
+	}
+
+	if (Pylon::BitPerPixel(m_pixelType) > 8)
+		AccumulateT<uint16_t>((const uint16_t*)image.GetBuffer(), m_sums.data(), m_sums.size());
+	else
+		AccumulateT<uint8_t>((const uint8_t*)image.GetBuffer(), m_sums.data(), m_sums.size());
+	m_numFrames++;
+	return true;
+}
+
+inline uint32_t FlatField::Accumulator::GetNumFrames() const
+{
+	return m_numFrames;
+}
+
+inline uint32_t FlatField::Accumulator::GetWidth() const
+{
+	return m_width;
+}
+
+inline uint32_t FlatField::Accumulator::GetHeight() const
+{
+	return m_height;
+}
+
+inline Pylon::EPixelType FlatField::Accumulator::GetPixelType() const
+{
+	return m_pixelType;
+}
+
+inline const std::vector<uint32_t>& FlatField::Accumulator::GetSums() const
+{
+	return m_sums;
+}
+
+template <typename T>
+inline void FlatField::AccumulateT(const T* pImage, uint32_t* pSums, size_t numPixels)
+{
+	size_t pixelsPerChunk = AnalysisTools::c_reductionChunkSize / sizeof(T);
+	size_t numChunks = (numPixels + pixelsPerChunk - 1) / pixelsPerChunk;
+
+	auto task = [&](size_t chunk)
+	{
+		size_t first = chunk * pixelsPerChunk;
+		size_t last = (first + pixelsPerChunk < numPixels) ? first + pixelsPerChunk : numPixels;
+		for (size_t i = first; i < last; i++)
+			pSums[i] += pImage[i];
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+}
+
+inline bool FlatField::Correction::Build(const Accumulator& dark, const Accumulator& flat, std::string& errorMessage)
+{
+	m_offsets.clear();
+	m_gains.clear();
+	m_numDefects = 0;
+	m_width = 0;
+	m_height = 0;
+
+	if (dark.GetNumFrames() == 0 || flat.GetNumFrames() == 0)
+	{
+		errorMessage = "ERROR: The master dark and master flat frames need at least one frame each.";
+		return false;
+	}
+
+	if (dark.GetWidth() != flat.GetWidth() || dark.GetHeight() != flat.GetHeight() || dark.GetPixelType() != flat.GetPixelType())
+	{
+		errorMessage = "ERROR: The master dark and master flat frames have different sizes or pixel formats.";
+		return false;
+	}
+
+	const uint32_t width = flat.GetWidth();
+	const uint32_t height = flat.GetHeight();
+	const size_t numPixels = (size_t)width * height;
+	const uint32_t maxValue = (1u << Pylon::BitDepth(flat.GetPixelType())) - 1;
+	const bool isBayer = Pylon::IsBayer(flat.GetPixelType());
+	const std::vector<uint32_t>& darkSums = dark.GetSums();
+	const std::vector<uint32_t>& flatSums = flat.GetSums();
+	const double darkScale = 1.0 / dark.GetNumFrames();
+	const double flatScale = 1.0 / flat.GetNumFrames();
+
+	// The offsets are the rounded dark means, and the gains are found for what is left after subtracting them.
+	// The targets are the mean signals of each position in the 2x2 Bayer cell (all four are the same for mono).
+	m_offsets.resize(numPixels);
+	double darkTotal = 0;
+	double signalSums[4] = { 0, 0, 0, 0 };
+	uint64_t signalCounts[4] = { 0, 0, 0, 0 };
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			size_t i = (size_t)y * width + x;
+			double darkMean = darkSums[i] * darkScale;
+			uint32_t offset = (uint32_t)(darkMean + 0.5);
+			m_offsets[i] = (uint16_t)((offset < maxValue) ? offset : maxValue);
+			darkTotal += darkMean;
+
+			uint32_t position = isBayer ? ((y & 1) * 2 + (x & 1)) : 0;
+			signalSums[position] += flatSums[i] * flatScale - m_offsets[i];
+			signalCounts[position]++;
+		}
+	}
+
+	double targets[4] = { 0, 0, 0, 0 };
+	for (uint32_t position = 0; position < 4; position++)
+	{
+		if (signalCounts[position] == 0)
+			continue;
+
+		targets[position] = signalSums[position] / signalCounts[position];
+		if (targets[position] < 1)
+		{
+			m_offsets.clear();
+			errorMessage = "ERROR: The master flat frame is not brighter than the master dark frame.";
+			return false;
+		}
+	}
+
+	m_gains.resize(numPixels);
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			size_t i = (size_t)y * width + x;
+			uint32_t position = isBayer ? ((y & 1) * 2 + (x & 1)) : 0;
+			double signal = flatSums[i] * flatScale - m_offsets[i];
+			double gain = (signal > 0.5) ? targets[position] / signal * c_unityGain : 0;
+			if (gain <= 0)
+			{
+				// a dead pixel: leave it as it is
+				m_gains[i] = c_unityGain;
+				m_numDefects++;
+			}
+			else if (gain > c_maxGain)
+			{
+				m_gains[i] = c_maxGain;
+				m_numDefects++;
+			}
+			else
+			{
+				m_gains[i] = (uint16_t)(gain + 0.5);
+			}
+		}
+	}
+
+	uint32_t pedestal = (uint32_t)(darkTotal / numPixels + 0.5);
+	m_pedestal = (uint16_t)((pedestal < maxValue) ? pedestal : maxValue);
+	m_pixelType = flat.GetPixelType();
+	m_width = width;
+	m_height = height;
+	return true;
+}
+
+inline bool FlatField::Correction::IsValid() const
+{
+	return m_width > 0 && m_height > 0 && m_offsets.size() == (size_t)m_width * m_height;
+}
+
+inline bool FlatField::Correction::Apply(Pylon::CPylonImage& image, std::string& errorMessage) const
+{
+	if (IsValid() == false)
+	{
+		errorMessage = "ERROR: The flat-field correction has not been built.";
+		return false;
+	}
+
+	if (image.GetWidth() != m_width || image.GetHeight() != m_height || image.GetPixelType() != m_pixelType)
+	{
+		errorMessage = "ERROR: The frame doesn't match the flat-field correction.";
+		return false;
+	}
+
+	const size_t numPixels = m_offsets.size();
+	const uint16_t maxValue = (uint16_t)((1u << Pylon::BitDepth(m_pixelType)) - 1);
+	const bool is16Bit = (Pylon::BitPerPixel(m_pixelType) > 8);
+	const size_t pixelsPerChunk = AnalysisTools::c_reductionChunkSize / (is16Bit ? sizeof(uint16_t) : sizeof(uint8_t));
+	const size_t numChunks = (numPixels + pixelsPerChunk - 1) / pixelsPerChunk;
+	void* pBuffer = image.GetBuffer();
+
+	auto task = [&](size_t chunk)
+	{
+		size_t first = chunk * pixelsPerChunk;
+		size_t count = (first + pixelsPerChunk < numPixels) ? pixelsPerChunk : numPixels - first;
+		if (is16Bit)
+		{
+			uint16_t* pImage = (uint16_t*)pBuffer + first;
+			ApplyT<uint16_t>(pImage, pImage, &m_offsets[first], &m_gains[first], count, m_pedestal, maxValue);
+		}
+		else
+		{
+			uint8_t* pImage = (uint8_t*)pBuffer + first;
+			ApplyT<uint8_t>(pImage, pImage, &m_offsets[first], &m_gains[first], count, m_pedestal, maxValue);
+		}
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+	return true;
+}
+
+inline bool FlatField::Correction::Save(const std::string& fileName, std::string& errorMessage) const
+{
+	if (IsValid() == false)
+	{
+		errorMessage = "ERROR: The flat-field correction has not been built.";
+		return false;
+	}
+
+	std::FILE* const file = std::fopen(fileName.c_str(), "wb");
+	if (file == NULL)
+	{
+		errorMessage = "ERROR: Could not open " + fileName + " for writing.";
+		return false;
+	}
+
+	uint32_t header[5] = { m_width, m_height, (uint32_t)m_pixelType, c_gainFractionBits, m_pedestal };
+	bool written = std::fwrite("FLATFLD1", 1, 8, file) == 8
+		&& std::fwrite(header, sizeof(uint32_t), 5, file) == 5
+		&& std::fwrite(m_offsets.data(), sizeof(uint16_t), m_offsets.size(), file) == m_offsets.size()
+		&& std::fwrite(m_gains.data(), sizeof(uint16_t), m_gains.size(), file) == m_gains.size();
+	written = (std::fclose(file) == 0) && written;
+
+	if (written == false)
+	{
+		errorMessage = "ERROR: Could not write " + fileName + ".";
+		return false;
+	}
+	return true;
+}
+
+inline bool FlatField::Correction::Load(const std::string& fileName, std::string& errorMessage)
+{
+	m_offsets.clear();
+	m_gains.clear();
+	m_numDefects = 0;
+	m_width = 0;
+	m_height = 0;
+
+	std::FILE* const file = std::fopen(fileName.c_str(), "rb");
+	if (file == NULL)
+	{
+		errorMessage = "ERROR: Could not open " + fileName + ".";
+		return false;
+	}
+
+	char magic[8] = { 0 };
+	uint32_t header[5] = { 0, 0, 0, 0, 0 };
+	bool valid = std::fread(magic, 1, 8, file) == 8 && std::memcmp(magic, "FLATFLD1", 8) == 0
+		&& std::fread(header, sizeof(uint32_t), 5, file) == 5 && header[3] == c_gainFractionBits
+		&& header[0] > 0 && header[1] > 0 && header[0] <= 65536 && header[1] <= 65536;
+	if (valid)
+	{
+		size_t numPixels = (size_t)header[0] * header[1];
+		m_offsets.resize(numPixels);
+		m_gains.resize(numPixels);
+		valid = std::fread(m_offsets.data(), sizeof(uint16_t), numPixels, file) == numPixels
+			&& std::fread(m_gains.data(), sizeof(uint16_t), numPixels, file) == numPixels;
+	}
+	std::fclose(file);
+
+	if (valid == false)
+	{
+		m_offsets.clear();
+		m_gains.clear();
+		errorMessage = "ERROR: " + fileName + " is not a flat-field correction file.";
+		return false;
+	}
+
+	// a saved correction may come from a different tool, so the gains are checked against what the kernel can handle
+	for (size_t i = 0; i < m_gains.size(); i++)
+	{
+		if (m_gains[i] > c_maxGain)
+		{
+			m_gains[i] = c_maxGain;
+			m_numDefects++;
+		}
+	}
+
+	m_width = header[0];
+	m_height = header[1];
+	m_pixelType = (Pylon::EPixelType)header[2];
+	m_pedestal = (uint16_t)header[4];
+	return true;
+}
+
+inline uint32_t FlatField::Correction::GetWidth() const
+{
+	return m_width;
+}
+
+inline uint32_t FlatField::Correction::GetHeight() const
+{
+	return m_height;
+}
+
+inline Pylon::EPixelType FlatField::Correction::GetPixelType() const
+{
+	return m_pixelType;
+}
+
+inline uint16_t FlatField::Correction::GetPedestal() const
+{
+	return m_pedestal;
+}
+
+inline uint64_t FlatField::Correction::GetNumDefects() const
+{
+	return m_numDefects;
+}
+
+inline const std::vector<uint16_t>& FlatField::Correction::GetOffsets() const
+{
+	return m_offsets;
+}
+
+inline const std::vector<uint16_t>& FlatField::Correction::GetGains() const
+{
+	return m_gains;
+}
+
+template <typename T>
+inline void FlatField::ApplyT(const T* pIn, T* pOut, const uint16_t* pOffsets, const uint16_t* pGains, size_t numPixels, uint16_t pedestal, uint16_t maxValue)
+{
+	const int32_t rounding = 1 << (c_gainFractionBits - 1);
+	size_t i = 0;
+
+#ifdef FLATFIELD_SSE2
+	// 8 pixels at a time: (raw - offset) and the gain are interleaved with 1 and the rounding term, so one madd gives (raw - offset) * gain + rounding.
+	// The difference must fit a signed 16 bit lane, so 16 bit formats use the plain loop below.
+	if (sizeof(T) == 1 || maxValue <= 32767)
+	{
+		const __m128i ones = _mm_set1_epi16(1);
+		const __m128i roundings = _mm_set1_epi16((int16_t)rounding);
+		const __m128i pedestals = _mm_set1_epi32(pedestal);
+		const __m128i zeros = _mm_setzero_si128();
+		const __m128i maxValues = _mm_set1_epi16((int16_t)((maxValue <= 32767) ? maxValue : 32767));
+
+		auto correct8 = [&](__m128i raw, size_t at) -> __m128i
+		{
+			__m128i offsets = _mm_loadu_si128((const __m128i*)(pOffsets + at));
+			__m128i gains = _mm_loadu_si128((const __m128i*)(pGains + at));
+			__m128i diff = _mm_sub_epi16(raw, offsets);
+			__m128i low = _mm_madd_epi16(_mm_unpacklo_epi16(diff, ones), _mm_unpacklo_epi16(gains, roundings));
+			__m128i high = _mm_madd_epi16(_mm_unpackhi_epi16(diff, ones), _mm_unpackhi_epi16(gains, roundings));
+			low = _mm_add_epi32(_mm_srai_epi32(low, c_gainFractionBits), pedestals);
+			high = _mm_add_epi32(_mm_srai_epi32(high, c_gainFractionBits), pedestals);
+			__m128i result = _mm_packs_epi32(low, high);
+			return _mm_min_epi16(_mm_max_epi16(result, zeros), maxValues);
+		};
+
+		if (sizeof(T) == 1)
+		{
+			for (; i + 16 <= numPixels; i += 16)
+			{
+				__m128i raw = _mm_loadu_si128((const __m128i*)(pIn + i));
+				__m128i low = correct8(_mm_unpacklo_epi8(raw, zeros), i);
+				__m128i high = correct8(_mm_unpackhi_epi8(raw, zeros), i + 8);
+				_mm_storeu_si128((__m128i*)(pOut + i), _mm_packus_epi16(low, high));
+			}
+		}
+		else
+		{
+			for (; i + 8 <= numPixels; i += 8)
+			{
+				__m128i raw = _mm_loadu_si128((const __m128i*)(pIn + i));
+				_mm_storeu_si128((__m128i*)(pOut + i), correct8(raw, i));
+			}
+		}
+	}
+#endif
+
+	// (the products of 16 bit values and gains below 2.0 fit in 32 bits)
+	for (; i < numPixels; i++)
+	{
+		int32_t value = ((((int32_t)pIn[i] - pOffsets[i]) * pGains[i] + rounding) >> c_gainFractionBits) + pedestal;
+		value = (value > 0) ? value : 0;
+		pOut[i] = (T)((value < maxValue) ? value : maxValue);
+	}
+}
+
+inline FlatField::Nonuniformity FlatField::FindNonuniformity(const FormatDispatch::Kernels& kernels, Pylon::CPylonImage& image1, Pylon::CPylonImage& image2)
+{
+	// var(A) + var(B) - var(A - B) = 2 * (variance of the mean frame - temporal variance / 2)
+	auto findVariance = [](uint64_t count, double sum, double sumOfSquares) -> double
+	{
+		return (count > 1) ? (sumOfSquares - sum * sum / count) / (count - 1) : 0;
+	};
+	auto findSpatialVariance = [&](const AnalysisTools::Stats& stats1, const AnalysisTools::Stats& stats2, const AnalysisTools::DiffStats& diff) -> double
+	{
+		double variance1 = findVariance(stats1.count, (double)stats1.sum, (double)stats1.sumOfSquares);
+		double variance2 = findVariance(stats2.count, (double)stats2.sum, (double)stats2.sumOfSquares);
+		double varianceDiff = findVariance(diff.count, (double)diff.sum, (double)diff.sumOfSquares);
+		double spatialVariance = (variance1 + variance2 - varianceDiff) / 2;
+		return (spatialVariance > 0) ? spatialVariance : 0;
+	};
+
+	Nonuniformity result;
+	if (kernels.isBayer)
+	{
+		AnalysisTools::CfaPairStats stats = kernels.findCfaPairStats(image1, image2);
+		for (uint32_t plane = 0; plane < AnalysisTools::c_numCfaPlanes; plane++)
+		{
+			result.mean += AnalysisTools::SummarizePlane(stats, plane).mean / AnalysisTools::c_numCfaPlanes;
+			result.spatialVariance += findSpatialVariance(stats.image1[plane], stats.image2[plane], stats.diff[plane]) / AnalysisTools::c_numCfaPlanes;
+		}
+	}
+	else
+	{
+		AnalysisTools::Stats stats1 = kernels.findStats(image1);
+		AnalysisTools::Stats stats2 = kernels.findStats(image2);
+		if (stats1.count > 0 && stats2.count > 0)
+			result.mean = ((double)stats1.sum / stats1.count + (double)stats2.sum / stats2.count) / 2;
+		result.spatialVariance = findSpatialVariance(stats1, stats2, kernels.findDiffStats(image1, image2));
+	}
+
+	if (kernels.isPacked == false)
+	{
+		std::string errorMessage = "";
+		result.hasHighPass = HighPass::FindPairVariance(kernels, image1, image2, HighPass::Settings(), result.highPassVariance, errorMessage);
+	}
+	return result;
+}
+
+inline bool FlatField::GrabInto(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, uint32_t numPairs, FrameTiming::Analyzer* pFrameTiming, Accumulator& accumulator, std::string& errorMessage)
+{
+	Pylon::CBaslerUniversalGrabResultPtr ptrGrabResult1;
+	Pylon::CBaslerUniversalGrabResultPtr ptrGrabResult2;
+	Pylon::CPylonImage image1;
+	Pylon::CPylonImage image2;
+
+	accumulator.Reset();
+	for (uint32_t p = 0; p < numPairs; p++)
+	{
+		DarkBright::GrabPair(camera, triggersPerPair, ptrGrabResult1, ptrGrabResult2, pFrameTiming);
+		if (ptrGrabResult1->GrabSucceeded() == false || ptrGrabResult2->GrabSucceeded() == false)
+		{
+			errorMessage = "ERROR: A grab for the flat-field correction failed: ";
+			errorMessage.append((ptrGrabResult1->GrabSucceeded() ? ptrGrabResult2 : ptrGrabResult1)->GetErrorDescription().c_str());
+			return false;
+		}
+
+		image1.AttachGrabResultBuffer(ptrGrabResult1);
+		image2.AttachGrabResultBuffer(ptrGrabResult2);
+		if (accumulator.Add(image1, errorMessage) == false || accumulator.Add(image2, errorMessage) == false)
+			return false;
+	}
+	return true;
+}
+
+inline bool FlatField::Calibrate(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, uint32_t numFrames, uint32_t lightSettleTimeMs, const FormatDispatch::Kernels& kernels,
+	FrameTiming::Analyzer* pFrameTiming, Accumulator& masterDark, Accumulator& masterFlat, Correction& correction, Report& report, std::string& errorMessage)
+{
+	report = Report();
+	if (DarkBright::HasLight(camera) == false)
+	{
+		errorMessage = "ERROR: The flat-field correction needs a Basler Camera Light for the dark frames.";
+		return false;
+	}
+
+	uint32_t numPairs = (numFrames > 2) ? (numFrames + 1) / 2 : 1;
+	Pylon::CBaslerUniversalGrabResultPtr ptrGrabResult1;
+	Pylon::CBaslerUniversalGrabResultPtr ptrGrabResult2;
+	Pylon::CPylonImage image1;
+	Pylon::CPylonImage image2;
+	Nonuniformity darkBefore, darkAfter, brightBefore, brightAfter;
+	double applySeconds = 0;
+	double applyBytes = 0;
+
+	// measure a fresh pair before and after correcting it
+	auto check = [&](Nonuniformity& before, Nonuniformity& after) -> bool
+	{
+		DarkBright::GrabPair(camera, triggersPerPair, ptrGrabResult1, ptrGrabResult2, pFrameTiming);
+		if (ptrGrabResult1->GrabSucceeded() == false || ptrGrabResult2->GrabSucceeded() == false)
+		{
+			errorMessage = "ERROR: A grab for checking the flat-field correction failed.";
+			return false;
+		}
+
+		image1.AttachGrabResultBuffer(ptrGrabResult1);
+		image2.AttachGrabResultBuffer(ptrGrabResult2);
+		before = FindNonuniformity(kernels, image1, image2);
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (correction.Apply(image1, errorMessage) == false || correction.Apply(image2, errorMessage) == false)
+			return false;
+		applySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		applyBytes += (double)image1.GetImageSize() + image2.GetImageSize();
+
+		after = FindNonuniformity(kernels, image1, image2);
+		return true;
+	};
+
+	bool succeeded = false;
+	bool lightOff = false;
+	try
+	{
+		// master flat with the light on, master dark with the light off, then the dark check pair while the light is still off
+		succeeded = GrabInto(camera, triggersPerPair, numPairs, pFrameTiming, masterFlat, errorMessage)
+			&& (lightOff = DarkBright::SetLight(camera, false, lightSettleTimeMs, errorMessage))
+			&& GrabInto(camera, triggersPerPair, numPairs, pFrameTiming, masterDark, errorMessage)
+			&& correction.Build(masterDark, masterFlat, errorMessage)
+			&& check(darkBefore, darkAfter);
+
+		if (lightOff)
+		{
+			std::string lightError = "";
+			lightOff = (DarkBright::SetLight(camera, true, lightSettleTimeMs, lightError) == false);
+			if (lightOff && succeeded)
+			{
+				errorMessage = lightError;
+				succeeded = false;
+			}
+		}
+
+		succeeded = succeeded && check(brightBefore, brightAfter);
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in Calibrate(): ";
+		errorMessage.append(e.GetDescription());
+		succeeded = false;
+	}
+
+	// don't leave the light off for the rest of the sweep
+	if (lightOff)
+	{
+		std::string lightError = "";
+		DarkBright::SetLight(camera, true, lightSettleTimeMs, lightError);
+	}
+
+	if (succeeded == false)
+		return false;
+
+	// EMVA1288: DSNU is the dark spatial noise in DN, PRNU the bright spatial noise (without the dark part) relative to the signal
+	auto findPrnu = [](double darkVariance, double brightVariance, const Nonuniformity& dark, const Nonuniformity& bright) -> double
+	{
+		double variance = brightVariance - darkVariance;
+		double signal = bright.mean - dark.mean;
+		return (signal > 0) ? 100.0 * std::sqrt((variance > 0) ? variance : 0) / signal : 0;
+	};
+
+	report.numFrames = 2 * numPairs;
+	report.dsnuBefore = std::sqrt(darkBefore.spatialVariance);
+	report.dsnuAfter = std::sqrt(darkAfter.spatialVariance);
+	report.prnuBefore = findPrnu(darkBefore.spatialVariance, brightBefore.spatialVariance, darkBefore, brightBefore);
+	report.prnuAfter = findPrnu(darkAfter.spatialVariance, brightAfter.spatialVariance, darkAfter, brightAfter);
+	if (darkBefore.hasHighPass && brightBefore.hasHighPass)
+	{
+		report.dsnuHighPassBefore = std::sqrt(darkBefore.highPassVariance);
+		report.dsnuHighPassAfter = std::sqrt(darkAfter.highPassVariance);
+		report.prnuHighPassBefore = findPrnu(darkBefore.highPassVariance, brightBefore.highPassVariance, darkBefore, brightBefore);
+		report.prnuHighPassAfter = findPrnu(darkAfter.highPassVariance, brightAfter.highPassVariance, darkAfter, brightAfter);
+
+		// the master frames hold the sums of the same frames the correction was built from (with the same exposure as the check pairs)
+		HighPass::Settings settings;
+		double darkMaster = HighPass::FindAveragedVariance(masterDark.GetSums().data(), masterDark.GetNumFrames(), masterDark.GetWidth(), masterDark.GetHeight(), kernels, settings);
+		double flatMaster = HighPass::FindAveragedVariance(masterFlat.GetSums().data(), masterFlat.GetNumFrames(), masterFlat.GetWidth(), masterFlat.GetHeight(), kernels, settings);
+		report.dsnuHighPassMaster = std::sqrt(darkMaster);
+		report.prnuHighPassMaster = findPrnu(darkMaster, flatMaster, darkBefore, brightBefore);
+	}
+	report.numDefects = correction.GetNumDefects();
+	report.megabytesPerSecond = (applySeconds > 0) ? applyBytes / applySeconds / 1e6 : 0;
+	return true;
+}
+// *********************************************************************************************************
+#endif
@@ -0,0 +1,196 @@
+// FormatDispatch.h
+// A table of the analysis kernels compiled for each supported pixel format.
+// Look up the kernels once per stream, then call them for every frame without any further format checks.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef FORMATDISPATCH_H
+#define FORMATDISPATCH_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+#include "PixelFormatTraits.h"
+#include "AnalysisTools.h"
+#include "PackedPixels.h"
+#include "BayerPreview.h"
+
+namespace FormatDispatch
+{
+	typedef AnalysisTools::Stats(*FindStatsFunction)(Pylon::CPylonImage& image);
+	typedef bool(*FindProfilesFunction)(Pylon::CPylonImage& image, AnalysisTools::Profiles& profiles, std::string& errorMessage);
+	typedef AnalysisTools::DiffStats(*FindDiffStatsFunction)(Pylon::CPylonImage& imageA, Pylon::CPylonImage& imageB);
+	typedef AnalysisTools::CfaPairStats(*FindCfaPairStatsFunction)(Pylon::CPylonImage& image1, Pylon::CPylonImage& image2);
+	typedef void(*FindHistogramsFunction)(Pylon::CPylonImage& image, AnalysisTools::Histograms& histograms);
+	typedef bool(*MakePreviewFunction)(Pylon::CPylonImage& image, uint32_t saturationLevel, Pylon::CPylonImage& preview, std::string& errorMessage);
+
+	// The kernels for one pixel format.
+	struct Kernels
+	{
+		Pylon::EPixelType pixelType;
+		bool isBayer;
+		bool isPacked; // the kernels unpack the pixels on the fly, but anything reading the buffer directly must not be used
+		uint32_t bitDepth;
+		uint32_t planePositions[4]; // where each plane (R, Gr, Gb, B, see AnalysisTools::ECfaPlane) sits in the 2x2 cell, all 0 for mono
+		FindStatsFunction findStats;
+		FindProfilesFunction findProfiles;
+		FindDiffStatsFunction findDiffStats;
+		FindCfaPairStatsFunction findCfaPairStats; // nullptr for mono formats
+		FindHistogramsFunction findHistograms; // one histogram per channel (4 for Bayer formats)
+		MakePreviewFunction makePreview; // RGB8 superpixel preview (see BayerPreview.h), nullptr for mono formats
+	};
+
+	// Build the kernels for one format from its traits.
+	template <typename Traits>
+	Kernels MakeKernels();
+
+	// Get the kernels for a pixel format. Returns nullptr if the format is not supported.
+	const Kernels* GetKernels(Pylon::EPixelType pixelType);
+
+	// Mono formats don't have the Bayer plane kernels.
+	template <typename Traits, bool isBayer>
+	struct BayerKernels
+	{
+		static FindCfaPairStatsFunction GetFindCfaPairStats() { return &AnalysisTools::FindCfaPairStatsForFormat<Traits>; }
+		static MakePreviewFunction GetMakePreview() { return &BayerPreview::MakePreviewT<Traits>; }
+	};
+
+	template <typename Traits>
+	struct BayerKernels<Traits, false>
+	{
+		static FindCfaPairStatsFunction GetFindCfaPairStats() { return nullptr; }
+		static MakePreviewFunction GetMakePreview() { return nullptr; }
+	};
+
+	// Packed formats have their own kernels (see PackedPixels.h).
+	template <typename Traits, bool isBayer>
+	struct PackedKernels
+	{
+		static FindCfaPairStatsFunction GetFindCfaPairStats() { return &PackedPixels::FindCfaPairStatsT<Traits>; }
+	};
+
+	template <typename Traits>
+	struct PackedKernels<Traits, false>
+	{
+		static FindCfaPairStatsFunction GetFindCfaPairStats() { return nullptr; }
+	};
+
+	// Fill in the kernels which read the image buffer.
+	template <typename Traits, bool isPacked>
+	struct BufferKernels
+	{
+		static void Fill(Kernels& kernels);
+	};
+
+	template <typename Traits>
+	struct BufferKernels<Traits, true>
+	{
+		static void Fill(Kernels& kernels);
+	};
+}
+
+// *********************************************************************************************************
+template <typename Traits>
+inline FormatDispatch::Kernels FormatDispatch::MakeKernels()
+{
+	Kernels kernels;
+	kernels.pixelType = Traits::pixelType;
+	kernels.isBayer = Traits::isBayer;
+	kernels.isPacked = Traits::isPacked;
+	kernels.bitDepth = Traits::bitDepth;
+	kernels.planePositions[AnalysisTools::Plane_Red] = Traits::red;
+	kernels.planePositions[AnalysisTools::Plane_GreenRed] = Traits::green1;
+	kernels.planePositions[AnalysisTools::Plane_GreenBlue] = Traits::green2;
+	kernels.planePositions[AnalysisTools::Plane_Blue] = Traits::blue;
+	// (the preview unpacks packed formats itself)
+	kernels.makePreview = BayerKernels<Traits, Traits::isBayer>::GetMakePreview();
+	BufferKernels<Traits, Traits::isPacked>::Fill(kernels);
+	return kernels;
+}
+
+template <typename Traits, bool isPacked>
+inline void FormatDispatch::BufferKernels<Traits, isPacked>::Fill(Kernels& kernels)
+{
+	kernels.findStats = &AnalysisTools::FindStatsForFormat<Traits>;
+	kernels.findProfiles = &AnalysisTools::FindProfilesForFormat<Traits>;
+	kernels.findDiffStats = &AnalysisTools::FindDiffStatsForFormat<Traits>;
+	kernels.findCfaPairStats = BayerKernels<Traits, Traits::isBayer>::GetFindCfaPairStats();
+	kernels.findHistograms = &AnalysisTools::FindHistogramsForFormat<Traits>;
+}
+
+template <typename Traits>
+inline void FormatDispatch::BufferKernels<Traits, true>::Fill(Kernels& kernels)
+{
+	kernels.findStats = &PackedPixels::FindStatsT<Traits>;
+	kernels.findProfiles = &PackedPixels::FindProfilesT<Traits>;
+	kernels.findDiffStats = &PackedPixels::FindDiffStatsT<Traits>;
+	kernels.findCfaPairStats = PackedKernels<Traits, Traits::isBayer>::GetFindCfaPairStats();
+	kernels.findHistograms = &PackedPixels::FindHistogramsT<Traits>;
+}
+
+inline const FormatDispatch::Kernels* FormatDispatch::GetKernels(Pylon::EPixelType pixelType)
+{
+	using namespace PixelFormatTraits;
+
+	// built once, the first time it is needed
+	static const std::map<Pylon::EPixelType, Kernels> table = []()
+	{
+		std::map<Pylon::EPixelType, Kernels> kernels;
+		kernels[Pylon::PixelType_Mono8] = MakeKernels<Traits<Pylon::PixelType_Mono8>>();
+		kernels[Pylon::PixelType_Mono10] = MakeKernels<Traits<Pylon::PixelType_Mono10>>();
+		kernels[Pylon::PixelType_Mono12] = MakeKernels<Traits<Pylon::PixelType_Mono12>>();
+		kernels[Pylon::PixelType_Mono16] = MakeKernels<Traits<Pylon::PixelType_Mono16>>();
+		kernels[Pylon::PixelType_BayerRG8] = MakeKernels<Traits<Pylon::PixelType_BayerRG8>>();
+		kernels[Pylon::PixelType_BayerGR8] = MakeKernels<Traits<Pylon::PixelType_BayerGR8>>();
+		kernels[Pylon::PixelType_BayerGB8] = MakeKernels<Traits<Pylon::PixelType_BayerGB8>>();
+		kernels[Pylon::PixelType_BayerBG8] = MakeKernels<Traits<Pylon::PixelType_BayerBG8>>();
+		kernels[Pylon::PixelType_BayerRG10] = MakeKernels<Traits<Pylon::PixelType_BayerRG10>>();
+		kernels[Pylon::PixelType_BayerGR10] = MakeKernels<Traits<Pylon::PixelType_BayerGR10>>();
+		kernels[Pylon::PixelType_BayerGB10] = MakeKernels<Traits<Pylon::PixelType_BayerGB10>>();
+		kernels[Pylon::PixelType_BayerBG10] = MakeKernels<Traits<Pylon::PixelType_BayerBG10>>();
+		kernels[Pylon::PixelType_BayerRG12] = MakeKernels<Traits<Pylon::PixelType_BayerRG12>>();
+		kernels[Pylon::PixelType_BayerGR12] = MakeKernels<Traits<Pylon::PixelType_BayerGR12>>();
+		kernels[Pylon::PixelType_BayerGB12] = MakeKernels<Traits<Pylon::PixelType_BayerGB12>>();
+		kernels[Pylon::PixelType_BayerBG12] = MakeKernels<Traits<Pylon::PixelType_BayerBG12>>();
+		kernels[Pylon::PixelType_BayerRG16] = MakeKernels<Traits<Pylon::PixelType_BayerRG16>>();
+		kernels[Pylon::PixelType_BayerGR16] = MakeKernels<Traits<Pylon::PixelType_BayerGR16>>();
+		kernels[Pylon::PixelType_BayerGB16] = MakeKernels<Traits<Pylon::PixelType_BayerGB16>>();
+		kernels[Pylon::PixelType_BayerBG16] = MakeKernels<Traits<Pylon::PixelType_BayerBG16>>();
+		kernels[Pylon::PixelType_Mono10p] = MakeKernels<Traits<Pylon::PixelType_Mono10p>>();
+		kernels[Pylon::PixelType_Mono12p] = MakeKernels<Traits<Pylon::PixelType_Mono12p>>();
+		kernels[Pylon::PixelType_BayerRG10p] = MakeKernels<Traits<Pylon::PixelType_BayerRG10p>>();
+		kernels[Pylon::PixelType_BayerGR10p] = MakeKernels<Traits<Pylon::PixelType_BayerGR10p>>();
+		kernels[Pylon::PixelType_BayerGB10p] = MakeKernels<Traits<Pylon::PixelType_BayerGB10p>>();
+		kernels[Pylon::PixelType_BayerBG10p] = MakeKernels<Traits<Pylon::PixelType_BayerBG10p>>();
+		kernels[Pylon::PixelType_BayerRG12p] = MakeKernels<Traits<Pylon::PixelType_BayerRG12p>>();
+		kernels[Pylon::PixelType_BayerGR12p] = MakeKernels<Traits<Pylon::PixelType_BayerGR12p>>();
+		kernels[Pylon::PixelType_BayerGB12p] = MakeKernels<Traits<Pylon::PixelType_BayerGB12p>>();
+		kernels[Pylon::PixelType_BayerBG12p] = MakeKernels<Traits<Pylon::PixelType_BayerBG12p>>();
+		return kernels;
+	}();
+
+	std::map<Pylon::EPixelType, Kernels>::const_iterator it = table.find(pixelType);
+	if (it == table.end())
+		return nullptr;
+
+	return &it->second;
+}
+// *********************************************************************************************************
+#endif
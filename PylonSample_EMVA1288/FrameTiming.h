@@ -0,0 +1,417 @@
+// FrameTiming.h
+// Timing analytics of the grabbed frames: trigger-to-frame latency, inter-frame interval, missing and out-of-order frames,
+// and a check that the two frames of a measurement really are one burst.
+// Uses the host clock at trigger and at retrieval, the camera's timestamps, the stream block IDs and the frame ID chunk.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef FRAMETIMING_H
+#define FRAMETIMING_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience (if this header included first)
+#endif
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace FrameTiming
+{
+	// How many blocks next is after previous: 1 for consecutive blocks, 0 or negative for a repeated or older block.
+	// GigE Vision 1 block IDs are 16 bit and wrap from 65535 to 1 (0 is not used), so a long sweep wraps them many times.
+	// USB3 Vision and GigE Vision 2 block IDs are 64 bit.
+	int64_t GetBlockIdStep(uint64_t previous, uint64_t next);
+
+	// A fixed-size histogram, so adding values never allocates.
+	class Histogram
+	{
+	private:
+		double m_binWidth = 1;
+		std::vector<uint64_t> m_bins;
+		uint64_t m_overflow = 0; // values beyond the last bin
+		uint64_t m_count = 0;
+		double m_sum = 0;
+		double m_sumOfSquares = 0;
+		double m_min = 0;
+		double m_max = 0;
+
+	public:
+		Histogram(double binWidth, size_t numBins);
+		~Histogram();
+
+		void Add(double value);
+		void Clear();
+
+		uint64_t GetCount();
+		double GetMean();
+		double GetStdDev(); // the jitter
+		double GetMin();
+		double GetMax();
+
+		// The upper edge of the bin holding this percentile (0 to 100).
+		double GetPercentile(double percentile);
+
+		double GetBinWidth();
+		size_t GetNumBins();
+		uint64_t GetBin(size_t bin);
+		uint64_t GetOverflow();
+	};
+
+	class Analyzer
+	{
+	private:
+		std::chrono::steady_clock::time_point m_triggerTime;
+		bool m_chunkFrameIdAvailable = false;
+		double m_tickFrequency = 1e9; // camera timestamp ticks per second
+		// the previous frame, to find missing and out-of-order frames
+		bool m_hasPrevious = false;
+		uint64_t m_previousBlockId = 0;
+		uint64_t m_previousTimestamp = 0;
+		uint64_t m_frames = 0;
+		uint64_t m_missingFrames = 0;
+		uint64_t m_outOfOrderFrames = 0;
+		uint64_t m_pairs = 0;
+		uint64_t m_badPairs = 0;
+		Histogram m_latency; // trigger until retrieved, in ms
+		Histogram m_interval; // between consecutive frames on the camera's clock, in us
+		Histogram m_pairInterval; // between the two frames of a burst, in us
+
+	public:
+		Analyzer();
+		~Analyzer();
+
+		// Turn on the timestamp and frame ID chunks (the camera must not be grabbing) and find the timestamp clock.
+		void Setup(Pylon::CBaslerUniversalInstantCamera& camera);
+
+		// Block IDs start over with every StartGrabbing().
+		void ResetSequence();
+
+		// Call right before executing the trigger.
+		void OnTrigger();
+
+		// Call right after retrieving each frame (also failed ones).
+		void OnFrame(Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult);
+
+		// Check that two frames are consecutive frames of one burst. Returns false with a reason if not.
+		bool CheckPair(Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult1, Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult2, std::string& errorMessage);
+
+		std::string GetSummary();
+
+		// Write the histograms into a csv file.
+		bool SaveHistograms(const std::string& fileName, std::string& errorMessage);
+	};
+}
+
+// *********************************************************************************************************
+inline int64_t FrameTiming::GetBlockIdStep(uint64_t previous, uint64_t next)
+{
+	// (a 16 bit ID far below the previous one is a wrap, not an old block)
+	const uint64_t maxShortId = 0xFFFF;
+	if (previous <= maxShortId && next <= maxShortId && next < previous && previous - next > maxShortId / 2)
+		return (int64_t)(maxShortId - previous + next);
+	return (int64_t)(next - previous);
+}
+
+inline FrameTiming::Histogram::Histogram(double binWidth, size_t numBins)
+{
+	m_binWidth = binWidth;
+	m_bins.resize(numBins, 0);
+}
+
+inline FrameTiming::Histogram::~Histogram()
+{
+	// nothing
+}
+
+inline void FrameTiming::Histogram::Add(double value)
+{
+	if (value < 0)
+		value = 0;
+
+	size_t bin = (size_t)(value / m_binWidth);
+	if (bin < m_bins.size())
+		m_bins[bin]++;
+	else
+		m_overflow++;
+
+	if (m_count == 0 || value < m_min)
+		m_min = value;
+	if (m_count == 0 || value > m_max)
+		m_max = value;
+	m_count++;
+	m_sum += value;
+	m_sumOfSquares += value * value;
+}
+
+inline void FrameTiming::Histogram::Clear()
+{
+	for (size_t i = 0; i < m_bins.size(); i++)
+		m_bins[i] = 0;
+	m_overflow = 0;
+	m_count = 0;
+	m_sum = 0;
+	m_sumOfSquares = 0;
+	m_min = 0;
+	m_max = 0;
+}
+
+inline uint64_t FrameTiming::Histogram::GetCount()
+{
+	return m_count;
+}
+
+inline double FrameTiming::Histogram::GetMean()
+{
+	return (m_count > 0) ? m_sum / m_count : 0;
+}
+
+inline double FrameTiming::Histogram::GetStdDev()
+{
+	if (m_count < 2)
+		return 0;
+
+	double mean = m_sum / m_count;
+	double variance = (m_sumOfSquares - m_count * mean * mean) / (m_count - 1);
+	return (variance > 0) ? std::sqrt(variance) : 0;
+}
+
+inline double FrameTiming::Histogram::GetMin()
+{
+	return m_min;
+}
+
+inline double FrameTiming::Histogram::GetMax()
+{
+	return m_max;
+}
+
+inline double FrameTiming::Histogram::GetPercentile(double percentile)
+{
+	if (m_count == 0)
+		return 0;
+
+	uint64_t target = (uint64_t)std::ceil(percentile / 100.0 * m_count);
+	if (target == 0)
+		target = 1;
+
+	uint64_t counted = 0;
+	for (size_t i = 0; i < m_bins.size(); i++)
+	{
+		counted += m_bins[i];
+		if (counted >= target)
+			return (i + 1) * m_binWidth;
+	}
+
+	// in the overflow
+	return m_max;
+}
+
+inline double FrameTiming::Histogram::GetBinWidth()
+{
+	return m_binWidth;
+}
+
+inline size_t FrameTiming::Histogram::GetNumBins()
+{
+	return m_bins.size();
+}
+
+inline uint64_t FrameTiming::Histogram::GetBin(size_t bin)
+{
+	return m_bins[bin];
+}
+
+inline uint64_t FrameTiming::Histogram::GetOverflow()
+{
+	return m_overflow;
+}
+
+inline FrameTiming::Analyzer::Analyzer() :
+	m_latency(0.25, 400), // up to 100 ms
+	m_interval(10, 10000), // up to 100 ms
+	m_pairInterval(10, 10000)
+{
+	// nothing
+}
+
+inline FrameTiming::Analyzer::~Analyzer()
+{
+	// nothing
+}
+
+inline void FrameTiming::Analyzer::Setup(Pylon::CBaslerUniversalInstantCamera& camera)
+{
+	camera.ChunkModeActive.TrySetValue(true);
+	if (camera.ChunkSelector.TrySetValue(Basler_UniversalCameraParams::ChunkSelector_Timestamp))
+		camera.ChunkEnable.TrySetValue(true);
+	m_chunkFrameIdAvailable = false;
+	if (camera.ChunkSelector.TrySetValue(Basler_UniversalCameraParams::ChunkSelector_FrameID))
+		m_chunkFrameIdAvailable = camera.ChunkEnable.TrySetValue(true);
+
+	// GigE cameras tell their tick frequency, USB cameras count nanoseconds.
+	m_tickFrequency = 1e9;
+	if (camera.GevTimestampTickFrequency.IsReadable())
+		m_tickFrequency = (double)camera.GevTimestampTickFrequency.GetValue();
+
+	ResetSequence();
+}
+
+inline void FrameTiming::Analyzer::ResetSequence()
+{
+	m_hasPrevious = false;
+}
+
+inline void FrameTiming::Analyzer::OnTrigger()
+{
+	m_triggerTime = std::chrono::steady_clock::now();
+}
+
+inline void FrameTiming::Analyzer::OnFrame(Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult)
+{
+	std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - m_triggerTime;
+	m_latency.Add(latency.count());
+	m_frames++;
+
+	// UINT64_MAX means the transport layer has no block IDs
+	uint64_t blockId = ptrGrabResult->GetBlockID();
+	uint64_t timestamp = ptrGrabResult->GetTimeStamp();
+
+	if (m_hasPrevious && blockId != UINT64_MAX)
+	{
+		int64_t step = GetBlockIdStep(m_previousBlockId, blockId);
+		if (step > 1)
+			m_missingFrames += (uint64_t)(step - 1);
+		else if (step <= 0)
+			m_outOfOrderFrames++;
+	}
+	if (m_hasPrevious && timestamp > m_previousTimestamp)
+		m_interval.Add((timestamp - m_previousTimestamp) * 1e6 / m_tickFrequency);
+
+	m_previousBlockId = blockId;
+	m_previousTimestamp = timestamp;
+	m_hasPrevious = true;
+}
+
+inline bool FrameTiming::Analyzer::CheckPair(Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult1, Pylon::CBaslerUniversalGrabResultPtr& ptrGrabResult2, std::string& errorMessage)
+{
+	m_pairs++;
+
+	// (the message is only built for a bad pair, so good pairs don't allocate)
+	uint64_t blockId1 = ptrGrabResult1->GetBlockID();
+	uint64_t blockId2 = ptrGrabResult2->GetBlockID();
+	bool badBlockIds = (blockId1 != UINT64_MAX && blockId2 != UINT64_MAX && GetBlockIdStep(blockId1, blockId2) != 1);
+
+	int64_t frameId1 = 0;
+	int64_t frameId2 = 0;
+	bool badFrameIds = false;
+	if (m_chunkFrameIdAvailable && ptrGrabResult1->ChunkFrameID.IsReadable() && ptrGrabResult2->ChunkFrameID.IsReadable())
+	{
+		frameId1 = ptrGrabResult1->ChunkFrameID.GetValue();
+		frameId2 = ptrGrabResult2->ChunkFrameID.GetValue();
+		badFrameIds = (frameId2 != frameId1 + 1);
+	}
+
+	uint64_t timestamp1 = ptrGrabResult1->GetTimeStamp();
+	uint64_t timestamp2 = ptrGrabResult2->GetTimeStamp();
+	bool badTimestamps = false;
+	if (timestamp2 > timestamp1)
+		m_pairInterval.Add((timestamp2 - timestamp1) * 1e6 / m_tickFrequency);
+	else if (timestamp1 != 0)
+		badTimestamps = true;
+
+	if (badBlockIds == false && badFrameIds == false && badTimestamps == false)
+		return true;
+
+	m_badPairs++;
+	std::ostringstream reason;
+	if (badBlockIds)
+		reason << "block IDs " << blockId1 << " and " << blockId2 << " are not consecutive. ";
+	if (badFrameIds)
+		reason << "frame IDs " << frameId1 << " and " << frameId2 << " are not consecutive. ";
+	if (badTimestamps)
+		reason << "the second frame is not newer than the first. ";
+	errorMessage = "Frames are not a burst pair: " + reason.str();
+	return false;
+}
+
+inline std::string FrameTiming::Analyzer::GetSummary()
+{
+	std::ostringstream summary;
+	summary << m_frames << " frames, " << m_missingFrames << " missing, " << m_outOfOrderFrames << " out of order, "
+		<< m_badPairs << " of " << m_pairs << " pairs not a burst." << std::endl;
+	summary << "Latency (ms) avg/jitter/p50/p95/max: " << m_latency.GetMean() << " / " << m_latency.GetStdDev() << " / "
+		<< m_latency.GetPercentile(50) << " / " << m_latency.GetPercentile(95) << " / " << m_latency.GetMax() << std::endl;
+	summary << "Pair interval (us) avg/jitter/max: " << m_pairInterval.GetMean() << " / " << m_pairInterval.GetStdDev() << " / " << m_pairInterval.GetMax();
+	return summary.str();
+}
+
+inline bool FrameTiming::Analyzer::SaveHistograms(const std::string& fileName, std::string& errorMessage)
+{
+	std::FILE* const timingfileout = std::fopen(fileName.c_str(), "wb+");
+	if (timingfileout == NULL)
+	{
+		errorMessage = "ERROR: Could not open " + fileName;
+		return false;
+	}
+
+	Histogram* histograms[3] = { &m_latency, &m_interval, &m_pairInterval };
+	std::fprintf(timingfileout, "%s,%s,%s,%s,%s,%s\n", "Latency (ms)", "Frames", "Frame Interval (us)", "Frames", "Pair Interval (us)", "Pairs");
+
+	size_t numRows = 0;
+	for (int h = 0; h < 3; h++)
+	{
+		// only up to the last bin with something in it
+		for (size_t i = histograms[h]->GetNumBins(); i > numRows; i--)
+		{
+			if (histograms[h]->GetBin(i - 1) > 0)
+			{
+				numRows = i;
+				break;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < numRows; i++)
+	{
+		for (int h = 0; h < 3; h++)
+		{
+			if (i < histograms[h]->GetNumBins())
+				std::fprintf(timingfileout, "%s%f,%llu", (h > 0) ? "," : "", i * histograms[h]->GetBinWidth(), (unsigned long long)histograms[h]->GetBin(i));
+			else
+				std::fprintf(timingfileout, "%s,", (h > 0) ? "," : "");
+		}
+		std::fprintf(timingfileout, "\n");
+	}
+	std::fprintf(timingfileout, "overflow,%llu,overflow,%llu,overflow,%llu\n", (unsigned long long)m_latency.GetOverflow(), (unsigned long long)m_interval.GetOverflow(), (unsigned long long)m_pairInterval.GetOverflow());
+
+	std::fclose(timingfileout);
+	return true;
+}
+// *********************************************************************************************************
+#endif
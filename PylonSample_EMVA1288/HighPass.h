@@ -0,0 +1,360 @@
+// HighPass.h
+// The spatial variance of an image after a box-filter high-pass (EMVA1288: DSNU and PRNU without the low-frequency shading).
+// Each pixel minus the mean of the boxWidth x boxHeight box around it, without writing the filtered image:
+// a running column sum down the rows, a running row sum along it, and the filtered values go straight into the sums.
+// The image is split into strips of columns (so the running sums stay in the cache) and chunks of rows, across the thread pool.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef HIGHPASS_H
+#define HIGHPASS_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "AnalysisTools.h"
+#include "FormatDispatch.h"
+#include "ThreadPool.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HIGHPASS_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace HighPass
+{
+	// Columns per strip (of a plane). The running sums and the ring of rows of a strip stay in the L2 cache.
+	const uint32_t c_stripColumns = 2048;
+
+	// The box of the high-pass. Both sizes are odd (even sizes are rounded up), eg: 5x5, or 7x11 for sensors with more row than column shading.
+	struct Settings
+	{
+		uint32_t boxWidth = 5;
+		uint32_t boxHeight = 5;
+	};
+
+	// Sums of the filtered values (times the box size, so they are whole numbers) of the pixels away from the border.
+	struct Result
+	{
+		uint64_t count = 0;
+		double sum = 0;
+		double sumOfSquares = 0;
+		double scale = 1; // filtered value = stored value * scale
+
+		void Merge(const Result& other);
+
+		// The variance of the filtered values, corrected for the filter: subtracting the box mean also removes 1/n
+		// of the variance of white noise (n = pixels in the box), so the result is multiplied by n / (n - 1).
+		double GetVariance(const Settings& settings) const;
+	};
+
+	// The engine, for one plane of an image: the pixels pA[y * stride + x * step] (x < width, y < height).
+	// With pB, the plane of pA + signB * pB is filtered (signB = 1 or -1, eg: the sum or difference of a pair).
+	// maxValue is the largest value pA or pB can hold. The engine works in 32 bit integers, and drops low bits if it must to fit.
+	template <typename T>
+	void FindPlaneT(const T* pA, const T* pB, int32_t signB, size_t stride, uint32_t step, uint32_t width, uint32_t height, uint64_t maxValue, const Settings& settings, Result& result);
+
+	// The filtered variance of a whole image (the average of its four planes for Bayer formats, like the FPN and the DSNU/PRNU).
+	template <typename T>
+	double FindImageVarianceT(const T* pA, const T* pB, int32_t signB, uint32_t width, uint32_t height, bool isBayer, uint64_t maxValue, const Settings& settings);
+
+	// The filtered spatial variance of a pair of frames, without the temporal noise:
+	// the variance of the mean frame (A + B) / 2 minus the temporal part, which the difference A - B measures.
+	bool FindPairVariance(const FormatDispatch::Kernels& kernels, Pylon::CPylonImage& image1, Pylon::CPylonImage& image2, const Settings& settings, double& spatialVariance, std::string& errorMessage);
+
+	// The filtered variance of a per-pixel averaged frame (eg: a master dark or flat frame), from the per-pixel sums of numFrames frames, in DN^2.
+	// What is left of the temporal noise is its variance / numFrames.
+	double FindAveragedVariance(const uint32_t* pSums, uint32_t numFrames, uint32_t width, uint32_t height, const FormatDispatch::Kernels& kernels, const Settings& settings);
+}
+
+// *********************************************************************************************************
+inline void HighPass::Result::Merge(const Result& other)
+{
+	count += other.count;
+	sum += other.sum;
+	sumOfSquares += other.sumOfSquares;
+}
+
+inline double HighPass::Result::GetVariance(const Settings& settings) const
+{
+	if (count < 2)
+		return 0;
+	double n = (double)(settings.boxWidth | 1) * (settings.boxHeight | 1); // (see FindPlaneT())
+	double variance = (sumOfSquares - sum * sum / count) / (count - 1) * scale * scale;
+	return (n > 1) ? variance * n / (n - 1) : variance;
+}
+
+namespace HighPass
+{
+	// One row of output: stored value = n * center - box sum, for columns [0, numColumns) of the strip.
+	// pColumnSums holds the running column sums of the strip, starting boxWidth / 2 columns to the left (and readable 4 past the end).
+	inline void FilterRow(const int32_t* pColumnSums, const int32_t* pCenter, uint32_t numColumns, uint32_t boxWidth, int32_t n, double& sum, double& sumOfSquares)
+	{
+		// the box sum of the first column, then each step adds the column entering the box and drops the one leaving it
+		int32_t boxSum = 0;
+		for (uint32_t i = 0; i < boxWidth; i++)
+			boxSum += pColumnSums[i];
+		const int32_t* pEnter = pColumnSums + boxWidth;
+		const int32_t* pLeave = pColumnSums;
+		uint32_t x = 0;
+
+#if defined HIGHPASS_SSE2
+		// 4 columns per step: the steps of the running sum are added up in the register (a prefix sum), on top of the last box sum
+		__m128d sum2 = _mm_setzero_pd();
+		__m128d sumOfSquares2 = _mm_setzero_pd();
+		const __m128d n2 = _mm_set1_pd((double)n);
+		__m128i boxSums = _mm_set1_epi32(boxSum);
+		for (; x + 4 <= numColumns; x += 4)
+		{
+			__m128i steps = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(pEnter + x)), _mm_loadu_si128((const __m128i*)(pLeave + x)));
+			__m128i prefix = _mm_slli_si128(steps, 4); // (column x uses the box sum before any of these steps)
+			prefix = _mm_add_epi32(prefix, _mm_slli_si128(prefix, 4));
+			prefix = _mm_add_epi32(prefix, _mm_slli_si128(prefix, 8));
+			__m128i sums = _mm_add_epi32(boxSums, prefix);
+			boxSums = _mm_shuffle_epi32(_mm_add_epi32(sums, steps), 0xff);
+
+			__m128i center = _mm_loadu_si128((const __m128i*)(pCenter + x));
+			// (in double, n * center can be larger than 32 bits)
+			__m128d low = _mm_sub_pd(_mm_mul_pd(n2, _mm_cvtepi32_pd(center)), _mm_cvtepi32_pd(sums));
+			__m128d high = _mm_sub_pd(_mm_mul_pd(n2, _mm_cvtepi32_pd(_mm_srli_si128(center, 8))), _mm_cvtepi32_pd(_mm_srli_si128(sums, 8)));
+			sum2 = _mm_add_pd(sum2, _mm_add_pd(low, high));
+			sumOfSquares2 = _mm_add_pd(sumOfSquares2, _mm_add_pd(_mm_mul_pd(low, low), _mm_mul_pd(high, high)));
+		}
+		boxSum = _mm_cvtsi128_si32(boxSums);
+		double lanes[2];
+		_mm_storeu_pd(lanes, sum2);
+		sum += lanes[0] + lanes[1];
+		_mm_storeu_pd(lanes, sumOfSquares2);
+		sumOfSquares += lanes[0] + lanes[1];
+#endif
+
+		for (; x < numColumns; x++)
+		{
+			double value = (double)n * pCenter[x] - boxSum;
+			sum += value;
+			sumOfSquares += value * value;
+			boxSum += pEnter[x] - pLeave[x];
+		}
+	}
+
+	// columnSums += pAdd - pSubtract
+	inline void UpdateColumnSums(int32_t* pColumnSums, const int32_t* pAdd, const int32_t* pSubtract, uint32_t numColumns)
+	{
+		uint32_t x = 0;
+#if defined HIGHPASS_SSE2
+		for (; x + 4 <= numColumns; x += 4)
+		{
+			__m128i sums = _mm_loadu_si128((const __m128i*)(pColumnSums + x));
+			sums = _mm_add_epi32(sums, _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(pAdd + x)), _mm_loadu_si128((const __m128i*)(pSubtract + x))));
+			_mm_storeu_si128((__m128i*)(pColumnSums + x), sums);
+		}
+#endif
+		for (; x < numColumns; x++)
+			pColumnSums[x] += pAdd[x] - pSubtract[x];
+	}
+
+	// Read numColumns pixels of one row (of pA + signB * pB) into 32 bit values.
+	template <typename T>
+	inline void LoadRow(const T* pA, const T* pB, int32_t signB, uint32_t step, uint32_t numColumns, uint32_t shift, int32_t* pRow)
+	{
+		if (pB == nullptr)
+		{
+			for (uint32_t x = 0; x < numColumns; x++)
+				pRow[x] = (int32_t)(pA[(size_t)x * step] >> shift);
+		}
+		else
+		{
+			for (uint32_t x = 0; x < numColumns; x++)
+				pRow[x] = (int32_t)(pA[(size_t)x * step] >> shift) + signB * (int32_t)(pB[(size_t)x * step] >> shift);
+		}
+	}
+}
+
+template <typename T>
+inline void HighPass::FindPlaneT(const T* pA, const T* pB, int32_t signB, size_t stride, uint32_t step, uint32_t width, uint32_t height, uint64_t maxValue, const Settings& settings, Result& result)
+{
+	result = Result();
+	const uint32_t boxWidth = settings.boxWidth | 1;
+	const uint32_t boxHeight = settings.boxHeight | 1;
+	const uint32_t radiusX = boxWidth / 2;
+	const uint32_t radiusY = boxHeight / 2;
+	if (width < boxWidth || height < boxHeight)
+		return;
+
+	// every sum, and every step of a running sum, must fit in 32 bits: 2 * n * (largest |value|) < 2^31
+	const int32_t n = (int32_t)(boxWidth * boxHeight);
+	uint64_t largest = (pB != nullptr) ? 2 * maxValue : maxValue;
+	uint32_t shift = 0;
+	while (2 * (uint64_t)n * (largest >> shift) >= (1ull << 31))
+		shift++;
+	result.scale = (double)(1ull << shift) / n;
+
+	// the filtered pixels: columns [radiusX, width - radiusX), rows [radiusY, height - radiusY)
+	uint32_t outWidth = width - 2 * radiusX;
+	uint32_t outHeight = height - 2 * radiusY;
+	uint32_t numStrips = (outWidth + c_stripColumns - 1) / c_stripColumns;
+	uint32_t stripColumns = (outWidth + numStrips - 1) / numStrips;
+	// (about c_reductionChunkSize of input per task, and at least a few times the box height, as every task starts with a full box)
+	size_t bytesPerRow = (size_t)(stripColumns + 2 * radiusX) * step * sizeof(T) * ((pB != nullptr) ? 2 : 1);
+	uint32_t rowsPerChunk = (uint32_t)(AnalysisTools::c_reductionChunkSize / bytesPerRow);
+	if (rowsPerChunk < 4 * boxHeight)
+		rowsPerChunk = 4 * boxHeight;
+	uint32_t numRowChunks = (outHeight + rowsPerChunk - 1) / rowsPerChunk;
+	size_t numTasks = (size_t)numStrips * numRowChunks;
+
+	// (the tasks run on the pool threads, so they must use this thread's array through a reference, not the thread_local name)
+	static thread_local std::vector<Result> taskResults;
+	if (taskResults.size() < numTasks)
+		taskResults.resize(numTasks);
+	std::vector<Result>& results = taskResults;
+
+	auto task = [&](size_t index)
+	{
+		uint32_t strip = (uint32_t)(index / numRowChunks);
+		uint32_t chunk = (uint32_t)(index % numRowChunks);
+		uint32_t firstColumn = strip * stripColumns; // of the output, the input starts radiusX to the left of it
+		uint32_t numColumns = (firstColumn + stripColumns < outWidth) ? stripColumns : outWidth - firstColumn;
+		uint32_t firstRow = chunk * rowsPerChunk;
+		uint32_t lastRow = (firstRow + rowsPerChunk < outHeight) ? firstRow + rowsPerChunk : outHeight;
+		uint32_t inColumns = numColumns + 2 * radiusX;
+
+		// each pool thread keeps its own ring of input rows (as 32 bit values: the box, plus a slot for the row entering it)
+		// and the column sums (padded, so the 4 column steps may read past the end)
+		static thread_local std::vector<int32_t> ring;
+		static thread_local std::vector<int32_t> columnSums;
+		const uint32_t numSlots = boxHeight + 1;
+		size_t rowLength = (size_t)inColumns + 4;
+		ring.assign(rowLength * numSlots, 0);
+		columnSums.assign(rowLength, 0);
+		auto slot = [&](uint32_t row) { return &ring[(size_t)(row % numSlots) * rowLength]; };
+
+		auto rowPointer = [&](const T* pPlane, uint32_t y) { return pPlane + (size_t)y * stride + (size_t)firstColumn * step; };
+		auto load = [&](uint32_t y, int32_t* pRow)
+		{
+			LoadRow<T>(rowPointer(pA, y), (pB != nullptr) ? rowPointer(pB, y) : nullptr, signB, step, inColumns, shift, pRow);
+		};
+
+		// the first box: input rows [firstRow, firstRow + boxHeight) of the plane
+		for (uint32_t row = firstRow; row < firstRow + boxHeight; row++)
+		{
+			int32_t* pRow = slot(row);
+			load(row, pRow);
+			for (uint32_t x = 0; x < inColumns; x++)
+				columnSums[x] += pRow[x];
+		}
+
+		Result taskResult;
+		for (uint32_t y = firstRow; y < lastRow; y++)
+		{
+			// output row y is centered on input row y + radiusY
+			if (y > firstRow)
+			{
+				// input row y + boxHeight - 1 enters, row y - 1 leaves (and its slot is free for the next row)
+				int32_t* pEntering = slot(y + boxHeight - 1);
+				load(y + boxHeight - 1, pEntering);
+				UpdateColumnSums(&columnSums[0], pEntering, slot(y - 1), inColumns);
+			}
+
+			const int32_t* pCenter = slot(y + radiusY) + radiusX;
+			FilterRow(&columnSums[0], pCenter, numColumns, boxWidth, n, taskResult.sum, taskResult.sumOfSquares);
+		}
+		taskResult.count = (uint64_t)numColumns * (lastRow - firstRow);
+		results[index] = taskResult;
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numTasks, std::cref(task));
+
+	// merge in task order
+	for (size_t i = 0; i < numTasks; i++)
+		result.Merge(taskResults[i]);
+}
+
+template <typename T>
+inline double HighPass::FindImageVarianceT(const T* pA, const T* pB, int32_t signB, uint32_t width, uint32_t height, bool isBayer, uint64_t maxValue, const Settings& settings)
+{
+	if (isBayer == false)
+	{
+		Result result;
+		FindPlaneT<T>(pA, pB, signB, width, 1, width, height, maxValue, settings, result);
+		return result.GetVariance(settings);
+	}
+
+	// each plane starts at its position in the 2x2 cell, and takes every other pixel of every other row
+	double variance = 0;
+	for (uint32_t plane = 0; plane < AnalysisTools::c_numCfaPlanes; plane++)
+	{
+		size_t offset = (size_t)(plane >> 1) * width + (plane & 1);
+		Result result;
+		FindPlaneT<T>(pA + offset, (pB != nullptr) ? pB + offset : nullptr, signB, 2 * (size_t)width, 2, width / 2, height / 2, maxValue, settings, result);
+		variance += result.GetVariance(settings) / AnalysisTools::c_numCfaPlanes;
+	}
+	return variance;
+}
+
+inline bool HighPass::FindPairVariance(const FormatDispatch::Kernels& kernels, Pylon::CPylonImage& image1, Pylon::CPylonImage& image2, const Settings& settings, double& spatialVariance, std::string& errorMessage)
+{
+	spatialVariance = 0;
+	if (kernels.isPacked)
+	{
+		errorMessage = "ERROR: The high-pass filter needs an unpacked pixel format.";
+		return false;
+	}
+	if (image1.GetPixelType() != kernels.pixelType || image2.GetPixelType() != kernels.pixelType || image1.GetWidth() != image2.GetWidth() || image1.GetHeight() != image2.GetHeight())
+	{
+		errorMessage = "ERROR: The high-pass filter needs two images of the same size and pixel format.";
+		return false;
+	}
+
+	// var(A + B) / 4 is the variance of the mean frame, var(A - B) / 4 is its temporal part (both filtered the same way)
+	uint32_t width = image1.GetWidth();
+	uint32_t height = image1.GetHeight();
+	uint64_t maxValue = (1ull << kernels.bitDepth) - 1;
+	double sumVariance = 0;
+	double diffVariance = 0;
+	if (kernels.bitDepth <= 8)
+	{
+		const uint8_t* pA = (const uint8_t*)image1.GetBuffer();
+		const uint8_t* pB = (const uint8_t*)image2.GetBuffer();
+		sumVariance = FindImageVarianceT<uint8_t>(pA, pB, 1, width, height, kernels.isBayer, maxValue, settings);
+		diffVariance = FindImageVarianceT<uint8_t>(pA, pB, -1, width, height, kernels.isBayer, maxValue, settings);
+	}
+	else
+	{
+		const uint16_t* pA = (const uint16_t*)image1.GetBuffer();
+		const uint16_t* pB = (const uint16_t*)image2.GetBuffer();
+		sumVariance = FindImageVarianceT<uint16_t>(pA, pB, 1, width, height, kernels.isBayer, maxValue, settings);
+		diffVariance = FindImageVarianceT<uint16_t>(pA, pB, -1, width, height, kernels.isBayer, maxValue, settings);
+	}
+
+	spatialVariance = (sumVariance - diffVariance) / 4;
+	if (spatialVariance < 0)
+		spatialVariance = 0;
+	return true;
+}
+
+inline double HighPass::FindAveragedVariance(const uint32_t* pSums, uint32_t numFrames, uint32_t width, uint32_t height, const FormatDispatch::Kernels& kernels, const Settings& settings)
+{
+	if (pSums == nullptr || numFrames == 0)
+		return 0;
+	uint64_t maxValue = (uint64_t)numFrames * ((1ull << kernels.bitDepth) - 1);
+	double variance = FindImageVarianceT<uint32_t>(pSums, nullptr, 0, width, height, kernels.isBayer, maxValue, settings);
+	return variance / ((double)numFrames * numFrames);
+}
+// *********************************************************************************************************
+#endif
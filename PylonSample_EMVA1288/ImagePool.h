@@ -0,0 +1,228 @@
+// ImagePool.h
+// A pool of aligned, reusable image buffers, so steady-state image processing does not need to allocate memory.
+// Buffers are keyed by pixel type and size. Check out a buffer into a CPylonImage, and return it when done.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef IMAGEPOOL_H
+#define IMAGEPOOL_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience (if this header included first)
+#endif
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <stdint.h>
+
+#ifdef WIN_BUILD
+#include <malloc.h>
+#endif
+
+namespace ImagePool
+{
+	// Buffers are aligned to a cache line, which also suits SIMD loads.
+	const size_t c_bufferAlignment = 64;
+
+	// How much work the pool has done. After warm-up, allocations should stop increasing.
+	struct Counters
+	{
+		uint64_t allocations = 0; // buffers allocated from the heap
+		uint64_t checkOuts = 0;
+		uint64_t returns = 0;
+		size_t bytesAllocated = 0; // total size of all buffers held by the pool
+		size_t buffersInUse = 0;
+	};
+
+	class Pool
+	{
+	private:
+		struct Buffer
+		{
+			void* pData;
+			size_t size;
+			Pylon::EPixelType pixelType;
+			uint32_t width;
+			uint32_t height;
+			bool inUse;
+		};
+
+		std::vector<Buffer> m_buffers;
+		Counters m_counters;
+		std::mutex m_mutex;
+
+		static void* AlignedAlloc(size_t size);
+		static void AlignedFree(void* pData);
+
+	public:
+		Pool();
+		~Pool();
+
+		// Attach a free buffer of this format and size to image. A new buffer is only allocated if none is free.
+		bool CheckOut(Pylon::EPixelType pixelType, uint32_t width, uint32_t height, Pylon::CPylonImage& image, std::string& errorMessage);
+
+		// Give the buffer attached to image back to the pool, and release the image.
+		bool Return(Pylon::CPylonImage& image, std::string& errorMessage);
+
+		// Free all buffers that are not checked out.
+		void Trim();
+
+		Counters GetCounters();
+	};
+}
+
+// *********************************************************************************************************
+inline void* ImagePool::Pool::AlignedAlloc(size_t size)
+{
+#ifdef WIN_BUILD
+	return _aligned_malloc(size, c_bufferAlignment);
+#else
+	void* pData = nullptr;
+	if (posix_memalign(&pData, c_bufferAlignment, size) != 0)
+		return nullptr;
+	return pData;
+#endif
+}
+
+inline void ImagePool::Pool::AlignedFree(void* pData)
+{
+#ifdef WIN_BUILD
+	_aligned_free(pData);
+#else
+	free(pData);
+#endif
+}
+
+inline ImagePool::Pool::Pool()
+{
+	// nothing
+}
+
+inline ImagePool::Pool::~Pool()
+{
+	for (size_t i = 0; i < m_buffers.size(); i++)
+		AlignedFree(m_buffers[i].pData);
+}
+
+inline bool ImagePool::Pool::CheckOut(Pylon::EPixelType pixelType, uint32_t width, uint32_t height, Pylon::CPylonImage& image, std::string& errorMessage)
+{
+	try
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		size_t index = m_buffers.size();
+		for (size_t i = 0; i < m_buffers.size(); i++)
+		{
+			if (m_buffers[i].inUse == false && m_buffers[i].pixelType == pixelType && m_buffers[i].width == width && m_buffers[i].height == height)
+			{
+				index = i;
+				break;
+			}
+		}
+
+		if (index == m_buffers.size())
+		{
+			Buffer buffer;
+			buffer.size = ((size_t)width * Pylon::BitPerPixel(pixelType) + 7) / 8 * height;
+			buffer.pData = AlignedAlloc(buffer.size);
+			buffer.pixelType = pixelType;
+			buffer.width = width;
+			buffer.height = height;
+			buffer.inUse = false;
+
+			if (buffer.pData == nullptr)
+			{
+				errorMessage = "ERROR: ImagePool could not allocate a buffer.";
+				return false;
+			}
+
+			m_buffers.push_back(buffer);
+			m_counters.allocations++;
+			m_counters.bytesAllocated += buffer.size;
+		}
+
+		image.AttachUserBuffer(m_buffers[index].pData, m_buffers[index].size, pixelType, width, height, 0);
+		m_buffers[index].inUse = true;
+		m_counters.checkOuts++;
+		m_counters.buffersInUse++;
+
+		return true;
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in CheckOut(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+	catch (std::exception& e)
+	{
+		errorMessage = "An exception occured in CheckOut(): ";
+		errorMessage.append(e.what());
+		return false;
+	}
+}
+
+inline bool ImagePool::Pool::Return(Pylon::CPylonImage& image, std::string& errorMessage)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	for (size_t i = 0; i < m_buffers.size(); i++)
+	{
+		if (m_buffers[i].inUse && m_buffers[i].pData == image.GetBuffer())
+		{
+			image.Release();
+			m_buffers[i].inUse = false;
+			m_counters.returns++;
+			m_counters.buffersInUse--;
+			return true;
+		}
+	}
+
+	errorMessage = "ERROR: Image buffer does not belong to this ImagePool.";
+	return false;
+}
+
+inline void ImagePool::Pool::Trim()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	for (size_t i = m_buffers.size(); i > 0; i--)
+	{
+		if (m_buffers[i - 1].inUse == false)
+		{
+			m_counters.bytesAllocated -= m_buffers[i - 1].size;
+			AlignedFree(m_buffers[i - 1].pData);
+			m_buffers.erase(m_buffers.begin() + (i - 1));
+		}
+	}
+}
+
+inline ImagePool::Counters ImagePool::Pool::GetCounters()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_counters;
+}
+// *********************************************************************************************************
+#endif
@@ -0,0 +1,457 @@
+// PackedPixels.h
+// Analysis kernels for the packed 10 and 12 bit formats (Mono10p, Mono12p, BayerRG12p, etc.).
+// Packed formats move the least data over USB3 and GigE, so they give the highest frame rates. The kernels here unpack a few rows
+// at a time into a small buffer that stays in the cache and run the regular kernels on it, so no unpacked copy of the frame is ever written to memory.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef PACKEDPIXELS_H
+#define PACKEDPIXELS_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "PixelFormatTraits.h"
+#include "AnalysisTools.h"
+#include "ThreadPool.h"
+
+// pshufb gathers the bytes of 8 pixels at once. The SSSE3 code is compiled on every x86/x64 build (without /arch or -mssse3)
+// and only called if the CPU has SSSE3, see HasSsse3().
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PACKEDPIXELS_SSSE3
+#include <tmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PACKEDPIXELS_TARGET_SSSE3
+#else
+#define PACKEDPIXELS_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+namespace PackedPixels
+{
+	// The rows are unpacked in strips of about this many pixels (16 KB per image, so both images of a pair fit in the L1 cache).
+	// Bayer strips are whole cell rows, so a strip is at least 2 rows.
+	const size_t c_stripPixels = 8 * 1024;
+
+	// Unpack one row of bitDepth bit pixels (least significant bit first). The row starts on a byte boundary.
+	template <uint32_t BitDepth>
+	void UnpackRowT(const uint8_t* pPacked, uint32_t width, uint16_t* pRow);
+
+	// true if the SSSE3 code can run on this CPU (checked once)
+	bool HasSsse3();
+
+	// Unpack numRows rows, starting at firstRow, into pRows (numRows * width pixels).
+	template <uint32_t BitDepth>
+	void UnpackRowsT(const uint8_t* pImage, size_t stride, uint32_t width, uint32_t firstRow, uint32_t numRows, uint16_t* pRows);
+
+	// The number of bytes from one packed row to the next.
+	size_t GetStride(Pylon::CPylonImage& image, uint32_t bitDepth);
+
+	// How many rows of an image are unpacked at a time.
+	template <typename Traits>
+	uint32_t GetRowsPerStrip(uint32_t width);
+
+	// The regular kernels (see FormatDispatch::Kernels), compiled for one packed format.
+	template <typename Traits>
+	AnalysisTools::Stats FindStatsT(Pylon::CPylonImage& image);
+
+	template <typename Traits>
+	AnalysisTools::DiffStats FindDiffStatsT(Pylon::CPylonImage& imageA, Pylon::CPylonImage& imageB);
+
+	template <typename Traits>
+	AnalysisTools::CfaPairStats FindCfaPairStatsT(Pylon::CPylonImage& image1, Pylon::CPylonImage& image2);
+
+	template <typename Traits>
+	void FindHistogramsT(Pylon::CPylonImage& image, AnalysisTools::Histograms& histograms);
+
+	template <typename Traits>
+	bool FindProfilesT(Pylon::CPylonImage& image, AnalysisTools::Profiles& profiles, std::string& errorMessage);
+
+	// helper: split the rows of an image into chunks of whole strips (about AnalysisTools::c_reductionChunkSize of packed data each)
+	template <typename Traits>
+	uint32_t GetRowsPerChunk(size_t stride, uint32_t width);
+
+#if defined PACKEDPIXELS_SSSE3
+	// helper for UnpackRowT(): unpack the start of the row, 8 pixels at a time. Returns the number of pixels unpacked.
+	template <uint32_t BitDepth>
+	PACKEDPIXELS_TARGET_SSSE3 uint32_t UnpackRowSsse3T(const uint8_t* pPacked, uint32_t width, uint16_t* pRow);
+#endif
+}
+
+// *********************************************************************************************************
+template <uint32_t BitDepth>
+inline void PackedPixels::UnpackRowT(const uint8_t* pPacked, uint32_t width, uint16_t* pRow)
+{
+	static_assert(BitDepth == 10 || BitDepth == 12, "Only 10 and 12 bit packed formats are supported");
+	const uint32_t mask = (1u << BitDepth) - 1;
+	size_t rowBytes = ((size_t)width * BitDepth + 7) / 8;
+	uint32_t x = 0;
+
+#if defined PACKEDPIXELS_SSSE3
+	if (HasSsse3())
+		x = UnpackRowSsse3T<BitDepth>(pPacked, width, pRow);
+#endif
+
+	// whole groups (2 pixels in 3 bytes, or 4 pixels in 5 bytes)
+	if (BitDepth == 12)
+	{
+		for (; x + 2 <= width; x += 2)
+		{
+			const uint8_t* p = pPacked + (size_t)(x / 2) * 3;
+			pRow[x] = (uint16_t)(p[0] | ((p[1] & 0x0F) << 8));
+			pRow[x + 1] = (uint16_t)((p[1] >> 4) | (p[2] << 4));
+		}
+	}
+	else
+	{
+		for (; x + 4 <= width; x += 4)
+		{
+			const uint8_t* p = pPacked + (size_t)(x / 4) * 5;
+			uint64_t group = (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32);
+			pRow[x] = (uint16_t)(group & mask);
+			pRow[x + 1] = (uint16_t)((group >> 10) & mask);
+			pRow[x + 2] = (uint16_t)((group >> 20) & mask);
+			pRow[x + 3] = (uint16_t)((group >> 30) & mask);
+		}
+	}
+
+	// the rest of the row (never reads past the end of the row)
+	for (; x < width; x++)
+	{
+		size_t bit = (size_t)x * BitDepth;
+		size_t byte = bit / 8;
+		uint32_t value = pPacked[byte];
+		if (byte + 1 < rowBytes)
+			value |= (uint32_t)pPacked[byte + 1] << 8;
+		if (byte + 2 < rowBytes)
+			value |= (uint32_t)pPacked[byte + 2] << 16;
+		pRow[x] = (uint16_t)((value >> (bit % 8)) & mask);
+	}
+}
+
+#if defined PACKEDPIXELS_SSSE3
+template <uint32_t BitDepth>
+PACKEDPIXELS_TARGET_SSSE3 inline uint32_t PackedPixels::UnpackRowSsse3T(const uint8_t* pPacked, uint32_t width, uint16_t* pRow)
+{
+	// 8 pixels (10 or 12 bytes) per 16 byte load. Each pixel's two bytes are gathered into a 16 bit lane,
+	// then the multiply moves its bits to the top of the lane and the shift brings them back down.
+	// (the load reads past the 8 pixels, so stop while there are 16 bytes left in the row)
+	size_t rowBytes = ((size_t)width * BitDepth + 7) / 8;
+	uint32_t x = 0;
+	const __m128i gather = (BitDepth == 12)
+		? _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11)
+		: _mm_setr_epi8(0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 6, 7, 7, 8, 8, 9);
+	const __m128i align = (BitDepth == 12)
+		? _mm_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1)
+		: _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+	const int shift = 16 - BitDepth;
+	const size_t bytesPer8 = BitDepth;
+	for (; x + 8 <= width && (size_t)(x / 8) * bytesPer8 + 16 <= rowBytes; x += 8)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(pPacked + (size_t)(x / 8) * bytesPer8));
+		__m128i pixels = _mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(bytes, gather), align), shift);
+		_mm_storeu_si128((__m128i*)(pRow + x), pixels);
+	}
+	return x;
+}
+#endif
+
+inline bool PackedPixels::HasSsse3()
+{
+#if defined PACKEDPIXELS_SSSE3
+#if defined(_MSC_VER)
+	static const bool hasSsse3 = []()
+	{
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 9)) != 0;
+	}();
+#else
+	static const bool hasSsse3 = (__builtin_cpu_supports("ssse3") != 0);
+#endif
+	return hasSsse3;
+#else
+	return false;
+#endif
+}
+
+template <uint32_t BitDepth>
+inline void PackedPixels::UnpackRowsT(const uint8_t* pImage, size_t stride, uint32_t width, uint32_t firstRow, uint32_t numRows, uint16_t* pRows)
+{
+	for (uint32_t row = 0; row < numRows; row++)
+		UnpackRowT<BitDepth>(pImage + (size_t)(firstRow + row) * stride, width, pRows + (size_t)row * width);
+}
+
+inline size_t PackedPixels::GetStride(Pylon::CPylonImage& image, uint32_t bitDepth)
+{
+	size_t stride = 0;
+	if (image.GetStride(stride) == false || stride == 0)
+		stride = ((size_t)image.GetWidth() * bitDepth + 7) / 8;
+	return stride;
+}
+
+template <typename Traits>
+inline uint32_t PackedPixels::GetRowsPerStrip(uint32_t width)
+{
+	uint32_t rows = (uint32_t)(c_stripPixels / ((width > 0) ? width : 1));
+	if (Traits::isBayer)
+		rows = rows & ~1u;
+	uint32_t minRows = Traits::isBayer ? 2 : 1;
+	return (rows < minRows) ? minRows : rows;
+}
+
+template <typename Traits>
+inline uint32_t PackedPixels::GetRowsPerChunk(size_t stride, uint32_t width)
+{
+	uint32_t rowsPerStrip = GetRowsPerStrip<Traits>(width);
+	size_t stripBytes = stride * rowsPerStrip;
+	size_t stripsPerChunk = (AnalysisTools::c_reductionChunkSize + stripBytes - 1) / stripBytes;
+	return (uint32_t)(stripsPerChunk * rowsPerStrip);
+}
+
+template <typename Traits>
+inline AnalysisTools::Stats PackedPixels::FindStatsT(Pylon::CPylonImage& image)
+{
+	AnalysisTools::Stats stats;
+	uint32_t width = image.GetWidth();
+	uint32_t height = image.GetHeight();
+	if (width == 0 || height == 0)
+		return stats;
+
+	size_t stride = GetStride(image, Traits::bitDepth);
+	uint32_t rowsPerStrip = GetRowsPerStrip<Traits>(width);
+	uint32_t rowsPerChunk = GetRowsPerChunk<Traits>(stride, width);
+	size_t numChunks = (height + rowsPerChunk - 1) / rowsPerChunk;
+
+	// (the tasks run on the pool threads, so they must use this thread's array through a reference, not the thread_local name)
+	static thread_local std::vector<AnalysisTools::Stats> chunkStats;
+	if (chunkStats.size() < numChunks)
+		chunkStats.resize(numChunks);
+	std::vector<AnalysisTools::Stats>& results = chunkStats;
+
+	const uint8_t* pImage = (const uint8_t*)image.GetBuffer();
+	auto task = [&](size_t chunk)
+	{
+		// each pool thread unpacks into its own strip
+		static thread_local std::vector<uint16_t> strip;
+		strip.resize((size_t)rowsPerStrip * width);
+
+		AnalysisTools::Stats chunkResult;
+		uint32_t last = ((chunk + 1) * rowsPerChunk < height) ? (uint32_t)(chunk + 1) * rowsPerChunk : height;
+		for (uint32_t row = (uint32_t)chunk * rowsPerChunk; row < last; row += rowsPerStrip)
+		{
+			uint32_t numRows = (row + rowsPerStrip < last) ? rowsPerStrip : last - row;
+			UnpackRowsT<Traits::bitDepth>(pImage, stride, width, row, numRows, &strip[0]);
+
+			AnalysisTools::Stats stripStats;
+			AnalysisTools::FindStatsT<uint16_t>(&strip[0], (size_t)numRows * width, stripStats);
+			chunkResult.Merge(stripStats);
+		}
+		results[chunk] = chunkResult;
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	// merge in chunk order
+	for (size_t chunk = 0; chunk < numChunks; chunk++)
+		stats.Merge(chunkStats[chunk]);
+
+	return stats;
+}
+
+template <typename Traits>
+inline AnalysisTools::DiffStats PackedPixels::FindDiffStatsT(Pylon::CPylonImage& imageA, Pylon::CPylonImage& imageB)
+{
+	AnalysisTools::DiffStats stats;
+	uint32_t width = imageA.GetWidth();
+	uint32_t height = (imageA.GetHeight() < imageB.GetHeight()) ? imageA.GetHeight() : imageB.GetHeight();
+	if (width == 0 || height == 0 || imageB.GetWidth() != width)
+		return stats;
+
+	size_t strideA = GetStride(imageA, Traits::bitDepth);
+	size_t strideB = GetStride(imageB, Traits::bitDepth);
+	uint32_t rowsPerStrip = GetRowsPerStrip<Traits>(width);
+	uint32_t rowsPerChunk = GetRowsPerChunk<Traits>(strideA, width);
+	size_t numChunks = (height + rowsPerChunk - 1) / rowsPerChunk;
+
+	static thread_local std::vector<AnalysisTools::DiffStats> chunkStats;
+	if (chunkStats.size() < numChunks)
+		chunkStats.resize(numChunks);
+	std::vector<AnalysisTools::DiffStats>& results = chunkStats;
+
+	const uint8_t* pImageA = (const uint8_t*)imageA.GetBuffer();
+	const uint8_t* pImageB = (const uint8_t*)imageB.GetBuffer();
+	auto task = [&](size_t chunk)
+	{
+		static thread_local std::vector<uint16_t> strips;
+		size_t stripSize = (size_t)rowsPerStrip * width;
+		strips.resize(2 * stripSize);
+
+		AnalysisTools::DiffStats chunkResult;
+		uint32_t last = ((chunk + 1) * rowsPerChunk < height) ? (uint32_t)(chunk + 1) * rowsPerChunk : height;
+		for (uint32_t row = (uint32_t)chunk * rowsPerChunk; row < last; row += rowsPerStrip)
+		{
+			uint32_t numRows = (row + rowsPerStrip < last) ? rowsPerStrip : last - row;
+			UnpackRowsT<Traits::bitDepth>(pImageA, strideA, width, row, numRows, &strips[0]);
+			UnpackRowsT<Traits::bitDepth>(pImageB, strideB, width, row, numRows, &strips[stripSize]);
+
+			AnalysisTools::DiffStats stripStats;
+			AnalysisTools::FindDiffStatsT<uint16_t>(&strips[0], &strips[stripSize], (size_t)numRows * width, stripStats);
+			chunkResult.Merge(stripStats);
+		}
+		results[chunk] = chunkResult;
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	for (size_t chunk = 0; chunk < numChunks; chunk++)
+		stats.Merge(chunkStats[chunk]);
+
+	return stats;
+}
+
+template <typename Traits>
+inline AnalysisTools::CfaPairStats PackedPixels::FindCfaPairStatsT(Pylon::CPylonImage& image1, Pylon::CPylonImage& image2)
+{
+	AnalysisTools::CfaPairStats stats;
+	uint32_t width = image1.GetWidth();
+	uint32_t height = image1.GetHeight() & ~1u; // whole cell rows
+	if (width < 2 || height == 0 || image2.GetWidth() != width || image2.GetHeight() != image1.GetHeight())
+		return stats;
+
+	size_t stride1 = GetStride(image1, Traits::bitDepth);
+	size_t stride2 = GetStride(image2, Traits::bitDepth);
+	uint32_t rowsPerStrip = GetRowsPerStrip<Traits>(width);
+	uint32_t rowsPerChunk = GetRowsPerChunk<Traits>(stride1, width);
+	size_t numChunks = (height + rowsPerChunk - 1) / rowsPerChunk;
+
+	static thread_local std::vector<AnalysisTools::CfaPairStats> chunkStats;
+	if (chunkStats.size() < numChunks)
+		chunkStats.resize(numChunks);
+	std::vector<AnalysisTools::CfaPairStats>& results = chunkStats;
+
+	const uint8_t* pImage1 = (const uint8_t*)image1.GetBuffer();
+	const uint8_t* pImage2 = (const uint8_t*)image2.GetBuffer();
+	auto task = [&](size_t chunk)
+	{
+		static thread_local std::vector<uint16_t> strips;
+		size_t stripSize = (size_t)rowsPerStrip * width;
+		strips.resize(2 * stripSize);
+
+		AnalysisTools::CfaPairStats chunkResult;
+		uint32_t last = ((chunk + 1) * rowsPerChunk < height) ? (uint32_t)(chunk + 1) * rowsPerChunk : height;
+		for (uint32_t row = (uint32_t)chunk * rowsPerChunk; row < last; row += rowsPerStrip)
+		{
+			uint32_t numRows = (row + rowsPerStrip < last) ? rowsPerStrip : last - row;
+			UnpackRowsT<Traits::bitDepth>(pImage1, stride1, width, row, numRows, &strips[0]);
+			UnpackRowsT<Traits::bitDepth>(pImage2, stride2, width, row, numRows, &strips[stripSize]);
+
+			// (the strips start on even rows, so they have the same Bayer phase as the image)
+			AnalysisTools::CfaPairStats stripStats;
+			AnalysisTools::FindCfaPairStatsT<Traits>(&strips[0], &strips[stripSize], width, 0, numRows / 2, stripStats);
+			chunkResult.Merge(stripStats);
+		}
+		results[chunk] = chunkResult;
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	for (size_t chunk = 0; chunk < numChunks; chunk++)
+		stats.Merge(chunkStats[chunk]);
+
+	return stats;
+}
+
+template <typename Traits>
+inline void PackedPixels::FindHistogramsT(Pylon::CPylonImage& image, AnalysisTools::Histograms& histograms)
+{
+	const uint32_t numBins = 1u << Traits::bitDepth;
+	const uint32_t numChannels = Traits::isBayer ? AnalysisTools::c_numCfaPlanes : 1;
+	uint32_t width = image.GetWidth();
+	uint32_t height = image.GetHeight();
+
+	histograms.numChannels = numChannels;
+	for (uint32_t channel = 0; channel < AnalysisTools::c_numCfaPlanes; channel++)
+		histograms.counts[channel].assign((channel < numChannels) ? numBins : 0, 0);
+	if (width == 0 || height == 0)
+		return;
+
+	// a few chunks per thread, like AnalysisTools::FindHistogramsForFormat() (every chunk needs its own bins)
+	size_t stride = GetStride(image, Traits::bitDepth);
+	uint32_t rowsPerStrip = GetRowsPerStrip<Traits>(width);
+	size_t numChunks = ThreadPool::GetDefaultPool().GetNumThreads() * 2;
+	uint32_t rowsPerChunk = (uint32_t)((height + numChunks - 1) / numChunks);
+	uint32_t minRowsPerChunk = GetRowsPerChunk<Traits>(stride, width);
+	rowsPerChunk = (rowsPerChunk < minRowsPerChunk) ? minRowsPerChunk : ((rowsPerChunk + rowsPerStrip - 1) / rowsPerStrip) * rowsPerStrip;
+	numChunks = (height + rowsPerChunk - 1) / rowsPerChunk;
+	size_t binsPerChunk = (size_t)numChannels * numBins;
+
+	// (grown only, each task clears its own chunk's bins, like AnalysisTools::FindHistogramsForFormat())
+	static thread_local std::vector<uint32_t> chunkCounts;
+	if (chunkCounts.size() < numChunks * binsPerChunk)
+		chunkCounts.resize(numChunks * binsPerChunk);
+	std::vector<uint32_t>& results = chunkCounts;
+
+	const uint8_t* pImage = (const uint8_t*)image.GetBuffer();
+	auto task = [&](size_t chunk)
+	{
+		static thread_local std::vector<uint16_t> strip;
+		strip.resize((size_t)rowsPerStrip * width);
+		uint32_t* pCounts = &results[chunk * binsPerChunk];
+		std::fill(pCounts, pCounts + binsPerChunk, 0);
+
+		uint32_t last = ((chunk + 1) * rowsPerChunk < height) ? (uint32_t)(chunk + 1) * rowsPerChunk : height;
+		for (uint32_t row = (uint32_t)chunk * rowsPerChunk; row < last; row += rowsPerStrip)
+		{
+			uint32_t numRows = (row + rowsPerStrip < last) ? rowsPerStrip : last - row;
+			UnpackRowsT<Traits::bitDepth>(pImage, stride, width, row, numRows, &strip[0]);
+			AnalysisTools::FindHistogramsT<Traits>(&strip[0], width, 0, numRows, pCounts);
+		}
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	AnalysisTools::MergeHistogramChunks(&chunkCounts[0], numChunks, histograms);
+}
+
+template <typename Traits>
+inline bool PackedPixels::FindProfilesT(Pylon::CPylonImage& image, AnalysisTools::Profiles& profiles, std::string& errorMessage)
+{
+	if (image.GetPixelType() != Traits::pixelType)
+	{
+		errorMessage = "ERROR: Image does not have the pixel type this function was compiled for.";
+		return false;
+	}
+
+	// the profiles read the rows in order, so one unpacked row is enough
+	static thread_local std::vector<uint16_t> row;
+	uint32_t width = image.GetWidth();
+	size_t stride = GetStride(image, Traits::bitDepth);
+	const uint8_t* pImage = (const uint8_t*)image.GetBuffer();
+	row.resize((width > 0) ? width : 1);
+	uint16_t* pRow = &row[0];
+
+	profiles.numChannels = Traits::isBayer ? 4 : 1;
+	AnalysisTools::FindProfilesRowsT<uint16_t>([pImage, stride, width, pRow](uint32_t y)
+	{
+		UnpackRowT<Traits::bitDepth>(pImage + (size_t)y * stride, width, pRow);
+		return (const uint16_t*)pRow;
+	}, width, image.GetHeight(), profiles);
+	return true;
+}
+// *********************************************************************************************************
+#endif
@@ -0,0 +1,426 @@
+// PhotonTransfer.h
+// Single-shot photon transfer: the mean versus temporal variance curve and the system gain K from a few pairs of frames,
+// instead of a sweep of hundreds of exposure steps. The scene must be spatially graded but temporally stable (eg: a gradient, or a vignetted flat),
+// so the pixels of one frame cover many signal levels. Each pixel is binned by its own mean signal (of the two frames of a pair),
+// and the temporal variance of each bin comes from the difference of the two frames, as in the sweep.
+// Since every pixel is binned by its own level, this works the same for mono and Bayer sensors.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef PHOTONTRANSFER_H
+#define PHOTONTRANSFER_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience
+#endif
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+#include "AnalysisTools.h"
+#include "DarkBright.h"
+#include "FrameTiming.h"
+#include "ThreadPool.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace PhotonTransfer
+{
+	// The pixels are first sorted into at most this many bins of signal level. Neighbouring bins are grouped into the points of the curve later.
+	const uint32_t c_maxFineBins = 4096;
+
+	// The pixels of one signal level, from any number of pairs.
+	struct Bin
+	{
+		uint64_t count = 0;
+		uint64_t sum = 0; // of image1 + image2
+		int64_t diffSum = 0; // of image1 - image2
+		uint64_t diffSumOfSquares = 0;
+
+		void Merge(const Bin& other);
+	};
+
+	// Bins the pixels of pairs of frames of the same size and format.
+	class Accumulator
+	{
+	private:
+		std::vector<Bin> m_bins;
+		Pylon::EPixelType m_pixelType = Pylon::PixelType_Undefined;
+		uint32_t m_saturationValue = 0;
+		uint32_t m_shift = 0; // bin = (image1 + image2) >> m_shift
+		uint32_t m_numPairs = 0;
+		uint64_t m_numClipped = 0; // pixels at zero or saturation in either frame (their noise is clipped, so they are left out)
+
+	public:
+		void Reset();
+
+		// Add a pair of (unpacked) frames of a stable scene. The first pair sets the format.
+		bool AddPair(Pylon::CPylonImage& image1, Pylon::CPylonImage& image2, std::string& errorMessage);
+
+		const std::vector<Bin>& GetBins() const;
+		uint32_t GetSaturationValue() const;
+		uint32_t GetNumPairs() const;
+		uint64_t GetNumClipped() const;
+	};
+
+	// Single threaded kernel: add numPixels pixel pairs to the bins.
+	template <typename T>
+	void BinPairT(const T* pImage1, const T* pImage2, size_t numPixels, uint32_t shift, uint32_t saturationValue, Bin* pBins, uint64_t& numClipped);
+
+	// Chunked, multi-threaded version of the above.
+	template <typename T>
+	void BinPairParallel(const T* pImage1, const T* pImage2, size_t numPixels, uint32_t shift, uint32_t saturationValue, std::vector<Bin>& bins, uint64_t& numClipped);
+
+	struct Settings
+	{
+		uint64_t minPixelsPerPoint = 2000; // neighbouring bins are grouped until each point of the curve has this many pixels
+		double maxFitLevel = 0.7; // the gain is fitted up to this fraction of saturation (like EMVA1288)
+	};
+
+	// One point of the curve.
+	struct Point
+	{
+		double mean = 0; // DN
+		double temporalVariance = 0; // DN^2
+		uint64_t count = 0; // pixels
+	};
+
+	struct Result
+	{
+		std::vector<Point> points;
+		size_t numFitPoints = 0; // the points below maxFitLevel
+		double systemGain = 0; // K (DN/e-), the slope of the variance over the mean
+		double intercept = 0; // DN^2, variance at zero DN (the dark noise, less K times the dark level)
+		double rSquared = 0; // of the fit
+	};
+
+	// Group the bins into points and fit the linear part of the curve.
+	bool Analyze(const Accumulator& accumulator, const Settings& settings, Result& result, std::string& errorMessage);
+
+	// The points, then the fit.
+	bool SaveCsv(const std::string& fileName, const Result& result, std::string& errorMessage);
+
+	// Find an exposure time at which the mean of the frame is about targetLevel (DN). The exposure time is set in the camera.
+	bool FindExposureTime(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, double targetLevel, FrameTiming::Analyzer* pFrameTiming, double& exposureTime, std::string& errorMessage);
+
+	// Set the exposure time and add numPairs pairs to the accumulator.
+	bool GrabPairs(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, double exposureTime, uint32_t numPairs, FrameTiming::Analyzer* pFrameTiming, Accumulator& accumulator, std::string& errorMessage);
+}
+
+// *********************************************************************************************************
+inline void PhotonTransfer::Bin::Merge(const Bin& other)
+{
+	count += other.count;
+	sum += other.sum;
+	diffSum += other.diffSum;
+	diffSumOfSquares += other.diffSumOfSquares;
+}
+
+inline void PhotonTransfer::Accumulator::Reset()
+{
+	m_bins.clear();
+	m_pixelType = Pylon::PixelType_Undefined;
+	m_saturationValue = 0;
+	m_shift = 0;
+	m_numPairs = 0;
+	m_numClipped = 0;
+}
+
+inline bool PhotonTransfer::Accumulator::AddPair(Pylon::CPylonImage& image1, Pylon::CPylonImage& image2, std::string& errorMessage)
+{
+	if (image1.GetPixelType() != image2.GetPixelType() || image1.GetWidth() != image2.GetWidth() || image1.GetHeight() != image2.GetHeight())
+	{
+		errorMessage = "ERROR: The two frames of a pair must have the same size and pixel format.";
+		return false;
+	}
+
+	if (Pylon::IsPacked(image1.GetPixelType()))
+	{
+		errorMessage = "ERROR: The photon transfer binning doesn't support packed pixel formats.";
+		return false;
+	}
+
+	if (m_numPairs == 0)
+	{
+		m_pixelType = image1.GetPixelType();
+		m_saturationValue = (1u << Pylon::BitDepth(m_pixelType)) - 1;
+		m_shift = 0;
+		while (((2 * m_saturationValue) >> m_shift) >= c_maxFineBins)
+			m_shift++;
+		m_bins.assign(((2 * m_saturationValue) >> m_shift) + 1, Bin());
+	}
+	else if (image1.GetPixelType() != m_pixelType)
+	{
+		errorMessage = "ERROR: All pairs must have the same pixel format.";
+		return false;
+	}
+
+	size_t numPixels = (size_t)image1.GetWidth() * image1.GetHeight();
+	if (Pylon::BitPerPixel(m_pixelType) > 8)
+		BinPairParallel<uint16_t>((const uint16_t*)image1.GetBuffer(), (const uint16_t*)image2.GetBuffer(), numPixels, m_shift, m_saturationValue, m_bins, m_numClipped);
+	else
+		BinPairParallel<uint8_t>((const uint8_t*)image1.GetBuffer(), (const uint8_t*)image2.GetBuffer(), numPixels, m_shift, m_saturationValue, m_bins, m_numClipped);
+	m_numPairs++;
+	return true;
+}
+
+inline const std::vector<PhotonTransfer::Bin>& PhotonTransfer::Accumulator::GetBins() const
+{
+	return m_bins;
+}
+
+inline uint32_t PhotonTransfer::Accumulator::GetSaturationValue() const
+{
+	return m_saturationValue;
+}
+
+inline uint32_t PhotonTransfer::Accumulator::GetNumPairs() const
+{
+	return m_numPairs;
+}
+
+inline uint64_t PhotonTransfer::Accumulator::GetNumClipped() const
+{
+	return m_numClipped;
+}
+
+template <typename T>
+inline void PhotonTransfer::BinPairT(const T* pImage1, const T* pImage2, size_t numPixels, uint32_t shift, uint32_t saturationValue, Bin* pBins, uint64_t& numClipped)
+{
+	for (size_t i = 0; i < numPixels; i++)
+	{
+		uint32_t value1 = pImage1[i];
+		uint32_t value2 = pImage2[i];
+		if (value1 == 0 || value2 == 0 || value1 >= saturationValue || value2 >= saturationValue)
+		{
+			numClipped++;
+			continue;
+		}
+
+		int64_t diff = (int64_t)value1 - (int64_t)value2;
+		Bin& bin = pBins[(value1 + value2) >> shift];
+		bin.count++;
+		bin.sum += value1 + value2;
+		bin.diffSum += diff;
+		bin.diffSumOfSquares += (uint64_t)(diff * diff);
+	}
+}
+
+template <typename T>
+inline void PhotonTransfer::BinPairParallel(const T* pImage1, const T* pImage2, size_t numPixels, uint32_t shift, uint32_t saturationValue, std::vector<Bin>& bins, uint64_t& numClipped)
+{
+	// Every chunk needs its own set of bins, so the chunks are a few per thread rather than c_reductionChunkSize each.
+	// (the sums are integers, so the result doesn't depend on how the pixels are split)
+	size_t numBins = bins.size();
+	size_t numChunks = ThreadPool::GetDefaultPool().GetNumThreads() * 4;
+	size_t pixelsPerChunk = (numPixels + numChunks - 1) / numChunks;
+	if (pixelsPerChunk < AnalysisTools::c_reductionChunkSize)
+		pixelsPerChunk = AnalysisTools::c_reductionChunkSize;
+	numChunks = (numPixels + pixelsPerChunk - 1) / pixelsPerChunk;
+
+	// (the tasks run on the pool threads, so they must use this thread's arrays through references, not the thread_local names)
+	static thread_local std::vector<Bin> chunkBins;
+	static thread_local std::vector<uint64_t> chunkClipped;
+	chunkBins.assign(numChunks * numBins, Bin());
+	chunkClipped.assign(numChunks, 0);
+	std::vector<Bin>& resultBins = chunkBins;
+	std::vector<uint64_t>& resultClipped = chunkClipped;
+
+	auto task = [&](size_t chunk)
+	{
+		size_t first = chunk * pixelsPerChunk;
+		size_t count = (first + pixelsPerChunk < numPixels) ? pixelsPerChunk : numPixels - first;
+		BinPairT<T>(pImage1 + first, pImage2 + first, count, shift, saturationValue, &resultBins[chunk * numBins], resultClipped[chunk]);
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	for (size_t chunk = 0; chunk < numChunks; chunk++)
+	{
+		for (size_t b = 0; b < numBins; b++)
+			bins[b].Merge(chunkBins[chunk * numBins + b]);
+		numClipped += chunkClipped[chunk];
+	}
+}
+
+inline bool PhotonTransfer::Analyze(const Accumulator& accumulator, const Settings& settings, Result& result, std::string& errorMessage)
+{
+	result = Result();
+	const std::vector<Bin>& bins = accumulator.GetBins();
+
+	// Group neighbouring bins until there are enough pixels for a precise variance. The difference of two frames has no
+	// spatial part, so pixels of slightly different levels can be pooled without adding to the variance.
+	Bin group;
+	for (size_t b = 0; b < bins.size(); b++)
+	{
+		group.Merge(bins[b]);
+		if (group.count < settings.minPixelsPerPoint || group.count < 2)
+			continue;
+
+		Point point;
+		point.count = group.count;
+		point.mean = (double)group.sum / group.count / 2;
+		double diffVariance = ((double)group.diffSumOfSquares - (double)group.diffSum * group.diffSum / group.count) / (group.count - 1);
+		point.temporalVariance = (diffVariance > 0) ? diffVariance / 2 : 0;
+		result.points.push_back(point);
+		group = Bin();
+	}
+
+	// least squares fit of variance = K * mean + intercept, over the linear part of the curve
+	double maxFitMean = settings.maxFitLevel * accumulator.GetSaturationValue();
+	double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0, sumYY = 0;
+	for (size_t p = 0; p < result.points.size(); p++)
+	{
+		const Point& point = result.points[p];
+		if (point.mean > maxFitMean)
+			continue;
+
+		result.numFitPoints++;
+		sumX += point.mean;
+		sumY += point.temporalVariance;
+		sumXX += point.mean * point.mean;
+		sumXY += point.mean * point.temporalVariance;
+		sumYY += point.temporalVariance * point.temporalVariance;
+	}
+
+	double n = (double)result.numFitPoints;
+	double denominator = n * sumXX - sumX * sumX;
+	if (result.numFitPoints < 3 || denominator <= 0)
+	{
+		errorMessage = "ERROR: Not enough signal levels for the photon transfer fit. Use a scene with a stronger gradient, more pairs, or a second exposure time.";
+		return false;
+	}
+
+	result.systemGain = (n * sumXY - sumX * sumY) / denominator;
+	result.intercept = (sumY - result.systemGain * sumX) / n;
+	double varianceY = n * sumYY - sumY * sumY;
+	result.rSquared = (varianceY > 0) ? (n * sumXY - sumX * sumY) * (n * sumXY - sumX * sumY) / (denominator * varianceY) : 0;
+	return true;
+}
+
+inline bool PhotonTransfer::SaveCsv(const std::string& fileName, const Result& result, std::string& errorMessage)
+{
+	std::FILE* const file = std::fopen(fileName.c_str(), "wb");
+	if (file == NULL)
+	{
+		errorMessage = "ERROR: Could not open " + fileName + " for writing.";
+		return false;
+	}
+
+	std::fprintf(file, "Mean (DN),Temporal Variance (DN^2),Pixels\n");
+	for (size_t p = 0; p < result.points.size(); p++)
+		std::fprintf(file, "%f,%f,%llu\n", result.points[p].mean, result.points[p].temporalVariance, (unsigned long long)result.points[p].count);
+	std::fprintf(file, "\nSystem Gain K (DN/e-),Variance Intercept (DN^2),R^2,Fit Points\n");
+	bool written = std::fprintf(file, "%f,%f,%f,%llu\n", result.systemGain, result.intercept, result.rSquared, (unsigned long long)result.numFitPoints) > 0;
+	written = (std::fclose(file) == 0) && written;
+
+	if (written == false)
+	{
+		errorMessage = "ERROR: Could not write " + fileName + ".";
+		return false;
+	}
+	return true;
+}
+
+inline bool PhotonTransfer::FindExposureTime(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, double targetLevel, FrameTiming::Analyzer* pFrameTiming, double& exposureTime, std::string& errorMessage)
+{
+	try
+	{
+		Pylon::CBaslerUniversalGrabResultPtr ptrGrabResult1;
+		Pylon::CBaslerUniversalGrabResultPtr ptrGrabResult2;
+		Pylon::CPylonImage image;
+		double minExposureTime = camera.ExposureTime.GetMin();
+		double maxExposureTime = camera.ExposureTime.GetMax();
+
+		// Scale the exposure time by how far the mean is from the target, a few times. The dark level is unknown,
+		// so each step undershoots a little, and the steps are limited so a very dark first frame doesn't overshoot.
+		exposureTime = minExposureTime;
+		for (int step = 0; step < 12; step++)
+		{
+			camera.ExposureTime.SetValue(exposureTime);
+			DarkBright::GrabPair(camera, triggersPerPair, ptrGrabResult1, ptrGrabResult2, pFrameTiming);
+			if (ptrGrabResult1->GrabSucceeded() == false)
+			{
+				errorMessage = "ERROR: A grab for finding the exposure time failed.";
+				return false;
+			}
+
+			image.AttachGrabResultBuffer(ptrGrabResult1);
+			AnalysisTools::Stats stats = AnalysisTools::FindStats(image);
+			double mean = (stats.count > 0) ? (double)stats.sum / stats.count : 0;
+			if (mean > 0.9 * targetLevel && mean < 1.1 * targetLevel)
+				return true;
+
+			double factor = (mean > 0) ? targetLevel / mean : 16;
+			factor = (factor > 16) ? 16 : factor;
+			double next = exposureTime * factor;
+			next = (next < minExposureTime) ? minExposureTime : ((next > maxExposureTime) ? maxExposureTime : next);
+			if (next == exposureTime)
+				return true; // can't get any closer
+			exposureTime = next;
+		}
+		return true;
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in FindExposureTime(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+}
+
+inline bool PhotonTransfer::GrabPairs(Pylon::CBaslerUniversalInstantCamera& camera, uint32_t triggersPerPair, double exposureTime, uint32_t numPairs, FrameTiming::Analyzer* pFrameTiming, Accumulator& accumulator, std::string& errorMessage)
+{
+	try
+	{
+		Pylon::CBaslerUniversalGrabResultPtr ptrGrabResult1;
+		Pylon::CBaslerUniversalGrabResultPtr ptrGrabResult2;
+		Pylon::CPylonImage image1;
+		Pylon::CPylonImage image2;
+
+		camera.ExposureTime.SetValue(exposureTime);
+		for (uint32_t p = 0; p < numPairs; p++)
+		{
+			DarkBright::GrabPair(camera, triggersPerPair, ptrGrabResult1, ptrGrabResult2, pFrameTiming);
+			if (ptrGrabResult1->GrabSucceeded() == false || ptrGrabResult2->GrabSucceeded() == false)
+			{
+				errorMessage = "ERROR: A grab for the photon transfer curve failed.";
+				return false;
+			}
+
+			image1.AttachGrabResultBuffer(ptrGrabResult1);
+			image2.AttachGrabResultBuffer(ptrGrabResult2);
+			if (accumulator.AddPair(image1, image2, errorMessage) == false)
+				return false;
+		}
+		return true;
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in GrabPairs(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+}
+// *********************************************************************************************************
+#endif
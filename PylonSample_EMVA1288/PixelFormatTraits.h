@@ -0,0 +1,113 @@
+// PixelFormatTraits.h
+// Compile-time description of the pixel formats the analysis kernels support.
+// To support a new format, add a specialization of Traits<> and an entry in FormatDispatch.h.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef PIXELFORMATTRAITS_H
+#define PIXELFORMATTRAITS_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+
+#include <stdint.h>
+
+namespace PixelFormatTraits
+{
+	// The color of the top-left pixel pair of the Bayer pattern (Cfa_None for mono).
+	enum ECfaPhase
+	{
+		Cfa_None,
+		Cfa_RG,
+		Cfa_GR,
+		Cfa_GB,
+		Cfa_BG
+	};
+
+	// Where each color sits in the 2x2 Bayer cell: 0=(0,0), 1=(0,1), 2=(1,0), 3=(1,1).
+	// green1 is the green pixel on the red row (Gr), green2 the one on the blue row (Gb).
+	template <ECfaPhase cfa> struct CfaLayout;
+	template <> struct CfaLayout<Cfa_None> { static const uint32_t red = 0, green1 = 0, green2 = 0, blue = 0; };
+	template <> struct CfaLayout<Cfa_RG> { static const uint32_t red = 0, green1 = 1, green2 = 2, blue = 3; };
+	template <> struct CfaLayout<Cfa_GR> { static const uint32_t red = 1, green1 = 0, green2 = 3, blue = 2; };
+	template <> struct CfaLayout<Cfa_GB> { static const uint32_t red = 2, green1 = 3, green2 = 0, blue = 1; };
+	template <> struct CfaLayout<Cfa_BG> { static const uint32_t red = 3, green1 = 2, green2 = 1, blue = 0; };
+
+	// Common members of all format traits.
+	//   value_type:   how one pixel is stored in memory (after unpacking)
+	//   pixelType:    the pylon pixel type these traits describe
+	template <Pylon::EPixelType PixelType, typename T, ECfaPhase Cfa, uint32_t BitDepth>
+	struct TraitsBase : public CfaLayout<Cfa>
+	{
+		typedef T value_type;
+		static const Pylon::EPixelType pixelType = PixelType;
+		static const ECfaPhase cfa = Cfa;
+		static const bool isBayer = (Cfa != Cfa_None);
+		static const uint32_t bitDepth = BitDepth;
+		static const bool isPacked = false;
+	};
+
+	// Packed formats (the GenICam "p" formats, eg: Mono12p): each row is a stream of bitDepth bit pixels, least significant bit first.
+	// value_type is what the kernels unpack them to (see PackedPixels.h).
+	template <Pylon::EPixelType PixelType, ECfaPhase Cfa, uint32_t BitDepth>
+	struct PackedTraitsBase : public TraitsBase<PixelType, uint16_t, Cfa, BitDepth>
+	{
+		static const bool isPacked = true;
+	};
+
+	// Only the formats listed here can be analyzed.
+	template <Pylon::EPixelType pixelType> struct Traits;
+
+	template <> struct Traits<Pylon::PixelType_Mono8> : public TraitsBase<Pylon::PixelType_Mono8, uint8_t, Cfa_None, 8> {};
+	template <> struct Traits<Pylon::PixelType_Mono10> : public TraitsBase<Pylon::PixelType_Mono10, uint16_t, Cfa_None, 10> {};
+	template <> struct Traits<Pylon::PixelType_Mono12> : public TraitsBase<Pylon::PixelType_Mono12, uint16_t, Cfa_None, 12> {};
+	template <> struct Traits<Pylon::PixelType_Mono16> : public TraitsBase<Pylon::PixelType_Mono16, uint16_t, Cfa_None, 16> {};
+
+	template <> struct Traits<Pylon::PixelType_BayerRG8> : public TraitsBase<Pylon::PixelType_BayerRG8, uint8_t, Cfa_RG, 8> {};
+	template <> struct Traits<Pylon::PixelType_BayerGR8> : public TraitsBase<Pylon::PixelType_BayerGR8, uint8_t, Cfa_GR, 8> {};
+	template <> struct Traits<Pylon::PixelType_BayerGB8> : public TraitsBase<Pylon::PixelType_BayerGB8, uint8_t, Cfa_GB, 8> {};
+	template <> struct Traits<Pylon::PixelType_BayerBG8> : public TraitsBase<Pylon::PixelType_BayerBG8, uint8_t, Cfa_BG, 8> {};
+
+	template <> struct Traits<Pylon::PixelType_BayerRG10> : public TraitsBase<Pylon::PixelType_BayerRG10, uint16_t, Cfa_RG, 10> {};
+	template <> struct Traits<Pylon::PixelType_BayerGR10> : public TraitsBase<Pylon::PixelType_BayerGR10, uint16_t, Cfa_GR, 10> {};
+	template <> struct Traits<Pylon::PixelType_BayerGB10> : public TraitsBase<Pylon::PixelType_BayerGB10, uint16_t, Cfa_GB, 10> {};
+	template <> struct Traits<Pylon::PixelType_BayerBG10> : public TraitsBase<Pylon::PixelType_BayerBG10, uint16_t, Cfa_BG, 10> {};
+
+	template <> struct Traits<Pylon::PixelType_BayerRG12> : public TraitsBase<Pylon::PixelType_BayerRG12, uint16_t, Cfa_RG, 12> {};
+	template <> struct Traits<Pylon::PixelType_BayerGR12> : public TraitsBase<Pylon::PixelType_BayerGR12, uint16_t, Cfa_GR, 12> {};
+	template <> struct Traits<Pylon::PixelType_BayerGB12> : public TraitsBase<Pylon::PixelType_BayerGB12, uint16_t, Cfa_GB, 12> {};
+	template <> struct Traits<Pylon::PixelType_BayerBG12> : public TraitsBase<Pylon::PixelType_BayerBG12, uint16_t, Cfa_BG, 12> {};
+
+	template <> struct Traits<Pylon::PixelType_BayerRG16> : public TraitsBase<Pylon::PixelType_BayerRG16, uint16_t, Cfa_RG, 16> {};
+	template <> struct Traits<Pylon::PixelType_BayerGR16> : public TraitsBase<Pylon::PixelType_BayerGR16, uint16_t, Cfa_GR, 16> {};
+	template <> struct Traits<Pylon::PixelType_BayerGB16> : public TraitsBase<Pylon::PixelType_BayerGB16, uint16_t, Cfa_GB, 16> {};
+	template <> struct Traits<Pylon::PixelType_BayerBG16> : public TraitsBase<Pylon::PixelType_BayerBG16, uint16_t, Cfa_BG, 16> {};
+
+	template <> struct Traits<Pylon::PixelType_Mono10p> : public PackedTraitsBase<Pylon::PixelType_Mono10p, Cfa_None, 10> {};
+	template <> struct Traits<Pylon::PixelType_Mono12p> : public PackedTraitsBase<Pylon::PixelType_Mono12p, Cfa_None, 12> {};
+
+	template <> struct Traits<Pylon::PixelType_BayerRG10p> : public PackedTraitsBase<Pylon::PixelType_BayerRG10p, Cfa_RG, 10> {};
+	template <> struct Traits<Pylon::PixelType_BayerGR10p> : public PackedTraitsBase<Pylon::PixelType_BayerGR10p, Cfa_GR, 10> {};
+	template <> struct Traits<Pylon::PixelType_BayerGB10p> : public PackedTraitsBase<Pylon::PixelType_BayerGB10p, Cfa_GB, 10> {};
+	template <> struct Traits<Pylon::PixelType_BayerBG10p> : public PackedTraitsBase<Pylon::PixelType_BayerBG10p, Cfa_BG, 10> {};
+
+	template <> struct Traits<Pylon::PixelType_BayerRG12p> : public PackedTraitsBase<Pylon::PixelType_BayerRG12p, Cfa_RG, 12> {};
+	template <> struct Traits<Pylon::PixelType_BayerGR12p> : public PackedTraitsBase<Pylon::PixelType_BayerGR12p, Cfa_GR, 12> {};
+	template <> struct Traits<Pylon::PixelType_BayerGB12p> : public PackedTraitsBase<Pylon::PixelType_BayerGB12p, Cfa_GB, 12> {};
+	template <> struct Traits<Pylon::PixelType_BayerBG12p> : public PackedTraitsBase<Pylon::PixelType_BayerBG12p, Cfa_BG, 12> {};
+}
+
+#endif
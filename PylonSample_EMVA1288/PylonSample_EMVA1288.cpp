@@ -15,7 +15,9 @@
 	Likewise, the color of the light source must be taken into account as well.
 */
 
+#ifndef LINUX_BUILD
 #define WIN_BUILD
+#endif
 
 #ifdef WIN_BUILD
 #define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience
@@ -26,11 +28,30 @@
 
 #include <pylon/BaslerUniversalInstantCamera.h>
 
+#ifdef WIN_BUILD
 #include <pylon/PylonGUI.h>
+#endif
 
-#include "BayerExtract.h"
 #include "AnalysisTools.h"
 #include "StitchImage.h" // for convience of displaying some images
+#include "FormatDispatch.h"
+#include "ImagePool.h"
+#include "SweepScheduler.h"
+#include "ExposureSequencer.h"
+#include "CommandLine.h"
+#include "RegressionHarness.h"
+#include "DarkBright.h"
+#include "FrameTiming.h"
+#include "ResultWriter.h"
+#include "AdaptiveSampling.h"
+#include "BatchAnalyzer.h"
+#include "RoiStats.h"
+#include "FlatField.h"
+#include "DarkFrame.h"
+#include "PhotonTransfer.h"
+#include "Checkpoint.h"
+#include "ThreadTuning.h"
+#include "CameraSetup.h"
 
 // Namespace for using pylon objects.
 using namespace Pylon;
@@ -46,6 +67,28 @@ int main(int argc, char* argv[])
 	// The exit code of the sample application.
 	int exitCode = 0;
 
+	// Options for running without hardware and without user interaction (see CommandLine::PrintUsage())
+	CommandLine::Options options;
+	{
+		std::string errorMessage = "";
+		if (CommandLine::Parse(argc, argv, options, errorMessage) == false)
+		{
+			cerr << errorMessage << endl;
+			CommandLine::PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	// The camera emulator must be enabled before the pylon runtime starts.
+	if (options.useEmulator && getenv("PYLON_CAMEMU") == NULL)
+	{
+#ifdef WIN_BUILD
+		_putenv_s("PYLON_CAMEMU", "1");
+#else
+		setenv("PYLON_CAMEMU", "1", 0);
+#endif
+	}
+
 	// Before using any pylon methods, the pylon runtime must be initialized.
 	PylonInitialize();
 
@@ -61,26 +104,255 @@ int main(int argc, char* argv[])
 	double snrRed = 0;
 	double snrGreen = 0;
 	double snrBlue = 0;
+	double rowFpn = 0; // spatial noise of the row mean profile (averaged over the color channels)
+	double colFpn = 0; // spatial noise of the column mean profile (averaged over the color channels)
 	// How we will measure it
 	// We will grab images of this size
 	int64_t	width = 128;
 	int64_t height = 128;
+	// What settings we will sweep. Every combination is measured. By default, the exposure time is ramped from minimum until saturation.
+	// The scheduler orders the combinations so the stream is restarted (for AOI/pixel format changes) as rarely as possible.
+	// For the highest frame rate on USB3 and GigE links, use a packed format (eg: streamsToTest[0].pixelFormat = "BayerRG12p" or "Mono10p").
+	// The measurements unpack the pixels on the fly. (ROI shading, the flat-field correction and contact sheets need an unpacked format.)
+	std::vector<SweepScheduler::StreamConfig> streamsToTest(1); // default: a 128x128 AOI near the center of the sensor
+	std::vector<double> gainsToTest = { 0 };
+	std::vector<double> blackLevelsToTest = { 0 };
+	std::vector<double> exposureTimesToTest = { SweepScheduler::c_exposureRamp };
+	// Shading and vignetting: measure several ROIs of every frame (center, corners and edge midpoints) and log them as extra columns,
+	// so the shading at every exposure time comes from the same sweep. Use a large AOI in streamsToTest (eg: the full sensor).
+	bool measureShading = false;
+	uint32_t shadingRoiSize = 64;
+	std::vector<RoiStats::Roi> rois; // in sensor coordinates. Filled with the shading layout if empty, or list your own (up to RoiStats::c_maxRois).
+	RoiStats::Plan roiPlan; // where the ROIs are in the current frame (rebuilt when the AOI changes)
+	std::vector<RoiStats::RoiPairStats> roiStats;
+	double blackLevel = 0; // the black level currently set in the camera (the calibration may raise it)
+	// All intermediate images are checked out of this pool once and reused for every frame, so the test loop doesn't allocate images.
+	// (the pool only counts its own buffers: small vectors, eg: the pending measurements, can still grow in the loop)
+	// (declared before the images, so the images are released before the pool frees its buffers)
+	ImagePool::Pool imagePool;
+	uint64_t warmupAllocations = 0; // pool allocations made while checking out the images at the start of each stream
 	// We will take two frames at each exposure time and average the values into one 'image'.
 	CPylonImage image1;
 	CPylonImage image2;
-	// With color cameras, we grab two images, but also extract the red, green, blue pixels from each, and treat them as "3 cameras".
-	CPylonImage RedImage1;
-	CPylonImage GreenImage1;
-	CPylonImage BlueImage1;
-	CPylonImage RedImage2;
-	CPylonImage GreenImage2;
-	CPylonImage BlueImage2;
+	// With color cameras, the red, green and blue pixels of each image are measured separately, as if they were "3 cameras".
+	// The two greens (Gr on the red rows, Gb on the blue rows) are kept apart as well, so any imbalance between them is measured too.
+	// All four planes of both images are measured in a single pass over the two mosaics.
+	AnalysisTools::CfaPairStats cfaStats;
+	// For debugging, the images are stitched side by side into this.
+	CPylonImage stitchedPair;
+	// For debugging, a half resolution color preview of the first image of each pair (one RGB pixel per 2x2 cell, see BayerPreview.h).
+	// Cells with any pixel at saturation are painted magenta.
+	CPylonImage colorPreview;
+#if defined WIN_BUILD
+	bool showSaturationOverlay = true; // (the preview is only made where it can be displayed)
+#endif
+	// For debugging, a contact sheet of the sweep: the first image of every measurement becomes one (downscaled) tile,
+	// contactSheetColumns x contactSheetRows tiles per sheet. Each completed sheet is displayed.
+	bool makeContactSheet = false;
+	uint32_t contactSheetColumns = 8;
+	uint32_t contactSheetRows = 6;
+	uint32_t contactSheetDownscale = 2;
+	StitchImage::TileCompositor contactSheet;
+	uint32_t contactSheetSlot = 0;
+	uint64_t contactSheetsShown = 0;
+	CPylonImage contactSheetImage;
+	// Row and column profiles of both images, for the spatial nonuniformity (spectrogram) measurements.
+	AnalysisTools::Profiles profiles1;
+	AnalysisTools::Profiles profiles2;
+	AnalysisTools::Profiles profilesAvg;
+	// The basic statistics of both images, gathered in one pass each.
+	AnalysisTools::Stats stats1;
+	AnalysisTools::Stats stats2;
+	// Per-channel histograms of both images, for the percentile based decisions below. Only gathered when the min/max can't decide.
+	AnalysisTools::Histograms histograms1;
+	AnalysisTools::Histograms histograms2;
+	// The analysis kernels compiled for the camera's pixel format. Looked up once, when the first images arrive.
+	const FormatDispatch::Kernels* pKernels = nullptr;
 	int exposureTimeIncrementUsec = 10; // With each measurment, we will increment the exposure time
 	uint32_t blackLevelCalibThreshold = 0; // Before testing, increase the black level until min pixel value is above this threshold. Use 0 to disable.
+	// The black level and saturation decisions use a low percentile of each color channel instead of the single darkest pixel,
+	// so a few dead or stuck pixels can't keep raising the black level or keep the sweep from ever reaching saturation. Use 0 for the plain min.
+	double blackLevelCalibPercentile = 0.1; // percent of pixels (per channel) allowed below blackLevelCalibThreshold
+	double saturationPercentile = 1.0; // saturation is reached when no more than this percent of pixels (per channel) are below the saturation value
 	uint32_t maxImagesToGrab = 100000; // We stop when saturation is reached. If it can't be reached, stop test after this many total images grabbed.
-	// Where we will log the measurements, a csv file
-	std::string csvFileName = "";
-	
+	// If the camera has a sequencer, upcoming exposure times are programmed into it a block at a time,
+	// so the host doesn't need to set and read back the exposure time for every measurement. Set false to always set it directly.
+	bool useExposureSequencer = true;
+	ExposureSequencer::Sequencer exposureSequencer;
+	std::vector<double> sequencerBlock; // the exposure times of the next block (reused)
+	double nextExposureTime = 0; // the exposure time the next measurement should use
+	// Each exposure time takes pairsPerExposure pairs. With --adaptive, pairs are grabbed until the mean and temporal variance estimates
+	// are precise enough (or samplingSettings.maxPairs is reached). The sequencer must know the number of pairs in advance, so it isn't used then.
+	uint32_t pairsPerExposure = 1;
+	AdaptiveSampling::Settings samplingSettings;
+	AdaptiveSampling::PointEstimator pointEstimator;
+	// Where we will log the measurements. The results are written on a separate thread, so the disk never holds up grabbing.
+	ResultWriter::EFormat resultFormat = ResultWriter::Format_Csv; // or Format_Binary, Format_JsonLines
+	ResultWriter::FlushPolicy flushPolicy; // how often the results are written/synced to disk
+	ResultWriter::Writer resultWriter;
+	std::string resultFileName = "";
+	// The horizontal and vertical spectrograms are logged once, at the first measurement which reaches 50% of saturation.
+	std::string spectrogramFileName = "";
+	bool spectrogramSaved = false;
+	// EMVA1288 also needs the dark signal at every exposure time. With a Basler light, we can measure it in the same run:
+	// each bright measurement gets a dark partner at the same exposure time, taken with the light off, and the row is logged with dark-corrected means.
+	bool measureDark = false;
+	// How the light is toggled: 1 = a dark measurement right after each bright one, N = N bright measurements, then their N dark partners,
+	// 0 = all dark measurements of a sweep point (eg: a gain) in one block. Bigger blocks wait for the light to settle less often.
+	uint32_t darkBlockSize = 0;
+	uint32_t lightSettleTimeMs = 100; // after switching the light, wait this long before grabbing
+	DarkBright::Measurement measurement;
+	std::vector<DarkBright::Measurement> pendingMeasurements; // bright measurements waiting for their dark partners
+	// Dark subtraction: instead of a dark partner for every measurement, master dark frames (darkFrames frames each, with the light off)
+	// are captured where the ramp is and darkExposureSpanUs above it, and every bright pair has the dark frame of its exposure time
+	// (interpolated between the masters) subtracted before it is measured. The rows are logged with the dark levels of the masters,
+	// like measureDark (which this replaces). Needs a Basler light. The flat-field correction, where it is applied, removes the dark frame itself.
+	bool subtractDark = false;
+	uint32_t darkFrames = 8;
+	double darkExposureSpanUs = 1000;
+	size_t darkCacheMegabytes = 256; // masters which don't fit are evicted: those of other settings first, then the farthest exposure times
+	DarkFrame::Cache darkCache;
+	DarkFrame::Key darkKey; // the settings the frames are taken with now
+	const DarkFrame::Master* pDarkFrame = nullptr; // subtracted from the current pair
+	// Flat-field correction: at the first measurement which reaches 50% of saturation, flatFieldFrames frames are averaged into a master flat,
+	// and (with the light off) into a master dark. Every pixel gets a fixed point offset and gain, which are saved for production use,
+	// and a fresh dark and bright pair are corrected to check the DSNU and PRNU left after correction. Needs a Basler light, like measureDark.
+	bool buildFlatField = false;
+	uint32_t flatFieldFrames = 16;
+	bool correctFrames = false; // once the correction is built, measure the rest of the sweep from corrected frames
+	FlatField::Accumulator masterDark;
+	FlatField::Accumulator masterFlat;
+	FlatField::Correction flatField;
+	std::string flatFieldFileName = "";
+	bool flatFieldPending = false; // reached 50% of saturation, build the correction at flatFieldExposureTime
+	bool flatFieldTried = false;
+	double flatFieldExposureTime = 0;
+	// Screening (--single-shot): the photon transfer curve from a few pairs of a graded but stable scene (eg: a gradient or a vignetted flat),
+	// filling a large AOI (streamsToTest[0]). Replaces the sweep.
+	std::vector<double> singleShotExposureTimes; // empty: find the exposure time for a mean of 40% of saturation, and add a quarter of it
+	uint32_t singleShotPairs = 4; // per exposure time
+	PhotonTransfer::Settings photonTransferSettings;
+	// Timing of each measurement (trigger until logged) and of the whole run
+	RegressionHarness::StepTimer stepTimer;
+	// Timing of every frame: latency, intervals, missing frames, and whether the two frames of a measurement really are one burst.
+	// The histograms are logged at the end. Use this to tune the transport settings, and to check the measurement pairs.
+	FrameTiming::Analyzer frameTiming;
+	std::string frameTimingFileName = "";
+	// Checkpoints: after every sweep point, and every checkpointIntervalSec within a point, the state of the sweep is saved
+	// (on its own thread) to <base>_Checkpoint.bin. If the sweep is interrupted, run it again with --resume to continue from there.
+	bool saveCheckpoints = true;
+	double checkpointIntervalSec = 60;
+	Checkpoint::Writer checkpointWriter;
+	Checkpoint::State checkpointState; // the state posted last (or resumed from)
+	std::string checkpointFileName = "";
+	double lastCheckpointTime = 0;
+	// Threads: on a busy host, pin the main thread (which triggers, grabs and helps the analysis) and the analysis workers to their own cores
+	// or to one NUMA node, and run the grab threads at realtime priority, so RetrieveResult() doesn't time out (see also the command line).
+	// The CPU time of every thread is reported at the end. Use it to size numThreads.
+	ThreadTuning::Settings threadSettings;
+	threadSettings.numaLocalBuffers = true; // with a NUMA node, allocate the frame buffers there too
+	ThreadTuning::NumaBufferFactory frameBufferFactory; // (must outlive the camera)
+	std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+	// Camera setup: the finished setup is kept as .pfs snapshots (see CameraSetup.h), so later runs set the camera up in one batch.
+	// Raise setupVersion when the setup below changes, so the snapshots are taken again (width and height are part of the snapshot names).
+	// The time from the start until the first frame is reported.
+	bool useSetupCache = true;
+	std::string setupCacheDirectory = ""; // with the trailing slash (eg: "C:/Temp/"), empty for the working directory
+	uint32_t setupVersion = 1;
+	bool firstFrameReported = false;
+
+	if (options.adaptiveSampling == false)
+	{
+		samplingSettings.minPairs = pairsPerExposure;
+		samplingSettings.maxPairs = pairsPerExposure;
+	}
+
+	// Set up the threads before any analysis runs (the analysis pool is created here).
+	{
+		std::string errorMessage = "";
+		threadSettings.numThreads = options.numThreads;
+		threadSettings.numaNode = options.numaNode;
+		threadSettings.realtimeGrab = options.realtimeGrab;
+		threadSettings.numaLocalBuffers = threadSettings.numaLocalBuffers && options.numaNode >= 0;
+		if (ThreadTuning::ParseCoreList(options.mainCores, threadSettings.mainCores, errorMessage) == false
+			|| ThreadTuning::ParseCoreList(options.workerCores, threadSettings.workerCores, errorMessage) == false)
+		{
+			cerr << errorMessage << endl;
+			PylonTerminate();
+			return 1;
+		}
+		// (a missing CAP_SYS_NICE shouldn't stop the test, but it should be seen)
+		if (ThreadTuning::Apply(threadSettings, errorMessage) == false)
+			cerr << errorMessage << endl;
+	}
+
+	// Offline mode: analyze frames saved on disk (see BatchAnalyzer.h) and log them like a live test. No camera is used.
+	if (options.analyzeDirectories.empty() == false)
+	{
+		std::string errorMessage = "";
+		BatchAnalyzer::RawFormat rawFormat;
+		rawFormat.width = options.rawWidth;
+		rawFormat.height = options.rawHeight;
+		if (options.rawPixelFormat.empty() == false)
+			rawFormat.pixelType = CPixelTypeMapper::GetPylonPixelTypeByName(options.rawPixelFormat.c_str());
+
+		// the results are named after the (first) directory
+		std::string baseFileName = options.analyzeDirectories[0];
+		while (baseFileName.size() > 1 && (baseFileName.back() == '/' || baseFileName.back() == '\\'))
+			baseFileName.pop_back();
+		baseFileName = "Analysis_" + baseFileName.substr(baseFileName.find_last_of("/\\") + 1);
+
+		std::vector<DarkBright::Measurement> rows;
+		BatchAnalyzer::Summary summary;
+		if (options.rawPixelFormat.empty() == false && rawFormat.pixelType == PixelType_Undefined)
+		{
+			cout << "ERROR: Unknown pixel format " << options.rawPixelFormat << endl;
+			exitCode = 1;
+		}
+		else if (BatchAnalyzer::Run(options.analyzeDirectories, rawFormat, samplingSettings, rows, summary, errorMessage) == false)
+		{
+			cout << errorMessage << endl;
+			exitCode = 1;
+		}
+		else if (resultWriter.Open(baseFileName, resultFormat, flushPolicy, resultFileName, errorMessage) == false)
+		{
+			cout << errorMessage << endl;
+			exitCode = 1;
+		}
+		else
+		{
+			for (size_t r = 0; r < rows.size(); r++)
+				resultWriter.Push(rows[r]);
+			if (resultWriter.Close(errorMessage) == false)
+			{
+				cout << errorMessage << endl;
+				exitCode = 1;
+			}
+
+			cout << "Analyzed " << summary.numPairs << " pairs (" << summary.numFrames << " frames in " << summary.numFiles << " files) in " << summary.seconds << " s, "
+				<< ((summary.seconds > 0) ? summary.bytesAnalyzed / summary.seconds / 1e6 : 0) << " MB/s, " << ThreadPool::GetDefaultPool().GetNumThreads() << " threads." << endl;
+			cout << "see \"" << resultFileName << "\" for results." << endl;
+
+			if (options.referenceCsv.empty() == false)
+			{
+				std::string report = "";
+				if (RegressionHarness::CompareCsv(resultFileName, options.referenceCsv, options.tolerance, report) == false)
+					exitCode = 2;
+				cout << report << endl;
+			}
+			cout << ThreadTuning::GetReport(runStart) << endl;
+		}
+
+		if (options.waitOnExit)
+		{
+			cerr << endl << "Press enter to exit." << endl;
+			while (cin.get() != '\n');
+		}
+
+		PylonTerminate();
+		return exitCode;
+	}
+
 	try
 	{
 		// Get the transport layer factory.
@@ -89,7 +361,16 @@ int main(int argc, char* argv[])
 		// Get all attached devices and exit application if no device is found.
 		DeviceInfoList_t devices;
 
-		if (tlFactory.EnumerateDevices(devices) == 0)
+		// With the emulator, only look at emulated devices, so a connected camera doesn't get in the way.
+		DeviceInfoList_t filter;
+		if (options.useEmulator)
+		{
+			CDeviceInfo emulatorInfo;
+			emulatorInfo.SetDeviceClass(BaslerCamEmuDeviceClass);
+			filter.push_back(emulatorInfo);
+		}
+
+		if ((options.useEmulator ? tlFactory.EnumerateDevices(devices, filter) : tlFactory.EnumerateDevices(devices)) == 0)
 		{
 			throw RUNTIME_EXCEPTION("Camera Not Found.");
 		}
@@ -104,57 +385,141 @@ int main(int argc, char* argv[])
 		// open the camera to configure settings.
 		camera.Open();
 
-		// Reset camera to default settings.
-		camera.UserSetSelector.TrySetValue(UserSetSelectorEnums::UserSetSelector_Default);
-		camera.UserSetLoad.Execute();
+		// Raise the priority of pylon's grab threads, and allocate the frame buffers on our NUMA node (see threadSettings).
+		{
+			std::string errorMessage = "";
+			if (ThreadTuning::ApplyToCamera(camera, threadSettings, frameBufferFactory, errorMessage) == false)
+				cerr << errorMessage << endl;
+		}
+
+		// Set the camera up for the test. Feature by feature, this is a few dozen writes (each a round trip to the camera),
+		// so the finished setup is kept as a snapshot (see CameraSetup.h), and later runs with the same camera model and firmware
+		// only write the features which differ from the defaults, in one batch. Use --fresh-setup to take the snapshot again.
+		std::chrono::steady_clock::time_point setupStart = std::chrono::steady_clock::now();
+		std::string setupFileBase = CameraSetup::MakeFileBase(camera, setupCacheDirectory, width, height, setupVersion);
+		CameraSetup::Report setupReport;
+		bool setupFromSnapshot = false;
+		uint32_t triggersPerPair = 1;
+		if (useSetupCache && options.freshSetup == false && CameraSetup::HasSnapshots(setupFileBase))
+		{
+			std::string errorMessage = "";
+			setupFromSnapshot = CameraSetup::Apply(camera, setupFileBase, setupReport, errorMessage);
+			if (setupFromSnapshot == false)
+				cout << errorMessage << endl << "Setting the camera up feature by feature." << endl;
+		}
+
+		if (setupFromSnapshot)
+		{
+			// (loading a snapshot leaves every selector at its last value, so select the trigger we use again)
+			if (camera.TriggerSelector.TrySetValue(Basler_UniversalCameraParams::TriggerSelector_FrameBurstStart) == false)
+			{
+				camera.TriggerSelector.TrySetValue(Basler_UniversalCameraParams::TriggerSelector_FrameStart);
+				triggersPerPair = 2;
+			}
+		}
+		else
+		{
+			std::string setupDefaults = "";
+			// Reset camera to default settings.
+			camera.UserSetSelector.TrySetValue(UserSetSelectorEnums::UserSetSelector_Default);
+			camera.UserSetLoad.Execute();
+			if (useSetupCache)
+			{
+				std::string errorMessage = "";
+				if (CameraSetup::TakeSnapshot(camera, setupDefaults, errorMessage) == false)
+					cout << errorMessage << endl;
+			}
 
-		// Use mono format for mono cameras, Bayer format for color cameras. Bayer is a must
-		if (camera.PixelFormat.TrySetValue(PixelFormat_BayerRG8) == false)
-			camera.PixelFormat.TrySetValue(PixelFormat_Mono8);
+			// Use mono format for mono cameras, Bayer format for color cameras. Bayer is a must
+			if (camera.PixelFormat.TrySetValue(PixelFormat_BayerRG8) == false)
+				camera.PixelFormat.TrySetValue(PixelFormat_Mono8);
 		
-		// Use an AOI near the center of the image
-		camera.Width.TrySetValue(width);
-		camera.Height.TrySetValue(height);
-		camera.OffsetX.TrySetValue(camera.SensorWidth.GetValue() / 2);
-		camera.OffsetY.TrySetValue(camera.SensorHeight.GetValue() / 2);
-
-		// We will start the test at the minimum exposure time.
-		camera.ExposureTime.TrySetToMinimum();
-
-		// For all cameras, we must make sure auto functions are off, and gain, black level, etc. are set to zero
-		camera.Gain.TrySetValue(0);
-		camera.Gamma.TrySetValue(1.0);
-		camera.BlackLevel.TrySetValue(0);
-		camera.DigitalShift.TrySetValue(0);
-		camera.GainAuto.TrySetValue(GainAutoEnums::GainAuto_Off);
-		camera.ExposureAuto.TrySetValue(ExposureAutoEnums::ExposureAuto_Off);
-
-		// For color cameras, we need to turn off any color correction/processing features
-		camera.BslLightSourcePreset.TrySetValue("Off");
-		camera.BslLightSourcePresetFeatureSelector.TrySetValue(BslLightSourcePresetFeatureSelector_WhiteBalance);
-		camera.BslLightSourcePresetFeatureEnable.TrySetValue(false);
-		camera.BslLightSourcePresetFeatureSelector.TrySetValue(BslLightSourcePresetFeatureSelector_ColorTransformation);
-		camera.BslLightSourcePresetFeatureEnable.TrySetValue(false);
-		camera.BslLightSourcePresetFeatureSelector.TrySetValue(BslLightSourcePresetFeatureSelector_ColorAdjustment);
-		camera.BslLightSourcePresetFeatureEnable.TrySetValue(false);
-		camera.BslHue.TrySetValue(0);
-		camera.BslSaturation.TrySetValue(1.0);
-		camera.BslColorSpace.TrySetValue(BslColorSpaceEnums::BslColorSpace_Off);
-		camera.BslColorAdjustmentEnable.TrySetValue(false);
-		camera.ColorTransformationEnable.TrySetValue(false);
-		camera.BalanceWhiteAuto.TrySetValue("Off");
-		camera.BalanceRatioSelector.TrySetValue("Red");
-		camera.BalanceRatio.TrySetValue(1.0);
-		camera.BalanceRatioSelector.TrySetValue("Green");
-		camera.BalanceRatio.TrySetValue(1.0);
-		camera.BalanceRatioSelector.TrySetValue("Blue");
-		camera.BalanceRatio.TrySetValue(1.0);
+			// Use an AOI near the center of the image
+			camera.Width.TrySetValue(width);
+			camera.Height.TrySetValue(height);
+			camera.OffsetX.TrySetValue(camera.SensorWidth.GetValue() / 2);
+			camera.OffsetY.TrySetValue(camera.SensorHeight.GetValue() / 2);
+
+			// We will start the test at the minimum exposure time.
+			camera.ExposureTime.TrySetToMinimum();
+
+			// For all cameras, we must make sure auto functions are off, and gain, black level, etc. are set to zero
+			camera.Gain.TrySetValue(0);
+			camera.Gamma.TrySetValue(1.0);
+			camera.BlackLevel.TrySetValue(0);
+			camera.DigitalShift.TrySetValue(0);
+			camera.GainAuto.TrySetValue(GainAutoEnums::GainAuto_Off);
+			camera.ExposureAuto.TrySetValue(ExposureAutoEnums::ExposureAuto_Off);
+
+			// For color cameras, we need to turn off any color correction/processing features
+			camera.BslLightSourcePreset.TrySetValue("Off");
+			camera.BslLightSourcePresetFeatureSelector.TrySetValue(BslLightSourcePresetFeatureSelector_WhiteBalance);
+			camera.BslLightSourcePresetFeatureEnable.TrySetValue(false);
+			camera.BslLightSourcePresetFeatureSelector.TrySetValue(BslLightSourcePresetFeatureSelector_ColorTransformation);
+			camera.BslLightSourcePresetFeatureEnable.TrySetValue(false);
+			camera.BslLightSourcePresetFeatureSelector.TrySetValue(BslLightSourcePresetFeatureSelector_ColorAdjustment);
+			camera.BslLightSourcePresetFeatureEnable.TrySetValue(false);
+			camera.BslHue.TrySetValue(0);
+			camera.BslSaturation.TrySetValue(1.0);
+			camera.BslColorSpace.TrySetValue(BslColorSpaceEnums::BslColorSpace_Off);
+			camera.BslColorAdjustmentEnable.TrySetValue(false);
+			camera.ColorTransformationEnable.TrySetValue(false);
+			camera.BalanceWhiteAuto.TrySetValue("Off");
+			camera.BalanceRatioSelector.TrySetValue("Red");
+			camera.BalanceRatio.TrySetValue(1.0);
+			camera.BalanceRatioSelector.TrySetValue("Green");
+			camera.BalanceRatio.TrySetValue(1.0);
+			camera.BalanceRatioSelector.TrySetValue("Blue");
+			camera.BalanceRatio.TrySetValue(1.0);
 		
-		// We will acquire images using a software trigger. FrameBurstStart is used to acquire two images per trigger.
-		camera.TriggerSelector.TrySetValue(Basler_UniversalCameraParams::TriggerSelector_FrameBurstStart);
-		camera.TriggerMode.TrySetValue(Basler_UniversalCameraParams::TriggerMode_On);
-		camera.TriggerSource.TrySetValue(Basler_UniversalCameraParams::TriggerSource_Software);
-		camera.AcquisitionBurstFrameCount.TrySetValue(2);
+			// We will acquire images using a software trigger. FrameBurstStart is used to acquire two images per trigger.
+			// Cameras without burst triggering (eg: the emulator) get one trigger per image.
+			if (camera.TriggerSelector.TrySetValue(Basler_UniversalCameraParams::TriggerSelector_FrameBurstStart) == false)
+			{
+				camera.TriggerSelector.TrySetValue(Basler_UniversalCameraParams::TriggerSelector_FrameStart);
+				triggersPerPair = 2;
+			}
+			camera.TriggerMode.TrySetValue(Basler_UniversalCameraParams::TriggerMode_On);
+			camera.TriggerSource.TrySetValue(Basler_UniversalCameraParams::TriggerSource_Software);
+			camera.AcquisitionBurstFrameCount.TrySetValue(2);
+
+			// keep the finished setup for the next run
+			std::string setupConfiguration = "";
+			std::string errorMessage = "";
+			if (useSetupCache && setupDefaults.empty() == false
+				&& (CameraSetup::TakeSnapshot(camera, setupConfiguration, errorMessage) == false || CameraSetup::Store(setupFileBase, setupDefaults, setupConfiguration, errorMessage) == false))
+			{
+				cout << errorMessage << endl;
+			}
+		}
+		double setupMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - setupStart).count();
+
+		// The emulator can play back image files instead of its test pattern.
+		if (options.syntheticDirectory.empty() == false)
+		{
+			// Synthetic frames with known mean and noise, covering the sensor. The last pair is saturated, which ends the ramp.
+			RegressionHarness::SyntheticSensor sensor;
+			sensor.width = (uint32_t)camera.SensorWidth.GetValue();
+			sensor.height = (uint32_t)camera.SensorHeight.GetValue();
+			std::string errorMessage = "";
+			if (RegressionHarness::GenerateSyntheticFrames(options.syntheticDirectory, sensor, errorMessage) == false)
+			{
+				throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+			}
+			options.imageDirectory = options.syntheticDirectory;
+			// the frames are 8 bit mono, so measure them that way
+			for (size_t s = 0; s < streamsToTest.size(); s++)
+				streamsToTest[s].pixelFormat = "Mono8";
+			// each pair of synthetic frames is one exposure step
+			samplingSettings.minPairs = 1;
+			samplingSettings.maxPairs = 1;
+		}
+		if (options.imageDirectory.empty() == false)
+		{
+			camera.TestImageSelector.TrySetValue(TestImageSelector_Off);
+			camera.ImageFileMode.TrySetValue(ImageFileMode_On);
+			camera.ImageFilename.TrySetValue(options.imageDirectory.c_str());
+		}
 
 		// if using a Basler light, turn it on
 		if (camera.BslLightControlMode.IsWritable())
@@ -171,203 +536,937 @@ int main(int argc, char* argv[])
 			camera.BslLightDeviceSelector.TrySetValue(BslLightDeviceSelector_Device1);
 			camera.BslLightDeviceOperationMode.TrySetValue(BslLightDeviceOperationMode_On);
 		}
+		if (measureDark && DarkBright::HasLight(camera) == false)
+		{
+			throw RUNTIME_EXCEPTION("Dark measurements need a Basler Camera Light.", __FILE__, __LINE__);
+		}
+		if (buildFlatField && DarkBright::HasLight(camera) == false)
+		{
+			throw RUNTIME_EXCEPTION("The flat-field correction needs a Basler Camera Light.", __FILE__, __LINE__);
+		}
+		if (subtractDark && DarkBright::HasLight(camera) == false)
+		{
+			throw RUNTIME_EXCEPTION("Dark subtraction needs a Basler Camera Light.", __FILE__, __LINE__);
+		}
+		for (size_t s = 0; s < streamsToTest.size() && measureShading; s++)
+		{
+			// the ROI statistics read the frame buffers directly (and the ROI columns are in the result file from the start, so they can't be skipped later)
+			std::string pixelFormat = streamsToTest[s].pixelFormat.empty() ? camera.PixelFormat.ToString().c_str() : streamsToTest[s].pixelFormat;
+			if (Pylon::IsPacked(CPixelTypeMapper::GetPylonPixelTypeByName(pixelFormat.c_str())))
+			{
+				throw RUNTIME_EXCEPTION("ROI shading needs an unpacked pixel format (eg: BayerRG12 instead of BayerRG12p).", __FILE__, __LINE__);
+			}
+		}
+		if (useExposureSequencer && samplingSettings.minPairs < samplingSettings.maxPairs)
+		{
+			cout << "Adaptive sampling takes a varying number of pairs per exposure time, the exposure sequencer is not used." << endl;
+			useExposureSequencer = false;
+		}
+		if (subtractDark && measureDark)
+		{
+			cout << "Dark subtraction logs the dark levels itself, the dark partner measurements are skipped." << endl;
+			measureDark = false;
+		}
+		darkCache.SetMaxBytes(darkCacheMegabytes << 20);
 		// ********** END CAMERA SETUP ***********************************************************************************************
 
-		// setup the CSV file of results
-		csvFileName.append(camera.GetDeviceInfo().GetFriendlyName().c_str());
-		csvFileName.append("_");
-		csvFileName.append(camera.PixelFormat.ToString().c_str());
-		csvFileName.append("_");
-		csvFileName.append(camera.Width.ToString().c_str());
-		csvFileName.append("x");
-		csvFileName.append(camera.Height.ToString().c_str());
-		csvFileName.append(".csv");
-		std::FILE* const csvfileout = std::fopen(csvFileName.c_str(), "wb+");
-		if (csvfileout == NULL)
-		{
-			throw GenICam::RuntimeException("CSV file already opened by another application.", __FILE__, __LINE__);
-		}
-
-		// Prepare a header for the csv file
-		std::fprintf(csvfileout, "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s",
-			"Exposure Time",
-			"Min Pixel Value",
-			"Max Pixel Value",
-			"Average All Pixels",
-			"Avg Red Pixels",
-			"Avg Green Pixels",
-			"Avg Blue Pixels",
-			"SNR All Pixels",
-			"SNR Red",
-			"SNR Green",
-			"SNR Blue");
-		std::fprintf(csvfileout, "\n");
+		// Plan the sweep. All points sharing an AOI/pixel format are batched together.
+		SweepScheduler::Scheduler scheduler;
+		if (options.singleShot == false) // (the screening doesn't sweep)
+			scheduler.AddGrid(streamsToTest, gainsToTest, blackLevelsToTest, exposureTimesToTest);
+		std::vector<SweepScheduler::SweepPoint> schedule = scheduler.GetSchedule();
+		if (schedule.empty() == false)
+			cout << "Sweep of " << schedule.size() << " settings needs " << SweepScheduler::CountStreamRestarts(schedule) << " stream starts ("
+			<< SweepScheduler::CountStreamRestarts(scheduler.GetPoints()) << " in the order given)." << endl;
+
+		// setup the file of results (the writer adds the extension and the header)
+		std::string baseFileName = "";
+		baseFileName.append(camera.GetDeviceInfo().GetFriendlyName().c_str());
+		baseFileName.append("_");
+		baseFileName.append(camera.PixelFormat.ToString().c_str());
+		baseFileName.append("_");
+		baseFileName.append(camera.Width.ToString().c_str());
+		baseFileName.append("x");
+		baseFileName.append(camera.Height.ToString().c_str());
+		spectrogramFileName = baseFileName + "_Spectrogram.csv";
+		frameTimingFileName = baseFileName + "_FrameTiming.csv";
+		flatFieldFileName = baseFileName + "_FlatField.bin";
+		checkpointFileName = baseFileName + "_Checkpoint.bin";
+		if (measureShading && rois.empty())
+			RoiStats::MakeShadingRois((uint32_t)camera.SensorWidth.GetValue(), (uint32_t)camera.SensorHeight.GetValue(), shadingRoiSize, shadingRoiSize, rois);
+		if (measureShading)
+		{
+			std::string errorMessage = "";
+			if (RoiStats::Validate(rois, (uint32_t)camera.SensorWidth.GetValue(), (uint32_t)camera.SensorHeight.GetValue(), errorMessage) == false)
+			{
+				throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+			}
+			std::vector<std::string> roiNames;
+			for (size_t r = 0; r < rois.size(); r++)
+				roiNames.push_back(rois[r].name);
+			resultWriter.SetRoiNames(roiNames);
+		}
+		if (options.singleShot)
+			resultFileName = baseFileName + "_PTC.csv";
+		else if (options.resume)
+		{
+			// continue the results file from the checkpoint (the rows after it are measured again)
+			std::string errorMessage = "";
+			if (Checkpoint::Load(checkpointFileName, checkpointState, errorMessage) == false
+				|| resultWriter.Reopen(baseFileName, resultFormat, flushPolicy, checkpointState.rowsLogged, resultFileName, errorMessage) == false)
+			{
+				throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+			}
+			if (checkpointState.scheduleHash != Checkpoint::HashSchedule(schedule) || checkpointState.numPoints != schedule.size())
+			{
+				throw RUNTIME_EXCEPTION("The checkpoint belongs to a sweep with different settings.", __FILE__, __LINE__);
+			}
+
+			spectrogramSaved = checkpointState.spectrogramSaved;
+			flatFieldTried = checkpointState.flatFieldTried;
+			if (checkpointState.flatFieldSaved && flatField.Load(flatFieldFileName, errorMessage) == false)
+			{
+				throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+			}
+			cout << "Resuming at setting " << checkpointState.pointIndex + 1 << " of " << schedule.size() << ", after " << checkpointState.rowsLogged << " results." << endl;
+		}
+		else
+		{
+			std::string errorMessage = "";
+			if (resultWriter.Open(baseFileName, resultFormat, flushPolicy, resultFileName, errorMessage) == false)
+			{
+				throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+			}
+		}
+		if (saveCheckpoints && options.singleShot == false)
+		{
+			std::string errorMessage = "";
+			if (checkpointWriter.Start(checkpointFileName, &resultWriter, errorMessage) == false)
+			{
+				throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+			}
+			checkpointState.scheduleHash = Checkpoint::HashSchedule(schedule);
+			checkpointState.numPoints = (uint32_t)schedule.size();
+		}
 
 		// find out when we should stop the test due to saturation
 		int64_t saturationValue = camera.PixelDynamicRangeMax.GetValue();
 
 		// This smart pointer will receive the grab result data.
-		CGrabResultPtr ptrGrabResult1;
-		CGrabResultPtr ptrGrabResult2;
+		// (the universal grab result gives access to the chunk data, eg: the exposure time each frame was taken with)
+		CBaslerUniversalGrabResultPtr ptrGrabResult1;
+		CBaslerUniversalGrabResultPtr ptrGrabResult2;
 
-		// StartGrabbing() starts the streamgrabber on the host, and starts image acquisition on the camera.
-		camera.StartGrabbing();
+		stepTimer.StartRun();
 
-		// Run a loop of trigger camera, grab image, process image, save data
-		for (uint32_t i = 0; i < maxImagesToGrab && camera.IsGrabbing(); ++i)
+		// Screening: the photon transfer curve from one or two exposure times, binned by the signal level of each pixel (see PhotonTransfer.h).
+		if (options.singleShot)
 		{
-			// trigger the cameras
-			camera.TriggerSoftware.Execute();
+			std::string errorMessage = "";
+			if (SweepScheduler::ApplyStreamConfig(camera, streamsToTest[0], errorMessage) == false)
+			{
+				throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+			}
+			camera.Gain.TrySetValue(gainsToTest[0]);
+			camera.BlackLevel.TrySetValue(blackLevelsToTest[0]);
+			saturationValue = camera.PixelDynamicRangeMax.GetValue();
+			camera.StartGrabbing();
+
+			if (singleShotExposureTimes.empty())
+			{
+				// the bright exposure covers the upper part of the curve, a quarter of it the lower part
+				double exposure = 0;
+				if (PhotonTransfer::FindExposureTime(camera, triggersPerPair, 0.4 * saturationValue, &frameTiming, exposure, errorMessage) == false)
+				{
+					throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+				}
+				singleShotExposureTimes.push_back(exposure);
+				if (exposure / 4 >= camera.ExposureTime.GetMin())
+					singleShotExposureTimes.push_back(exposure / 4);
+			}
+
+			PhotonTransfer::Accumulator photonTransfer;
+			PhotonTransfer::Result photonTransferResult;
+			for (size_t e = 0; e < singleShotExposureTimes.size(); e++)
+			{
+				if (PhotonTransfer::GrabPairs(camera, triggersPerPair, singleShotExposureTimes[e], singleShotPairs, &frameTiming, photonTransfer, errorMessage) == false)
+				{
+					throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+				}
+			}
+			camera.StopGrabbing();
+
+			if (PhotonTransfer::Analyze(photonTransfer, photonTransferSettings, photonTransferResult, errorMessage) == false
+				|| PhotonTransfer::SaveCsv(resultFileName, photonTransferResult, errorMessage) == false)
+			{
+				cout << errorMessage << endl;
+				exitCode = 1;
+			}
+			else
+			{
+				cout << "Single-shot photon transfer from " << photonTransfer.GetNumPairs() << " pairs at " << singleShotExposureTimes.size() << " exposure times: "
+					<< photonTransferResult.points.size() << " points (" << photonTransferResult.numFitPoints << " fitted), K = " << photonTransferResult.systemGain
+					<< " DN/e-, R^2 = " << photonTransferResult.rSquared << ", " << photonTransfer.GetNumClipped() << " clipped pixels left out." << endl;
+			}
+		}
 
-			// Wait for images to arrive and then retrieve them into the smartpointers
-			camera.RetrieveResult(5000, ptrGrabResult1, TimeoutHandling_ThrowException);
-			camera.RetrieveResult(5000, ptrGrabResult2, TimeoutHandling_ThrowException);
+		// (a resumed sweep starts at the checkpoint's point)
+		size_t firstPoint = options.resume ? checkpointState.pointIndex : 0;
+		bool sweepAborted = false; // an error in the middle of the sweep ends it, and the results so far are still written and closed
+		for (size_t p = firstPoint; p < schedule.size() && sweepAborted == false; p++)
+		{
+			const SweepScheduler::SweepPoint& point = schedule[p];
+			bool restarted = (p == firstPoint || SweepScheduler::IsSameStream(point.stream, schedule[p - 1].stream) == false);
 
-			// Image grabbed successfully?
-			if (ptrGrabResult1->GrabSucceeded() && ptrGrabResult2->GrabSucceeded())
+			// AOI and pixel format can only be changed while the camera is not grabbing.
+			if (restarted)
 			{
-				// Attach the "GrabResult" to a "Pylon Image" for easier handling.
-				image1.AttachGrabResultBuffer(ptrGrabResult1);
-				image2.AttachGrabResultBuffer(ptrGrabResult2);
+				camera.StopGrabbing();
 
-				// for debugging convinience, we can stitch together and display the two images side by side.
+				// The intermediate images depend on the format and size. Give them back, they are checked out again with the first frame.
+				if (pKernels != nullptr)
 				{
-					CPylonImage stitchedImage;
-					std::string err = "";
-					StitchImage::StitchToRight(image1, image2, &stitchedImage, err);
-#if defined WIN_BUILD
-					Pylon::DisplayImage(0, stitchedImage);
-#endif
+					std::string errorMessage = "";
+					Pylon::CPylonImage* pooledImages[2] = { &stitchedPair, &colorPreview };
+					for (int n = 0; n < 2; n++)
+						imagePool.Return(*pooledImages[n], errorMessage); // (not all of them are checked out, eg: for mono cameras or on Linux)
+					pKernels = nullptr;
+				}
+
+				std::string errorMessage = "";
+				if (SweepScheduler::ApplyStreamConfig(camera, point.stream, errorMessage) == false)
+				{
+					throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
 				}
+				saturationValue = camera.PixelDynamicRangeMax.GetValue();
+
+				// Find out if we can use the sequencer (we grab two frames per pair, and all pairs of an exposure time are one step).
+				uint32_t pairsPerStep = (samplingSettings.maxPairs > 0) ? samplingSettings.maxPairs : 1;
+				if (exposureSequencer.Setup(camera, 2 * pairsPerStep, useExposureSequencer, errorMessage) == false)
+				{
+					throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+				}
+				frameTiming.Setup(camera);
+
+				// StartGrabbing() starts the streamgrabber on the host, and starts image acquisition on the camera.
+				camera.StartGrabbing();
+				frameTiming.ResetSequence();
+			}
+
+			// These can be changed while grabbing. Only write what actually changed.
+			if (restarted || point.gain != schedule[p - 1].gain)
+				camera.Gain.TrySetValue(point.gain);
+			if (restarted || blackLevel != point.blackLevel) // (also undoes any black level calibration of the previous point)
+			{
+				blackLevel = point.blackLevel;
+				camera.BlackLevel.TrySetValue(blackLevel);
+			}
+			if (point.exposureTime == SweepScheduler::c_exposureRamp)
+				nextExposureTime = camera.ExposureTime.GetMin();
+			else
+				nextExposureTime = point.exposureTime;
+			double maxExposureTime = camera.ExposureTime.GetMax();
 
-				// It's advised to check if we have any pixels of zero value and increase the blacklevel until we get some reading.
-				if (AnalysisTools::FindMin(image1) < blackLevelCalibThreshold || AnalysisTools::FindMin(image2) < blackLevelCalibThreshold)
+			// continue a resumed point where the checkpoint left it
+			uint32_t firstImage = 0;
+			if (options.resume && p == firstPoint && checkpointState.pointStarted)
+			{
+				blackLevel = checkpointState.blackLevel;
+				camera.BlackLevel.TrySetValue(blackLevel);
+				nextExposureTime = checkpointState.nextExposureTime;
+				firstImage = checkpointState.imagesGrabbed;
+				pendingMeasurements = checkpointState.pendingMeasurements;
+			}
+
+			// gain and black level are stored in the sequencer sets too, so the sets must be programmed again
+			exposureSequencer.InvalidateBlock();
+			pointEstimator.Reset();
+
+			// Run a loop of trigger camera, grab image, process image, save data
+			bool pointDone = false;
+			for (uint32_t i = firstImage; i < maxImagesToGrab && pointDone == false && sweepAborted == false; ++i)
+			{
+				// Capture master dark frames where the cache has none for this exposure time (a black level calibration step needs new ones too).
+				// Like the dark partners, they are taken with the light off and without the sequencer.
+				darkKey = DarkFrame::MakeKey(point, blackLevel);
+				if (subtractDark && darkCache.Covers(darkKey, nextExposureTime) == false)
 				{
-					cout << "Zero value pixels detected, increasing blacklevel before testing..." << endl;
-					camera.BlackLevel.SetValue(camera.BlackLevel.GetValue() + 1);
+					bool restartedGrabbing = false;
+					exposureSequencer.Disable(camera, restartedGrabbing);
+					if (restartedGrabbing)
+						frameTiming.ResetSequence();
+
+					// the ramp interpolates up to the second master, then captures the next span
+					std::vector<double> darkExposureTimes(1, nextExposureTime);
+					if (point.exposureTime == SweepScheduler::c_exposureRamp && nextExposureTime < maxExposureTime)
+						darkExposureTimes.push_back((nextExposureTime + darkExposureSpanUs < maxExposureTime) ? nextExposureTime + darkExposureSpanUs : maxExposureTime);
+
+					std::string errorMessage = "";
+					if (DarkFrame::Capture(camera, triggersPerPair, exposureSequencer, darkExposureTimes, darkFrames, lightSettleTimeMs, darkKey, &frameTiming, darkCache, errorMessage) == false)
+					{
+						cout << errorMessage << endl << "Dark subtraction is turned off." << endl;
+						subtractDark = false;
+					}
+					exposureSequencer.InvalidateBlock();
+				}
+
+				// Set up the exposure time for this measurement.
+				if (exposureSequencer.GetMaxBlockSize() > 0)
+				{
+					// Program the upcoming exposure times into the sequencer, one block at a time.
+					// (this only happens once per block, and grabbing is only stopped for it if the camera needs that)
+					if (exposureSequencer.IsSequencerActive() == false)
+					{
+						size_t blockSize = (point.exposureTime == SweepScheduler::c_exposureRamp) ? exposureSequencer.GetMaxBlockSize() : 1;
+						sequencerBlock.clear();
+						for (size_t k = 0; k < blockSize; k++)
+						{
+							double blockExposureTime = nextExposureTime + k * exposureTimeIncrementUsec;
+							sequencerBlock.push_back((blockExposureTime < maxExposureTime) ? blockExposureTime : maxExposureTime);
+						}
+
+						std::string errorMessage = "";
+						bool restartedGrabbing = false;
+						if (exposureSequencer.LoadBlock(camera, sequencerBlock, restartedGrabbing, errorMessage) == false)
+						{
+							throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+						}
+						if (restartedGrabbing)
+							frameTiming.ResetSequence();
+					}
 				}
 				else
 				{
-					// find the average min and max pixel value
-					minAll = (AnalysisTools::FindMin(image1) + AnalysisTools::FindMin(image2)) / 2;
-					maxAll = (AnalysisTools::FindMax(image1) + AnalysisTools::FindMax(image2)) / 2;
+					// Without a sequencer, the host remembers what was set, so only changes are written and nothing is read back.
+					exposureSequencer.SetExposureTime(camera, nextExposureTime);
+				}
+
+				// trigger the cameras and retrieve the images
+				if (pointEstimator.GetNumPairs() == 0)
+					stepTimer.StartStep();
+				DarkBright::GrabPair(camera, triggersPerPair, ptrGrabResult1, ptrGrabResult2, &frameTiming);
 
-					// Find the average pixel value and SNR value for the combined images
-					if (IsMonoImage(ptrGrabResult1->GetPixelType()))
+				// Image grabbed successfully?
+				if (ptrGrabResult1->GrabSucceeded() && ptrGrabResult2->GrabSucceeded())
+				{
+					if (firstFrameReported == false)
 					{
-						// Find the average of the average pixel value for both images
-						avgAll = (AnalysisTools::FindAvg(image1) + AnalysisTools::FindAvg(image2)) / 2;
-						// Find the average SNR of the two images
-						snrAll = (AnalysisTools::FindSNR(image1) + AnalysisTools::FindSNR(image2)) / 2;
+						firstFrameReported = true;
+						cout << "First frames " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - runStart).count() << " ms after the start (camera setup "
+							<< setupMilliseconds << " ms, " << (setupFromSnapshot ? "from the cached snapshot, " + std::to_string(setupReport.numWritten) + " of "
+							+ std::to_string(setupReport.numFeatures) + " features written" : std::string("feature by feature")) << ")." << endl;
 					}
-					else
+
+					// The two frames must be consecutive frames of one burst, or the measurement mixes different conditions.
+					{
+						std::string errorMessage = "";
+						if (frameTiming.CheckPair(ptrGrabResult1, ptrGrabResult2, errorMessage) == false)
+							cout << "WARNING: " << errorMessage << endl;
+					}
+
+					// Attach the "GrabResult" to a "Pylon Image" for easier handling.
+					image1.AttachGrabResultBuffer(ptrGrabResult1);
+					image2.AttachGrabResultBuffer(ptrGrabResult2);
+
+					// Correct the frames in place (only frames of the size and format the correction was built for).
+					bool flatFieldApplied = false;
+					if (correctFrames && flatField.IsValid() && flatField.GetWidth() == image1.GetWidth() && flatField.GetHeight() == image1.GetHeight()
+						&& flatField.GetPixelType() == image1.GetPixelType())
 					{
-						// We will need to extract the pixels of the bayer pattern into three images
 						std::string errorMessage = "";
-						if (BayerExtract::Extract(image1, RedImage1, GreenImage1, BlueImage1, errorMessage) == false)
+						if (flatField.Apply(image1, errorMessage) == false || flatField.Apply(image2, errorMessage) == false)
+							cout << errorMessage << endl;
+						flatFieldApplied = true;
+					}
+
+					// Otherwise subtract the dark frame of this exposure time, before anything is measured.
+					pDarkFrame = nullptr;
+					if (subtractDark && flatFieldApplied == false)
+					{
+						std::string errorMessage = "";
+						pDarkFrame = darkCache.Find(darkKey, nextExposureTime);
+						if (pDarkFrame != nullptr && (DarkFrame::Subtract(*pDarkFrame, image1, errorMessage) == false || DarkFrame::Subtract(*pDarkFrame, image2, errorMessage) == false))
+						{
+							cout << errorMessage << endl;
+							pDarkFrame = nullptr;
+						}
+					}
+
+					// Select the kernels for this pixel format once. From here on, no per-frame or per-pixel format checks are needed.
+					if (pKernels == nullptr)
+					{
+						uint64_t allocationsBefore = imagePool.GetCounters().allocations;
+						pKernels = FormatDispatch::GetKernels(ptrGrabResult1->GetPixelType());
+						if (pKernels == nullptr)
+						{
+							cout << "ERROR: Pixel format " << camera.PixelFormat.ToString() << " is not supported." << endl;
+							sweepAborted = true;
+							break;
+						}
+
+						// Now that we know the format and size, check out the intermediate images from the pool.
+						uint32_t frameWidth = ptrGrabResult1->GetWidth();
+						uint32_t frameHeight = ptrGrabResult1->GetHeight();
+						std::string errorMessage = "";
+						bool checkedOut = true;
+#if defined WIN_BUILD
+						// (the debugging images are only made where they can be displayed)
+						checkedOut = imagePool.CheckOut(pKernels->pixelType, frameWidth * 2, frameHeight, stitchedPair, errorMessage);
+						if (pKernels->isBayer)
+							checkedOut = checkedOut && imagePool.CheckOut(PixelType_RGB8packed, frameWidth / 2, frameHeight / 2, colorPreview, errorMessage);
+#endif
+						if (checkedOut == false)
 						{
 							cout << errorMessage << endl;
-							return 1;
+							sweepAborted = true;
+							break;
+						}
+						warmupAllocations += imagePool.GetCounters().allocations - allocationsBefore;
+
+						// these read the frame buffers directly, so they can't be used with packed formats (ROI shading was checked before the sweep)
+						if (pKernels->isPacked && (makeContactSheet || buildFlatField))
+						{
+							cout << "Packed pixel format: the contact sheet and flat-field correction are skipped." << endl;
+							makeContactSheet = false;
+							buildFlatField = false;
 						}
 
-						errorMessage = "";
-						if (BayerExtract::Extract(image2, RedImage2, GreenImage2, BlueImage2, errorMessage) == false)
+						// the contact sheet tiles have the size of this AOI (a new sheet starts with each stream)
+						// (it is only a preview, so the sweep goes on without it)
+						if (makeContactSheet && contactSheet.Setup(pKernels->pixelType, frameWidth, frameHeight, contactSheetColumns, contactSheetRows, contactSheetDownscale, errorMessage) != 0)
+						{
+							cout << errorMessage << endl << "The contact sheet is turned off." << endl;
+							makeContactSheet = false;
+						}
+						contactSheetSlot = 0;
+						contactSheetsShown = 0;
+
+						// find where the ROIs are in this AOI
+						if (measureShading && roiPlan.Build(rois, ptrGrabResult1->GetOffsetX(), ptrGrabResult1->GetOffsetY(), frameWidth, frameHeight,
+							pKernels->isBayer ? pKernels->planePositions : nullptr, errorMessage) == false)
 						{
 							cout << errorMessage << endl;
-							return 1;
+							sweepAborted = true;
+							break;
 						}
+					}
+
+					// for debugging convinience, we can stitch together and display the two images side by side.
+#if defined WIN_BUILD
+					{
+						std::string err = "";
+						Pylon::CPylonImage* pair[2] = { &image1, &image2 };
+						StitchImage::StitchRow(pair, 2, stitchedPair, err);
+						Pylon::DisplayImage(0, stitchedPair);
+					}
+#endif
+
+					// Gather the min, max, sum, etc. of both images once, instead of re-reading them for every value.
+					stats1 = pKernels->findStats(image1);
+					stats2 = pKernels->findStats(image2);
+
+					// It's advised to check if we have any pixels of zero value and increase the blacklevel until we get some reading.
+					bool calibratingBlackLevel = (stats1.min < blackLevelCalibThreshold || stats2.min < blackLevelCalibThreshold);
+					bool haveHistograms = false;
+					if (calibratingBlackLevel && blackLevelCalibPercentile > 0)
+					{
+						// some pixels are below the threshold, but are there more than a few in any channel?
+						pKernels->findHistograms(image1, histograms1);
+						pKernels->findHistograms(image2, histograms2);
+						haveHistograms = true;
+						calibratingBlackLevel = (AnalysisTools::FindLowestPercentile(histograms1, blackLevelCalibPercentile) < blackLevelCalibThreshold
+							|| AnalysisTools::FindLowestPercentile(histograms2, blackLevelCalibPercentile) < blackLevelCalibThreshold);
+					}
+
+					// Add this pair's mean and temporal variance (from the difference of the two images) to the estimates of this exposure time.
+					if (calibratingBlackLevel == false)
+					{
+						double pairMean = ((double)stats1.sum / stats1.count + (double)stats2.sum / stats2.count) / 2;
+						pointEstimator.AddPair(pairMean, AnalysisTools::FindTemporalVariance(pKernels->findDiffStats(image1, image2)));
+					}
+
+					if (calibratingBlackLevel)
+					{
+						cout << "Zero value pixels detected, increasing blacklevel before testing..." << endl;
+						blackLevel = blackLevel + 1;
+						camera.BlackLevel.SetValue(blackLevel);
+						// (the sequencer sets still have the old black level)
+						exposureSequencer.InvalidateBlock();
+						pointEstimator.Reset();
+					}
+					else if (pointEstimator.IsDone(samplingSettings) == false)
+					{
+						// Not precise enough yet. Grab another pair at the same exposure time.
+					}
+					else
+					{
+						// find the average min and max pixel value
+						minAll = (stats1.min + stats2.min) / 2;
+						maxAll = (stats1.max + stats2.max) / 2;
 
-						// Find the average of the average pixel value for both images
-						avgRed = (AnalysisTools::FindAvg(RedImage1) + AnalysisTools::FindAvg(RedImage2)) / 2;
-						avgGreen = (AnalysisTools::FindAvg(GreenImage1) + AnalysisTools::FindAvg(GreenImage2)) / 2;
-						avgBlue = (AnalysisTools::FindAvg(BlueImage1) + AnalysisTools::FindAvg(BlueImage2)) / 2;
-
-						// Find the average SNR of the two images
-						snrRed = (AnalysisTools::FindSNR(RedImage1) + AnalysisTools::FindAvg(RedImage2)) / 2;
-						snrGreen = (AnalysisTools::FindSNR(GreenImage1) + AnalysisTools::FindAvg(GreenImage1)) / 2;
-						snrBlue = (AnalysisTools::FindSNR(BlueImage1) + AnalysisTools::FindAvg(BlueImage2)) / 2;
-
-						// Find values for the average and snr of all the pixels from the original images together.
-						// Note: This illustrates why the colors must be measured individually.
-						//       The response will always look non-linear if all the pixels are measured together,
-						//       Even if all of the color features are disabled and pure 'white' light is used.
-						//       (The different QE of the sensor under filtered light plays a role)
-						avgAll = (AnalysisTools::FindAvg(image1) + AnalysisTools::FindAvg(image2)) / 2;
-						snrAll = (AnalysisTools::FindSNR(image1) + AnalysisTools::FindSNR(image2)) / 2;
-
-						// for debugging, we can also stitch together and display the extracted R,G,B sub-images of the two original images
+						// Find the average pixel value and SNR value for the combined images
+						if (pKernels->isBayer == false)
+						{
+							// Find the average of the average pixel value for both images
+							avgAll = (uint32_t)((stats1.sum / stats1.count + stats2.sum / stats2.count) / 2);
+							// Find the average SNR of the two images
+							snrAll = (AnalysisTools::FindSNR(stats1) + AnalysisTools::FindSNR(stats2)) / 2;
+						}
+						else
 						{
-							CPylonImage stitchedImage;
-							std::string err = "";
-							StitchImage::StitchToRight(stitchedImage, RedImage1, &stitchedImage, err);
-							StitchImage::StitchToRight(stitchedImage, GreenImage1, &stitchedImage, err);
-							StitchImage::StitchToRight(stitchedImage, BlueImage1, &stitchedImage, err);
-							StitchImage::StitchToRight(stitchedImage, RedImage2, &stitchedImage, err);
-							StitchImage::StitchToRight(stitchedImage, GreenImage2, &stitchedImage, err);
-							StitchImage::StitchToRight(stitchedImage, BlueImage2, &stitchedImage, err);
+							// Measure the four planes of the bayer pattern (R, Gr, Gb, B) of both images in one pass
+							cfaStats = pKernels->findCfaPairStats(image1, image2);
+
+							// Find the average of the average pixel value for both images
+							// (the single green value pools Gr and Gb in floating point, the planes are logged separately below)
+							AnalysisTools::Stats green1 = cfaStats.image1[AnalysisTools::Plane_GreenRed];
+							AnalysisTools::Stats green2 = cfaStats.image2[AnalysisTools::Plane_GreenRed];
+							green1.Merge(cfaStats.image1[AnalysisTools::Plane_GreenBlue]);
+							green2.Merge(cfaStats.image2[AnalysisTools::Plane_GreenBlue]);
+							avgRed = (uint32_t)AnalysisTools::SummarizePlane(cfaStats, AnalysisTools::Plane_Red).mean;
+							avgGreen = (uint32_t)AnalysisTools::SummarizeGreen(cfaStats).mean;
+							avgBlue = (uint32_t)AnalysisTools::SummarizePlane(cfaStats, AnalysisTools::Plane_Blue).mean;
+
+							// Find the average SNR of the two images
+							snrRed = (AnalysisTools::FindSNR(cfaStats.image1[AnalysisTools::Plane_Red]) + AnalysisTools::FindSNR(cfaStats.image2[AnalysisTools::Plane_Red])) / 2;
+							snrGreen = (AnalysisTools::FindSNR(green1) + AnalysisTools::FindSNR(green2)) / 2;
+							snrBlue = (AnalysisTools::FindSNR(cfaStats.image1[AnalysisTools::Plane_Blue]) + AnalysisTools::FindSNR(cfaStats.image2[AnalysisTools::Plane_Blue])) / 2;
+
+							// Find values for the average and snr of all the pixels from the original images together.
+							// Note: This illustrates why the colors must be measured individually.
+							//       The response will always look non-linear if all the pixels are measured together,
+							//       Even if all of the color features are disabled and pure 'white' light is used.
+							//       (The different QE of the sensor under filtered light plays a role)
+							avgAll = (uint32_t)((stats1.sum / stats1.count + stats2.sum / stats2.count) / 2);
+							snrAll = (AnalysisTools::FindSNR(stats1) + AnalysisTools::FindSNR(stats2)) / 2;
+
+							// for debugging, we can also display the first image in color (works for packed formats too)
 #if defined WIN_BUILD
-							Pylon::DisplayImage(1, stitchedImage);
+							{
+								std::string err = "";
+								if (pKernels->makePreview(image1, showSaturationOverlay ? (uint32_t)saturationValue : 0, colorPreview, err))
+									Pylon::DisplayImage(1, colorPreview);
+								else
+									cout << err << endl;
+							}
 #endif
 						}
+
+						// Find the row and column profiles of the two images and average them (this removes some of the temporal noise)
+						{
+							std::string errorMessage = "";
+							if (pKernels->findProfiles(image1, profiles1, errorMessage) == false || pKernels->findProfiles(image2, profiles2, errorMessage) == false)
+							{
+								cout << errorMessage << endl;
+								sweepAborted = true;
+								break;
+							}
+
+							rowFpn = 0;
+							colFpn = 0;
+							profilesAvg.numChannels = profiles1.numChannels;
+							for (uint32_t c = 0; c < profiles1.numChannels; c++)
+							{
+								profilesAvg.rowMean[c].resize(profiles1.rowMean[c].size());
+								profilesAvg.colMean[c].resize(profiles1.colMean[c].size());
+								for (size_t n = 0; n < profiles1.rowMean[c].size(); n++)
+									profilesAvg.rowMean[c][n] = (profiles1.rowMean[c][n] + profiles2.rowMean[c][n]) / 2;
+								for (size_t n = 0; n < profiles1.colMean[c].size(); n++)
+									profilesAvg.colMean[c][n] = (profiles1.colMean[c][n] + profiles2.colMean[c][n]) / 2;
+
+								rowFpn = rowFpn + AnalysisTools::FindProfileStdDev(profilesAvg.rowMean[c]);
+								colFpn = colFpn + AnalysisTools::FindProfileStdDev(profilesAvg.colMean[c]);
+							}
+							rowFpn = rowFpn / profilesAvg.numChannels;
+							colFpn = colFpn / profilesAvg.numChannels;
+						}
+
+						// EMVA1288 evaluates the spectrograms at 50% saturation. Log them once when we get there.
+						if (spectrogramSaved == false && avgAll >= saturationValue / 2)
+						{
+							// The two spectrograms have different lengths unless the AOI is square, so each has its own frequency column
+							// (the channels of one direction all have the same length).
+							std::vector<double> spectrograms[2][4]; // [0]: horizontal, from the column profiles. [1]: vertical, from the row profiles.
+							size_t numBins[2] = { 0, 0 };
+							for (uint32_t c = 0; c < profilesAvg.numChannels; c++)
+							{
+								AnalysisTools::FindSpectrogram(profilesAvg.colMean[c], spectrograms[0][c]);
+								AnalysisTools::FindSpectrogram(profilesAvg.rowMean[c], spectrograms[1][c]);
+								for (int d = 0; d < 2; d++)
+									numBins[d] = (spectrograms[d][c].size() > numBins[d]) ? spectrograms[d][c].size() : numBins[d];
+							}
+
+							// (the spectrograms are only a side result, so the sweep goes on without them)
+							spectrogramSaved = true;
+							std::FILE* const spectrogramfileout = std::fopen(spectrogramFileName.c_str(), "wb+");
+							if (spectrogramfileout == NULL)
+							{
+								cout << "ERROR: Could not create " << spectrogramFileName << " (opened by another application?), the spectrograms are skipped." << endl;
+							}
+							else
+							{
+								const char* directions[2] = { "Horizontal", "Vertical" };
+								for (int d = 0; d < 2; d++)
+								{
+									std::fprintf(spectrogramfileout, "%s%s Frequency (cycles/pixel)", (d > 0) ? "," : "", directions[d]);
+									for (uint32_t c = 0; c < profilesAvg.numChannels; c++)
+										std::fprintf(spectrogramfileout, ",%s Ch%u", directions[d], c);
+								}
+								std::fprintf(spectrogramfileout, "\n");
+
+								size_t numRows = (numBins[0] > numBins[1]) ? numBins[0] : numBins[1];
+								for (size_t k = 0; k < numRows; k++)
+								{
+									for (int d = 0; d < 2; d++)
+									{
+										if (d > 0)
+											std::fprintf(spectrogramfileout, ",");
+										if (k < numBins[d])
+											std::fprintf(spectrogramfileout, "%f", (numBins[d] > 1) ? 0.5 * k / (numBins[d] - 1) : 0.0);
+										for (uint32_t c = 0; c < profilesAvg.numChannels; c++)
+										{
+											if (k < spectrograms[d][c].size())
+												std::fprintf(spectrogramfileout, ",%f", spectrograms[d][c][k]);
+											else
+												std::fprintf(spectrogramfileout, ",");
+										}
+									}
+									std::fprintf(spectrogramfileout, "\n");
+								}
+
+								std::fclose(spectrogramfileout);
+							}
+						}
+
+						// get the exposure time for this measurement (from the chunk data, without asking the camera)
+						exposureTime = exposureSequencer.GetFrameExposureTime(ptrGrabResult1, exposureSequencer.GetExposureTime(camera));
+
+						// Both frames of the burst must have been taken with the same exposure time, or they don't belong together.
+						if (exposureSequencer.GetFrameExposureTime(ptrGrabResult2, exposureTime) != exposureTime)
+						{
+							cout << "WARNING: The two frames of the burst have different exposure times ("
+								<< exposureTime << " / " << exposureSequencer.GetFrameExposureTime(ptrGrabResult2, exposureTime) << ")." << endl;
+						}
+
+						// Log the measurements into the .csv file (held back until the dark partner is measured, if measuring dark).
+						measurement.exposureTime = exposureTime;
+						measurement.minAll = minAll;
+						measurement.maxAll = maxAll;
+						measurement.avgAll = avgAll;
+						measurement.avgRed = avgRed;
+						measurement.avgGreen = avgGreen;
+						measurement.avgBlue = avgBlue;
+						measurement.snrAll = snrAll;
+						measurement.snrRed = snrRed;
+						measurement.snrGreen = snrGreen;
+						measurement.snrBlue = snrBlue;
+						measurement.rowFpn = rowFpn;
+						measurement.colFpn = colFpn;
+						measurement.gain = point.gain;
+						measurement.blackLevel = blackLevel;
+						measurement.width = (uint32_t)ptrGrabResult1->GetWidth();
+						measurement.height = (uint32_t)ptrGrabResult1->GetHeight();
+						measurement.offsetX = (int)ptrGrabResult1->GetOffsetX();
+						measurement.offsetY = (int)ptrGrabResult1->GetOffsetY();
+						measurement.numPairs = pointEstimator.GetNumPairs();
+						measurement.mean = pointEstimator.GetMean();
+						measurement.meanHalfWidth = pointEstimator.GetMeanHalfWidth(samplingSettings);
+						measurement.temporalVariance = pointEstimator.GetTemporalVariance();
+						measurement.temporalVarianceHalfWidth = pointEstimator.GetTemporalVarianceHalfWidth(samplingSettings);
+						measurement.hasPlanes = pKernels->isBayer;
+						for (uint32_t plane = 0; plane < AnalysisTools::c_numCfaPlanes && measurement.hasPlanes; plane++)
+							measurement.planes[plane] = AnalysisTools::SummarizePlane(cfaStats, plane);
+						measurement.numRois = 0;
+						if (measureShading)
+						{
+							// all ROIs from the same pair, in one pass over the rows
+							std::string errorMessage = "";
+							if (RoiStats::FindRoiPairStats(roiPlan, image1, image2, roiStats, errorMessage) == false)
+							{
+								cout << errorMessage << endl;
+								sweepAborted = true;
+								break;
+							}
+							measurement.numRois = (uint32_t)roiStats.size();
+							for (size_t r = 0; r < roiStats.size(); r++)
+								measurement.rois[r] = RoiStats::Summarize(roiStats[r], roiPlan.IsBayer());
+						}
+						measurement.hasDark = false;
+						if (pDarkFrame != nullptr)
+							DarkFrame::FillMeasurement(*pDarkFrame, *pKernels, measurement);
+						if (measureDark)
+							pendingMeasurements.push_back(measurement);
+						else
+							resultWriter.Push(measurement);
+
+						if (makeContactSheet)
+						{
+							std::string errorMessage = "";
+							if (contactSheet.PutTile(contactSheetSlot, image1, errorMessage) != 0)
+								cout << errorMessage << endl;
+							contactSheetSlot = (contactSheetSlot + 1) % contactSheet.GetNumSlots();
+							if (contactSheet.GetNumPublished() > contactSheetsShown && contactSheet.GetLatestCanvas(&contactSheetImage, errorMessage) == 0)
+							{
+								contactSheetsShown = contactSheet.GetNumPublished();
+#if defined WIN_BUILD
+								Pylon::DisplayImage(2, contactSheetImage);
+#endif
+							}
+						}
+
+						// the flat-field correction is built at the same point as the spectrograms, after this measurement
+						if (buildFlatField && flatFieldTried == false && avgAll >= saturationValue / 2)
+						{
+							flatFieldPending = true;
+							flatFieldTried = true;
+							flatFieldExposureTime = exposureTime;
+						}
+
+						// Display the exposure time and avg pixel values.
+						cout << std::setw(8)
+							<< std::setw(8) << point.gain << " "
+							<< std::setw(8) << exposureTime << " "
+							<< std::setw(8) << minAll << " "
+							<< std::setw(8) << maxAll << " "
+							<< std::setw(8) << avgAll << " "
+							<< std::setw(8) << avgRed << " "
+							<< std::setw(8) << avgGreen << " "
+							<< std::setw(8) << avgBlue << " "
+							<< std::setw(8) << snrAll << " "
+							<< std::setw(8) << snrRed << " "
+							<< std::setw(8) << snrGreen << " "
+							<< std::setw(8) << snrBlue << " "
+							<< std::setw(8) << rowFpn << " "
+							<< std::setw(8) << colFpn << " "
+							<< endl;
+						stepTimer.StopStep();
+						pointEstimator.Reset();
+
+						// stop if we've reached saturation (in every channel of both images)
+						// if you want to see what happens to linearity & snr at saturation, lower saturationPercentile to 0 (the min), or raise it towards 50 (the median)
+						bool saturated = (stats1.min == saturationValue && stats2.min == saturationValue);
+						if (saturated == false && saturationPercentile > 0 && stats1.max == saturationValue && stats2.max == saturationValue)
+						{
+							// some pixels are saturated (otherwise no percentile can be), so look at how many
+							if (haveHistograms == false)
+							{
+								pKernels->findHistograms(image1, histograms1);
+								pKernels->findHistograms(image2, histograms2);
+							}
+							saturated = (AnalysisTools::FindLowestPercentile(histograms1, saturationPercentile) >= saturationValue
+								&& AnalysisTools::FindLowestPercentile(histograms2, saturationPercentile) >= saturationValue);
+						}
+						if (saturated)
+						{
+							pointDone = true;
+							cout << endl << "Saturation Reached at Gain " << point.gain << ". Moving on..." << endl;
+						}
+						else if (point.exposureTime != SweepScheduler::c_exposureRamp)
+						{
+							// a fixed exposure time point only needs one measurement
+							pointDone = true;
+						}
+						else
+						{
+							// Increment the exposure time for the next image.
+							// (with the sequencer, the camera moves on to the next set by itself)
+							nextExposureTime = nextExposureTime + exposureTimeIncrementUsec;
+							if (nextExposureTime > maxExposureTime)
+								nextExposureTime = maxExposureTime;
+							if (exposureSequencer.AdvanceStep() == false)
+								exposureSequencer.InvalidateBlock(); // block used up, program the next one
+						}
+					}
+				}
+				else
+				{
+					cout << "Error: " << std::hex << ptrGrabResult1->GetErrorCode() << std::dec << " " << ptrGrabResult1->GetErrorDescription() << endl;
+					cout << "Error: " << std::hex << ptrGrabResult2->GetErrorCode() << std::dec << " " << ptrGrabResult2->GetErrorDescription() << endl;
+					// we don't know how far the sequencer got, so start it again from this exposure time
+					exposureSequencer.InvalidateBlock();
+					pointEstimator.Reset();
+				}
+
+				// Take the dark partners of the waiting bright measurements, with the light off.
+				bool darkBlockFull = (darkBlockSize > 0 && pendingMeasurements.size() >= darkBlockSize);
+				if (pendingMeasurements.size() > 0 && (darkBlockFull || pointDone || i + 1 == maxImagesToGrab))
+				{
+					// the sequencer holds the bright ramp, so it is switched off and the dark exposure times are set directly
+					bool restartedGrabbing = false;
+					exposureSequencer.Disable(camera, restartedGrabbing);
+					if (restartedGrabbing)
+						frameTiming.ResetSequence();
+
+					std::string errorMessage = "";
+					if (DarkBright::SetLight(camera, false, lightSettleTimeMs, errorMessage) == false)
+					{
+						throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
 					}
 
-					// get the exposure time for this measurement
-					exposureTime = camera.ExposureTime.GetValue();
-
-					// Log the measurements into the .csv file.
-					std::fprintf(csvfileout, "%f,%u,%u,%u,%u,%u,%u,%f,%f,%f,%f",
-						(double)exposureTime,
-						(uint32_t)minAll,
-						(uint32_t)maxAll,
-						(uint32_t)avgAll,
-						(uint32_t)avgRed,
-						(uint32_t)avgGreen,
-						(uint32_t)avgBlue,
-						(double)snrAll,
-						(double)snrRed,
-						(double)snrGreen,
-						(double)snrBlue);
-					std::fprintf(csvfileout, "\n");
-
-					// Display the exposure time and avg pixel values.
-					cout << std::setw(8)
-						<< std::setw(8) << exposureTime << " "
-						<< std::setw(8) << minAll << " "
-						<< std::setw(8) << maxAll << " "
-						<< std::setw(8) << avgAll << " "
-						<< std::setw(8) << avgRed << " "
-						<< std::setw(8) << avgGreen << " "
-						<< std::setw(8) << avgBlue << " "
-						<< std::setw(8) << snrAll << " "
-						<< std::setw(8) << snrRed << " "
-						<< std::setw(8) << snrGreen << " "
-						<< std::setw(8) << snrBlue << " "
-						<< endl;
-
-					// stop if we've reached saturation
-					// if you want to see what happens to linearity & snr at saturation, change this to FindMin() or FindAvg()
-					if (AnalysisTools::FindMin(image1) == saturationValue && AnalysisTools::FindMin(image2) == saturationValue)
+					for (size_t d = 0; d < pendingMeasurements.size(); d++)
 					{
-						camera.StopGrabbing();
-						cout << endl << "Saturation Reached. Stopping Test..." << endl;
-						cout << "see \"" << csvFileName << "\" for results." << endl;
+						DarkBright::Measurement& bright = pendingMeasurements[d];
+						exposureSequencer.SetExposureTime(camera, bright.exposureTime);
+						DarkBright::GrabPair(camera, triggersPerPair, ptrGrabResult1, ptrGrabResult2, &frameTiming);
+						if (ptrGrabResult1->GrabSucceeded() == false || ptrGrabResult2->GrabSucceeded() == false)
+						{
+							// the row is logged without dark values
+							cout << "Error: Dark grab failed at exposure time " << bright.exposureTime << endl;
+							continue;
+						}
+
+						image1.AttachGrabResultBuffer(ptrGrabResult1);
+						image2.AttachGrabResultBuffer(ptrGrabResult2);
+						stats1 = pKernels->findStats(image1);
+						stats2 = pKernels->findStats(image2);
+						bright.darkAvgAll = ((double)stats1.sum / stats1.count + (double)stats2.sum / stats2.count) / 2;
+
+						if (pKernels->isBayer)
+						{
+							cfaStats = pKernels->findCfaPairStats(image1, image2);
+							bright.darkAvgRed = AnalysisTools::SummarizePlane(cfaStats, AnalysisTools::Plane_Red).mean;
+							bright.darkAvgGreen = AnalysisTools::SummarizeGreen(cfaStats).mean;
+							bright.darkAvgBlue = AnalysisTools::SummarizePlane(cfaStats, AnalysisTools::Plane_Blue).mean;
+						}
+						bright.hasDark = true;
+					}
+
+					if (DarkBright::SetLight(camera, true, lightSettleTimeMs, errorMessage) == false)
+					{
+						throw GenICam::RuntimeException(errorMessage.c_str(), __FILE__, __LINE__);
+					}
+
+					for (size_t d = 0; d < pendingMeasurements.size(); d++)
+						resultWriter.Push(pendingMeasurements[d]);
+					pendingMeasurements.clear();
+
+					// the bright ramp continues with a freshly programmed block
+					exposureSequencer.InvalidateBlock();
+				}
+
+				// Build the flat-field correction (after the dark partners, so the light is on again).
+				if (flatFieldPending)
+				{
+					flatFieldPending = false;
+
+					// like the dark partners, the frames are taken at one exposure time without the sequencer
+					bool restartedGrabbing = false;
+					exposureSequencer.Disable(camera, restartedGrabbing);
+					if (restartedGrabbing)
+						frameTiming.ResetSequence();
+					exposureSequencer.SetExposureTime(camera, flatFieldExposureTime);
+
+					std::string errorMessage = "";
+					FlatField::Report report;
+					if (FlatField::Calibrate(camera, triggersPerPair, flatFieldFrames, lightSettleTimeMs, *pKernels, &frameTiming, masterDark, masterFlat, flatField, report, errorMessage) == false
+						|| flatField.Save(flatFieldFileName, errorMessage) == false)
+					{
+						cout << errorMessage << endl;
 					}
 					else
 					{
-						// Increment the exposure time for the next image.
-						camera.ExposureTime.SetValue(exposureTime + exposureTimeIncrementUsec);
+						cout << "Flat-field correction from " << report.numFrames << " dark and " << report.numFrames << " bright frames at " << flatFieldExposureTime << " us: "
+							<< "DSNU " << report.dsnuBefore << " -> " << report.dsnuAfter << " DN, PRNU " << report.prnuBefore << " -> " << report.prnuAfter << " %, "
+							<< report.numDefects << " defect pixels, corrected at " << report.megabytesPerSecond << " MB/s." << endl;
+						if (pKernels->isPacked == false)
+							cout << "High-pass (5x5) DSNU " << report.dsnuHighPassBefore << " -> " << report.dsnuHighPassAfter << " DN, PRNU " << report.prnuHighPassBefore << " -> " << report.prnuHighPassAfter
+								<< " %, master frames: DSNU " << report.dsnuHighPassMaster << " DN, PRNU " << report.prnuHighPassMaster << " %." << endl;
+						cout << "see \"" << flatFieldFileName << "\" for the coefficients." << endl;
 					}
+
+					exposureSequencer.InvalidateBlock();
+				}
+
+				// Save a checkpoint after each point, and now and then within a point (only between exposure steps, never in the middle of one).
+				bool pointEnds = (pointDone || i + 1 == maxImagesToGrab);
+				if (checkpointWriter.IsRunning() && pointEstimator.GetNumPairs() == 0
+					&& (pointEnds || stepTimer.GetRunTime() - lastCheckpointTime >= checkpointIntervalSec))
+				{
+					checkpointState.pointIndex = (uint32_t)(pointEnds ? p + 1 : p);
+					checkpointState.pointStarted = (pointEnds == false);
+					checkpointState.imagesGrabbed = i + 1;
+					checkpointState.nextExposureTime = nextExposureTime;
+					checkpointState.blackLevel = blackLevel;
+					checkpointState.rowsLogged = resultWriter.GetCounters().rowsPushed;
+					checkpointState.spectrogramSaved = spectrogramSaved;
+					checkpointState.flatFieldTried = flatFieldTried;
+					checkpointState.flatFieldSaved = flatField.IsValid();
+					checkpointState.pendingMeasurements = pendingMeasurements;
+					checkpointWriter.Post(checkpointState);
+					lastCheckpointTime = stepTimer.GetRunTime();
 				}
 			}
-			else
+		}
+
+		camera.StopGrabbing();
+		bool restartedGrabbing = false;
+		exposureSequencer.Disable(camera, restartedGrabbing);
+		if (sweepAborted)
+		{
+			cout << endl << "Sweep Aborted. Stopping Test..." << endl;
+			exitCode = 1;
+		}
+		else
+			cout << endl << (options.singleShot ? "Screening Complete." : "Sweep Complete. Stopping Test...") << endl;
+
+		// a complete sweep has nothing to resume (an aborted one keeps its last checkpoint)
+		if (checkpointWriter.IsRunning())
+		{
+			std::string errorMessage = "";
+			if (checkpointWriter.Stop(errorMessage) == false)
+				cout << errorMessage << endl;
+			if (sweepAborted == false)
+				Checkpoint::Remove(checkpointFileName);
+		}
+		cout << "see \"" << resultFileName << "\" for results." << endl;
+		cout << "Test took " << stepTimer.GetRunTime() << " s, " << stepTimer.GetSummary() << endl;
+		cout << frameTiming.GetSummary() << endl;
+		{
+			std::string errorMessage = "";
+			if (frameTiming.SaveHistograms(frameTimingFileName, errorMessage) == false)
+				cout << errorMessage << endl;
+		}
+
+		// write what is left and close the results file
+		{
+			std::string errorMessage = "";
+			if (resultWriter.Close(errorMessage) == false)
 			{
-				cout << "Error: " << std::hex << ptrGrabResult1->GetErrorCode() << std::dec << " " << ptrGrabResult1->GetErrorDescription() << endl;
-				cout << "Error: " << std::hex << ptrGrabResult2->GetErrorCode() << std::dec << " " << ptrGrabResult2->GetErrorDescription() << endl;
+				cout << errorMessage << endl;
+				exitCode = 1;
 			}
+
+			// If rows overflowed the queue, the disk couldn't keep up with the measurements (the sweep waited for it, dropped rows are lost).
+			ResultWriter::Counters counters = resultWriter.GetCounters();
+			cout << "Result writer: " << counters.rowsWritten << " of " << counters.rowsPushed << " rows, " << counters.bytesWritten << " bytes in "
+				<< counters.writes << " writes, max queue depth " << counters.maxQueueDepth << ", " << counters.rowsOverflowed << " rows waited for the queue, "
+				<< counters.rowsDropped << " dropped." << endl;
 		}
 
-		// close the csv file
-		std::fclose(csvfileout);
+		// For regression runs, check the results against a known good csv file.
+		if (options.referenceCsv.empty() == false)
+		{
+			std::string report = "";
+			if (RegressionHarness::CompareCsv(resultFileName, options.referenceCsv, options.tolerance, report) == false)
+				exitCode = 2;
+			cout << report << endl;
+		}
+
+		// Report how much memory the intermediate images used. If the pool kept allocating after warm-up, something is leaking buffers.
+		// (only the image buffers are counted, not every allocation of the loop)
+		{
+			ImagePool::Counters counters = imagePool.GetCounters();
+			cout << "Image pool: " << counters.allocations << " buffers (" << counters.bytesAllocated << " bytes), "
+				<< counters.allocations - warmupAllocations << " image buffer allocations after warm-up." << endl;
+			if (options.referenceCsv.empty() == false && counters.allocations != warmupAllocations)
+			{
+				cout << "ERROR: The image pool allocated after warm-up." << endl;
+				exitCode = 2;
+			}
+		}
+
+		// Report how busy each thread was (workers near 0% aren't needed, a main thread near 100% can't keep up).
+		cout << ThreadTuning::GetReport(runStart) << endl;
 
 		// For convinience, turn off the light and turn turn off triggering (if you like to go now into pylon viewer and do other things)
 		if (camera.BslLightControlMode.IsWritable())
@@ -396,9 +1495,12 @@ int main(int argc, char* argv[])
 		exitCode = 1;
 	}
 
-	// Comment the following two lines to disable waiting on exit.
-	cerr << endl << "Press enter to exit." << endl;
-	while (cin.get() != '\n');
+	// Use --no-wait to disable waiting on exit.
+	if (options.waitOnExit)
+	{
+		cerr << endl << "Press enter to exit." << endl;
+		while (cin.get() != '\n');
+	}
 
 	// Releases all pylon resources.
 	PylonTerminate();
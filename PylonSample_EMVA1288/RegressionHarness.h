@@ -0,0 +1,329 @@
+// RegressionHarness.h
+// Helpers to run the test without hardware, using the pylon camera emulator, and to check the results automatically.
+// - Synthetic photon transfer frames: a ramp of flat frames with known mean and shot/read noise, which the emulator plays back.
+// - Timing of each measurement step (trigger until the results are logged).
+// - Comparison of a result csv against a reference csv, within a tolerance.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef REGRESSIONHARNESS_H
+#define REGRESSIONHARNESS_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience (if this header included first)
+#endif
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace RegressionHarness
+{
+	// Describes the synthetic sensor. Values are in DN (digital numbers) of an 8 bit image.
+	struct SyntheticSensor
+	{
+		uint32_t width = 1024;
+		uint32_t height = 1040;
+		uint32_t numSteps = 24; // number of exposure steps, the last one is saturated
+		double darkLevel = 8; // mean of the darkest step
+		double readNoise = 1.0; // temporal dark noise (sigma)
+		double systemGain = 0.25; // K, DN per electron. Shot noise variance = K * (mean - darkLevel)
+		uint32_t seed = 1288;
+	};
+
+	// Write numSteps pairs of Mono8 frames (frame_00000.png, frame_00001.png, ...) into directory, which must exist.
+	// The emulator plays them back in name order, so each triggered pair of frames gets the next step.
+	// The noise comes from std::mt19937 with our own Box-Muller transform, so the frames are the same with every compiler.
+	bool GenerateSyntheticFrames(const std::string& directory, const SyntheticSensor& sensor, std::string& errorMessage);
+
+	// Measures the time of each step of the test.
+	class StepTimer
+	{
+	private:
+		std::chrono::steady_clock::time_point m_runStart;
+		std::chrono::steady_clock::time_point m_stepStart;
+		std::vector<double> m_stepTimes; // milliseconds
+
+	public:
+		StepTimer();
+		~StepTimer();
+
+		void StartRun();
+		void StartStep();
+		void StopStep();
+
+		// Wall-clock time since StartRun() in seconds.
+		double GetRunTime();
+
+		// Summary of the step times: "N steps, min/avg/p95/max ms"
+		std::string GetSummary();
+	};
+
+	// Compare the numeric fields of two csv files (same header, same number of rows).
+	// A field matches if |result - reference| <= tolerance * max(|reference|, 1).
+	// Returns false if the files can't be compared or don't match. report lists the first mismatches.
+	bool CompareCsv(const std::string& resultFile, const std::string& referenceFile, double tolerance, std::string& report);
+
+	// helpers
+	bool ReadLines(const std::string& fileName, std::vector<std::string>& lines);
+	void SplitCsvLine(const std::string& line, std::vector<std::string>& fields);
+}
+
+// *********************************************************************************************************
+inline bool RegressionHarness::GenerateSyntheticFrames(const std::string& directory, const SyntheticSensor& sensor, std::string& errorMessage)
+{
+	try
+	{
+		if (sensor.numSteps < 3 || sensor.width == 0 || sensor.height == 0)
+		{
+			errorMessage = "ERROR: Synthetic sensor needs at least three steps and a size.";
+			return false;
+		}
+
+		const double saturation = 255;
+		std::mt19937 generator(sensor.seed);
+		const double twoPi = 6.283185307179586;
+
+		Pylon::CPylonImage frame;
+		frame.Reset(Pylon::PixelType_Mono8, sensor.width, sensor.height);
+		uint8_t* pFrame = (uint8_t*)frame.GetBuffer();
+		size_t numPixels = (size_t)sensor.width * sensor.height;
+
+		for (uint32_t step = 0; step < sensor.numSteps; step++)
+		{
+			// ramp up to 90% of saturation, then one fully saturated step so the test stops
+			bool saturated = (step == sensor.numSteps - 1);
+			double mean = sensor.darkLevel + (0.9 * saturation - sensor.darkLevel) * step / (sensor.numSteps - 2);
+			double sigma = std::sqrt(sensor.readNoise * sensor.readNoise + sensor.systemGain * (mean - sensor.darkLevel));
+
+			for (uint32_t n = 0; n < 2; n++)
+			{
+				for (size_t i = 0; i < numPixels; i++)
+				{
+					if (saturated)
+					{
+						pFrame[i] = (uint8_t)saturation;
+						continue;
+					}
+
+					// Box-Muller (u1 is never 0)
+					double u1 = (generator() + 1.0) / 4294967297.0;
+					double u2 = generator() / 4294967296.0;
+					double value = mean + sigma * std::sqrt(-2.0 * std::log(u1)) * std::cos(twoPi * u2);
+					value = std::floor(value + 0.5);
+					pFrame[i] = (uint8_t)((value < 0) ? 0 : (value > saturation) ? saturation : value);
+				}
+
+				char fileName[32];
+				std::snprintf(fileName, sizeof(fileName), "frame_%05u.png", step * 2 + n);
+				std::string path = directory + "/" + fileName;
+				Pylon::CImagePersistence::Save(Pylon::ImageFileFormat_Png, path.c_str(), frame);
+			}
+		}
+
+		return true;
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in GenerateSyntheticFrames(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+	catch (std::exception& e)
+	{
+		errorMessage = "An exception occured in GenerateSyntheticFrames(): ";
+		errorMessage.append(e.what());
+		return false;
+	}
+}
+
+inline RegressionHarness::StepTimer::StepTimer()
+{
+	m_runStart = std::chrono::steady_clock::now();
+	m_stepStart = m_runStart;
+}
+
+inline RegressionHarness::StepTimer::~StepTimer()
+{
+	// nothing
+}
+
+inline void RegressionHarness::StepTimer::StartRun()
+{
+	m_stepTimes.clear();
+	m_stepTimes.reserve(4096);
+	m_runStart = std::chrono::steady_clock::now();
+}
+
+inline void RegressionHarness::StepTimer::StartStep()
+{
+	m_stepStart = std::chrono::steady_clock::now();
+}
+
+inline void RegressionHarness::StepTimer::StopStep()
+{
+	std::chrono::duration<double, std::milli> stepTime = std::chrono::steady_clock::now() - m_stepStart;
+	m_stepTimes.push_back(stepTime.count());
+}
+
+inline double RegressionHarness::StepTimer::GetRunTime()
+{
+	std::chrono::duration<double> runTime = std::chrono::steady_clock::now() - m_runStart;
+	return runTime.count();
+}
+
+inline std::string RegressionHarness::StepTimer::GetSummary()
+{
+	std::ostringstream summary;
+	summary << m_stepTimes.size() << " steps";
+	if (m_stepTimes.empty())
+		return summary.str();
+
+	std::vector<double> sorted = m_stepTimes;
+	std::sort(sorted.begin(), sorted.end());
+	double total = 0;
+	for (size_t i = 0; i < sorted.size(); i++)
+		total += sorted[i];
+
+	size_t p95 = (sorted.size() * 95) / 100;
+	if (p95 >= sorted.size())
+		p95 = sorted.size() - 1;
+
+	summary << ", step time min/avg/p95/max: " << sorted.front() << " / " << total / sorted.size() << " / " << sorted[p95] << " / " << sorted.back() << " ms";
+	return summary.str();
+}
+
+inline bool RegressionHarness::ReadLines(const std::string& fileName, std::vector<std::string>& lines)
+{
+	std::FILE* const filein = std::fopen(fileName.c_str(), "rb");
+	if (filein == NULL)
+		return false;
+
+	lines.clear();
+	std::string line = "";
+	int c = 0;
+	while ((c = std::fgetc(filein)) != EOF)
+	{
+		if (c == '\n')
+		{
+			lines.push_back(line);
+			line.clear();
+		}
+		else if (c != '\r')
+			line.push_back((char)c);
+	}
+	if (line.empty() == false)
+		lines.push_back(line);
+
+	std::fclose(filein);
+	return true;
+}
+
+inline void RegressionHarness::SplitCsvLine(const std::string& line, std::vector<std::string>& fields)
+{
+	fields.clear();
+	size_t start = 0;
+	while (true)
+	{
+		size_t comma = line.find(',', start);
+		if (comma == std::string::npos)
+		{
+			fields.push_back(line.substr(start));
+			return;
+		}
+		fields.push_back(line.substr(start, comma - start));
+		start = comma + 1;
+	}
+}
+
+inline bool RegressionHarness::CompareCsv(const std::string& resultFile, const std::string& referenceFile, double tolerance, std::string& report)
+{
+	std::vector<std::string> resultLines;
+	std::vector<std::string> referenceLines;
+	if (ReadLines(resultFile, resultLines) == false)
+	{
+		report = "ERROR: Could not read " + resultFile;
+		return false;
+	}
+	if (ReadLines(referenceFile, referenceLines) == false)
+	{
+		report = "ERROR: Could not read " + referenceFile;
+		return false;
+	}
+
+	if (resultLines.empty() || referenceLines.empty() || resultLines[0] != referenceLines[0])
+	{
+		report = "ERROR: The csv headers don't match.";
+		return false;
+	}
+
+	std::ostringstream out;
+	bool match = true;
+	size_t mismatches = 0;
+	const size_t maxReported = 10;
+
+	if (resultLines.size() != referenceLines.size())
+	{
+		out << "Row count differs: " << resultLines.size() - 1 << " rows, expected " << referenceLines.size() - 1 << "." << std::endl;
+		match = false;
+	}
+
+	std::vector<std::string> header;
+	std::vector<std::string> resultFields;
+	std::vector<std::string> referenceFields;
+	SplitCsvLine(referenceLines[0], header);
+
+	size_t numRows = (resultLines.size() < referenceLines.size()) ? resultLines.size() : referenceLines.size();
+	for (size_t row = 1; row < numRows; row++)
+	{
+		SplitCsvLine(resultLines[row], resultFields);
+		SplitCsvLine(referenceLines[row], referenceFields);
+		for (size_t col = 0; col < referenceFields.size(); col++)
+		{
+			double expected = std::atof(referenceFields[col].c_str());
+			double actual = (col < resultFields.size()) ? std::atof(resultFields[col].c_str()) : 0;
+			double allowed = tolerance * ((std::fabs(expected) > 1.0) ? std::fabs(expected) : 1.0);
+			if (col >= resultFields.size() || std::fabs(actual - expected) > allowed)
+			{
+				match = false;
+				if (mismatches++ < maxReported)
+					out << "Row " << row << ", " << ((col < header.size()) ? header[col] : "?") << ": " << actual << ", expected " << expected << std::endl;
+			}
+		}
+	}
+
+	if (mismatches > maxReported)
+		out << "... " << mismatches - maxReported << " more." << std::endl;
+
+	report = match ? "Results match the reference." : out.str();
+	return match;
+}
+// *********************************************************************************************************
+#endif
@@ -0,0 +1,718 @@
+// ResultWriter.h
+// Writes the measurement results on its own thread, so slow disks or network shares never stall the acquisition loop.
+// The loop pushes results into a bounded lock-free queue. The writer thread formats them with a sink (csv, binary or json lines)
+// and writes them in large batches, flushing (and optionally syncing to disk) according to a policy.
+// If the writer falls behind and the queue is full, results go into an overflow list instead of blocking, and are counted as backpressure.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef RESULTWRITER_H
+#define RESULTWRITER_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience (if this header included first)
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#ifdef WIN_BUILD
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "DarkBright.h"
+
+namespace ResultWriter
+{
+	enum EFormat
+	{
+		Format_Csv,
+		Format_Binary, // fixed size little-endian records after a small header, see BinarySink
+		Format_JsonLines // one json object per line
+	};
+
+	struct FlushPolicy
+	{
+		size_t batchBytes = 1024 * 1024; // collect this much before writing
+		uint32_t flushIntervalMs = 1000; // but write at least this often (0 = only when the batch is full, or at the end)
+		bool syncToDisk = false; // after each write, wait until the data is on the disk (safest, but slow)
+		uint32_t maxPushWaitMs = 1000; // when the queue is full, Push() waits this long for room, then drops the row (a write error)
+	};
+
+	// How the writer kept up.
+	struct Counters
+	{
+		uint64_t rowsPushed = 0;
+		uint64_t rowsWritten = 0;
+		uint64_t bytesWritten = 0;
+		uint64_t writes = 0;
+		uint64_t maxQueueDepth = 0; // highest number of rows waiting in the queue
+		uint64_t rowsOverflowed = 0; // rows that had to wait for room in the queue (the sink fell behind)
+		uint64_t rowsDropped = 0; // rows that didn't get room in time, and are not in the file
+	};
+
+	// Formats results into bytes.
+	class Sink
+	{
+	public:
+		virtual ~Sink() {}
+		virtual const char* GetExtension() = 0;
+		// roiNames: the ROIs every row has results for (see RoiStats.h)
+		virtual void FormatHeader(std::string& out, const std::vector<std::string>& roiNames) = 0;
+		virtual void Format(const DarkBright::Measurement& measurement, std::string& out) = 0;
+		// Bytes per row after FormatHeader(), or 0 for text formats with one row per line.
+		virtual size_t GetRecordSize() { return 0; }
+	};
+
+	class CsvSink : public Sink
+	{
+	public:
+		const char* GetExtension() { return ".csv"; }
+		void FormatHeader(std::string& out, const std::vector<std::string>& roiNames) { DarkBright::FormatCsvHeader(out, roiNames); }
+		void Format(const DarkBright::Measurement& measurement, std::string& out) { DarkBright::FormatCsvRow(measurement, out); }
+	};
+
+	// Header: "EMVA1288" (8 bytes), uint32 version, uint32 record size, uint32 number of ROIs, the ROI names (32 bytes each, zero padded).
+	// Record: the Measurement fields in declaration order. doubles as float64, counts as uint32, offsets as int32, hasPlanes/hasDark as uint32.
+	// The planes are 4 x (mean, temporal noise, snr, saturation), each ROI is uint32 valid, mean, std dev, temporal noise.
+	class BinarySink : public Sink
+	{
+	private:
+		uint32_t m_numRois = 0;
+		template <typename T> static void Append(std::string& out, T value) { out.append((const char*)&value, sizeof(T)); }
+	public:
+		static const uint32_t c_version = 4;
+		static const uint32_t c_recordSize = 1 * 8 + 6 * 4 + 8 * 8 + 2 * 4 + 2 * 4 + 4 + 4 * 8 + 4 + 16 * 8 + 4 + 4 * 8; // without the ROIs
+		static const uint32_t c_roiRecordSize = 4 + 3 * 8;
+		static const uint32_t c_roiNameSize = 32;
+		const char* GetExtension() { return ".bin"; }
+		void FormatHeader(std::string& out, const std::vector<std::string>& roiNames);
+		void Format(const DarkBright::Measurement& measurement, std::string& out);
+		size_t GetRecordSize() { return c_recordSize + m_numRois * c_roiRecordSize; }
+	};
+
+	class JsonLinesSink : public Sink
+	{
+	private:
+		std::vector<std::string> m_roiNames;
+		// ,"name":value for each of the values (the first one without the comma if first is set). nan and inf are written as null.
+		static void AppendNumbers(std::string& out, const char* const* names, const double* values, size_t count, bool first = false);
+		// a quoted string, with " and \ and control characters escaped
+		static void AppendString(std::string& out, const std::string& text);
+	public:
+		const char* GetExtension() { return ".jsonl"; }
+		void FormatHeader(std::string& /*out*/, const std::vector<std::string>& roiNames) { m_roiNames = roiNames; /* no header */ }
+		void Format(const DarkBright::Measurement& measurement, std::string& out);
+	};
+
+	Sink* CreateSink(EFormat format);
+
+	// Single producer, single consumer ring buffer. Capacity is rounded up to a power of two.
+	template <typename T>
+	class RingBuffer
+	{
+	private:
+		std::vector<T> m_items;
+		size_t m_mask = 0;
+		std::atomic<size_t> m_head; // next item to pop (consumer)
+		std::atomic<size_t> m_tail; // next free slot (producer)
+
+	public:
+		RingBuffer(size_t capacity);
+		bool TryPush(const T& item);
+		bool TryPop(T& item);
+		size_t GetDepth();
+		size_t GetCapacity();
+	};
+
+	class Writer
+	{
+	private:
+		std::unique_ptr<Sink> m_sink;
+		std::FILE* m_file = NULL;
+		FlushPolicy m_policy;
+		RingBuffer<DarkBright::Measurement> m_queue;
+		std::atomic<bool> m_stop;
+		std::thread m_thread;
+		// producer side
+		uint64_t m_rowsPushed = 0;
+		uint64_t m_maxQueueDepth = 0;
+		uint64_t m_rowsOverflowed = 0;
+		std::atomic<uint64_t> m_rowsDropped;
+		// writer thread side
+		std::atomic<uint64_t> m_rowsWritten;
+		std::atomic<uint64_t> m_bytesWritten;
+		std::atomic<uint64_t> m_writes;
+		std::atomic<bool> m_writeFailed;
+		std::atomic<uint64_t> m_rowsFlushed; // rows handed to the OS (stops at the first failed write)
+		std::atomic<bool> m_flushRequested;
+		std::vector<std::string> m_roiNames;
+
+		void Run();
+		void WriteBuffer(std::string& buffer);
+
+	public:
+		Writer(size_t queueCapacity = 4096);
+		~Writer();
+
+		// The ROIs the rows will have results for (see RoiStats.h). Set before Open(), the header lists them.
+		void SetRoiNames(const std::vector<std::string>& roiNames);
+
+		// Open the file (the sink's extension is appended to baseFileName) and start the writer thread.
+		bool Open(const std::string& baseFileName, EFormat format, const FlushPolicy& policy, std::string& fileName, std::string& errorMessage);
+
+		// Open an existing results file to continue it (eg: resuming from a checkpoint, see Checkpoint.h).
+		// The header must match, the first numRows rows are kept and anything after them is cut off.
+		bool Reopen(const std::string& baseFileName, EFormat format, const FlushPolicy& policy, uint64_t numRows, std::string& fileName, std::string& errorMessage);
+
+		// Queue a result. If the queue is full, waits up to FlushPolicy::maxPushWaitMs for the writer thread to make room,
+		// so memory stays bounded. Returns false if the row was dropped (the file then misses rows, see HasWriteFailed()).
+		bool Push(const DarkBright::Measurement& measurement);
+
+		// Write everything that is left, and close the file.
+		bool Close(std::string& errorMessage);
+
+		// Ask the writer thread to write its batch now, instead of waiting for the flush policy.
+		void RequestFlush();
+
+		// How many rows (counting from the start of the file) have been handed to the OS.
+		uint64_t GetRowsFlushed();
+
+		// true once a write failed or a row was dropped: the file doesn't have every row pushed, and can't be resumed from.
+		bool HasWriteFailed();
+
+		bool IsOpen();
+		Counters GetCounters();
+	};
+}
+
+// *********************************************************************************************************
+inline void ResultWriter::BinarySink::FormatHeader(std::string& out, const std::vector<std::string>& roiNames)
+{
+	m_numRois = (uint32_t)roiNames.size();
+	out.append("EMVA1288", 8);
+	Append<uint32_t>(out, c_version);
+	Append<uint32_t>(out, c_recordSize + m_numRois * c_roiRecordSize);
+	Append<uint32_t>(out, m_numRois);
+	for (uint32_t roi = 0; roi < m_numRois; roi++)
+	{
+		std::string name = roiNames[roi].substr(0, c_roiNameSize - 1);
+		name.resize(c_roiNameSize, '\0');
+		out.append(name);
+	}
+}
+
+inline void ResultWriter::BinarySink::Format(const DarkBright::Measurement& m, std::string& out)
+{
+	Append<double>(out, m.exposureTime);
+	Append<uint32_t>(out, m.minAll);
+	Append<uint32_t>(out, m.maxAll);
+	Append<uint32_t>(out, m.avgAll);
+	Append<uint32_t>(out, m.avgRed);
+	Append<uint32_t>(out, m.avgGreen);
+	Append<uint32_t>(out, m.avgBlue);
+	Append<double>(out, m.snrAll);
+	Append<double>(out, m.snrRed);
+	Append<double>(out, m.snrGreen);
+	Append<double>(out, m.snrBlue);
+	Append<double>(out, m.rowFpn);
+	Append<double>(out, m.colFpn);
+	Append<double>(out, m.gain);
+	Append<double>(out, m.blackLevel);
+	Append<uint32_t>(out, m.width);
+	Append<uint32_t>(out, m.height);
+	Append<int32_t>(out, m.offsetX);
+	Append<int32_t>(out, m.offsetY);
+	Append<uint32_t>(out, m.numPairs);
+	Append<double>(out, m.mean);
+	Append<double>(out, m.meanHalfWidth);
+	Append<double>(out, m.temporalVariance);
+	Append<double>(out, m.temporalVarianceHalfWidth);
+	Append<uint32_t>(out, m.hasPlanes ? 1 : 0);
+	for (int plane = 0; plane < 4; plane++)
+	{
+		Append<double>(out, m.planes[plane].mean);
+		Append<double>(out, m.planes[plane].temporalNoise);
+		Append<double>(out, m.planes[plane].snr);
+		Append<double>(out, m.planes[plane].saturation);
+	}
+	Append<uint32_t>(out, m.hasDark ? 1 : 0);
+	Append<double>(out, m.darkAvgAll);
+	Append<double>(out, m.darkAvgRed);
+	Append<double>(out, m.darkAvgGreen);
+	Append<double>(out, m.darkAvgBlue);
+	for (uint32_t roi = 0; roi < m_numRois; roi++)
+	{
+		// (rows always have the ROIs of the header, a row without them gets invalid entries)
+		RoiStats::RoiSummary summary;
+		if (roi < m.numRois)
+			summary = m.rois[roi];
+		Append<uint32_t>(out, summary.valid ? 1 : 0);
+		Append<double>(out, summary.mean);
+		Append<double>(out, summary.stdDev);
+		Append<double>(out, summary.temporalNoise);
+	}
+}
+
+inline void ResultWriter::JsonLinesSink::AppendNumbers(std::string& out, const char* const* names, const double* values, size_t count, bool first)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out.append((first && i == 0) ? "\"" : ",\"");
+		out.append(names[i]);
+		// (JSON has no numbers for nan and inf, printf would write them as words)
+		if (std::isfinite(values[i]))
+			DarkBright::AppendFormat(out, "\":%f", values[i]);
+		else
+			out.append("\":null");
+	}
+}
+
+inline void ResultWriter::JsonLinesSink::AppendString(std::string& out, const std::string& text)
+{
+	out.append("\"");
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		char c = text[i];
+		if (c == '"' || c == '\\')
+		{
+			out.push_back('\\');
+			out.push_back(c);
+		}
+		else if ((unsigned char)c < 0x20)
+			DarkBright::AppendFormat(out, "\\u%04x", (unsigned int)(unsigned char)c);
+		else
+			out.push_back(c);
+	}
+	out.append("\"");
+}
+
+inline void ResultWriter::JsonLinesSink::Format(const DarkBright::Measurement& m, std::string& out)
+{
+	out.append("{");
+	const char* exposureName[1] = { "exposureTime" };
+	AppendNumbers(out, exposureName, &m.exposureTime, 1, true);
+	DarkBright::AppendFormat(out, ",\"min\":%u,\"max\":%u,\"avgAll\":%u,\"avgRed\":%u,\"avgGreen\":%u,\"avgBlue\":%u",
+		m.minAll, m.maxAll, m.avgAll, m.avgRed, m.avgGreen, m.avgBlue);
+	const char* noiseNames[8] = { "snrAll", "snrRed", "snrGreen", "snrBlue", "rowFpn", "colFpn", "gain", "blackLevel" };
+	const double noiseValues[8] = { m.snrAll, m.snrRed, m.snrGreen, m.snrBlue, m.rowFpn, m.colFpn, m.gain, m.blackLevel };
+	AppendNumbers(out, noiseNames, noiseValues, 8);
+	DarkBright::AppendFormat(out, ",\"width\":%u,\"height\":%u,\"offsetX\":%d,\"offsetY\":%d,\"pairs\":%u",
+		m.width, m.height, m.offsetX, m.offsetY, m.numPairs);
+	const char* estimateNames[4] = { "mean", "meanCI", "temporalVariance", "temporalVarianceCI" };
+	const double estimateValues[4] = { m.mean, m.meanHalfWidth, m.temporalVariance, m.temporalVarianceHalfWidth };
+	AppendNumbers(out, estimateNames, estimateValues, 4);
+
+	if (m.hasPlanes)
+	{
+		const char* planeNames[4] = { "red", "greenRed", "greenBlue", "blue" };
+		const char* planeValueNames[4] = { "mean", "temporalNoise", "snr", "saturation" };
+		for (int plane = 0; plane < 4; plane++)
+		{
+			const double planeValues[4] = { m.planes[plane].mean, m.planes[plane].temporalNoise, m.planes[plane].snr, m.planes[plane].saturation };
+			out.append(",\"");
+			out.append(planeNames[plane]);
+			out.append("\":{");
+			AppendNumbers(out, planeValueNames, planeValues, 4, true);
+			out.append("}");
+		}
+	}
+
+	if (m.hasDark)
+	{
+		const char* darkNames[4] = { "darkAvgAll", "darkAvgRed", "darkAvgGreen", "darkAvgBlue" };
+		const double darkValues[4] = { m.darkAvgAll, m.darkAvgRed, m.darkAvgGreen, m.darkAvgBlue };
+		AppendNumbers(out, darkNames, darkValues, 4);
+	}
+
+	if (m.numRois > 0)
+	{
+		const char* roiValueNames[3] = { "mean", "stdDev", "temporalNoise" };
+		out.append(",\"rois\":{");
+		for (uint32_t roi = 0; roi < m.numRois && roi < m_roiNames.size(); roi++)
+		{
+			if (roi > 0)
+				out.append(",");
+			AppendString(out, m_roiNames[roi]);
+			if (m.rois[roi].valid)
+			{
+				const double roiValues[3] = { m.rois[roi].mean, m.rois[roi].stdDev, m.rois[roi].temporalNoise };
+				out.append(":{");
+				AppendNumbers(out, roiValueNames, roiValues, 3, true);
+				out.append("}");
+			}
+			else
+				out.append(":null");
+		}
+		out.append("}");
+	}
+	out.append("}\n");
+}
+
+inline ResultWriter::Sink* ResultWriter::CreateSink(EFormat format)
+{
+	switch (format)
+	{
+	case Format_Binary:
+		return new BinarySink();
+	case Format_JsonLines:
+		return new JsonLinesSink();
+	default:
+		return new CsvSink();
+	}
+}
+
+template <typename T>
+inline ResultWriter::RingBuffer<T>::RingBuffer(size_t capacity) : m_head(0), m_tail(0)
+{
+	size_t size = 2;
+	while (size < capacity)
+		size = size * 2;
+	m_items.resize(size);
+	m_mask = size - 1;
+}
+
+template <typename T>
+inline bool ResultWriter::RingBuffer<T>::TryPush(const T& item)
+{
+	size_t tail = m_tail.load(std::memory_order_relaxed);
+	if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+		return false; // full
+
+	m_items[tail & m_mask] = item;
+	m_tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+template <typename T>
+inline bool ResultWriter::RingBuffer<T>::TryPop(T& item)
+{
+	size_t head = m_head.load(std::memory_order_relaxed);
+	if (head == m_tail.load(std::memory_order_acquire))
+		return false; // empty
+
+	item = m_items[head & m_mask];
+	m_head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+template <typename T>
+inline size_t ResultWriter::RingBuffer<T>::GetDepth()
+{
+	return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+}
+
+template <typename T>
+inline size_t ResultWriter::RingBuffer<T>::GetCapacity()
+{
+	return m_items.size();
+}
+
+inline ResultWriter::Writer::Writer(size_t queueCapacity) :
+	m_queue(queueCapacity), m_stop(false), m_rowsDropped(0), m_rowsWritten(0), m_bytesWritten(0), m_writes(0), m_writeFailed(false), m_rowsFlushed(0), m_flushRequested(false)
+{
+	// nothing
+}
+
+inline ResultWriter::Writer::~Writer()
+{
+	std::string errorMessage = "";
+	Close(errorMessage);
+}
+
+inline bool ResultWriter::Writer::Open(const std::string& baseFileName, EFormat format, const FlushPolicy& policy, std::string& fileName, std::string& errorMessage)
+{
+	if (m_file != NULL)
+	{
+		errorMessage = "ERROR: ResultWriter is already open.";
+		return false;
+	}
+
+	m_sink.reset(CreateSink(format));
+	m_policy = policy;
+	fileName = baseFileName + m_sink->GetExtension();
+
+	m_file = std::fopen(fileName.c_str(), "wb+");
+	if (m_file == NULL)
+	{
+		errorMessage = "ERROR: Could not open " + fileName + " (already opened by another application?)";
+		return false;
+	}
+	// We collect our own batches, so each batch goes to the OS in one write.
+	std::setvbuf(m_file, NULL, _IONBF, 0);
+
+	std::string header = "";
+	m_sink->FormatHeader(header, m_roiNames);
+	WriteBuffer(header);
+
+	m_stop = false;
+	m_thread = std::thread(&Writer::Run, this);
+	return true;
+}
+
+inline bool ResultWriter::Writer::Reopen(const std::string& baseFileName, EFormat format, const FlushPolicy& policy, uint64_t numRows, std::string& fileName, std::string& errorMessage)
+{
+	if (m_file != NULL)
+	{
+		errorMessage = "ERROR: ResultWriter is already open.";
+		return false;
+	}
+
+	m_sink.reset(CreateSink(format));
+	m_policy = policy;
+	fileName = baseFileName + m_sink->GetExtension();
+
+	m_file = std::fopen(fileName.c_str(), "rb+");
+	if (m_file == NULL)
+	{
+		errorMessage = "ERROR: Could not open " + fileName + " to continue it (missing, or opened by another application?)";
+		return false;
+	}
+	std::setvbuf(m_file, NULL, _IONBF, 0);
+
+	std::string contents = "";
+	char buffer[65536];
+	size_t numRead = 0;
+	while ((numRead = std::fread(buffer, 1, sizeof(buffer), m_file)) > 0)
+		contents.append(buffer, numRead);
+
+	// find the end of the rows to keep
+	std::string header = "";
+	m_sink->FormatHeader(header, m_roiNames);
+	size_t end = header.size();
+	size_t recordSize = m_sink->GetRecordSize();
+	bool complete = (contents.compare(0, header.size(), header) == 0);
+	for (uint64_t row = 0; row < numRows && complete; row++)
+	{
+		if (recordSize > 0)
+		{
+			complete = (end + recordSize <= contents.size());
+			end = end + recordSize;
+		}
+		else
+		{
+			size_t lineEnd = contents.find('\n', end);
+			complete = (lineEnd != std::string::npos);
+			end = lineEnd + 1;
+		}
+	}
+	if (complete == false)
+	{
+		errorMessage = "ERROR: " + fileName + " doesn't have the header or the rows this test expects.";
+		std::fclose(m_file);
+		m_file = NULL;
+		return false;
+	}
+
+	// cut off the rows written after that (they are measured again)
+	std::fflush(m_file);
+#ifdef WIN_BUILD
+	int truncated = _chsize_s(_fileno(m_file), (long long)end);
+#else
+	int truncated = ftruncate(fileno(m_file), (off_t)end);
+#endif
+	if (truncated != 0 || std::fseek(m_file, 0, SEEK_END) != 0)
+	{
+		errorMessage = "ERROR: Could not cut off the rows after the checkpoint in " + fileName;
+		std::fclose(m_file);
+		m_file = NULL;
+		return false;
+	}
+
+	m_rowsPushed = numRows;
+	m_rowsWritten = numRows;
+	m_rowsFlushed = numRows;
+	m_stop = false;
+	m_thread = std::thread(&Writer::Run, this);
+	return true;
+}
+
+inline void ResultWriter::Writer::SetRoiNames(const std::vector<std::string>& roiNames)
+{
+	m_roiNames = roiNames;
+}
+
+inline bool ResultWriter::Writer::Push(const DarkBright::Measurement& measurement)
+{
+	m_rowsPushed++;
+
+	bool pushed = m_queue.TryPush(measurement);
+	if (pushed == false)
+	{
+		// The writer is behind. Wait for it (a little), rather than keep rows aside without limit.
+		m_rowsOverflowed++;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		while ((pushed = m_queue.TryPush(measurement)) == false)
+		{
+			std::chrono::duration<double, std::milli> waited = std::chrono::steady_clock::now() - start;
+			if (waited.count() >= m_policy.maxPushWaitMs)
+				break;
+			m_flushRequested.store(true);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	if (pushed == false)
+	{
+		m_rowsDropped++;
+		return false;
+	}
+
+	size_t depth = m_queue.GetDepth();
+	if (depth > m_maxQueueDepth)
+		m_maxQueueDepth = depth;
+	return true;
+}
+
+inline void ResultWriter::Writer::WriteBuffer(std::string& buffer)
+{
+	if (buffer.empty())
+		return;
+
+	if (std::fwrite(buffer.data(), 1, buffer.size(), m_file) != buffer.size())
+		m_writeFailed = true;
+	m_bytesWritten += buffer.size();
+	m_writes++;
+	buffer.clear();
+	// (only the writer thread formats rows, so every row counted so far was in this buffer. After a failed write,
+	// the file has a hole, so no later row counts as flushed either.)
+	if (m_writeFailed == false)
+		m_rowsFlushed.store(m_rowsWritten.load());
+
+	if (m_policy.syncToDisk)
+	{
+		std::fflush(m_file);
+#ifdef WIN_BUILD
+		_commit(_fileno(m_file));
+#else
+		fsync(fileno(m_file));
+#endif
+	}
+}
+
+inline void ResultWriter::Writer::Run()
+{
+	std::string buffer;
+	buffer.reserve(m_policy.batchBytes + 4096);
+	DarkBright::Measurement measurement;
+	std::chrono::steady_clock::time_point lastWrite = std::chrono::steady_clock::now();
+
+	while (true)
+	{
+		// everything pushed before Close() is visible once we see the stop flag
+		bool stopping = m_stop.load(std::memory_order_acquire);
+
+		while (m_queue.TryPop(measurement))
+		{
+			m_sink->Format(measurement, buffer);
+			m_rowsWritten++;
+			if (buffer.size() >= m_policy.batchBytes)
+			{
+				WriteBuffer(buffer);
+				lastWrite = std::chrono::steady_clock::now();
+			}
+		}
+
+		std::chrono::duration<double, std::milli> sinceWrite = std::chrono::steady_clock::now() - lastWrite;
+		bool flushRequested = m_flushRequested.exchange(false);
+		if (stopping || flushRequested || (m_policy.flushIntervalMs > 0 && sinceWrite.count() >= m_policy.flushIntervalMs))
+		{
+			WriteBuffer(buffer);
+			lastWrite = std::chrono::steady_clock::now();
+		}
+
+		if (stopping)
+			break;
+
+		// (a full queue asks for a flush, so don't sleep then)
+		if (m_queue.GetDepth() < m_queue.GetCapacity())
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+}
+
+inline bool ResultWriter::Writer::Close(std::string& errorMessage)
+{
+	if (m_file == NULL)
+		return true;
+
+	m_stop.store(true, std::memory_order_release);
+	if (m_thread.joinable())
+		m_thread.join();
+
+	std::fflush(m_file);
+	std::fclose(m_file);
+	m_file = NULL;
+
+	if (m_writeFailed)
+	{
+		errorMessage = "ERROR: Not all results could be written.";
+		return false;
+	}
+	if (m_rowsDropped > 0)
+	{
+		errorMessage = "ERROR: " + std::to_string(m_rowsDropped.load()) + " results were dropped, the results file couldn't keep up.";
+		return false;
+	}
+	return true;
+}
+
+inline void ResultWriter::Writer::RequestFlush()
+{
+	m_flushRequested.store(true);
+}
+
+inline uint64_t ResultWriter::Writer::GetRowsFlushed()
+{
+	return m_rowsFlushed.load();
+}
+
+inline bool ResultWriter::Writer::HasWriteFailed()
+{
+	return m_writeFailed.load() || m_rowsDropped.load() > 0;
+}
+
+inline bool ResultWriter::Writer::IsOpen()
+{
+	return m_file != NULL;
+}
+
+inline ResultWriter::Counters ResultWriter::Writer::GetCounters()
+{
+	Counters counters;
+	counters.rowsPushed = m_rowsPushed;
+	counters.rowsWritten = m_rowsWritten;
+	counters.bytesWritten = m_bytesWritten;
+	counters.writes = m_writes;
+	counters.maxQueueDepth = m_maxQueueDepth;
+	counters.rowsOverflowed = m_rowsOverflowed;
+	counters.rowsDropped = m_rowsDropped;
+	return counters;
+}
+// *********************************************************************************************************
+#endif
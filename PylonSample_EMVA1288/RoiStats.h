@@ -0,0 +1,473 @@
+// RoiStats.h
+// Statistics of several regions of interest (ROIs) of one frame, for shading and vignetting measurements.
+// Instead of moving a small AOI around the sensor (one sweep per position), the camera grabs a large AOI (eg: the full frame)
+// and all ROIs are measured from the same pair of frames, in a single pass over the rows.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef ROISTATS_H
+#define ROISTATS_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+
+#include "AnalysisTools.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace RoiStats
+{
+	// Results have room for this many ROIs (so a row of results has a fixed size and can be queued without allocating).
+	const uint32_t c_maxRois = 16;
+
+	// A rectangle in sensor coordinates. (For Bayer sensors, use even positions and sizes, so each ROI holds whole 2x2 cells.)
+	struct Roi
+	{
+		std::string name;
+		uint32_t x = 0;
+		uint32_t y = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+	};
+
+	// The usual shading layout: center, the four corners and the four edge midpoints of the sensor, each roiWidth x roiHeight.
+	void MakeShadingRois(uint32_t sensorWidth, uint32_t sensorHeight, uint32_t roiWidth, uint32_t roiHeight, std::vector<Roi>& rois);
+
+	// Check a list of ROIs before the sweep: not too many, not empty, and on the sensor.
+	bool Validate(const std::vector<Roi>& rois, uint32_t sensorWidth, uint32_t sensorHeight, std::string& errorMessage);
+
+	// Statistics of one ROI in a pair of frames, per plane (R, Gr, Gb, B, see AnalysisTools::ECfaPlane). Mono frames only use the first.
+	struct RoiPairStats
+	{
+		AnalysisTools::Stats image1[4];
+		AnalysisTools::Stats image2[4];
+		AnalysisTools::DiffStats diff[4]; // image1 - image2, for the temporal noise
+
+		void Merge(const RoiPairStats& other);
+	};
+
+	// The results of one ROI. valid is false if the ROI is not inside the frame.
+	// For Bayer sensors, only the green pixels are used: mixing the colors would make the mean and the spatial noise follow the color ratios
+	// instead of the shading. Gr and Gb are pooled, each around its own mean, so an imbalance between them doesn't count as noise either.
+	struct RoiSummary
+	{
+		bool valid = false;
+		double mean = 0; // of both frames
+		double stdDev = 0; // spatial + temporal, of both frames
+		double temporalNoise = 0; // sqrt of the temporal variance
+	};
+
+	RoiSummary Summarize(const RoiPairStats& stats, bool isBayer);
+
+	// helper: the variance of the values of several planes, each around the mean of its own plane
+	template <typename S>
+	double FindPooledVariance(const S* planeStats, const uint32_t* planes, uint32_t numPlanes);
+
+	// Where the ROIs are in a frame, prepared once per frame geometry.
+	// The frame is cut into bands of rows in which the same ROIs are active. Within a band, the ROI spans are sorted by x,
+	// so every row of the frame is read once, from left to right, no matter how many ROIs there are.
+	class Plan
+	{
+	private:
+		struct Span
+		{
+			uint32_t x0 = 0;
+			uint32_t x1 = 0; // exclusive
+			uint32_t roi = 0;
+		};
+		std::vector<uint32_t> m_bandStarts; // first row of each band, plus the end of the last band
+		std::vector<size_t> m_bandSpans; // index of the first span of each band, plus the total
+		std::vector<Span> m_spans;
+		uint32_t m_width = 0;
+		uint32_t m_height = 0;
+		uint32_t m_numRois = 0;
+		uint32_t m_planeOf[4] = { 0, 0, 0, 0 }; // the plane of each position in the 2x2 cell of the frame, all 0 for mono
+		bool m_isBayer = false;
+
+	public:
+		// The ROIs are in sensor coordinates. offsetX/offsetY is where the frame sits on the sensor. ROIs are clipped to the frame.
+		// For Bayer frames, planePositions is where each plane sits in the 2x2 cell (see FormatDispatch::Kernels). nullptr for mono frames.
+		bool Build(const std::vector<Roi>& rois, int64_t offsetX, int64_t offsetY, uint32_t frameWidth, uint32_t frameHeight, const uint32_t* planePositions, std::string& errorMessage);
+
+		uint32_t GetNumRois() const;
+		uint32_t GetWidth() const;
+		uint32_t GetHeight() const;
+		bool IsBayer() const;
+
+		// Single threaded kernel for a range of rows. pStats has one entry per ROI (they are added to).
+		template <typename T>
+		void Accumulate(const T* pImage1, const T* pImage2, uint32_t firstRow, uint32_t numRows, RoiPairStats* pStats) const;
+	};
+
+	// Chunked, multi-threaded pass over a pair of frames. stats gets one entry per ROI of the plan.
+	template <typename T>
+	void FindRoiPairStatsT(const Plan& plan, const T* pImage1, const T* pImage2, std::vector<RoiPairStats>& stats);
+
+	// Same as above, for unpacked pylon images with the plan's geometry.
+	bool FindRoiPairStats(const Plan& plan, Pylon::CPylonImage& image1, Pylon::CPylonImage& image2, std::vector<RoiPairStats>& stats, std::string& errorMessage);
+}
+
+// *********************************************************************************************************
+inline void RoiStats::MakeShadingRois(uint32_t sensorWidth, uint32_t sensorHeight, uint32_t roiWidth, uint32_t roiHeight, std::vector<Roi>& rois)
+{
+	rois.clear();
+	if (roiWidth > sensorWidth)
+		roiWidth = sensorWidth;
+	if (roiHeight > sensorHeight)
+		roiHeight = sensorHeight;
+
+	// left/center/right and top/middle/bottom positions (kept even, so Bayer ROIs start on a cell)
+	uint32_t xs[3] = { 0, ((sensorWidth - roiWidth) / 2) & ~1u, (sensorWidth - roiWidth) & ~1u };
+	uint32_t ys[3] = { 0, ((sensorHeight - roiHeight) / 2) & ~1u, (sensorHeight - roiHeight) & ~1u };
+	const char* names[3][3] = { { "Top Left", "Top", "Top Right" }, { "Left", "Center", "Right" }, { "Bottom Left", "Bottom", "Bottom Right" } };
+
+	// center first, it is the reference the others are compared to
+	Roi roi;
+	roi.width = roiWidth;
+	roi.height = roiHeight;
+	roi.name = names[1][1];
+	roi.x = xs[1];
+	roi.y = ys[1];
+	rois.push_back(roi);
+
+	for (int row = 0; row < 3; row++)
+	{
+		for (int col = 0; col < 3; col++)
+		{
+			if (row == 1 && col == 1)
+				continue;
+			roi.name = names[row][col];
+			roi.x = xs[col];
+			roi.y = ys[row];
+			rois.push_back(roi);
+		}
+	}
+}
+
+inline bool RoiStats::Validate(const std::vector<Roi>& rois, uint32_t sensorWidth, uint32_t sensorHeight, std::string& errorMessage)
+{
+	if (rois.size() > c_maxRois)
+	{
+		errorMessage = "ERROR: Too many ROIs (the results have room for " + std::to_string(c_maxRois) + ").";
+		return false;
+	}
+
+	for (size_t r = 0; r < rois.size(); r++)
+	{
+		const Roi& roi = rois[r];
+		if (roi.width == 0 || roi.height == 0 || (uint64_t)roi.x + roi.width > sensorWidth || (uint64_t)roi.y + roi.height > sensorHeight)
+		{
+			errorMessage = "ERROR: The ROI \"" + roi.name + "\" is empty or not on the sensor (" + std::to_string(sensorWidth) + "x" + std::to_string(sensorHeight) + ").";
+			return false;
+		}
+	}
+	return true;
+}
+
+inline void RoiStats::RoiPairStats::Merge(const RoiPairStats& other)
+{
+	for (uint32_t plane = 0; plane < AnalysisTools::c_numCfaPlanes; plane++)
+	{
+		image1[plane].Merge(other.image1[plane]);
+		image2[plane].Merge(other.image2[plane]);
+		diff[plane].Merge(other.diff[plane]);
+	}
+}
+
+template <typename S>
+inline double RoiStats::FindPooledVariance(const S* planeStats, const uint32_t* planes, uint32_t numPlanes)
+{
+	double sumOfSquaredDeviations = 0;
+	uint64_t count = 0;
+	for (uint32_t p = 0; p < numPlanes; p++)
+	{
+		const S& stats = planeStats[planes[p]];
+		if (stats.count == 0)
+			continue;
+		double mean = (double)stats.sum / stats.count;
+		sumOfSquaredDeviations += (double)stats.sumOfSquares - mean * (double)stats.sum;
+		count += stats.count;
+	}
+
+	// (one degree of freedom per plane mean)
+	if (count <= numPlanes)
+		return 0;
+	double variance = sumOfSquaredDeviations / (count - numPlanes);
+	return (variance > 0) ? variance : 0;
+}
+
+inline RoiStats::RoiSummary RoiStats::Summarize(const RoiPairStats& stats, bool isBayer)
+{
+	const uint32_t greenPlanes[2] = { AnalysisTools::Plane_GreenRed, AnalysisTools::Plane_GreenBlue };
+	const uint32_t monoPlane[1] = { 0 };
+	const uint32_t* planes = isBayer ? greenPlanes : monoPlane;
+	uint32_t numPlanes = isBayer ? 2 : 1;
+
+	AnalysisTools::Stats image1;
+	AnalysisTools::Stats image2;
+	for (uint32_t p = 0; p < numPlanes; p++)
+	{
+		image1.Merge(stats.image1[planes[p]]);
+		image2.Merge(stats.image2[planes[p]]);
+	}
+
+	RoiSummary summary;
+	if (image1.count < 2 * numPlanes || image2.count < 2 * numPlanes)
+		return summary;
+
+	summary.valid = true;
+	summary.mean = ((double)image1.sum / image1.count + (double)image2.sum / image2.count) / 2;
+	summary.stdDev = (std::sqrt(FindPooledVariance(stats.image1, planes, numPlanes)) + std::sqrt(FindPooledVariance(stats.image2, planes, numPlanes))) / 2;
+	// EMVA1288 temporal variance: var(a - b) / 2
+	summary.temporalNoise = std::sqrt(FindPooledVariance(stats.diff, planes, numPlanes) / 2);
+	return summary;
+}
+
+inline bool RoiStats::Plan::Build(const std::vector<Roi>& rois, int64_t offsetX, int64_t offsetY, uint32_t frameWidth, uint32_t frameHeight, const uint32_t* planePositions, std::string& errorMessage)
+{
+	m_bandStarts.clear();
+	m_bandSpans.clear();
+	m_spans.clear();
+	m_width = frameWidth;
+	m_height = frameHeight;
+	m_numRois = (uint32_t)rois.size();
+	m_isBayer = (planePositions != nullptr);
+	for (uint32_t plane = 0; plane < AnalysisTools::c_numCfaPlanes; plane++)
+		m_planeOf[m_isBayer ? planePositions[plane] : plane] = m_isBayer ? plane : 0;
+
+	if (rois.size() > c_maxRois)
+	{
+		errorMessage = "ERROR: Too many ROIs (the results have room for " + std::to_string(c_maxRois) + ").";
+		m_numRois = 0;
+		return false;
+	}
+
+	// clip the ROIs to the frame (in frame coordinates)
+	std::vector<Span> clipped(rois.size());
+	std::vector<uint32_t> y0(rois.size(), 0);
+	std::vector<uint32_t> y1(rois.size(), 0);
+	std::vector<uint32_t> boundaries;
+	for (size_t r = 0; r < rois.size(); r++)
+	{
+		int64_t left = (int64_t)rois[r].x - offsetX;
+		int64_t top = (int64_t)rois[r].y - offsetY;
+		int64_t right = left + rois[r].width;
+		int64_t bottom = top + rois[r].height;
+		left = (left < 0) ? 0 : left;
+		top = (top < 0) ? 0 : top;
+		right = (right > (int64_t)frameWidth) ? frameWidth : right;
+		bottom = (bottom > (int64_t)frameHeight) ? frameHeight : bottom;
+		if (left >= right || top >= bottom)
+			continue; // not in this frame, its results stay empty
+
+		clipped[r].x0 = (uint32_t)left;
+		clipped[r].x1 = (uint32_t)right;
+		clipped[r].roi = (uint32_t)r;
+		y0[r] = (uint32_t)top;
+		y1[r] = (uint32_t)bottom;
+		boundaries.push_back(y0[r]);
+		boundaries.push_back(y1[r]);
+	}
+
+	std::sort(boundaries.begin(), boundaries.end());
+	boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+	// one band between each pair of boundaries, with the spans of the ROIs that cover it, sorted by x
+	for (size_t b = 0; b + 1 < boundaries.size(); b++)
+	{
+		m_bandStarts.push_back(boundaries[b]);
+		m_bandSpans.push_back(m_spans.size());
+		size_t first = m_spans.size();
+		for (size_t r = 0; r < rois.size(); r++)
+		{
+			if (y0[r] < y1[r] && y0[r] <= boundaries[b] && boundaries[b] < y1[r])
+				m_spans.push_back(clipped[r]);
+		}
+		std::sort(m_spans.begin() + first, m_spans.end(), [](const Span& left, const Span& right) { return left.x0 < right.x0; });
+	}
+	if (boundaries.empty() == false)
+		m_bandStarts.push_back(boundaries.back());
+	m_bandSpans.push_back(m_spans.size());
+
+	return true;
+}
+
+inline uint32_t RoiStats::Plan::GetNumRois() const
+{
+	return m_numRois;
+}
+
+inline uint32_t RoiStats::Plan::GetWidth() const
+{
+	return m_width;
+}
+
+inline uint32_t RoiStats::Plan::GetHeight() const
+{
+	return m_height;
+}
+
+inline bool RoiStats::Plan::IsBayer() const
+{
+	return m_isBayer;
+}
+
+template <typename T>
+inline void RoiStats::Plan::Accumulate(const T* pImage1, const T* pImage2, uint32_t firstRow, uint32_t numRows, RoiPairStats* pStats) const
+{
+	if (m_bandSpans.size() < 2)
+		return;
+
+	uint32_t endRow = firstRow + numRows;
+	// the band that holds firstRow (the last band start at or before it)
+	size_t band = std::upper_bound(m_bandStarts.begin(), m_bandStarts.end() - 1, firstRow) - m_bandStarts.begin();
+	band = (band > 0) ? band - 1 : 0;
+
+	for (; band + 1 < m_bandStarts.size() && m_bandStarts[band] < endRow; band++)
+	{
+		uint32_t rowStart = (m_bandStarts[band] > firstRow) ? m_bandStarts[band] : firstRow;
+		uint32_t rowEnd = (m_bandStarts[band + 1] < endRow) ? m_bandStarts[band + 1] : endRow;
+
+		for (uint32_t y = rowStart; y < rowEnd; y++)
+		{
+			const T* pRow1 = pImage1 + (size_t)y * m_width;
+			const T* pRow2 = pImage2 + (size_t)y * m_width;
+
+			// the planes of the even and odd columns of this row
+			const uint32_t rowPlanes[2] = { m_planeOf[(y & 1) * 2], m_planeOf[(y & 1) * 2 + 1] };
+
+			for (size_t s = m_bandSpans[band]; s < m_bandSpans[band + 1]; s++)
+			{
+				const Span& span = m_spans[s];
+				RoiPairStats& stats = pStats[span.roi];
+
+				for (uint32_t parity = 0; parity < 2; parity++)
+				{
+					uint32_t firstX = span.x0 + ((span.x0 & 1) != parity ? 1 : 0);
+					if (firstX >= span.x1)
+						continue;
+
+					uint64_t sum1 = 0;
+					uint64_t sumOfSquares1 = 0;
+					uint32_t min1 = UINT32_MAX;
+					uint32_t max1 = 0;
+					uint64_t sum2 = 0;
+					uint64_t sumOfSquares2 = 0;
+					uint32_t min2 = UINT32_MAX;
+					uint32_t max2 = 0;
+					int64_t diffSum = 0;
+					uint64_t diffSumOfSquares = 0;
+
+					for (uint32_t x = firstX; x < span.x1; x += 2)
+					{
+						uint32_t value1 = pRow1[x];
+						uint32_t value2 = pRow2[x];
+						int64_t diff = (int64_t)value1 - (int64_t)value2;
+						sum1 += value1;
+						sumOfSquares1 += (uint64_t)value1 * value1;
+						min1 = (value1 < min1) ? value1 : min1;
+						max1 = (value1 > max1) ? value1 : max1;
+						sum2 += value2;
+						sumOfSquares2 += (uint64_t)value2 * value2;
+						min2 = (value2 < min2) ? value2 : min2;
+						max2 = (value2 > max2) ? value2 : max2;
+						diffSum += diff;
+						diffSumOfSquares += (uint64_t)(diff * diff);
+					}
+
+					uint32_t plane = rowPlanes[parity];
+					uint32_t count = (span.x1 - firstX + 1) / 2;
+					stats.image1[plane].count += count;
+					stats.image1[plane].sum += sum1;
+					stats.image1[plane].sumOfSquares += sumOfSquares1;
+					stats.image1[plane].min = (min1 < stats.image1[plane].min) ? min1 : stats.image1[plane].min;
+					stats.image1[plane].max = (max1 > stats.image1[plane].max) ? max1 : stats.image1[plane].max;
+					stats.image2[plane].count += count;
+					stats.image2[plane].sum += sum2;
+					stats.image2[plane].sumOfSquares += sumOfSquares2;
+					stats.image2[plane].min = (min2 < stats.image2[plane].min) ? min2 : stats.image2[plane].min;
+					stats.image2[plane].max = (max2 > stats.image2[plane].max) ? max2 : stats.image2[plane].max;
+					stats.diff[plane].count += count;
+					stats.diff[plane].sum += diffSum;
+					stats.diff[plane].sumOfSquares += diffSumOfSquares;
+				}
+			}
+		}
+	}
+}
+
+template <typename T>
+inline void RoiStats::FindRoiPairStatsT(const Plan& plan, const T* pImage1, const T* pImage2, std::vector<RoiPairStats>& stats)
+{
+	uint32_t numRois = plan.GetNumRois();
+	stats.assign(numRois, RoiPairStats());
+	if (numRois == 0 || plan.GetWidth() == 0 || plan.GetHeight() == 0)
+		return;
+
+	// chunks of whole rows, about c_reductionChunkSize of each image
+	size_t bytesPerRow = (size_t)plan.GetWidth() * sizeof(T);
+	uint32_t rowsPerChunk = (uint32_t)((AnalysisTools::c_reductionChunkSize + bytesPerRow - 1) / bytesPerRow);
+	size_t numChunks = (plan.GetHeight() + rowsPerChunk - 1) / rowsPerChunk;
+
+	// (the tasks run on the pool threads, so they must use this thread's array through a reference, not the thread_local name)
+	static thread_local std::vector<RoiPairStats> chunkStats;
+	chunkStats.assign(numChunks * numRois, RoiPairStats());
+	std::vector<RoiPairStats>& results = chunkStats;
+
+	auto task = [&](size_t chunk)
+	{
+		uint32_t first = (uint32_t)chunk * rowsPerChunk;
+		uint32_t count = (first + rowsPerChunk < plan.GetHeight()) ? rowsPerChunk : plan.GetHeight() - first;
+		plan.Accumulate<T>(pImage1, pImage2, first, count, &results[chunk * numRois]);
+	};
+	ThreadPool::GetDefaultPool().ParallelFor(numChunks, std::cref(task));
+
+	// merge in chunk order
+	for (size_t chunk = 0; chunk < numChunks; chunk++)
+	{
+		for (uint32_t roi = 0; roi < numRois; roi++)
+			stats[roi].Merge(chunkStats[chunk * numRois + roi]);
+	}
+}
+
+inline bool RoiStats::FindRoiPairStats(const Plan& plan, Pylon::CPylonImage& image1, Pylon::CPylonImage& image2, std::vector<RoiPairStats>& stats, std::string& errorMessage)
+{
+	if (image1.GetWidth() != plan.GetWidth() || image1.GetHeight() != plan.GetHeight() || image2.GetWidth() != plan.GetWidth() || image2.GetHeight() != plan.GetHeight()
+		|| image1.GetPixelType() != image2.GetPixelType())
+	{
+		errorMessage = "ERROR: The frames don't match the ROI plan.";
+		return false;
+	}
+
+	if (Pylon::IsPacked(image1.GetPixelType()))
+	{
+		errorMessage = "ERROR: ROI statistics don't support packed pixel formats.";
+		return false;
+	}
+
+	if (Pylon::BitPerPixel(image1.GetPixelType()) > 8)
+		FindRoiPairStatsT<uint16_t>(plan, (const uint16_t*)image1.GetBuffer(), (const uint16_t*)image2.GetBuffer(), stats);
+	else
+		FindRoiPairStatsT<uint8_t>(plan, (const uint8_t*)image1.GetBuffer(), (const uint8_t*)image2.GetBuffer(), stats);
+	return true;
+}
+// *********************************************************************************************************
+#endif
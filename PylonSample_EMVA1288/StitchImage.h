@@ -29,11 +29,20 @@
 // Include Pylon libraries (if needed)
 #include <pylon/PylonIncludes.h>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 namespace StitchImage
 {
 	int StitchToBottom(Pylon::CPylonImage &topImage, Pylon::CPylonImage &bottomImage, Pylon::CPylonImage *stitchedImage, std::string &errorMessage);
 	int StitchToRight(Pylon::CPylonImage &leftImage, Pylon::CPylonImage &rightImage, Pylon::CPylonImage *stitchedImage, std::string &errorMessage);
 
+	// Copy several images side by side into an existing canvas (eg: one checked out of an ImagePool), without allocating anything.
+	// The canvas must have the same pixel type and height as the images, and be exactly as wide as all of them together.
+	int StitchRow(Pylon::CPylonImage *images[], size_t numImages, Pylon::CPylonImage &canvas, std::string &errorMessage);
+
 	class CollageMaker
 	{
 	private:
@@ -60,6 +69,54 @@ namespace StitchImage
 		bool IsCollageComplete();
 	};
 
+	// Composes tiles from several producer threads (eg: one per camera, or one per exposure step) into a preallocated canvas of columns x rows slots.
+	// Every slot has its own region of the canvas, so the producers copy their tiles in parallel without locking, and nothing is allocated after Setup().
+	// There are two canvases: producers fill the back one while readers get the front one. When every slot of the back canvas
+	// has been filled, it is published as the new front canvas and the producers move on to the other one.
+	// A slot may be filled again before its canvas is complete (the newer tile wins), but only one thread may fill a given slot at a time.
+	class TileCompositor
+	{
+	private:
+		Pylon::CPylonImage m_canvases[2];
+		std::unique_ptr<std::atomic<uint8_t>[]> m_slotFilled[2];
+		std::atomic<uint32_t> m_numFilled[2];
+		std::atomic<uint32_t> m_numWriters[2]; // PutTile() calls copying into each canvas
+		std::atomic<uint32_t> m_back;
+		std::mutex m_publishMutex; // held while publishing, and while a reader copies the front canvas
+		uint32_t m_front = 0;
+		uint64_t m_numPublished = 0;
+		Pylon::EPixelType m_pixelType = Pylon::PixelType_Undefined;
+		uint32_t m_tileWidth = 0; // of the tiles given to PutTile()
+		uint32_t m_tileHeight = 0;
+		uint32_t m_columns = 0;
+		uint32_t m_rows = 0;
+		uint32_t m_downscale = 1;
+
+		void Publish(uint32_t canvas);
+
+	public:
+		TileCompositor();
+		~TileCompositor();
+
+		// Allocate both canvases. Tiles are tileWidth x tileHeight, and are shrunk by downscale (1, 2, 3...) on the way in.
+		// Only 8 and 16 bit mono and Bayer formats are supported (Bayer tiles are downscaled per color, so the canvas is a valid mosaic).
+		// Not thread safe: call before the producers start.
+		int Setup(Pylon::EPixelType pixelType, uint32_t tileWidth, uint32_t tileHeight, uint32_t columns, uint32_t rows, uint32_t downscale, std::string &errorMessage);
+
+		// Copy a tile into its slot (0 = top left, row by row) of the back canvas. Safe to call from several threads for different slots.
+		int PutTile(uint32_t slot, Pylon::CPylonImage &tile, std::string &errorMessage);
+
+		// Copy the most recently completed canvas.
+		int GetLatestCanvas(Pylon::CPylonImage *canvas, std::string &errorMessage);
+
+		uint64_t GetNumPublished();
+		uint32_t GetNumSlots();
+	};
+
+	// Single threaded kernel: shrink rows [firstRow, firstRow + numRows) of the downscaled tile, averaging factor x factor pixels
+	// that are period pixels apart (1 for mono, 2 for Bayer).
+	template <typename T>
+	void DownscaleRowsT(const T *pTile, uint32_t tileWidth, uint32_t period, uint32_t factor, uint32_t firstRow, uint32_t numRows, T *pCanvas, size_t canvasWidth);
 }
 
 // *********************************************************************************************************
@@ -269,6 +326,73 @@ inline int StitchImage::StitchToRight(Pylon::CPylonImage &leftImage, Pylon::CPyl
 	}
 }
 
+inline int StitchImage::StitchRow(Pylon::CPylonImage *images[], size_t numImages, Pylon::CPylonImage &canvas, std::string &errorMessage)
+{
+	// Note: The error message is only built when something goes wrong, so the normal path doesn't allocate.
+	try
+	{
+		Pylon::EPixelType pixelType = canvas.GetPixelType();
+		int height = canvas.GetHeight();
+		int totalWidth = 0;
+
+		if (Pylon::IsPacked(pixelType) == true || Pylon::IsPlanar(pixelType) == true)
+		{
+			errorMessage = "ERROR: StitchRow(): Packed and planar pixel formats are not supported yet";
+			return 1;
+		}
+
+		for (size_t n = 0; n < numImages; n++)
+		{
+			if (images[n]->GetPixelType() != pixelType || (int)images[n]->GetHeight() != height)
+			{
+				errorMessage = "ERROR: StitchRow(): Images must be same PixelType and Height as the canvas";
+				return 1;
+			}
+			totalWidth += images[n]->GetWidth();
+		}
+
+		if (totalWidth != (int)canvas.GetWidth())
+		{
+			errorMessage = "ERROR: StitchRow(): Canvas must be as wide as all images together";
+			return 1;
+		}
+
+		int BytesPerPixel = Pylon::BitPerPixel(pixelType) / 8;
+		uint8_t *pCanvas = (uint8_t*)canvas.GetBuffer();
+
+		for (int i = 0; i < height; i++)
+		{
+			uint8_t *pCanvasRow = &pCanvas[totalWidth * i * BytesPerPixel];
+			for (size_t n = 0; n < numImages; n++)
+			{
+				int imageWidth = images[n]->GetWidth();
+				uint8_t *pImage = (uint8_t*)images[n]->GetBuffer();
+				memcpy(pCanvasRow, &pImage[imageWidth * i * BytesPerPixel], imageWidth * BytesPerPixel);
+				pCanvasRow += imageWidth * BytesPerPixel;
+			}
+		}
+
+		return 0;
+	}
+	catch (GenICam::GenericException &e)
+	{
+		errorMessage = "ERROR: StitchRow(): EXCEPTION: ";
+		errorMessage.append(e.GetDescription());
+		return 1;
+	}
+	catch (std::exception &e)
+	{
+		errorMessage = "ERROR: StitchRow(): EXCEPTION: ";
+		errorMessage.append(e.what());
+		return 1;
+	}
+	catch (...)
+	{
+		errorMessage = "ERROR: StitchRow(): EXCEPTION: UNKNOWN.";
+		return 1;
+	}
+}
+
 inline StitchImage::CollageMaker::CollageMaker()
 {
 	// nothing
@@ -438,6 +562,224 @@ inline bool StitchImage::CollageMaker::IsCollageComplete()
 	return m_collageComplete;
 }
 
+inline StitchImage::TileCompositor::TileCompositor()
+{
+	for (int c = 0; c < 2; c++)
+	{
+		m_numFilled[c] = 0;
+		m_numWriters[c] = 0;
+	}
+	m_back = 0;
+}
+
+inline StitchImage::TileCompositor::~TileCompositor()
+{
+	// nothing
+}
+
+inline int StitchImage::TileCompositor::Setup(Pylon::EPixelType pixelType, uint32_t tileWidth, uint32_t tileHeight, uint32_t columns, uint32_t rows, uint32_t downscale, std::string &errorMessage)
+{
+	try
+	{
+		uint32_t bitsPerPixel = Pylon::BitPerPixel(pixelType);
+		if (Pylon::IsPacked(pixelType) == true || Pylon::IsPlanar(pixelType) == true || (bitsPerPixel != 8 && bitsPerPixel != 16))
+		{
+			errorMessage = "ERROR: TileCompositor::Setup(): Only 8 and 16 bit mono and Bayer formats are supported";
+			return 1;
+		}
+
+		uint32_t period = Pylon::IsBayer(pixelType) ? 2 : 1;
+		if (columns == 0 || rows == 0 || downscale == 0 || tileWidth % (period * downscale) != 0 || tileHeight % (period * downscale) != 0 || tileWidth == 0 || tileHeight == 0)
+		{
+			errorMessage = "ERROR: TileCompositor::Setup(): The tile size must be a multiple of the downscale factor (twice the factor for Bayer formats)";
+			return 1;
+		}
+
+		uint32_t numSlots = columns * rows;
+		for (int c = 0; c < 2; c++)
+		{
+			m_canvases[c].Reset(pixelType, (tileWidth / downscale) * columns, (tileHeight / downscale) * rows);
+			memset(m_canvases[c].GetBuffer(), 0, m_canvases[c].GetImageSize());
+			m_slotFilled[c].reset(new std::atomic<uint8_t>[numSlots]);
+			for (uint32_t slot = 0; slot < numSlots; slot++)
+				m_slotFilled[c][slot] = 0;
+			m_numFilled[c] = 0;
+			m_numWriters[c] = 0;
+		}
+		m_back = 0;
+		m_front = 0;
+		m_numPublished = 0;
+		m_pixelType = pixelType;
+		m_tileWidth = tileWidth;
+		m_tileHeight = tileHeight;
+		m_columns = columns;
+		m_rows = rows;
+		m_downscale = downscale;
+		return 0;
+	}
+	catch (GenICam::GenericException &e)
+	{
+		errorMessage = "ERROR: TileCompositor::Setup(): EXCEPTION: ";
+		errorMessage.append(e.GetDescription());
+		return 1;
+	}
+	catch (std::exception &e)
+	{
+		errorMessage = "ERROR: TileCompositor::Setup(): EXCEPTION: ";
+		errorMessage.append(e.what());
+		return 1;
+	}
+	catch (...)
+	{
+		errorMessage = "ERROR: TileCompositor::Setup(): EXCEPTION: UNKNOWN.";
+		return 1;
+	}
+}
+
+inline int StitchImage::TileCompositor::PutTile(uint32_t slot, Pylon::CPylonImage &tile, std::string &errorMessage)
+{
+	// Note: The error message is only built when something goes wrong, so the normal path doesn't allocate.
+	if (slot >= m_columns * m_rows)
+	{
+		errorMessage = "ERROR: TileCompositor::PutTile(): No such slot";
+		return 1;
+	}
+
+	if (tile.GetPixelType() != m_pixelType || tile.GetWidth() != m_tileWidth || tile.GetHeight() != m_tileHeight)
+	{
+		errorMessage = "ERROR: TileCompositor::PutTile(): The tile must have the PixelType and size given to Setup()";
+		return 1;
+	}
+
+	// Register as a writer of the back canvas. If it was published in the meantime, try again with the new back canvas.
+	// (Publish() switches the back canvas first and then waits for the writers, so either it sees this writer, or this writer sees the switch)
+	uint32_t canvas = 0;
+	for (;;)
+	{
+		canvas = m_back.load();
+		m_numWriters[canvas]++;
+		if (m_back.load() == canvas)
+			break;
+		m_numWriters[canvas]--;
+	}
+
+	const uint32_t outWidth = m_tileWidth / m_downscale;
+	const uint32_t outHeight = m_tileHeight / m_downscale;
+	const size_t canvasWidth = (size_t)outWidth * m_columns;
+	const size_t bytesPerPixel = Pylon::BitPerPixel(m_pixelType) / 8;
+	const uint32_t period = Pylon::IsBayer(m_pixelType) ? 2 : 1;
+	const uint8_t *pTile = (const uint8_t*)tile.GetBuffer();
+	uint8_t *pSlot = (uint8_t*)m_canvases[canvas].GetBuffer() + (((size_t)(slot / m_columns) * outHeight * canvasWidth) + (size_t)(slot % m_columns) * outWidth) * bytesPerPixel;
+
+	// (copied on the calling thread: the producers are the parallelism, and a pool job here could wait on a producer blocked in Publish())
+	if (m_downscale == 1)
+	{
+		for (uint32_t row = 0; row < outHeight; row++)
+			memcpy(pSlot + row * canvasWidth * bytesPerPixel, pTile + (size_t)row * m_tileWidth * bytesPerPixel, m_tileWidth * bytesPerPixel);
+	}
+	else if (bytesPerPixel == 1)
+		DownscaleRowsT<uint8_t>(pTile, m_tileWidth, period, m_downscale, 0, outHeight, pSlot, canvasWidth);
+	else
+		DownscaleRowsT<uint16_t>((const uint16_t*)pTile, m_tileWidth, period, m_downscale, 0, outHeight, (uint16_t*)pSlot, canvasWidth);
+
+	// the writer which fills the last empty slot publishes the canvas
+	bool completed = (m_slotFilled[canvas][slot].exchange(1) == 0) && (m_numFilled[canvas].fetch_add(1) + 1 == m_columns * m_rows);
+	m_numWriters[canvas]--;
+	if (completed)
+		Publish(canvas);
+
+	return 0;
+}
+
+inline void StitchImage::TileCompositor::Publish(uint32_t canvas)
+{
+	std::lock_guard<std::mutex> lock(m_publishMutex);
+
+	// The other canvas becomes the back canvas. Nobody writes to it (it is the front canvas), so it can be cleared for refilling.
+	uint32_t next = 1 - canvas;
+	for (uint32_t slot = 0; slot < m_columns * m_rows; slot++)
+		m_slotFilled[next][slot] = 0;
+	m_numFilled[next] = 0;
+	m_back = next;
+
+	// writers which registered before the switch may still be replacing a tile of this canvas
+	while (m_numWriters[canvas].load() != 0)
+		std::this_thread::yield();
+
+	m_front = canvas;
+	m_numPublished++;
+}
+
+inline int StitchImage::TileCompositor::GetLatestCanvas(Pylon::CPylonImage *canvas, std::string &errorMessage)
+{
+	try
+	{
+		std::lock_guard<std::mutex> lock(m_publishMutex);
+		if (m_numPublished == 0)
+		{
+			errorMessage = "ERROR: TileCompositor::GetLatestCanvas(): No canvas available yet";
+			return 1;
+		}
+
+		canvas->CopyImage(m_canvases[m_front]);
+		return 0;
+	}
+	catch (GenICam::GenericException &e)
+	{
+		errorMessage = "ERROR: TileCompositor::GetLatestCanvas(): EXCEPTION: ";
+		errorMessage.append(e.GetDescription());
+		return 1;
+	}
+	catch (std::exception &e)
+	{
+		errorMessage = "ERROR: TileCompositor::GetLatestCanvas(): EXCEPTION: ";
+		errorMessage.append(e.what());
+		return 1;
+	}
+	catch (...)
+	{
+		errorMessage = "ERROR: TileCompositor::GetLatestCanvas(): EXCEPTION: UNKNOWN.";
+		return 1;
+	}
+}
+
+inline uint64_t StitchImage::TileCompositor::GetNumPublished()
+{
+	std::lock_guard<std::mutex> lock(m_publishMutex);
+	return m_numPublished;
+}
+
+inline uint32_t StitchImage::TileCompositor::GetNumSlots()
+{
+	return m_columns * m_rows;
+}
+
+template <typename T>
+inline void StitchImage::DownscaleRowsT(const T *pTile, uint32_t tileWidth, uint32_t period, uint32_t factor, uint32_t firstRow, uint32_t numRows, T *pCanvas, size_t canvasWidth)
+{
+	const uint32_t outWidth = tileWidth / factor;
+	const uint32_t numSamples = factor * factor;
+
+	for (uint32_t outRow = firstRow; outRow < firstRow + numRows; outRow++)
+	{
+		// the first source row of the same color, then every period-th row
+		uint32_t sourceRow = (outRow / period) * period * factor + outRow % period;
+		T *pOut = pCanvas + outRow * canvasWidth;
+		for (uint32_t outColumn = 0; outColumn < outWidth; outColumn++)
+		{
+			uint32_t sourceColumn = (outColumn / period) * period * factor + outColumn % period;
+			uint32_t sum = 0;
+			for (uint32_t j = 0; j < factor; j++)
+			{
+				const T *pIn = pTile + (size_t)(sourceRow + j * period) * tileWidth + sourceColumn;
+				for (uint32_t i = 0; i < factor; i++)
+					sum += pIn[i * period];
+			}
+			pOut[outColumn] = (T)((sum + numSamples / 2) / numSamples);
+		}
+	}
+}
+
 // *********************************************************************************************************
 
 #endif
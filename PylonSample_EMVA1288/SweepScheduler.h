@@ -0,0 +1,270 @@
+// SweepScheduler.h
+// Plans a multi-dimensional measurement sweep (AOI/pixel format x gain x black level x exposure time),
+// ordering the points so the expensive camera reconfigurations happen as rarely as possible.
+// eg: AOI and pixel format changes need StopGrabbing()/StartGrabbing(), exposure time changes don't.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef SWEEPSCHEDULER_H
+#define SWEEPSCHEDULER_H
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace SweepScheduler
+{
+	// Use this as the exposure time of a point to ramp the exposure from minimum until saturation (the classic EMVA1288 sweep).
+	const double c_exposureRamp = -1;
+
+	// Settings that can only be changed while the camera is not grabbing.
+	struct StreamConfig
+	{
+		std::string pixelFormat = ""; // empty keeps the camera's current format
+		int64_t width = 128;
+		int64_t height = 128;
+		int64_t offsetX = -1; // -1 places the AOI near the center of the sensor
+		int64_t offsetY = -1;
+	};
+
+	// One combination of settings to measure.
+	struct SweepPoint
+	{
+		StreamConfig stream;
+		double gain = 0;
+		double blackLevel = 0;
+		double exposureTime = c_exposureRamp;
+	};
+
+	// How long (eg: in ms) each kind of change takes. Measure these on your camera/interface if ordering matters a lot.
+	struct ChangeCosts
+	{
+		double streamRestart = 100; // StopGrabbing(), change AOI/format, StartGrabbing()
+		double gain = 2;
+		double blackLevel = 2;
+		double exposureTime = 1;
+	};
+
+	class Scheduler
+	{
+	private:
+		std::vector<SweepPoint> m_points;
+		ChangeCosts m_costs;
+
+	public:
+		Scheduler();
+		~Scheduler();
+
+		void SetCosts(const ChangeCosts& costs);
+		void AddPoint(const SweepPoint& point);
+
+		// Add every combination of the given values.
+		void AddGrid(const std::vector<StreamConfig>& streams, const std::vector<double>& gains, const std::vector<double>& blackLevels, const std::vector<double>& exposureTimes);
+
+		// The points, ordered so that the most expensive settings change the fewest times.
+		// All points sharing a stream configuration are batched together, so the stream is restarted once per configuration.
+		std::vector<SweepPoint> GetSchedule();
+
+		// The points in the order they were added.
+		std::vector<SweepPoint> GetPoints();
+
+		// Total cost of running the points in this order.
+		double EstimateCost(const std::vector<SweepPoint>& schedule);
+	};
+
+	bool IsSameStream(const StreamConfig& a, const StreamConfig& b);
+	int CompareStreams(const StreamConfig& a, const StreamConfig& b);
+	size_t CountStreamRestarts(const std::vector<SweepPoint>& schedule);
+
+	// Apply the stream settings. The camera must not be grabbing.
+	bool ApplyStreamConfig(Pylon::CBaslerUniversalInstantCamera& camera, const StreamConfig& stream, std::string& errorMessage);
+}
+
+// *********************************************************************************************************
+inline SweepScheduler::Scheduler::Scheduler()
+{
+	// nothing
+}
+
+inline SweepScheduler::Scheduler::~Scheduler()
+{
+	// nothing
+}
+
+inline void SweepScheduler::Scheduler::SetCosts(const ChangeCosts& costs)
+{
+	m_costs = costs;
+}
+
+inline void SweepScheduler::Scheduler::AddPoint(const SweepPoint& point)
+{
+	m_points.push_back(point);
+}
+
+inline void SweepScheduler::Scheduler::AddGrid(const std::vector<StreamConfig>& streams, const std::vector<double>& gains, const std::vector<double>& blackLevels, const std::vector<double>& exposureTimes)
+{
+	for (size_t s = 0; s < streams.size(); s++)
+		for (size_t g = 0; g < gains.size(); g++)
+			for (size_t b = 0; b < blackLevels.size(); b++)
+				for (size_t e = 0; e < exposureTimes.size(); e++)
+				{
+					SweepPoint point;
+					point.stream = streams[s];
+					point.gain = gains[g];
+					point.blackLevel = blackLevels[b];
+					point.exposureTime = exposureTimes[e];
+					m_points.push_back(point);
+				}
+}
+
+inline std::vector<SweepScheduler::SweepPoint> SweepScheduler::Scheduler::GetPoints()
+{
+	return m_points;
+}
+
+inline int SweepScheduler::CompareStreams(const StreamConfig& a, const StreamConfig& b)
+{
+	if (a.pixelFormat != b.pixelFormat)
+		return (a.pixelFormat < b.pixelFormat) ? -1 : 1;
+	if (a.width != b.width)
+		return (a.width < b.width) ? -1 : 1;
+	if (a.height != b.height)
+		return (a.height < b.height) ? -1 : 1;
+	if (a.offsetX != b.offsetX)
+		return (a.offsetX < b.offsetX) ? -1 : 1;
+	if (a.offsetY != b.offsetY)
+		return (a.offsetY < b.offsetY) ? -1 : 1;
+	return 0;
+}
+
+inline bool SweepScheduler::IsSameStream(const StreamConfig& a, const StreamConfig& b)
+{
+	return CompareStreams(a, b) == 0;
+}
+
+inline std::vector<SweepScheduler::SweepPoint> SweepScheduler::Scheduler::GetSchedule()
+{
+	// Sort by the settings, most expensive change first. The stream restart always dominates.
+	// Exposure ramps stay innermost, since they run through many exposure times on their own.
+	enum EKey { Key_Gain, Key_BlackLevel, Key_Exposure };
+	std::vector<std::pair<double, int>> keys;
+	keys.push_back(std::make_pair(m_costs.gain, (int)Key_Gain));
+	keys.push_back(std::make_pair(m_costs.blackLevel, (int)Key_BlackLevel));
+	keys.push_back(std::make_pair(m_costs.exposureTime, (int)Key_Exposure));
+	std::stable_sort(keys.begin(), keys.end(), [](const std::pair<double, int>& a, const std::pair<double, int>& b) { return a.first > b.first; });
+
+	std::vector<SweepPoint> schedule = m_points;
+	std::stable_sort(schedule.begin(), schedule.end(), [&](const SweepPoint& a, const SweepPoint& b)
+	{
+		int streamOrder = CompareStreams(a.stream, b.stream);
+		if (streamOrder != 0)
+			return streamOrder < 0;
+
+		for (size_t k = 0; k < keys.size(); k++)
+		{
+			double valueA = (keys[k].second == Key_Gain) ? a.gain : (keys[k].second == Key_BlackLevel) ? a.blackLevel : a.exposureTime;
+			double valueB = (keys[k].second == Key_Gain) ? b.gain : (keys[k].second == Key_BlackLevel) ? b.blackLevel : b.exposureTime;
+			if (valueA != valueB)
+				return valueA < valueB;
+		}
+		return false;
+	});
+
+	return schedule;
+}
+
+inline double SweepScheduler::Scheduler::EstimateCost(const std::vector<SweepPoint>& schedule)
+{
+	double cost = 0;
+
+	for (size_t i = 0; i < schedule.size(); i++)
+	{
+		if (i == 0 || IsSameStream(schedule[i].stream, schedule[i - 1].stream) == false)
+		{
+			// after a restart, everything is written again
+			cost += m_costs.streamRestart + m_costs.gain + m_costs.blackLevel + m_costs.exposureTime;
+			continue;
+		}
+		if (schedule[i].gain != schedule[i - 1].gain)
+			cost += m_costs.gain;
+		if (schedule[i].blackLevel != schedule[i - 1].blackLevel)
+			cost += m_costs.blackLevel;
+		if (schedule[i].exposureTime != schedule[i - 1].exposureTime)
+			cost += m_costs.exposureTime;
+	}
+
+	return cost;
+}
+
+inline size_t SweepScheduler::CountStreamRestarts(const std::vector<SweepPoint>& schedule)
+{
+	size_t restarts = 0;
+
+	for (size_t i = 0; i < schedule.size(); i++)
+	{
+		if (i == 0 || IsSameStream(schedule[i].stream, schedule[i - 1].stream) == false)
+			restarts++;
+	}
+
+	return restarts;
+}
+
+inline bool SweepScheduler::ApplyStreamConfig(Pylon::CBaslerUniversalInstantCamera& camera, const StreamConfig& stream, std::string& errorMessage)
+{
+	try
+	{
+		if (camera.IsGrabbing())
+		{
+			errorMessage = "ERROR: Stop grabbing before changing the stream configuration.";
+			return false;
+		}
+
+		if (stream.pixelFormat.empty() == false && camera.PixelFormat.TrySetValue(stream.pixelFormat.c_str()) == false)
+		{
+			errorMessage = "ERROR: Pixel format " + stream.pixelFormat + " is not available.";
+			return false;
+		}
+
+		// Move the offsets out of the way first, so the new size always fits.
+		camera.OffsetX.TrySetValue(0);
+		camera.OffsetY.TrySetValue(0);
+		camera.Width.TrySetValue(stream.width);
+		camera.Height.TrySetValue(stream.height);
+		camera.OffsetX.TrySetValue((stream.offsetX < 0) ? camera.SensorWidth.GetValue() / 2 : stream.offsetX);
+		camera.OffsetY.TrySetValue((stream.offsetY < 0) ? camera.SensorHeight.GetValue() / 2 : stream.offsetY);
+
+		return true;
+	}
+	catch (GenICam::GenericException& e)
+	{
+		errorMessage = "An exception occured in ApplyStreamConfig(): ";
+		errorMessage.append(e.GetDescription());
+		return false;
+	}
+	catch (std::exception& e)
+	{
+		errorMessage = "An exception occured in ApplyStreamConfig(): ";
+		errorMessage.append(e.what());
+		return false;
+	}
+}
+// *********************************************************************************************************
+#endif
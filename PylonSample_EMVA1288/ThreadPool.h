@@ -0,0 +1,243 @@
+// ThreadPool.h
+// A small pool of worker threads for splitting image processing work into independent tasks.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <vector>
+#include <stdint.h>
+
+namespace ThreadPool
+{
+	class Pool
+	{
+	private:
+		// One ParallelFor() call. It lives on the caller's stack, and a worker only touches it between joining and leaving it (under m_mutex),
+		// so a worker waking up late can't take tasks of the next job.
+		struct Job
+		{
+			const std::function<void(size_t)>* pTask = nullptr;
+			size_t numTasks = 0;
+			std::atomic<size_t> nextTask;
+			size_t activeWorkers = 0; // workers inside the job (under m_mutex)
+			std::exception_ptr exception; // the first exception thrown by a task (under m_mutex)
+		};
+
+		std::vector<std::thread> m_workers;
+		std::mutex m_jobMutex; // only one ParallelFor() runs at a time
+		std::mutex m_mutex;
+		std::condition_variable m_wakeCondition;
+		std::condition_variable m_doneCondition;
+		Job* m_pJob = nullptr; // the job workers can join, nullptr once it has finished
+		uint64_t m_jobId = 0;
+		bool m_stop = false;
+
+		void WorkerLoop();
+		void RunTasks(Job& job);
+		static bool& IsWorkerThread();
+
+	public:
+		// numThreads = 0 uses one thread per hardware core (the calling thread counts as one of them).
+		Pool(size_t numThreads = 0);
+		~Pool();
+
+		// Run task(0) ... task(numTasks - 1) across the pool and wait for all of them to finish.
+		// Tasks must be independent. The calling thread helps, so this also works with a pool of one thread.
+		// If a task throws, the tasks not started yet are skipped, and the first exception is rethrown here once the workers are done.
+		void ParallelFor(size_t numTasks, const std::function<void(size_t)>& task);
+
+		size_t GetNumThreads();
+
+		// The native handle of a worker thread (0 ... GetNumThreads() - 2), eg: to pin it to a core (see ThreadTuning.h).
+		std::thread::native_handle_type GetWorkerHandle(size_t worker);
+	};
+
+	// The pool shared by the analysis functions.
+	Pool& GetDefaultPool();
+
+	// The number of threads of the default pool (0: one per hardware core).
+	// Returns false if the default pool already exists, its size can't be changed anymore.
+	bool SetDefaultPoolSize(size_t numThreads);
+}
+
+// *********************************************************************************************************
+inline ThreadPool::Pool::Pool(size_t numThreads)
+{
+	if (numThreads == 0)
+		numThreads = std::thread::hardware_concurrency();
+	if (numThreads == 0)
+		numThreads = 1;
+
+	// the calling thread does its share of the work, so we need one less worker
+	for (size_t i = 1; i < numThreads; i++)
+		m_workers.push_back(std::thread(&Pool::WorkerLoop, this));
+}
+
+inline ThreadPool::Pool::~Pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeCondition.notify_all();
+
+	for (size_t i = 0; i < m_workers.size(); i++)
+		m_workers[i].join();
+}
+
+inline bool& ThreadPool::Pool::IsWorkerThread()
+{
+	static thread_local bool isWorker = false;
+	return isWorker;
+}
+
+inline void ThreadPool::Pool::RunTasks(Job& job)
+{
+	for (size_t i = job.nextTask++; i < job.numTasks; i = job.nextTask++)
+	{
+		try
+		{
+			(*job.pTask)(i);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!job.exception)
+				job.exception = std::current_exception();
+			// skip the rest
+			job.nextTask = job.numTasks;
+		}
+	}
+}
+
+inline void ThreadPool::Pool::WorkerLoop()
+{
+	IsWorkerThread() = true;
+	uint64_t lastJobId = 0;
+
+	while (true)
+	{
+		Job* pJob = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wakeCondition.wait(lock, [&] { return m_stop || m_jobId != lastJobId; });
+			if (m_stop)
+				return;
+			lastJobId = m_jobId;
+			// (woke up too late, the job has finished already)
+			if (m_pJob == nullptr)
+				continue;
+			pJob = m_pJob;
+			pJob->activeWorkers++;
+		}
+
+		RunTasks(*pJob);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			pJob->activeWorkers--;
+			if (pJob->activeWorkers == 0)
+				m_doneCondition.notify_all();
+		}
+	}
+}
+
+inline void ThreadPool::Pool::ParallelFor(size_t numTasks, const std::function<void(size_t)>& task)
+{
+	// Small jobs, single threaded pools and calls from inside a task are just run here.
+	if (numTasks <= 1 || m_workers.size() == 0 || IsWorkerThread())
+	{
+		for (size_t i = 0; i < numTasks; i++)
+			task(i);
+		return;
+	}
+
+	std::lock_guard<std::mutex> jobLock(m_jobMutex);
+
+	Job job;
+	job.pTask = &task;
+	job.numTasks = numTasks;
+	job.nextTask = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pJob = &job;
+		m_jobId++;
+	}
+	m_wakeCondition.notify_all();
+
+	// (while the calling thread runs tasks it counts as a worker, so a nested ParallelFor() runs inline instead of waiting for m_jobMutex)
+	IsWorkerThread() = true;
+	RunTasks(job);
+	IsWorkerThread() = false;
+
+	// Every task has been handed out now, the ones still running belong to the workers inside the job.
+	// Once they have left, no worker can join anymore.
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_doneCondition.wait(lock, [&] { return job.activeWorkers == 0; });
+	m_pJob = nullptr;
+
+	if (job.exception)
+		std::rethrow_exception(job.exception);
+}
+
+inline size_t ThreadPool::Pool::GetNumThreads()
+{
+	return m_workers.size() + 1;
+}
+
+inline std::thread::native_handle_type ThreadPool::Pool::GetWorkerHandle(size_t worker)
+{
+	return m_workers.at(worker).native_handle();
+}
+
+namespace ThreadPool
+{
+	inline size_t& DefaultPoolSize()
+	{
+		static size_t numThreads = 0;
+		return numThreads;
+	}
+
+	inline std::atomic<bool>& DefaultPoolCreated()
+	{
+		static std::atomic<bool> created(false);
+		return created;
+	}
+}
+
+inline ThreadPool::Pool& ThreadPool::GetDefaultPool()
+{
+	static Pool pool((DefaultPoolCreated() = true, DefaultPoolSize()));
+	return pool;
+}
+
+inline bool ThreadPool::SetDefaultPoolSize(size_t numThreads)
+{
+	if (DefaultPoolCreated())
+		return false;
+	DefaultPoolSize() = numThreads;
+	return true;
+}
+// *********************************************************************************************************
+#endif
@@ -0,0 +1,575 @@
+// ThreadTuning.h
+// Core affinity and priority of the acquisition and analysis threads, NUMA local frame buffers, and per thread CPU time.
+// On a busy host, a scheduling hiccup on the grabbing thread is enough for RetrieveResult() to time out or the stream to run out of buffers.
+// Pinning the threads away from each other (and from other processes), and raising the priority of the grabbing threads, prevents that.
+//
+// Copyright (c) 2022 Matthew Breit - matt.breit@baslerweb.com or matt.breit@gmail.com
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http ://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef THREADTUNING_H
+#define THREADTUNING_H
+
+#ifndef LINUX_BUILD
+#define WIN_BUILD
+#endif
+
+#ifdef WIN_BUILD
+#define _CRT_SECURE_NO_WARNINGS // suppress fopen_s warnings for convinience (if this header included first)
+#endif
+
+// We will use with Pylon
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#ifdef WIN_BUILD
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "ThreadPool.h"
+
+namespace ThreadTuning
+{
+	// Where and how the threads run. The defaults change nothing.
+	// The main thread triggers the camera, retrieves the frames and helps the analysis workers (see ThreadPool::Pool::ParallelFor()),
+	// so it is the "grab thread" here. pylon's own grab engine (and GigE receive) threads get the realtime priority as well.
+	struct Settings
+	{
+		size_t numThreads = 0; // of the analysis pool, including the main thread (0: one per hardware core)
+		int numaNode = -1; // >= 0: run all threads on the cores of this NUMA node (unless mainCores/workerCores say otherwise)
+		std::vector<uint32_t> mainCores; // empty: don't pin the main thread
+		std::vector<uint32_t> workerCores; // empty: don't pin the workers. Otherwise each worker gets one of these cores, round robin.
+		bool realtimeGrab = false; // run the main thread and pylon's grab threads at realtime priority (Linux: SCHED_FIFO, needs CAP_SYS_NICE)
+		int realtimePriority = 10; // SCHED_FIFO priority (1 ... 99) on Linux. Windows uses THREAD_PRIORITY_TIME_CRITICAL.
+		bool numaLocalBuffers = false; // allocate the frame buffers on numaNode (-1: on the node of the main thread, which consumes them)
+	};
+
+	// CPU time of one thread since it started.
+	struct ThreadTime
+	{
+		std::string name = "";
+		double cpuSeconds = 0;
+	};
+
+	// Pin a thread to a set of cores. An empty set does nothing.
+	bool PinThread(std::thread::native_handle_type handle, const std::vector<uint32_t>& cores, std::string& errorMessage);
+
+	// Run a thread at realtime priority.
+	bool SetRealtime(std::thread::native_handle_type handle, int priority, std::string& errorMessage);
+
+	// CPU time (user + kernel) the thread has used so far. Returns -1 if it isn't available.
+	double GetCpuSeconds(std::thread::native_handle_type handle);
+
+	// The handle of the calling thread. On Windows it is a duplicate of the pseudo handle, which the caller must close with CloseHandle().
+	std::thread::native_handle_type GetCurrentThreadHandle();
+
+	// The cores of a NUMA node.
+	bool GetNumaNodeCores(int node, std::vector<uint32_t>& cores, std::string& errorMessage);
+
+	// Parse a core list like "0-3,8,10-11" (the format of the Linux cpulist files, and of the command line).
+	bool ParseCoreList(const std::string& text, std::vector<uint32_t>& cores, std::string& errorMessage);
+
+	// Frame buffers for the camera's stream, allocated on one NUMA node.
+	// Windows places the pages on the node directly, Linux binds them to it with mbind() (without libnuma).
+	// Without a node, the pages come from the node of the allocating thread (StartGrabbing() runs on the main thread, which should be pinned by then).
+	// The buffers are touched when allocated, so the pages are in place before the first frame.
+	class NumaBufferFactory : public Pylon::IBufferFactory
+	{
+	private:
+		int m_numaNode = -1; // -1: the node of the allocating thread
+		size_t m_numAllocated = 0;
+
+	public:
+		NumaBufferFactory();
+		~NumaBufferFactory();
+		void SetNumaNode(int numaNode);
+		size_t GetNumAllocated();
+
+		virtual void AllocateBuffer(size_t bufferSize, void** pCreatedBuffer, intptr_t& bufferContext);
+		virtual void FreeBuffer(void* pCreatedBuffer, intptr_t bufferContext);
+		virtual void DestroyBufferFactory();
+	};
+
+	// Size the analysis pool, pin the main thread and the workers, and raise the main thread's priority.
+	// Call this before anything uses ThreadPool::GetDefaultPool(). Problems with the priority are reported, but don't stop the others.
+	bool Apply(const Settings& settings, std::string& errorMessage);
+
+	// Raise the priority of pylon's grab threads, and use the NUMA buffer factory (if enabled). Call this after camera.Open(),
+	// before StartGrabbing(). The factory must outlive the camera's grabbing.
+	// pylon's threads already run at a realtime priority (in pylon's own range), so they are only ever raised, never lowered:
+	// on Windows to the top of pylon's range, on Linux to one above the main thread (so the driver threads preempt their consumer).
+	bool ApplyToCamera(Pylon::CBaslerUniversalInstantCamera& camera, const Settings& settings, NumaBufferFactory& bufferFactory, std::string& errorMessage);
+
+	// CPU time of the main thread (the one that called Apply()) and of every pool worker.
+	void GetThreadTimes(std::vector<ThreadTime>& times);
+
+	// One line per thread: CPU seconds, and the share of the wall clock time since wallStart.
+	// Use it to size numThreads: workers that are mostly idle are not needed, a main thread near 100% is the bottleneck.
+	std::string GetReport(const std::chrono::steady_clock::time_point& wallStart);
+}
+
+// *********************************************************************************************************
+namespace ThreadTuning
+{
+	// The handle of the main thread, saved by Apply() (GetCurrentThread() on Windows is only a pseudo handle, so a duplicate is saved).
+	// The duplicate is closed when Apply() saves another one, and at exit.
+	struct SavedThreadHandle
+	{
+		std::thread::native_handle_type handle = std::thread::native_handle_type();
+
+		~SavedThreadHandle()
+		{
+			Close();
+		}
+
+		void Close()
+		{
+#ifdef WIN_BUILD
+			if (handle != NULL)
+				CloseHandle(handle);
+#endif
+			handle = std::thread::native_handle_type();
+		}
+	};
+
+	inline SavedThreadHandle& MainThreadHandle()
+	{
+		static SavedThreadHandle saved;
+		return saved;
+	}
+
+	// Set one of pylon's thread priority parameters to priority (capped at its maximum), unless it is already that high.
+	template <typename IntegerParameter>
+	bool RaisePriority(IntegerParameter& parameter, int64_t priority)
+	{
+		if (parameter.IsReadable() == false || parameter.IsWritable() == false)
+			return false;
+		if (priority > parameter.GetMax())
+			priority = parameter.GetMax();
+		if (parameter.GetValue() >= priority)
+			return true;
+		return parameter.TrySetValue(priority);
+	}
+}
+
+inline std::thread::native_handle_type ThreadTuning::GetCurrentThreadHandle()
+{
+#ifdef WIN_BUILD
+	HANDLE handle = NULL;
+	DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &handle, 0, FALSE, DUPLICATE_SAME_ACCESS);
+	return handle;
+#else
+	return pthread_self();
+#endif
+}
+
+inline bool ThreadTuning::PinThread(std::thread::native_handle_type handle, const std::vector<uint32_t>& cores, std::string& errorMessage)
+{
+	if (cores.empty())
+		return true;
+
+#ifdef WIN_BUILD
+	// (without processor groups, so the first 64 cores)
+	DWORD_PTR mask = 0;
+	for (size_t i = 0; i < cores.size(); i++)
+	{
+		if (cores[i] >= 64)
+		{
+			errorMessage = "ERROR: PinThread(): core " + std::to_string(cores[i]) + " is beyond the first 64 cores.";
+			return false;
+		}
+		mask |= ((DWORD_PTR)1) << cores[i];
+	}
+	if (SetThreadAffinityMask(handle, mask) == 0)
+	{
+		errorMessage = "ERROR: PinThread(): SetThreadAffinityMask() failed with error " + std::to_string(GetLastError()) + ".";
+		return false;
+	}
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i = 0; i < cores.size(); i++)
+	{
+		if (cores[i] >= CPU_SETSIZE)
+		{
+			errorMessage = "ERROR: PinThread(): core " + std::to_string(cores[i]) + " is out of range.";
+			return false;
+		}
+		CPU_SET(cores[i], &set);
+	}
+	int result = pthread_setaffinity_np(handle, sizeof(set), &set);
+	if (result != 0)
+	{
+		errorMessage = "ERROR: PinThread(): pthread_setaffinity_np() failed: " + std::string(strerror(result)) + ".";
+		return false;
+	}
+#endif
+	return true;
+}
+
+inline bool ThreadTuning::SetRealtime(std::thread::native_handle_type handle, int priority, std::string& errorMessage)
+{
+#ifdef WIN_BUILD
+	(void)priority;
+	if (SetThreadPriority(handle, THREAD_PRIORITY_TIME_CRITICAL) == 0)
+	{
+		errorMessage = "ERROR: SetRealtime(): SetThreadPriority() failed with error " + std::to_string(GetLastError()) + ".";
+		return false;
+	}
+#else
+	sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	int result = pthread_setschedparam(handle, SCHED_FIFO, &param);
+	if (result != 0)
+	{
+		errorMessage = "ERROR: SetRealtime(): SCHED_FIFO priority " + std::to_string(priority) + " failed: " + std::string(strerror(result)) + ".";
+		if (result == EPERM)
+			errorMessage += " (Run as root, or give the program CAP_SYS_NICE or an rtprio limit.)";
+		return false;
+	}
+#endif
+	return true;
+}
+
+inline double ThreadTuning::GetCpuSeconds(std::thread::native_handle_type handle)
+{
+#ifdef WIN_BUILD
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if (::GetThreadTimes(handle, &creationTime, &exitTime, &kernelTime, &userTime) == 0)
+		return -1;
+	// 100 ns units
+	uint64_t kernel = ((uint64_t)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime;
+	uint64_t user = ((uint64_t)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime;
+	return (double)(kernel + user) * 1e-7;
+#else
+	clockid_t clockId;
+	if (pthread_getcpuclockid(handle, &clockId) != 0)
+		return -1;
+	timespec time;
+	if (clock_gettime(clockId, &time) != 0)
+		return -1;
+	return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+#endif
+}
+
+inline bool ThreadTuning::ParseCoreList(const std::string& text, std::vector<uint32_t>& cores, std::string& errorMessage)
+{
+	cores.clear();
+	std::stringstream stream(text);
+	std::string item = "";
+	while (std::getline(stream, item, ','))
+	{
+		// (the cpulist files end with a newline)
+		while (item.empty() == false && (item.back() == '\n' || item.back() == ' '))
+			item.pop_back();
+		if (item.empty())
+			continue;
+
+		char* pEnd = nullptr;
+		unsigned long first = strtoul(item.c_str(), &pEnd, 10);
+		unsigned long last = first;
+		if (*pEnd == '-')
+			last = strtoul(pEnd + 1, &pEnd, 10);
+		if (pEnd == item.c_str() || *pEnd != '\0' || last < first || last >= 4096)
+		{
+			errorMessage = "ERROR: ParseCoreList(): can't read \"" + item + "\" (expected eg: 0-3,8,10-11).";
+			return false;
+		}
+		for (unsigned long core = first; core <= last; core++)
+			cores.push_back((uint32_t)core);
+	}
+	return true;
+}
+
+inline bool ThreadTuning::GetNumaNodeCores(int node, std::vector<uint32_t>& cores, std::string& errorMessage)
+{
+	cores.clear();
+	if (node < 0)
+	{
+		errorMessage = "ERROR: GetNumaNodeCores(): invalid node " + std::to_string(node) + ".";
+		return false;
+	}
+
+#ifdef WIN_BUILD
+	ULONGLONG mask = 0;
+	if (node > 255 || GetNumaNodeProcessorMask((UCHAR)node, &mask) == 0 || mask == 0)
+	{
+		errorMessage = "ERROR: GetNumaNodeCores(): NUMA node " + std::to_string(node) + " not found.";
+		return false;
+	}
+	for (uint32_t core = 0; core < 64; core++)
+	{
+		if (mask & (((ULONGLONG)1) << core))
+			cores.push_back(core);
+	}
+	return true;
+#else
+	std::string fileName = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+	FILE* pFile = fopen(fileName.c_str(), "r");
+	if (pFile == NULL)
+	{
+		errorMessage = "ERROR: GetNumaNodeCores(): NUMA node " + std::to_string(node) + " not found (" + fileName + ").";
+		return false;
+	}
+	char buffer[1024];
+	size_t length = fread(buffer, 1, sizeof(buffer) - 1, pFile);
+	fclose(pFile);
+	buffer[length] = '\0';
+	if (ParseCoreList(buffer, cores, errorMessage) == false)
+		return false;
+	if (cores.empty())
+	{
+		errorMessage = "ERROR: GetNumaNodeCores(): NUMA node " + std::to_string(node) + " has no cores.";
+		return false;
+	}
+	return true;
+#endif
+}
+
+inline ThreadTuning::NumaBufferFactory::NumaBufferFactory()
+{
+	// nothing
+}
+
+inline ThreadTuning::NumaBufferFactory::~NumaBufferFactory()
+{
+	// nothing
+}
+
+inline void ThreadTuning::NumaBufferFactory::SetNumaNode(int numaNode)
+{
+	m_numaNode = numaNode;
+}
+
+inline size_t ThreadTuning::NumaBufferFactory::GetNumAllocated()
+{
+	return m_numAllocated;
+}
+
+inline void ThreadTuning::NumaBufferFactory::AllocateBuffer(size_t bufferSize, void** pCreatedBuffer, intptr_t& bufferContext)
+{
+	bufferContext = 0;
+	*pCreatedBuffer = NULL;
+
+#ifdef WIN_BUILD
+	DWORD node = 0;
+	if (m_numaNode >= 0)
+	{
+		node = (DWORD)m_numaNode;
+	}
+	else
+	{
+		UCHAR currentNode = 0;
+		GetNumaProcessorNode((UCHAR)GetCurrentProcessorNumber(), &currentNode);
+		node = currentNode;
+	}
+	*pCreatedBuffer = VirtualAllocExNuma(GetCurrentProcess(), NULL, bufferSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+#else
+	// page aligned, bound to the node (before the first touch places the pages), and touched here
+	void* pBuffer = NULL;
+	if (posix_memalign(&pBuffer, 4096, bufferSize) == 0)
+	{
+		if (m_numaNode >= 0)
+		{
+			// (MPOL_BIND from numaif.h. The mask has 1024 bits, a node beyond that leaves it empty, which mbind() rejects.)
+			const int mpolBind = 2;
+			const size_t bitsPerWord = 8 * sizeof(unsigned long);
+			unsigned long nodeMask[1024 / bitsPerWord];
+			memset(nodeMask, 0, sizeof(nodeMask));
+			if (m_numaNode < 1024)
+				nodeMask[m_numaNode / bitsPerWord] = 1ul << (m_numaNode % bitsPerWord);
+			size_t length = (bufferSize + 4095) & ~(size_t)4095;
+			if (syscall(SYS_mbind, pBuffer, length, mpolBind, nodeMask, (unsigned long)1024 + 1, 0) != 0)
+			{
+				std::string message = "NumaBufferFactory: can't bind the frame buffers to NUMA node " + std::to_string(m_numaNode)
+					+ " (mbind() failed: " + std::string(strerror(errno)) + ").";
+				free(pBuffer);
+				throw GenICam::RuntimeException(message.c_str(), __FILE__, __LINE__);
+			}
+		}
+		memset(pBuffer, 0, bufferSize);
+		*pCreatedBuffer = pBuffer;
+	}
+#endif
+
+	if (*pCreatedBuffer == NULL)
+	{
+		std::string message = "NumaBufferFactory: can't allocate a frame buffer of " + std::to_string(bufferSize) + " bytes.";
+		throw GenICam::RuntimeException(message.c_str(), __FILE__, __LINE__);
+	}
+	m_numAllocated++;
+}
+
+inline void ThreadTuning::NumaBufferFactory::FreeBuffer(void* pCreatedBuffer, intptr_t bufferContext)
+{
+	(void)bufferContext;
+	if (pCreatedBuffer == NULL)
+		return;
+#ifdef WIN_BUILD
+	VirtualFree(pCreatedBuffer, 0, MEM_RELEASE);
+#else
+	free(pCreatedBuffer);
+#endif
+	m_numAllocated--;
+}
+
+inline void ThreadTuning::NumaBufferFactory::DestroyBufferFactory()
+{
+	// nothing (the factory is owned by the application, see ApplyToCamera())
+}
+
+inline bool ThreadTuning::Apply(const Settings& settings, std::string& errorMessage)
+{
+	MainThreadHandle().Close();
+	MainThreadHandle().handle = GetCurrentThreadHandle();
+
+	std::vector<uint32_t> mainCores = settings.mainCores;
+	std::vector<uint32_t> workerCores = settings.workerCores;
+	if (settings.numaNode >= 0)
+	{
+		std::vector<uint32_t> nodeCores;
+		if (GetNumaNodeCores(settings.numaNode, nodeCores, errorMessage) == false)
+			return false;
+		// the main thread and the workers share the node's cores, unless they were given their own
+		if (mainCores.empty())
+			mainCores = nodeCores;
+		if (workerCores.empty())
+			workerCores = nodeCores;
+	}
+
+	if (ThreadPool::SetDefaultPoolSize(settings.numThreads) == false && settings.numThreads != 0)
+	{
+		errorMessage = "ERROR: Apply(): the analysis pool is already running, so its size can't be set anymore.";
+		return false;
+	}
+
+	// Create the pool (starting the workers) before the main thread is pinned or raised, so the workers don't inherit that.
+	ThreadPool::Pool& pool = ThreadPool::GetDefaultPool();
+	for (size_t i = 0; i + 1 < pool.GetNumThreads() && workerCores.empty() == false; i++)
+	{
+		// each worker gets its own core, or (with a NUMA node but no worker cores) floats over the whole node
+		std::vector<uint32_t> cores(1, workerCores[i % workerCores.size()]);
+		if (settings.workerCores.empty())
+			cores = workerCores;
+		if (PinThread(pool.GetWorkerHandle(i), cores, errorMessage) == false)
+			return false;
+	}
+
+	if (PinThread(MainThreadHandle().handle, mainCores, errorMessage) == false)
+		return false;
+
+	if (settings.realtimeGrab)
+		return SetRealtime(MainThreadHandle().handle, settings.realtimePriority, errorMessage);
+
+	return true;
+}
+
+inline bool ThreadTuning::ApplyToCamera(Pylon::CBaslerUniversalInstantCamera& camera, const Settings& settings, NumaBufferFactory& bufferFactory, std::string& errorMessage)
+{
+	if (settings.numaLocalBuffers)
+	{
+		bufferFactory.SetNumaNode(settings.numaNode);
+		camera.SetBufferFactory(&bufferFactory, Pylon::Cleanup_None);
+	}
+
+	if (settings.realtimeGrab)
+	{
+		// (pylon's priorities aren't the Windows THREAD_PRIORITY_* values, and are capped at the top of pylon's range)
+#ifdef WIN_BUILD
+		int64_t priority = camera.InternalGrabEngineThreadPriority.GetMax();
+#else
+		int64_t priority = (int64_t)settings.realtimePriority + 1;
+#endif
+		// the thread that retrieves the buffers from the driver (all transport layers)
+		camera.InternalGrabEngineThreadPriorityOverride.TrySetValue(true);
+		if (RaisePriority(camera.InternalGrabEngineThreadPriority, priority) == false)
+		{
+			errorMessage = "ERROR: ApplyToCamera(): can't raise the priority of the grab engine thread to " + std::to_string(priority) + ".";
+			return false;
+		}
+		// the packet receive thread (GigE only, the other transport layers don't have one)
+		camera.GetStreamGrabberParams().ReceiveThreadPriorityOverride.TrySetValue(true);
+		RaisePriority(camera.GetStreamGrabberParams().ReceiveThreadPriority, priority);
+	}
+
+	return true;
+}
+
+inline void ThreadTuning::GetThreadTimes(std::vector<ThreadTime>& times)
+{
+	times.clear();
+
+	ThreadTime mainTime;
+	mainTime.name = "main (grab)";
+	mainTime.cpuSeconds = GetCpuSeconds(MainThreadHandle().handle); // (see Apply())
+	times.push_back(mainTime);
+
+	ThreadPool::Pool& pool = ThreadPool::GetDefaultPool();
+	for (size_t i = 0; i + 1 < pool.GetNumThreads(); i++)
+	{
+		ThreadTime workerTime;
+		workerTime.name = "worker " + std::to_string(i);
+		workerTime.cpuSeconds = GetCpuSeconds(pool.GetWorkerHandle(i));
+		times.push_back(workerTime);
+	}
+}
+
+inline std::string ThreadTuning::GetReport(const std::chrono::steady_clock::time_point& wallStart)
+{
+	double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+	std::vector<ThreadTime> times;
+	GetThreadTimes(times);
+
+	std::stringstream report;
+	report << "CPU time per thread over " << wallSeconds << " s:" << std::endl;
+	double total = 0;
+	for (size_t i = 0; i < times.size(); i++)
+	{
+		report << "  " << times[i].name << ": ";
+		if (times[i].cpuSeconds < 0)
+		{
+			report << "n/a" << std::endl;
+			continue;
+		}
+		total += times[i].cpuSeconds;
+		report << times[i].cpuSeconds << " s";
+		if (wallSeconds > 0)
+			report << " (" << (int)(100 * times[i].cpuSeconds / wallSeconds + 0.5) << "%)";
+		report << std::endl;
+	}
+	report << "  total: " << total << " s";
+	if (wallSeconds > 0)
+		report << " (" << total / wallSeconds << " cores busy on average)";
+	return report.str();
+}
+// *********************************************************************************************************
+#endif